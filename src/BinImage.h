@@ -1,29 +1,46 @@
 #pragma once
 
 #include <QRect>
-#include "ImageObject.h"
+#include "ImageHandle.h"
 #include "Karlsun.h"
 
+// orientation an image may take on the sheet
+//		RotateFree : upright or 90 degrees, chosen by the packer
+//		RotateNever : always upright (text, directional materials)
+//		Rotate180 : upright or upside down, same footprint so it packs like RotateNever
+enum RotationPolicy { RotateFree = 0, RotateNever, Rotate180, MaxRotationPolicy };
+
 class BinImage
 {
 public:
 	using Ptr = std::shared_ptr<BinImage>;
 	using ConstPtr = const std::shared_ptr<BinImage>;
-	ImageDataRGBPtr imagePtr = 0;
+	ImageHandlePtr handle = std::make_shared<ImageHandle>(); //pixels on demand, see ImageHandle
 	int imageIndex = -1; // Zero base index
 	bool isFlipped = false;
+	RotationPolicy rotation = RotateFree;
+	bool pinned = false; //result and isFlipped are kept, the others are packed around it
 
 	QRect result; //rbp 
 	Karlsun karlsun; //Į
-
-	//metadata
-	QString path;
+	ShapeMaskPtr shape; //nesting : occupancy of the placed image, oriented like result. null for bounding box placement
 
 	BinImage() {}
 	BinImage(ImageDataRGBPtr image, int index, QString filePath)
-		: imagePtr(image)
+		: handle(std::make_shared<ImageHandle>(image, filePath))
+		, imageIndex(index)
+	{
+	}
+	//deferred : size probed from the file header, the pixels are decoded on demand
+	BinImage(QSize size, int index, QString filePath)
+		: handle(std::make_shared<ImageHandle>(filePath, size))
+		, imageIndex(index)
+	{
+	}
+	//one more placement of an image already added, quantity items share one handle
+	BinImage(ImageHandlePtr shared, int index)
+		: handle(shared)
 		, imageIndex(index)
-		, path(filePath)
 	{
 	}
 	~BinImage() {}
@@ -40,13 +57,22 @@ public:
 
 public:
 
-	//if is flipped, update 
+	bool isDecoded() const { return handle->isResident(); }
+	bool canRotate90() const { return rotation == RotateFree; }
+
+	QString path() const { return handle->path(); }
+	//unrotated, known before the pixels are decoded
+	QSize size() const { return handle->size(); }
+
+	//resident pixels, rotated if is flipped. null if not decoded
 	ImageDataRGBPtr eval()
 	{
-		if (!isFlipped)
-			return imagePtr;
+		BP_TRACE_SCOPE("eval");
+		auto img = handle->resident();
+		if (!img || !isFlipped)
+			return img;
 
-		return imagePtr->rotate();
+		return img->rotate();
 	}
 
 	void updateKarlsun(int offset, int roundPx = 0, QColor drawColor = Qt::red)
@@ -66,6 +92,17 @@ public:
 			roundPx,
 			drawColor
 		);
+
+		//a nested shape is cut along its own outline, inset like the rect. tiny shapes keep the uninset one
+		if (shape)
+		{
+			auto outline = shape->shrunk((offset + shape->cell() / 2) / shape->cell()).outline(shape->cell());
+			if (outline.empty())
+				outline = shape->outline(shape->cell());
+			for (auto& polygon : outline)
+				polygon.translate(result.topLeft());
+			karlsun.outline = outline;
+		}
 	}
 };
 using BinImagePtr = std::shared_ptr<BinImage>;
\ No newline at end of file
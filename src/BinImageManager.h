@@ -1,10 +1,32 @@
 #pragma once
 
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QStandardPaths>
 #include <QString>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <iterator>
+#include <map>
+#include <mutex>
 #include <stack>
+#include <unordered_map>
+#include <unordered_set>
 #include "BinImage.h"
 #include "ImagePathParser.h"
 #include "BinPacker.h"
+#include "BinPackerMaxRects.h"
+#include "BinPackerNesting.h"
+#include "BinPackerSearch.h"
+#include "ImageProbe.h"
+#include "JpegEncoder.h"
+#include "MemoryAccountant.h"
+#include "TiffWriter.h"
+#include "Trace.h"
+#include "Utils.h"
+#include "WarmImageCache.h"
 
 // * header only class
 // contains followings :
@@ -17,12 +39,40 @@ class BinImageManager
 public:
 	ImagePathParser m_parser;
 	std::unique_ptr<BaseBinPacker> binPacker = 0;
+	BinPackAlgorithm packAlgorithm = Guillotine;
 
 	using BinImages = std::vector<BinImagePtr>;
 	BinImages binImages;
 	QSize resultSize{ -1,-1 };
 
 	BinImages lastState;
+
+	// content hash -> decoded pixels, every BinImage with the same content shares one buffer
+	// weak so that removed images release their pixels
+	std::unordered_map<uint64_t, std::weak_ptr<ImageDataRGB>> imageIndex;
+	std::mutex imageIndexMutex; //decode workers register into imageIndex
+
+	// path -> handle of the images added deferred, a path added again shares it
+	// weak so that removed images release their handle
+	std::map<QString, std::weak_ptr<ImageHandle>> handleIndex;
+
+	// decoded images shared across managers of a long running process, null decodes every time
+	std::shared_ptr<WarmImageCache> warmImages;
+
+	// spacing/bleed/margin handed to every packer
+	PackSpacing packSpacing;
+
+	// sheet coordinates kept empty by every packer, see BaseBinPacker::forbidden
+	std::vector<QRect> forbiddenRegions;
+
+	// layouts already packed for the current images, sheet and packer, one per spacing
+	// a style change back to a packed spacing restores the rects instead of repacking
+	struct PackedLayout
+	{
+		BinImages order;
+		std::vector<std::pair<QRect, bool>> placements; //result, isFlipped
+	};
+	std::map<PackSpacing, PackedLayout> layoutTable;
 public:
 
 	void storeCurState()
@@ -33,16 +83,62 @@ public:
 	void restoreLastState()
 	{
 		binImages = lastState;
+		invalidateLayouts();
 	}
 
 	void setResultSize(QSize size)
 	{
+		if (resultSize != size)
+			invalidateLayouts();
 		resultSize = size;
 	}
 
 	void setResultSize(int dst_wid, int dst_hi)
 	{
-		resultSize = QSize{ dst_wid, dst_hi };
+		setResultSize(QSize{ dst_wid, dst_hi });
+	}
+
+	void setSpacing(PackSpacing spacing)
+	{
+		packSpacing = spacing;
+		if (binPacker)
+			binPacker->spacing = spacing;
+	}
+
+	void setForbiddenRegions(std::vector<QRect> const& regions)
+	{
+		forbiddenRegions = regions;
+		if (binPacker)
+			binPacker->forbidden = regions;
+		invalidateLayouts();
+	}
+
+	// pinned images keep their result, the others are packed around them on the next pack()
+	bool setPinned(std::vector<int> const& indices, bool pinned)
+	{
+		bool changed = false;
+		for (int index : indices)
+		{
+			if (auto binImage = imageAt(index); binImage && binImage->pinned != pinned)
+			{
+				binImage->pinned = pinned;
+				changed = true;
+			}
+		}
+		if (changed)
+			invalidateLayouts();
+		return changed;
+	}
+
+	// true if pack() would have to run the packer
+	bool needsRepack() const
+	{
+		return layoutTable.find(packSpacing) == layoutTable.end();
+	}
+
+	void invalidateLayouts()
+	{
+		layoutTable.clear();
 	}
 
 	bool isResultSizeReady() const
@@ -96,7 +192,8 @@ public:
 		createBinPacker(algorithm);
 	}
 
-	void createBinPacker(BinPackAlgorithm algorithm)
+	// budget : used by GuillotineSearch only
+	void createBinPacker(BinPackAlgorithm algorithm, SearchBudget budget = SearchBudget())
 	{
 		if (binPacker)
 			binPacker = nullptr;
@@ -106,72 +203,534 @@ public:
 		case Guillotine:
 			binPacker = std::make_unique<BinPacker<Guillotine>>();
 			break;
+		case GuillotineSearch:
+			binPacker = std::make_unique<BinPacker<GuillotineSearch>>(budget);
+			break;
+		case MaxRects:
+			binPacker = std::make_unique<BinPacker<MaxRects>>();
+			break;
+		case Nesting:
+			binPacker = std::make_unique<BinPacker<Nesting>>();
+			break;
 		default:
 			throw;
 			break;
 		}
+		packAlgorithm = algorithm;
+		binPacker->spacing = packSpacing;
+		binPacker->forbidden = forbiddenRegions;
+		invalidateLayouts();
 	}
 
-	ImageDataRGBPtr makeFinalImage(VectorRGB background = VectorRGB::White()) const
+	// composited on a 4 byte RGBX sheet : rotated images go through the SIMD rotation kernel
+	// and the sheet is handed over to QImage without conversion when saved
+	// placements never overlap, so deferred images are decoded and drawn straight into the sheet in parallel
+	ImageDataRGBXPtr makeFinalImage(VectorRGBX background = VectorRGBX::White(), TaskState* task = nullptr)
 	{
-		ImageDataRGBPtr retval = 0;
+		BP_TRACE_SCOPE("makeFinalImage");
+		ImageDataRGBXPtr retval = 0;
 		if (!isResultSizeReady())
 			return retval;
 
 		const int dst_wid = resultSize.width();
 		const int dst_hi = resultSize.height();
 
-		retval = std::make_shared<ImageDataRGB>(dst_wid, dst_hi, background);
-		for (auto binImg : binImages)
 		{
-			auto img = binImg->imagePtr;
-			const auto startPoint = binImg->result.topLeft();
-			if (!retval->drawSubImage(*img, startPoint.x(), startPoint.y(), binImg->isFlipped))
-				return nullptr;
+			MemoryAccountant::Scope scope(MemoryAccountant::Sheet);
+			retval = std::make_shared<ImageDataRGBX>(dst_wid, dst_hi, background);
 		}
+
+		SharedSources sources;
+		countSources(sources);
+
+		util::beginStage(task, "compositing", imageCount());
+		std::atomic<bool> suc{ true };
+		util::parallelFor(imageCount(), [&](int idx)
+			{
+				if (util::isCancelled(task))
+				{
+					suc = false;
+					return;
+				}
+
+				BP_TRACE_SCOPE("compositeImage");
+				auto binImg = binImages.at(idx);
+				SharedSource& source = sources.at(binImg->handle.get());
+				//held here, an eviction by another worker cannot drop them mid draw
+				ImageDataRGBPtr img;
+				ImageDataRGBXPtr cellTemplate;
+				const bool shaped = (bool)binImg->shape;
+				{
+					std::lock_guard<std::mutex> lock(source.mutex);
+					if (!source.pixels && !(source.pixels = binImg->handle->resident()))
+					{
+						if (!decode(*binImg, &source.pixels))
+						{
+							suc = false;
+							return;
+						}
+						source.decodedHere = true;
+					}
+					img = source.pixels;
+					cellTemplate = source.cellTemplate(binImg->isFlipped, shaped);
+				}
+
+				//images are kept in their loaded orientation, rotated while drawn
+				//or copied row by row from the template of their orientation
+				const QRect placed = binImg->result;
+				if (shaped)
+				{
+					//nested : the runs of its shape only, the bounding boxes of neighbors overlap
+					for (auto const& run : binImg->shape->runs())
+						if (!retval->drawSubRect(*cellTemplate, run, placed.x() + run.x(), placed.y() + run.y()))
+						{
+							suc = false;
+							return;
+						}
+				}
+				else if (!(cellTemplate ? retval->drawSubImage(*cellTemplate, placed.x(), placed.y())
+					: retval->drawSubImage(*img, placed.x(), placed.y(), binImg->isFlipped)))
+				{
+					suc = false;
+					return;
+				}
+
+				//bleed bands are inside the inflated rect of this image only, a nested shape has no band
+				if (!shaped)
+					retval->extendBorder(placed.x(), placed.y(), placed.width(), placed.height(), packSpacing.bleed);
+
+				//degraded mode, the images decoded for the sheet are not kept past their last placement
+				if (source.release() && source.decodedHere && MemoryAccountant::instance().isOverBudget())
+					binImg->handle->evict();
+				util::advance(task);
+			});
+
+		if (!suc)
+			return nullptr;
 		return retval;
 	}
 
-	template <typename FuncT>
-	ImageDataRGBPtr binPack(FuncT&& logger)
+	// reduced resolution copy of the sheet, e.g. a screen proof of a 300 DPI layout at 72 DPI
+	// every image is decoded from its file at its placed size instead of being downsampled from the sheet
+	ImageDataRGBXPtr makeProofImage(int sheetDPI, int proofDPI, VectorRGBX background = VectorRGBX::White(), TaskState* task = nullptr) const
 	{
-		ImageDataRGBPtr retval = 0;
+		if (!isResultSizeReady() || sheetDPI <= 0 || proofDPI <= 0)
+			return nullptr;
+		BP_TRACE_SCOPE("makeProofImage");
+
+		//edges are mapped rather than sizes, so neighbors stay adjacent after rounding
+		auto toProof = [=](int px) { return (int)(((int64_t)px * proofDPI + sheetDPI / 2) / sheetDPI); };
+
+		const int dst_wid = std::max(1, toProof(resultSize.width()));
+		const int dst_hi = std::max(1, toProof(resultSize.height()));
+		ImageDataRGBXPtr retval;
+		{
+			MemoryAccountant::Scope scope(MemoryAccountant::Sheet);
+			retval = std::make_shared<ImageDataRGBX>(dst_wid, dst_hi, background);
+		}
+
+		SharedSources sources;
+		countSources(sources);
+
+		util::beginStage(task, "compositing", imageCount());
+		std::atomic<bool> suc{ true };
+		util::parallelFor(imageCount(), [&](int idx)
+			{
+				if (util::isCancelled(task))
+				{
+					suc = false;
+					return;
+				}
+
+				auto binImg = binImages.at(idx);
+				SharedSource& source = sources.at(binImg->handle.get());
+				const QRect placed = binImg->result;
+				const int x = toProof(placed.x()), y = toProof(placed.y());
+				const QSize proofSize(toProof(placed.x() + placed.width()) - x, toProof(placed.y() + placed.height()) - y);
+				if (proofSize.isEmpty())
+				{
+					source.release();
+					return;
+				}
+
+				//decoded unrotated, drawSubImage rotates
+				//placements of one image mostly round to the same size and share the decode
+				const QSize target = binImg->isFlipped ? proofSize.transposed() : proofSize;
+				ImageDataRGBPtr img;
+				{
+					std::lock_guard<std::mutex> lock(source.mutex);
+					if (!source.pixels || source.target != target)
+					{
+						auto loaded = std::make_shared<ImageDataRGB>();
+						if (binImg->handle->hasFile())
+						{
+							if (!loaded->load(binImg->path(), target))
+								loaded = nullptr;
+						}
+						else if (auto full = binImg->handle->load())
+						{
+							//added from memory, no file to decode from
+							loaded->fromQImage(full->toQImage().scaled(target, Qt::IgnoreAspectRatio, Qt::SmoothTransformation));
+						}
+						else
+						{
+							loaded = nullptr;
+						}
+						source.pixels = loaded;
+						source.target = target;
+					}
+					img = source.pixels;
+				}
 
+				if (!img)
+					suc = false;
+				else if (binImg->shape)
+				{
+					//nested : oriented first, then the runs of the shape mapped to the proof
+					ImageDataRGBXPtr oriented;
+					{
+						MemoryAccountant::Scope scope(MemoryAccountant::Temporary);
+						oriented = std::make_shared<ImageDataRGBX>(proofSize.width(), proofSize.height());
+					}
+					oriented->drawSubImage(*img, 0, 0, binImg->isFlipped);
+					for (auto const& run : binImg->shape->runs())
+					{
+						const int left = toProof(placed.x() + run.x()) - x, top = toProof(placed.y() + run.y()) - y;
+						const QRect part(left, top, std::min(toProof(placed.x() + run.x() + run.width()) - x, proofSize.width()) - left,
+							std::min(toProof(placed.y() + run.y() + run.height()) - y, proofSize.height()) - top);
+						if (!part.isEmpty())
+							retval->drawSubRect(*oriented, part, x + part.x(), y + part.y());
+					}
+				}
+				else if (!retval->drawSubImage(*img, x, y, binImg->isFlipped))
+					suc = false;
+				else
+					retval->extendBorder(x, y, proofSize.width(), proofSize.height(), toProof(packSpacing.bleed));
+				source.release();
+				util::advance(task);
+			});
+
+		if (!suc)
+			return nullptr;
+		return retval;
+	}
+
+	// the sheet as a tiled TIFF rendered band by band from the placements, it never exists in memory whole
+	// deferred images are decoded when the first band reaches them and dropped once the bands passed them
+	// a cancelled task or an image that cannot be decoded leaves no file
+	bool saveTiff(QString path, TiffWriter::Options const& options, VectorRGBX background = VectorRGBX::White(), TaskState* task = nullptr) const
+	{
 		if (!isResultSizeReady())
-			return retval;
+			return false;
+		BP_TRACE_SCOPE("saveTiff");
+
+		SheetBands bands(*this, background);
+		return TiffWriter::save(path, resultSize,
+			[&bands](QRect const& rect, ImageDataRGBX& tile) { return bands.draw(rect, tile); },
+			options, task,
+			[&bands](QRect const& band) { return bands.begin(band); });
+	}
+
+	// the sheet as a JPEG rendered strip by strip like saveTiff(), for sheets that do not fit the memory budget
+	bool saveJpeg(QString path, int quality, int dpi, VectorRGBX background = VectorRGBX::White(), TaskState* task = nullptr) const
+	{
+		if (!isResultSizeReady())
+			return false;
+		BP_TRACE_SCOPE("saveJpeg");
+
+		SheetBands bands(*this, background);
+		return JpegEncoder::save(path, resultSize,
+			[&bands](QRect const& rect, ImageDataRGBX& strip) { return bands.draw(rect, strip); },
+			quality, dpi, task, 0,
+			[&bands](QRect const& band) { return bands.begin(band); });
+	}
+
+	// bytes of the composited sheet, see makeFinalImage()
+	int64_t sheetBytes() const
+	{
+		return isResultSizeReady() ? (int64_t)resultSize.width() * resultSize.height() * (int64_t)sizeof(VectorRGBX) : 0;
+	}
+
+	// layout only, works on probed sizes. false if the images do not fit or the task is cancelled
+	template <typename FuncT>
+	bool pack(FuncT&& logger, TaskState* task = nullptr)
+	{
+		if (!isResultSizeReady())
+			return false;
+
+		BP_TRACE_SCOPE("pack");
+		if (restoreLayout(packSpacing))
+		{
+			updateShapes();
+			return true;
+		}
 
 		const int dst_wid = resultSize.width();
 		const int dst_hi = resultSize.height();
 
-		BinPackError error = binPacker->run(dst_wid, dst_hi, binImages);
+		binPacker->task = task;
+		BinPackError error = 0;
+		{
+			BP_TRACE_SCOPE("binPack");
+			error = binPacker->run(dst_wid, dst_hi, binImages);
+		}
+		binPacker->task = nullptr;
 
 		if (error)
 		{
 			QString errorLog = QString(BinPackErrorToString.at(std::abs(error)));
 			QString log = QString("Bin packing error. Error message : [%1] @[%2] @LINE[%3]").arg(errorLog).arg(__FUNCTION__).arg(__LINE__);
 			logger(log);
-			return retval;
+			return false;
 		}
-		
-		//update image itself if rotated
-		for (auto& ptr : binImages)
-			ptr->imagePtr = ptr->eval();
 
-		retval = makeFinalImage();
+		storeLayout();
+		updateShapes();
+		return true;
+	}
 
-		return retval;
+	// shapes of the placements as nested, for compositing and cut paths. null unless the layout is nested
+	// after every pack or restored layout, the shapes follow the orientations
+	void updateShapes()
+	{
+		const bool nested = packAlgorithm == Nesting && isResultSizeReady();
+		const int cell = nested ? BinPacker<Nesting>::cellSize(resultSize) : 0;
+		if (nested)
+		{
+			//read once per handle on worker threads, cached by the handles
+			std::vector<ImageHandlePtr> handles;
+			std::unordered_set<ImageHandle const*> seen;
+			for (auto const& ptr : binImages)
+				if (seen.insert(ptr->handle.get()).second)
+					handles.push_back(ptr->handle);
+			util::parallelFor((int)handles.size(), [&](int idx) { handles.at(idx)->shape(cell, false); handles.at(idx)->shape(cell, true); });
+		}
+		for (auto const& ptr : binImages)
+			ptr->shape = nested ? ptr->handle->shape(cell, ptr->isFlipped) : nullptr;
+	}
+
+	// current placements as the layout of the current spacing, e.g. restored from a job cache
+	void storeLayout()
+	{
+		auto& layout = layoutTable[packSpacing];
+		layout.order = binImages;
+		layout.placements.clear();
+		for (auto const& ptr : binImages)
+			layout.placements.emplace_back(ptr->result, ptr->isFlipped);
+	}
+
+	bool restoreLayout(PackSpacing spacing)
+	{
+		auto found = layoutTable.find(spacing);
+		if (found == layoutTable.end() || found->second.order.size() != binImages.size())
+			return false;
+
+		auto const& layout = found->second;
+		binImages = layout.order;
+		for (size_t idx = 0; idx < binImages.size(); ++idx)
+		{
+			binImages.at(idx)->result = layout.placements.at(idx).first;
+			binImages.at(idx)->isFlipped = layout.placements.at(idx).second;
+		}
+		return true;
+	}
+
+	bool pack()
+	{
+		return pack([](QString msg) {/* mute */});
+	}
+
+	template <typename FuncT>
+	ImageDataRGBXPtr binPack(FuncT&& logger)
+	{
+		if (!pack(logger))
+			return nullptr;
+
+		return makeFinalImage();
 	}
 
 	//bin pack logger muted
-	ImageDataRGBPtr binPack()
+	ImageDataRGBXPtr binPack()
 	{
 		return binPack([](QString msg) {/* mute */});
 	}
 
+#pragma region MinimumSheet
+	// roll media : smallest height the images fit in with the given width. invalid QSize if none
+	QSize minimumSheetForWidth(int dst_wid, int threadCount = 0) const
+	{
+		if (!binPacker || binImages.empty() || dst_wid <= 0)
+			return QSize();
+
+		//bounds in the packable area, rects are inflated by the spacing
+		auto const& spacing = binPacker->spacing;
+		const auto unpinned = unpinnedImages();
+		const auto rects = binPacker->binImage2Rects(unpinned);
+		const auto fixed = binPacker->binImage2Fixed(unpinned);
+		const auto obstacles = binPacker->obstacleRects(binImages);
+		const int innerWid = spacing.inner(dst_wid);
+		if (innerWid <= 0)
+			return QSize();
+
+		//pinned images are packed around, everything else may go below the lowest obstacle
+		int64_t totalArea = 0;
+		int lower = 1, upper = 0;
+		for (size_t idx = 0; idx < binImages.size() - unpinned.size(); ++idx)
+		{
+			auto const& rect = obstacles.at(idx);
+			if (rect.x + rect.width > innerWid)
+				return QSize();
+			totalArea += (int64_t)rect.width * rect.height;
+			lower = std::max(lower, rect.y + rect.height);
+		}
+		for (auto const& rect : obstacles)
+			upper = std::max(upper, rect.y + rect.height);
+
+		for (size_t idx = 0; idx < rects.size(); ++idx)
+		{
+			auto const& rect = rects[idx];
+			totalArea += (int64_t)rect.width * rect.height;
+			if (fixed[idx])
+			{
+				if (rect.width > innerWid)
+					return QSize();
+				lower = std::max(lower, rect.height);
+				upper += rect.height;
+				continue;
+			}
+
+			const int shortSide = std::min(rect.width, rect.height), longSide = std::max(rect.width, rect.height);
+			if (shortSide > innerWid)
+				return QSize();
+			lower = std::max(lower, longSide > innerWid ? longSide : shortSide);
+			upper += longSide;
+		}
+		lower = (int)std::max<int64_t>(lower, (totalArea + innerWid - 1) / innerWid);
+		lower = std::max(1, spacing.outer(lower));
+		upper = std::max(1, spacing.outer(upper));
+
+		auto sheetAt = [dst_wid](int hi) { return QSize(dst_wid, hi); };
+		return searchMinimumSheet(rects, fixed, obstacles, sheetAt, lower, std::max(lower, upper), threadCount);
+	}
+
+	// smallest sheet with the given aspect ratio (width / height). invalid QSize if none
+	QSize minimumSheetForAspect(double aspect, int threadCount = 0) const
+	{
+		if (!binPacker || binImages.empty() || aspect <= 0)
+			return QSize();
+
+		const auto unpinned = unpinnedImages();
+		const auto rects = binPacker->binImage2Rects(unpinned);
+		const auto fixed = binPacker->binImage2Fixed(unpinned);
+		const auto obstacles = binPacker->obstacleRects(binImages);
+		int64_t totalArea = 0;
+		int lower = 1, upper = 0;
+
+		//the sheet has to cover the pinned images, the others may go below the lowest obstacle
+		for (size_t idx = 0; idx < obstacles.size(); ++idx)
+		{
+			auto const& rect = obstacles.at(idx);
+			const int coverHi = std::max(rect.y + rect.height, (int)std::ceil((rect.x + rect.width) / aspect));
+			if (idx < binImages.size() - unpinned.size())
+			{
+				totalArea += (int64_t)rect.width * rect.height;
+				lower = std::max(lower, coverHi);
+			}
+			upper = std::max(upper, coverHi);
+		}
+
+		for (auto const& rect : rects)
+		{
+			const int shortSide = std::min(rect.width, rect.height), longSide = std::max(rect.width, rect.height);
+			totalArea += (int64_t)rect.width * rect.height;
+			//the short side has to fit the shorter edge of the sheet, holds for fixed items too
+			lower = std::max(lower, aspect >= 1.0 ? shortSide : (int)std::ceil(shortSide / aspect));
+			upper += longSide;
+		}
+		lower = std::max(lower, (int)std::ceil(std::sqrt(totalArea / aspect)));
+		upper = std::max(upper, (int)std::ceil(upper / aspect));
+
+		//bounds above are in the packable area
+		auto const& spacing = binPacker->spacing;
+		lower = std::max(1, spacing.outer(lower));
+		upper = std::max(1, spacing.outer(upper) + (int)std::ceil(2 * spacing.margin / std::min(1.0, aspect)));
+
+		auto sheetAt = [aspect](int hi) { return QSize(std::max(1, (int)std::lround(hi * aspect)), hi); };
+		return searchMinimumSheet(rects, fixed, obstacles, sheetAt, lower, std::max(lower, upper), threadCount);
+	}
+
+	// k-ary search over height : each round probes one height per thread between the bounds
+	// assumes fitting is monotonic in height, which holds for the greedy probe in practice
+	template <typename SheetFuncT>
+	QSize searchMinimumSheet(std::vector<rbp::RectSize> const& rects, std::vector<char> const& fixed, std::vector<rbp::Rect> const& obstacles,
+		SheetFuncT&& sheetAt, int lower, int upper, int threadCount = 0) const
+	{
+		if (threadCount <= 0)
+			threadCount = (int)std::thread::hardware_concurrency();
+		threadCount = std::max(1, threadCount);
+
+		auto const& spacing = binPacker->spacing;
+		auto fits = [&](int hi)
+		{
+			const QSize sheet = sheetAt(hi);
+			if (binPacker->checkPinned(spacing.inner(sheet.width()), spacing.inner(sheet.height()), binImages, obstacles))
+				return false;
+			return binPacker->fits(sheet.width(), sheet.height(), rects, fixed, obstacles);
+		};
+
+		//the upper bound is not guaranteed with a heuristic packer, grow it a few times
+		for (int grow = 0; !fits(upper); ++grow)
+		{
+			if (grow == 4)
+				return QSize();
+			lower = upper + 1;
+			upper *= 2;
+		}
+
+		//invariant : upper fits, everything below lower is unknown or does not fit
+		int infeasible = lower - 1;
+		while (upper - infeasible > 1)
+		{
+			const int span = upper - infeasible - 1;
+			const int probeCount = std::min(threadCount, span);
+
+			std::vector<int> heights(probeCount);
+			for (int idx = 0; idx < probeCount; ++idx)
+				heights.at(idx) = infeasible + (int)(((int64_t)span * (idx + 1) + probeCount) / (probeCount + 1));
+			std::vector<char> results(probeCount, 0);
+
+			util::parallelFor(probeCount, [&](int idx) { results.at(idx) = fits(heights.at(idx)); }, probeCount);
+
+			//lowest fitting probe becomes the upper bound, the highest failing one below it the lower
+			for (int idx = 0; idx < probeCount; ++idx)
+			{
+				if (results.at(idx))
+				{
+					upper = std::min(upper, heights.at(idx));
+					break;
+				}
+			}
+			for (int idx = 0; idx < probeCount; ++idx)
+				if (!results.at(idx) && heights.at(idx) < upper)
+					infeasible = std::max(infeasible, heights.at(idx));
+		}
+
+		return sheetAt(upper);
+	}
+
+	BinImages unpinnedImages() const
+	{
+		BinImages retval;
+		std::copy_if(binImages.begin(), binImages.end(), std::back_inserter(retval), [](BinImagePtr const& ptr) { return !ptr->pinned; });
+		return retval;
+	}
+#pragma endregion
+
 	int imageCount() const { return (int)binImages.size(); }
 
 	bool addImage(QString path)
 	{
+		BP_TRACE_SCOPE("addImage");
 		if (!m_parser.isSupportedFormat(path))
 			return false;
 
@@ -184,16 +743,209 @@ public:
 		return true;
 	}
 
-	bool addImage(ImageDataRGBPtr image, QString path = "")
+	// quantity placements of image, they share one handle and so one buffer
+	bool addImage(ImageDataRGBPtr image, QString path = "", int quantity = 1)
 	{
-		binImages.push_back(std::make_shared<BinImage>(image, imageCount(), path));
+		if (!image || image->empty() || quantity < 1)
+			return false;
+
+		if (auto existing = findDuplicate(*image))
+			image = existing;
+		else
+			imageIndex[image->contentHash()] = image;
+
+		addPlacements(std::make_shared<ImageHandle>(image, path), quantity);
+		return true;
+	}
+
+	// probes the file header only, pixels are decoded by decodePending() or makeFinalImage()
+	// so that packing can start before any image is decoded
+	// quantity placements share one handle, as do the placements of a path added again : one decode for all of them
+	bool addImageDeferred(QString path, int quantity = 1)
+	{
+		BP_TRACE_SCOPE("addImageDeferred");
+		if (quantity < 1 || !m_parser.isSupportedFormat(path))
+			return false;
+
+		auto found = handleIndex.find(path);
+		ImageHandlePtr handle = found != handleIndex.end() ? found->second.lock() : nullptr;
+		if (!handle)
+		{
+			const QSize size = ImageProbe::size(path);
+			if (!size.isValid() || size.isEmpty())
+				return false;
+			handle = std::make_shared<ImageHandle>(path, size);
+			handleIndex[path] = handle;
+		}
+
+		addPlacements(handle, quantity);
+		return true;
+	}
+
+	// number of images sharing the handle of the image at index, 0 if there is none
+	int quantityOf(int index) const
+	{
+		auto binImage = imageAt(index);
+		if (!binImage)
+			return 0;
+		return (int)std::count_if(binImages.begin(), binImages.end(), [&](BinImagePtr const& ptr) { return ptr->handle == binImage->handle; });
+	}
+
+	// adds or removes placements of the image at index until quantity share its handle
+	// new ones take its rotation policy, pinned ones are removed last. false if nothing changed
+	bool setQuantity(int index, int quantity)
+	{
+		auto binImage = imageAt(index);
+		const int current = quantityOf(index);
+		if (!binImage || quantity < 1 || quantity == current)
+			return false;
+
+		if (quantity > current)
+		{
+			const int first = imageCount();
+			addPlacements(binImage->handle, quantity - current);
+			for (int idx = first; idx < imageCount(); ++idx)
+				binImages.at(idx)->rotation = binImage->rotation;
+			return true;
+		}
+
+		BinImages group;
+		std::copy_if(binImages.begin(), binImages.end(), std::back_inserter(group), [&](BinImagePtr const& ptr) { return ptr->handle == binImage->handle; });
+		std::stable_sort(group.begin(), group.end(), [](BinImagePtr const& lhs, BinImagePtr const& rhs)
+			{
+				return std::make_pair(lhs->pinned, -lhs->imageIndex) < std::make_pair(rhs->pinned, -rhs->imageIndex);
+			});
+
+		std::vector<int> indices;
+		for (int idx = 0; idx < current - quantity; ++idx)
+			indices.push_back(group.at(idx)->imageIndex);
+		return removeBinImage(indices);
+	}
+
+	int pendingCount() const
+	{
+		return (int)std::count_if(binImages.begin(), binImages.end(), [](BinImagePtr const& ptr) { return !ptr->isDecoded(); });
+	}
+
+	// decodes every deferred image on worker threads. false if any failed
+	bool decodePending(int threadCount = 0)
+	{
+		BinImages pending;
+		for (auto const& ptr : binImages)
+			if (!ptr->isDecoded())
+				pending.push_back(ptr);
+
+		std::atomic<bool> suc{ true };
+		util::parallelFor((int)pending.size(), [&](int idx)
+			{
+				if (!decode(*pending.at(idx)))
+					suc = false;
+			}, threadCount);
+		return suc;
+	}
+
+	// makes the pixels of binImage resident, through the warm cache and shared with a duplicate already added
+	// thread safe. the decoded size must match the probed one, the layout was made with it
+	// pixels : set to the decoded pixels, the handle may evict them again over the memory budget
+	bool decode(BinImage& binImage, ImageDataRGBPtr* pixels = nullptr)
+	{
+		BP_TRACE_SCOPE("decode");
+		ImageHandle& handle = *binImage.handle;
+		//a warm image is shared read only with other jobs, its hash is computed before it is inserted
+		auto img = warmImages && handle.hasFile() ? warmImages->find(handle.path()) : nullptr;
+		if (img && QSize(img->width(), img->height()) != handle.size())
+			return false;
+		if (!img)
+		{
+			if (!(img = handle.load()))
+				return false;
+
+			//hash outside the lock
+			img->contentHash();
+			//over the memory budget nothing more is kept for other jobs
+			if (warmImages && handle.hasFile() && !MemoryAccountant::instance().isOverBudget())
+				warmImages->insert(handle.path(), img);
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(imageIndexMutex);
+			if (auto existing = findDuplicate(*img))
+				img = existing;
+			else
+				imageIndex[img->contentHash()] = img;
+		}
+
+		handle.setResident(img);
+		if (pixels)
+			*pixels = img;
 		return true;
 	}
 
+	// pixels of binImage, decoded or not, without keeping them resident. null if they cannot be loaded
+	ImageDataRGBPtr pixelsOf(BinImage const& binImage) const
+	{
+		ImageHandle const& handle = *binImage.handle;
+		if (auto img = handle.resident())
+			return img;
+
+		auto img = warmImages && handle.hasFile() ? warmImages->find(handle.path()) : nullptr;
+		if (img && QSize(img->width(), img->height()) != handle.size())
+			return nullptr;
+		return img ? img : handle.load();
+	}
+
+	// degraded mode, over the memory budget : the pixels of every decoded image are evicted
+	// an image with a file is decoded from it again when needed, one added from memory is spilled to the disk cache first
+	// the canvas shows evicted images as placeholders. returns the number of handles evicted, placements share one
+	int spillDecoded()
+	{
+		int retval = 0;
+		for (auto const& ptr : binImages)
+			if (ptr->isDecoded() && ptr->handle->evict())
+				retval++;
+		return retval;
+	}
+
+	// an already added image with the same content, null if none
+	ImageDataRGBPtr findDuplicate(ImageDataRGB const& image)
+	{
+		auto found = imageIndex.find(image.contentHash());
+		if (found == imageIndex.end())
+			return nullptr;
+
+		auto existing = found->second.lock();
+		if (!existing)
+		{
+			imageIndex.erase(found);
+			return nullptr;
+		}
+
+		//confirm, hash collisions are possible
+		if (existing.get() != &image && !(*existing == image))
+			return nullptr;
+
+		return existing;
+	}
+
+	// number of images with the content of an image added before them, decoded ones only
+	int duplicateCount() const
+	{
+		std::unordered_set<uint64_t> hashes;
+		int retval = 0;
+		for (auto const& ptr : binImages)
+			if (const uint64_t hash = ptr->handle->hash(); hash && !hashes.insert(hash).second)
+				retval++;
+		return retval;
+	}
+
+	// indices made contiguous again after a removal, in their previous order
+	// binImages is in packed order, numbering by position would renumber the images still to be removed
 	void updateIndices()
 	{
-		for (int idx = 0; idx < imageCount(); ++idx)
-			binImages.at(idx)->imageIndex = idx;
+		BinImages byIndex = binImages;
+		std::sort(byIndex.begin(), byIndex.end(), [](BinImagePtr const& lhs, BinImagePtr const& rhs) { return lhs->imageIndex < rhs->imageIndex; });
+		for (int idx = 0; idx < (int)byIndex.size(); ++idx)
+			byIndex.at(idx)->imageIndex = idx;
 	}
 
 	//returns true if successfully removed
@@ -208,6 +960,7 @@ public:
 			if (**it == *imageAt(index))
 			{
 				binImages.erase(binImages.begin() + startPos);
+				invalidateLayouts();
 				updateIndices();
 				return true;
 			}
@@ -243,5 +996,149 @@ public:
 	void clear()
 	{
 		binImages = BinImages();
+		imageIndex.clear();
+		handleIndex.clear();
+		invalidateLayouts();
 	}
+
+protected:
+	// one decode shared by the placements of a handle while a sheet is composed
+	// held until the last of them is drawn
+	struct SharedSource
+	{
+		std::mutex mutex;
+		ImageDataRGBPtr pixels;
+		QSize target; //makeProofImage() : size the pixels were decoded at
+		bool decodedHere = false;
+		std::atomic<int> remaining{ 0 };
+
+		//makeFinalImage() : pixels converted to the sheet format and orientation once, for an orientation placed more than once
+		std::array<int, 2> placements{};
+		std::array<ImageDataRGBXPtr, 2> templates;
+
+		// mutex held, null if the orientation is placed once. always : for a nested shape, drawn run by run
+		ImageDataRGBXPtr cellTemplate(bool flipped, bool always = false)
+		{
+			if ((!always && placements[flipped] < 2) || !pixels)
+				return nullptr;
+			auto& retval = templates[flipped];
+			if (!retval)
+			{
+				MemoryAccountant::Scope scope(MemoryAccountant::Temporary);
+				retval = std::make_shared<ImageDataRGBX>(flipped ? pixels->height() : pixels->width(), flipped ? pixels->width() : pixels->height());
+				retval->drawSubImage(*pixels, 0, 0, flipped);
+			}
+			return retval;
+		}
+
+		// true for the last placement, the pixels are dropped then
+		bool release()
+		{
+			if (--remaining > 0)
+				return false;
+			std::lock_guard<std::mutex> lock(mutex);
+			pixels = nullptr;
+			templates = {};
+			return true;
+		}
+	};
+	using SharedSources = std::map<ImageHandle const*, SharedSource>;
+
+	void countSources(SharedSources& sources) const
+	{
+		for (auto const& ptr : binImages)
+		{
+			auto& source = sources[ptr->handle.get()];
+			source.remaining++;
+			source.placements[ptr->isFlipped]++;
+		}
+	}
+
+	void addPlacements(ImageHandlePtr handle, int quantity)
+	{
+		for (int idx = 0; idx < quantity; ++idx)
+			binImages.push_back(std::make_shared<BinImage>(handle, imageCount()));
+		invalidateLayouts();
+	}
+
+	// the sheet rendered band by band from the placements, see saveTiff() and saveJpeg()
+	// images are loaded when the first band reaches them and dropped once the bands passed them, once for all their placements
+	// begin() for every band top to bottom, then draw() from any thread for rects within the band
+	class SheetBands
+	{
+	public:
+		SheetBands(BinImageManager const& mgr, VectorRGBX background)
+			: mgr(mgr), background(background), bleed(std::max(0, mgr.packSpacing.bleed)), byTop(mgr.binImages)
+		{
+			std::sort(byTop.begin(), byTop.end(), [this](BinImagePtr const& lhs, BinImagePtr const& rhs) { return extent(*lhs).top() < extent(*rhs).top(); });
+		}
+
+		bool begin(QRect const& band)
+		{
+			BP_TRACE_SCOPE("loadBand");
+			active.erase(std::remove_if(active.begin(), active.end(),
+				[&](auto const& item) { return extent(*item.first).bottom() < band.top(); }), active.end());
+
+			const size_t first = reached;
+			while (reached < byTop.size() && extent(*byTop.at(reached)).top() <= band.bottom())
+				reached++;
+
+			//placements sharing a handle share the pixels, those of an active one included
+			std::map<ImageHandle const*, ImageDataRGBPtr> pixels;
+			for (auto const& item : active)
+				pixels.emplace(item.first->handle.get(), item.second);
+			std::vector<BinImagePtr> loads;
+			for (size_t idx = first; idx < reached; ++idx)
+				if (pixels.emplace(byTop.at(idx)->handle.get(), nullptr).second)
+					loads.push_back(byTop.at(idx));
+
+			std::vector<ImageDataRGBPtr> loaded(loads.size());
+			std::atomic<bool> suc{ true };
+			util::parallelFor((int)loads.size(), [&](int idx)
+				{
+					if (!(loaded.at(idx) = mgr.pixelsOf(*loads.at(idx))))
+						suc = false;
+				});
+			for (size_t idx = 0; idx < loads.size(); ++idx)
+				pixels[loads.at(idx)->handle.get()] = loaded.at(idx);
+
+			for (size_t idx = first; idx < reached; ++idx)
+				active.emplace_back(byTop.at(idx), pixels[byTop.at(idx)->handle.get()]);
+			return (bool)suc;
+		}
+
+		bool draw(QRect const& rect, ImageDataRGBX& out) const
+		{
+			out.fill(background);
+			for (auto const& item : active)
+			{
+				BinImage const& binImg = *item.first;
+				if (!extent(binImg).intersects(rect))
+					continue;
+				if (!binImg.shape)
+				{
+					out.drawSubImageClipped(*item.second, binImg.result.x() - rect.x(), binImg.result.y() - rect.y(), binImg.isFlipped, bleed);
+					continue;
+				}
+				//nested : clipped to the runs of its shape, no bleed band
+				for (auto const& run : binImg.shape->runs())
+					if (run.translated(binImg.result.topLeft()).intersects(rect))
+						out.drawSubImageClipped(*item.second, binImg.result.x() - rect.x(), binImg.result.y() - rect.y(), binImg.isFlipped, 0,
+							run.translated(binImg.result.topLeft() - rect.topLeft()));
+			}
+			return true;
+		}
+
+	protected:
+		QRect extent(BinImage const& binImage) const { return binImage.shape ? binImage.result : binImage.result.adjusted(-bleed, -bleed, bleed, bleed); }
+
+		BinImageManager const& mgr;
+		const VectorRGBX background;
+		const int bleed;
+		BinImages byTop;
+
+		//only changed between bands, the rects of a band read it concurrently
+		std::vector<std::pair<BinImagePtr, ImageDataRGBPtr>> active;
+		size_t reached = 0;
+	};
 };
\ No newline at end of file
@@ -1,18 +1,24 @@
 #pragma once
 
 #include "BinImage.h"
+#include "Task.h"
 
 //guillotine
 #include <algorithm>
+#include <limits>
+#include <numeric>
+#include <tuple>
 #include "GuillotineBinPack.h"
 
-enum BinPackAlgorithm { Guillotine = 0, MaxBinPackAlgorithm };
+enum BinPackAlgorithm { Guillotine = 0, GuillotineSearch, MaxRects, Nesting, MaxBinPackAlgorithm };
 
 using BinPackError = int;
 #define BP_NO_ERROR 0
 #define BP_ERR_NO_IMAGE -1
 #define BP_ERR_EXCEED_MAX_IMAGE -2
 #define BP_ERR_EXCEED_AVAILABLE_SPACE -3
+#define BP_ERR_PINNED_OVERLAP -4
+#define BP_ERR_CANCELLED -5
 
 const static std::vector<const char*> BinPackErrorToString
 {
@@ -20,23 +26,465 @@ const static std::vector<const char*> BinPackErrorToString
 	"BINPACK_ERR_NO_IMAGE",
 	"BINPACK_ERR_EXCEED_MAX_IMAGE",
 	"BINPACK_ERR_EXCEED_AVAILABLE_SPACE",
+	"BINPACK_ERR_PINNED_OVERLAP",
+	"BINPACK_ERR_CANCELLED",
+};
+
+// spacing/bleed/margin applied by inflating rects at insert time
+// an item occupies its image + bleed on every side + spacing on the right and bottom,
+// the packable area is the sheet without margins, plus one spacing for the last item of a row/column
+struct PackSpacing
+{
+	int spacing = 0;
+	int bleed = 0;
+	int margin = 0;
+
+	bool operator==(PackSpacing const& rhs) const { return spacing == rhs.spacing && bleed == rhs.bleed && margin == rhs.margin; }
+	bool operator!=(PackSpacing const& rhs) const { return !(*this == rhs); }
+	bool operator<(PackSpacing const& rhs) const { return std::tie(spacing, bleed, margin) < std::tie(rhs.spacing, rhs.bleed, rhs.margin); }
+
+	rbp::RectSize inflate(int wid, int hi) const { return { wid + 2 * bleed + spacing, hi + 2 * bleed + spacing }; }
+	int inner(int sheetExtent) const { return sheetExtent - 2 * margin + spacing; }
+	int outer(int innerExtent) const { return innerExtent + 2 * margin - spacing; }
+
+	// image rect of an item inserted at packed, flipped if rbp rotated it
+	QRect place(rbp::Rect const& packed, bool flipped, int wid, int hi) const
+	{
+		const QSize size = !flipped ? QSize(wid, hi) : QSize(hi, wid);
+		return QRect(QPoint(packed.x + margin + bleed, packed.y + margin + bleed), size);
+	}
+
+	// packed rect of an image placed at result, the inverse of place()
+	rbp::Rect occupied(QRect const& result) const
+	{
+		const auto inflated = inflate(result.width(), result.height());
+		return rbp::Rect{ result.x() - margin - bleed, result.y() - margin - bleed, inflated.width, inflated.height };
+	}
+
+	// rbp result of an inflated rect is rotated if its size does not match
+	bool isFlipped(rbp::Rect const& packed, int wid, int hi) const
+	{
+		const auto inflated = inflate(wid, hi);
+		return !(packed.width == inflated.width && packed.height == inflated.height);
+	}
 };
 
 class BaseBinPacker
 {
 public:
+	PackSpacing spacing;
+
+	// sheet coordinates nothing is packed into, e.g. registration marks or an already printed area
+	std::vector<QRect> forbidden;
+
+	// cancel token and progress of the running pack, set by BinImageManager::pack. may be null
+	TaskState* task = nullptr;
+
+	// inflated by spacing, in the packable area of spacing.inner()
 	virtual std::vector<rbp::RectSize> binImage2Rects(std::vector<BinImagePtr> const& images) const
 	{
 		std::vector<rbp::RectSize> retval;
 
 		for (auto ptr : images)
 		{
-			retval.push_back({ ptr->imagePtr->width(), ptr->imagePtr->height() });
+			const QSize size = ptr->size();
+			retval.push_back(spacing.inflate(size.width(), size.height()));
 		}
 
 		return retval;
 	}
+
+	// parallel to binImage2Rects, nonzero if the item may not turn 90 degrees
+	std::vector<char> binImage2Fixed(std::vector<BinImagePtr> const& images) const
+	{
+		std::vector<char> retval;
+		for (auto ptr : images)
+			retval.push_back(!ptr->canRotate90());
+		return retval;
+	}
+
 	virtual BinPackError run(int dst_wid, int dst_hi, std::vector<BinImagePtr>& images) = 0;
+
+#pragma region Obstacles
+	static bool overlaps(rbp::Rect const& lhs, rbp::Rect const& rhs)
+	{
+		return lhs.x < rhs.x + rhs.width && rhs.x < lhs.x + lhs.width
+			&& lhs.y < rhs.y + rhs.height && rhs.y < lhs.y + lhs.height;
+	}
+
+	// pinned images, then forbidden regions, in the packable area of spacing.inner()
+	// both are inflated like the items so the spacing to their neighbors is kept
+	std::vector<rbp::Rect> obstacleRects(std::vector<BinImagePtr> const& images) const
+	{
+		std::vector<rbp::Rect> retval;
+		for (auto ptr : images)
+			if (ptr->pinned)
+				retval.push_back(spacing.occupied(ptr->result));
+		for (auto const& region : forbidden)
+			retval.push_back(rbp::Rect{ region.x() - spacing.margin, region.y() - spacing.margin,
+				region.width() + spacing.spacing, region.height() + spacing.spacing });
+		return retval;
+	}
+
+	// BP_ERR_PINNED_OVERLAP if a pinned image leaves the packable area or overlaps another obstacle
+	// forbidden regions may overlap each other and the sheet edge
+	BinPackError checkPinned(int innerWid, int innerHi, std::vector<BinImagePtr> const& images, std::vector<rbp::Rect> const& obstacles) const
+	{
+		const int pinnedCount = (int)std::count_if(images.begin(), images.end(), [](BinImagePtr const& ptr) { return ptr->pinned; });
+		for (int idx = 0; idx < pinnedCount; ++idx)
+		{
+			auto const& rect = obstacles.at(idx);
+			if (rect.x < 0 || rect.y < 0 || rect.x + rect.width > innerWid || rect.y + rect.height > innerHi)
+				return BP_ERR_PINNED_OVERLAP;
+			for (int other = idx + 1; other < (int)obstacles.size(); ++other)
+				if (overlaps(rect, obstacles.at(other)))
+					return BP_ERR_PINNED_OVERLAP;
+		}
+		return BP_NO_ERROR;
+	}
+
+	// Init, then the obstacles are cut out of the free rects. the pieces stay disjoint as rbp expects
+	static void initPacker(rbp::GuillotineBinPack& packer, int innerWid, int innerHi, std::vector<rbp::Rect> const& obstacles)
+	{
+		packer.Init(innerWid, innerHi);
+
+		auto& freeRects = packer.GetFreeRectangles();
+		for (auto const& obstacle : obstacles)
+		{
+			std::vector<rbp::Rect> carved;
+			for (auto const& freeRect : freeRects)
+			{
+				if (!overlaps(freeRect, obstacle))
+				{
+					carved.push_back(freeRect);
+					continue;
+				}
+
+				const int freeRight = freeRect.x + freeRect.width, freeBottom = freeRect.y + freeRect.height;
+				const int left = std::max(freeRect.x, obstacle.x), right = std::min(freeRight, obstacle.x + obstacle.width);
+				const int top = std::max(freeRect.y, obstacle.y), bottom = std::min(freeBottom, obstacle.y + obstacle.height);
+
+				//bands above and below span the whole free rect, the sides fill the rows in between
+				if (top > freeRect.y)
+					carved.push_back(rbp::Rect{ freeRect.x, freeRect.y, freeRect.width, top - freeRect.y });
+				if (bottom < freeBottom)
+					carved.push_back(rbp::Rect{ freeRect.x, bottom, freeRect.width, freeBottom - bottom });
+				if (left > freeRect.x)
+					carved.push_back(rbp::Rect{ freeRect.x, top, left - freeRect.x, bottom - top });
+				if (right < freeRight)
+					carved.push_back(rbp::Rect{ right, top, freeRight - right, bottom - top });
+			}
+			freeRects.swap(carved);
+		}
+	}
+#pragma endregion
+
+	// same score as rbp's FindPositionForNewNode, lower is better
+	static int scoreFreeRect(rbp::GuillotineBinPack::FreeRectChoiceHeuristic choice, int wid, int hi, rbp::Rect const& freeRect)
+	{
+		using Packer = rbp::GuillotineBinPack;
+		const int leftoverWid = std::abs(freeRect.width - wid), leftoverHi = std::abs(freeRect.height - hi);
+		const int areaFit = freeRect.width * freeRect.height - wid * hi;
+		switch (choice)
+		{
+		case Packer::RectBestAreaFit: return areaFit;
+		case Packer::RectBestShortSideFit: return std::min(leftoverWid, leftoverHi);
+		case Packer::RectBestLongSideFit: return std::max(leftoverWid, leftoverHi);
+		case Packer::RectWorstAreaFit: return -areaFit;
+		case Packer::RectWorstShortSideFit: return -std::min(leftoverWid, leftoverHi);
+		case Packer::RectWorstLongSideFit: return -std::max(leftoverWid, leftoverHi);
+		default: return std::numeric_limits<int>::max();
+		}
+	}
+
+	// rbp::GuillotineBinPack::Insert tries the rotated orientation whenever the upright one does not fit
+	// fixed items score upright candidates only, then rbp inserts into that single free rect,
+	// where the upright orientation always wins. zero sized rect if it does not fit
+	static rbp::Rect insertUpright(rbp::GuillotineBinPack& packer, int wid, int hi, bool merge,
+		rbp::GuillotineBinPack::FreeRectChoiceHeuristic choice, rbp::GuillotineBinPack::GuillotineSplitHeuristic split)
+	{
+		auto& freeRects = packer.GetFreeRectangles();
+
+		int bestIdx = -1, bestScore = std::numeric_limits<int>::max();
+		for (int idx = 0; idx < (int)freeRects.size(); ++idx)
+		{
+			auto const& freeRect = freeRects[idx];
+			if (wid > freeRect.width || hi > freeRect.height)
+				continue;
+			const int score = scoreFreeRect(choice, wid, hi, freeRect);
+			if (score < bestScore)
+			{
+				bestScore = score;
+				bestIdx = idx;
+			}
+		}
+		if (bestIdx < 0)
+			return rbp::Rect{ 0, 0, 0, 0 };
+
+		//isolate the chosen free rect, rbp splits it, then the others are put back
+		const rbp::Rect chosen = freeRects[bestIdx];
+		std::vector<rbp::Rect> others;
+		others.reserve(freeRects.size());
+		for (int idx = 0; idx < (int)freeRects.size(); ++idx)
+			if (idx != bestIdx)
+				others.push_back(freeRects[idx]);
+
+		freeRects.assign(1, chosen);
+		const auto retval = packer.Insert(wid, hi, false, choice, split);
+		freeRects.insert(freeRects.begin(), others.begin(), others.end());
+
+		if (merge)
+			packer.MergeFreeList();
+		return retval;
+	}
+
+	// dispatches fixed items to insertUpright, which skips the rotated candidates
+	static rbp::Rect insert(rbp::GuillotineBinPack& packer, int wid, int hi, bool fixed, bool merge,
+		rbp::GuillotineBinPack::FreeRectChoiceHeuristic choice, rbp::GuillotineBinPack::GuillotineSplitHeuristic split)
+	{
+		if (fixed && wid != hi)
+			return insertUpright(packer, wid, hi, merge, choice, split);
+		return packer.Insert(wid, hi, merge, choice, split);
+	}
+
+	// a run of count items of one inflated size, inserted as grid blocks : one rbp insert and split per block instead of per item
+	// each block takes whole rows of the free rect that holds the most cells, upright or turned, the rest of the run goes on from there
+	// runs of one or cells of one are inserted one by one. placed : a rect per item placed, false as soon as one does not fit
+	static bool insertRun(rbp::GuillotineBinPack& packer, int wid, int hi, int count, bool fixed, bool merge,
+		rbp::GuillotineBinPack::FreeRectChoiceHeuristic choice, rbp::GuillotineBinPack::GuillotineSplitHeuristic split, std::vector<rbp::Rect>& placed)
+	{
+		placed.clear();
+		const int orientations = fixed || wid == hi ? 1 : 2;
+		while ((int)placed.size() < count)
+		{
+			const int left = count - (int)placed.size();
+
+			int64_t bestCells = 0;
+			int cellWid = wid, cellHi = hi, cols = 0, rows = 0;
+			for (auto const& freeRect : packer.GetFreeRectangles())
+			{
+				for (int turned = 0; turned < orientations; ++turned)
+				{
+					const int w = turned ? hi : wid, h = turned ? wid : hi;
+					const int64_t cells = (int64_t)(freeRect.width / w) * (freeRect.height / h);
+					if (cells > bestCells)
+					{
+						bestCells = cells;
+						cellWid = w;
+						cellHi = h;
+						cols = std::min(freeRect.width / w, left);
+						rows = std::min(freeRect.height / h, left / cols);
+					}
+				}
+			}
+
+			if (cols * rows < 2)
+			{
+				const auto result = insert(packer, wid, hi, fixed, merge, choice, split);
+				if (result.width == 0 || result.height == 0)
+					return false;
+				placed.push_back(result);
+				continue;
+			}
+
+			//upright, the block is already in the orientation of its cells
+			const auto block = insertUpright(packer, cols * cellWid, rows * cellHi, merge, choice, split);
+			if (block.width == 0 || block.height == 0)
+				return false;
+			for (int row = 0; row < rows; ++row)
+				for (int col = 0; col < cols; ++col)
+					placed.push_back(rbp::Rect{ block.x + col * cellWid, block.y + row * cellHi, cellWid, cellHi });
+		}
+		return true;
+	}
+
+#pragma region UniformGrid
+	// items within this fraction of the largest width and height share its cell
+	static constexpr double NearUniformTolerance = 0.02;
+
+	// a block of cells filled row by row from its top left
+	struct GridBlock
+	{
+		int x = 0, y = 0;
+		int cols = 0, rows = 0;
+		int cellWid = 0, cellHi = 0;
+
+		int64_t capacity() const { return (int64_t)cols * rows; }
+		int usedWid(int64_t count) const { return count > 0 ? (int)std::min<int64_t>(count, cols) * cellWid : 0; }
+		int usedHi(int64_t count) const { return count > 0 ? (int)((count + cols - 1) / cols) * cellHi : 0; }
+		rbp::Rect cell(int64_t idx) const { return rbp::Rect{ x + (int)(idx % cols) * cellWid, y + (int)(idx / cols) * cellHi, cellWid, cellHi }; }
+	};
+
+	// upright cells in the first block, turned cells in the rest of the area below or to the right of it
+	struct Grid
+	{
+		GridBlock upright, turned;
+
+		int64_t capacity() const { return upright.capacity() + turned.capacity(); }
+	};
+
+	// cell of near uniform rects : their largest width and height, empty if they are not near uniform
+	static rbp::RectSize uniformCell(std::vector<rbp::RectSize> const& rects)
+	{
+		rbp::RectSize retval{ 0, 0 };
+		for (auto const& rect : rects)
+		{
+			retval.width = std::max(retval.width, rect.width);
+			retval.height = std::max(retval.height, rect.height);
+		}
+		for (auto const& rect : rects)
+			if (rect.width < retval.width * (1.0 - NearUniformTolerance) || rect.height < retval.height * (1.0 - NearUniformTolerance))
+				return rbp::RectSize{ 0, 0 };
+		return retval;
+	}
+
+	// the grid of cell sized items in the inner area that holds count of them in the smallest bounding box, ties to fewer turned
+	// candidates : k rows of upright cells with turned rows below, or k columns of upright cells with turned columns to the right
+	// empty grid if count do not fit. O(rows + columns), independent of count
+	static Grid uniformGrid(int innerWid, int innerHi, rbp::RectSize cell, int64_t count, bool turnable)
+	{
+		Grid retval;
+		int64_t bestBound = std::numeric_limits<int64_t>::max();
+		int64_t bestTurned = 0;
+		if (cell.width <= 0 || cell.height <= 0 || innerWid <= 0 || innerHi <= 0)
+			return retval;
+
+		auto consider = [&](Grid const& grid, bool below)
+		{
+			if (grid.capacity() < count)
+				return;
+			const int64_t inUpright = std::min(count, grid.upright.capacity()), inTurned = count - inUpright;
+			const int uprightWid = grid.upright.usedWid(inUpright), uprightHi = grid.upright.usedHi(inUpright);
+			const int turnedWid = grid.turned.usedWid(inTurned), turnedHi = grid.turned.usedHi(inTurned);
+			const int right = below ? std::max(uprightWid, turnedWid) : (inTurned ? grid.turned.x + turnedWid : uprightWid);
+			const int bottom = below ? (inTurned ? grid.turned.y + turnedHi : uprightHi) : std::max(uprightHi, turnedHi);
+			const int64_t bound = (int64_t)right * bottom;
+			if (bound < bestBound || (bound == bestBound && inTurned < bestTurned))
+			{
+				bestBound = bound;
+				bestTurned = inTurned;
+				retval = grid;
+			}
+		};
+
+		const int maxCols = innerWid / cell.width, maxRows = innerHi / cell.height;
+		for (int rows = turnable ? 0 : maxRows; rows <= maxRows; ++rows)
+		{
+			Grid grid;
+			grid.upright = GridBlock{ 0, 0, maxCols, rows, cell.width, cell.height };
+			if (turnable)
+				grid.turned = GridBlock{ 0, rows * cell.height, innerWid / cell.height, (innerHi - rows * cell.height) / cell.width, cell.height, cell.width };
+			consider(grid, true);
+		}
+		for (int cols = maxCols; turnable && cols >= 0; --cols)
+		{
+			Grid grid;
+			grid.upright = GridBlock{ 0, 0, cols, maxRows, cell.width, cell.height };
+			grid.turned = GridBlock{ cols * cell.width, 0, (innerWid - cols * cell.width) / cell.height, innerHi / cell.width, cell.height, cell.width };
+			consider(grid, false);
+		}
+		return retval;
+	}
+
+	// analytic layout of near uniform rects without obstacles, false if they are not or do not fit in a grid
+	// placed : a rect per item at the top left of its cell, rotated if its cell is turned
+	static bool placeUniform(int innerWid, int innerHi, std::vector<rbp::RectSize> const& rects, std::vector<char> const& fixed,
+		std::vector<rbp::Rect> const& obstacles, std::vector<rbp::Rect>* placed = nullptr)
+	{
+		if (rects.size() < 2 || !obstacles.empty())
+			return false;
+		const auto cell = uniformCell(rects);
+		const bool turnable = std::none_of(fixed.begin(), fixed.end(), [](char value) { return value != 0; }) && cell.width != cell.height;
+		const Grid grid = uniformGrid(innerWid, innerHi, cell, (int64_t)rects.size(), turnable);
+		if (grid.capacity() < (int64_t)rects.size())
+			return false;
+
+		if (placed)
+		{
+			placed->clear();
+			for (size_t idx = 0; idx < rects.size(); ++idx)
+			{
+				const bool inUpright = (int64_t)idx < grid.upright.capacity();
+				const auto slot = inUpright ? grid.upright.cell(idx) : grid.turned.cell(idx - grid.upright.capacity());
+				auto const& rect = rects[idx];
+				placed->push_back(inUpright ? rbp::Rect{ slot.x, slot.y, rect.width, rect.height } : rbp::Rect{ slot.x, slot.y, rect.height, rect.width });
+			}
+		}
+		return true;
+	}
+#pragma endregion
+
+	// largest area first, then wider first so that items of one size are consecutive runs for insertRun()
+	static bool insertsBefore(int64_t lhsArea, int lhsWid, int64_t rhsArea, int rhsWid)
+	{
+		return lhsArea != rhsArea ? lhsArea > rhsArea : lhsWid > rhsWid;
+	}
+
+	using HeuristicPair = std::pair<rbp::GuillotineBinPack::FreeRectChoiceHeuristic, rbp::GuillotineBinPack::GuillotineSplitHeuristic>;
+
+	// greedy guillotine heuristics, the first pair is the default and the rest are tried when it fails
+	// a single pair is far from monotonic in sheet size
+	static std::vector<HeuristicPair> const& guillotineHeuristics()
+	{
+		using Packer = rbp::GuillotineBinPack;
+		static const std::vector<HeuristicPair> heuristics
+		{
+			{ Packer::RectBestAreaFit, Packer::SplitMaximizeArea },
+			{ Packer::RectBestAreaFit, Packer::SplitShorterLeftoverAxis },
+			{ Packer::RectBestShortSideFit, Packer::SplitMinimizeArea },
+			{ Packer::RectBestShortSideFit, Packer::SplitLongerLeftoverAxis },
+		};
+		return heuristics;
+	}
+
+	// probe only : true if every rect fits on the sheet, no BinImage is touched
+	// fixed : from binImage2Fixed, empty if every item may rotate
+	// obstacles : from obstacleRects, rects of pinned images are not in rects then
+	virtual bool fits(int dst_wid, int dst_hi, std::vector<rbp::RectSize> const& rects, std::vector<char> const& fixed = std::vector<char>(),
+		std::vector<rbp::Rect> const& obstacles = std::vector<rbp::Rect>()) const
+	{
+		using Packer = rbp::GuillotineBinPack;
+
+		std::vector<int> order(rects.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::stable_sort(order.begin(), order.end(), [&rects](int lhs, int rhs)
+			{
+				return insertsBefore((int64_t)rects[lhs].width * rects[lhs].height, rects[lhs].width,
+					(int64_t)rects[rhs].width * rects[rhs].height, rects[rhs].width);
+			});
+
+		const int innerWid = spacing.inner(dst_wid), innerHi = spacing.inner(dst_hi);
+		if (innerWid <= 0 || innerHi <= 0)
+			return false;
+		if (placeUniform(innerWid, innerHi, rects, fixed, obstacles))
+			return true;
+
+		auto isFixed = [&fixed](int idx) { return !fixed.empty() && fixed[idx]; };
+		const bool merge = false;
+		std::vector<rbp::Rect> placed;
+		for (auto const& [choice, split] : guillotineHeuristics())
+		{
+			Packer packer;
+			initPacker(packer, innerWid, innerHi, obstacles);
+
+			bool allInserted = true;
+			for (size_t first = 0, last = 0; first < order.size() && allInserted; first = last)
+			{
+				auto const& rect = rects[order[first]];
+				for (last = first + 1; last < order.size(); ++last)
+				{
+					auto const& next = rects[order[last]];
+					if (next.width != rect.width || next.height != rect.height || isFixed(order[last]) != isFixed(order[first]))
+						break;
+				}
+				allInserted = insertRun(packer, rect.width, rect.height, (int)(last - first), isFixed(order[first]), merge, choice, split, placed);
+			}
+			if (allInserted)
+				return true;
+		}
+		return false;
+	}
+
 	virtual ~BaseBinPacker() {}
 };
 
@@ -55,46 +503,100 @@ public:
 public:
 	BinPackError run(int dst_wid, int dst_hi, std::vector<BinImagePtr>& images) override
 	{
+		//pinned images stay where they are, the others are packed around them
+		const int innerWid = spacing.inner(dst_wid), innerHi = spacing.inner(dst_hi);
+		const auto obstacles = obstacleRects(images);
+		if (BinPackError error = checkPinned(innerWid, innerHi, images, obstacles))
+			return error;
+
 		//copy as a workspace
 		std::vector<BinImagePtr> reservoir = images;
 		
-		std::sort(reservoir.begin(), reservoir.end(), [](BinImagePtr const& lhs, BinImagePtr const& rhs)
+		//sizes only, pixels may not be decoded yet. stable, fits() has to see the same order
+		std::stable_sort(reservoir.begin(), reservoir.end(), [](BinImagePtr const& lhs, BinImagePtr const& rhs)
 			{
-				return lhs->imagePtr->pixelCount() > rhs->imagePtr->pixelCount();
+				const QSize l = lhs->size(), r = rhs->size();
+				return insertsBefore((int64_t)l.width() * l.height(), l.width(), (int64_t)r.width() * r.height(), r.width());
 			});
 
-		packer = std::make_unique<Packer>();
-		packer->Init(dst_wid, dst_hi);
+		//near uniform items on a sheet without obstacles are laid out as a grid, no insert at all
+		std::vector<rbp::Rect> placed;
+		if (placeUniform(innerWid, innerHi, binImage2Rects(reservoir), binImage2Fixed(reservoir), obstacles, &placed))
+		{
+			for (size_t idx = 0; idx < reservoir.size(); ++idx)
+			{
+				auto binImage = reservoir.at(idx);
+				const QSize imgSize = binImage->size();
+				const bool flipped = spacing.isFlipped(placed.at(idx), imgSize.width(), imgSize.height());
+				binImage->isFlipped = flipped;
+				binImage->result = spacing.place(placed.at(idx), flipped, imgSize.width(), imgSize.height());
+			}
+			images = reservoir;
+			return BP_NO_ERROR;
+		}
+
+		util::beginStage(task, "packing", (int64_t)guillotineHeuristics().size());
+		for (auto const& [Choice, Split] : guillotineHeuristics())
+		{
+			if (util::isCancelled(task))
+				return BP_ERR_CANCELLED;
+
+			if (insertAll(dst_wid, dst_hi, reservoir, obstacles, Choice, Split))
+			{
+				//return if successful
+				images = reservoir;
+				return BP_NO_ERROR;
+			}
+			util::advance(task);
+		}
+
+		//failed to insert a rectangle
+		return BP_ERR_EXCEED_AVAILABLE_SPACE;
+	}
 
-		auto Choice = Packer::FreeRectChoiceHeuristic::RectBestAreaFit;
-		auto Split = Packer::GuillotineSplitHeuristic::SplitMaximizeArea;
+protected:
+	bool insertAll(int dst_wid, int dst_hi, std::vector<BinImagePtr> const& reservoir, std::vector<rbp::Rect> const& obstacles,
+		Packer::FreeRectChoiceHeuristic Choice, Packer::GuillotineSplitHeuristic Split)
+	{
+		const int innerWid = spacing.inner(dst_wid), innerHi = spacing.inner(dst_hi);
+		if (innerWid <= 0 || innerHi <= 0)
+			return false;
+
+		packer = std::make_unique<Packer>();
+		initPacker(*packer, innerWid, innerHi, obstacles);
 
 		const bool merge = false;
-		std::vector<rbp::Rect> retval;
-		for (auto binImage : reservoir)
+		std::vector<rbp::Rect> placed;
+		for (size_t first = 0, last = 0; first < reservoir.size(); first = last)
 		{
-			const auto img = binImage->imagePtr;
-			const auto wid = img->width(), hi = img->height();
+			auto const& binImage = reservoir.at(first);
+			last = first + 1;
+			if (binImage->pinned)
+				continue;
+
+			//consecutive items of one size and rotation policy, e.g. the quantity placements of one image, go in as a run
+			const QSize imgSize = binImage->size();
+			while (last < reservoir.size() && !reservoir.at(last)->pinned && reservoir.at(last)->size() == imgSize
+				&& reservoir.at(last)->canRotate90() == binImage->canRotate90())
+				last++;
 
-			auto result = packer->Insert(wid, hi, merge, Choice, Split);
-			if (result.height == 0 || result.width == 0)
+			const auto wid = imgSize.width(), hi = imgSize.height();
+			const auto inflated = spacing.inflate(wid, hi);
+			if (!insertRun(*packer, inflated.width, inflated.height, (int)(last - first), !binImage->canRotate90(), merge, Choice, Split, placed))
+				return false;
+
+			for (size_t idx = first; idx < last; ++idx)
 			{
-				//failed to insert a rectangle
-				return BP_ERR_EXCEED_AVAILABLE_SPACE;
-			}
+				auto const& result = placed.at(idx - first);
 
-			//check if flipped
-			const bool flipped = !(result.height == hi && result.width == wid);
-			binImage->isFlipped = flipped;
+				//check if flipped
+				const bool flipped = spacing.isFlipped(result, wid, hi);
+				reservoir.at(idx)->isFlipped = flipped;
 
-			//update result
-			const QPoint startPoint(result.x, result.y);
-			const QSize size = !flipped ? QSize(wid, hi) : QSize(hi, wid);
-			binImage->result = QRect(startPoint, size);
+				//update result
+				reservoir.at(idx)->result = spacing.place(result, flipped, wid, hi);
+			}
 		}
-
-		//return if successful
-		images = reservoir;
-		return BP_NO_ERROR;
+		return true;
 	}
 };
\ No newline at end of file
@@ -0,0 +1,134 @@
+#pragma once
+
+#include "BinPacker.h"
+#include "FreeRectStore.h"
+
+// own MaxRects core for large jobs (thousands of small stickers)
+// rbp keeps its free rects in a vector and prunes them O(n^2) on every insert, see FreeRectStore for the layout here
+// items are inserted largest area first, the heuristics are tried in order until every item fits
+template <>
+class BinPacker<MaxRects> : public BaseBinPacker
+{
+public:
+	static std::vector<maxrects::Heuristic> const& heuristics()
+	{
+		static const std::vector<maxrects::Heuristic> retval{ maxrects::ShortSideFit, maxrects::BottomLeft, maxrects::LongSideFit };
+		return retval;
+	}
+
+	BinPackError run(int dst_wid, int dst_hi, std::vector<BinImagePtr>& images) override
+	{
+		if (images.empty())
+			return BP_ERR_NO_IMAGE;
+
+		const int innerWid = spacing.inner(dst_wid), innerHi = spacing.inner(dst_hi);
+		const auto obstacles = obstacleRects(images);
+		if (BinPackError error = checkPinned(innerWid, innerHi, images, obstacles))
+			return error;
+
+		std::vector<BinImagePtr> reservoir;
+		for (auto ptr : images)
+			if (!ptr->pinned)
+				reservoir.push_back(ptr);
+		const auto rects = binImage2Rects(reservoir);
+		const auto fixed = binImage2Fixed(reservoir);
+
+		std::vector<maxrects::Rect> placed;
+		std::vector<char> rotated;
+		for (auto heuristic : heuristics())
+		{
+			util::beginStage(task, "packing", (int64_t)rects.size());
+			if (!packRects(innerWid, innerHi, rects, fixed, obstacles, heuristic, placed, rotated, task))
+			{
+				if (util::isCancelled(task))
+					return BP_ERR_CANCELLED;
+				continue;
+			}
+
+			//pinned images first, then in insertion order like the other packers
+			std::vector<BinImagePtr> result;
+			for (auto ptr : images)
+				if (ptr->pinned)
+					result.push_back(ptr);
+			for (int idx : insertionOrder(rects))
+			{
+				auto binImage = reservoir.at(idx);
+				const QSize size = binImage->size();
+				auto const& rect = placed.at(idx);
+				binImage->isFlipped = rotated.at(idx);
+				binImage->result = spacing.place(rbp::Rect{ rect.x, rect.y, rect.width, rect.height }, rotated.at(idx), size.width(), size.height());
+				result.push_back(binImage);
+			}
+			images = result;
+			return BP_NO_ERROR;
+		}
+		return BP_ERR_EXCEED_AVAILABLE_SPACE;
+	}
+
+	bool fits(int dst_wid, int dst_hi, std::vector<rbp::RectSize> const& rects, std::vector<char> const& fixed = std::vector<char>(),
+		std::vector<rbp::Rect> const& obstacles = std::vector<rbp::Rect>()) const override
+	{
+		const int innerWid = spacing.inner(dst_wid), innerHi = spacing.inner(dst_hi);
+		std::vector<maxrects::Rect> placed;
+		std::vector<char> rotated;
+		for (auto heuristic : heuristics())
+			if (packRects(innerWid, innerHi, rects, fixed, obstacles, heuristic, placed, rotated))
+				return true;
+		return false;
+	}
+
+protected:
+	// largest area first, stable so that fits() and run() agree
+	static std::vector<int> insertionOrder(std::vector<rbp::RectSize> const& rects)
+	{
+		std::vector<int> order(rects.size());
+		std::iota(order.begin(), order.end(), 0);
+		std::stable_sort(order.begin(), order.end(), [&rects](int lhs, int rhs)
+			{
+				return (int64_t)rects[lhs].width * rects[lhs].height > (int64_t)rects[rhs].width * rects[rhs].height;
+			});
+		return order;
+	}
+
+	// placed/rotated by rect index, false as soon as one rect does not fit or the task is cancelled
+	static bool packRects(int innerWid, int innerHi, std::vector<rbp::RectSize> const& rects, std::vector<char> const& fixed,
+		std::vector<rbp::Rect> const& obstacles, maxrects::Heuristic heuristic, std::vector<maxrects::Rect>& placed, std::vector<char>& rotated,
+		TaskState* task = nullptr)
+	{
+		if (innerWid <= 0 || innerHi <= 0)
+			return false;
+
+		maxrects::FreeRectStore store;
+		store.init(innerWid, innerHi);
+		for (auto const& obstacle : obstacles)
+			store.place(maxrects::Rect{ obstacle.x, obstacle.y, obstacle.width, obstacle.height });
+
+		placed.assign(rects.size(), maxrects::Rect());
+		rotated.assign(rects.size(), 0);
+		int count = 0;
+		for (int idx : insertionOrder(rects))
+		{
+			if ((++count & 255) == 0)
+			{
+				if (util::isCancelled(task))
+					return false;
+				util::advance(task, 256);
+			}
+
+			auto const& rect = rects[idx];
+			const bool allowRotate = fixed.empty() || !fixed[idx];
+			const auto candidate = store.find(rect.width, rect.height, allowRotate, heuristic);
+			if (!candidate.found())
+				return false;
+
+			const auto freeRect = store.at(candidate.slot);
+			const maxrects::Rect used = !candidate.rotated
+				? maxrects::Rect{ freeRect.x, freeRect.y, rect.width, rect.height }
+				: maxrects::Rect{ freeRect.x, freeRect.y, rect.height, rect.width };
+			store.place(used);
+			placed[idx] = used;
+			rotated[idx] = candidate.rotated;
+		}
+		return true;
+	}
+};
@@ -0,0 +1,175 @@
+#pragma once
+
+#include "BinPacker.h"
+#include "ShapeMask.h"
+#include "Trace.h"
+#include "Utils.h"
+
+#include <array>
+#include <map>
+
+// nesting by shape, for die cut stickers on a transparent background : items interlock instead of lining up their bounding boxes
+//		every image is its ShapeMask on a grid of cells over the sheet, see cellSize()
+//		largest first, each item goes to the first position in rows top to bottom, then left to right, where its cells meet no occupied one
+//		the collision test ANDs 64 cells per word, see ShapeMask::overlaps()
+//		spacing : the tested mask is grown by the spacing and the occupied one is not, so neighbors keep it on every side
+//		bleed : a clearance band around the shape. nothing is drawn in it, the artwork of a die cut shape carries its own bleed
+//		pinned images and forbidden regions occupy their rects
+// fits() probes bounding boxes (BaseBinPacker), a minimum sheet found with it is an upper bound for a nested layout
+template <>
+class BinPacker<Nesting> : public BaseBinPacker
+{
+public:
+	// cells along the longer side of the sheet, the cell size in pixels follows the sheet
+	static constexpr int Resolution = 1024;
+
+	static int cellSize(QSize sheet)
+	{
+		const int longSide = std::max(sheet.width(), sheet.height());
+		return std::max(1, (longSide + Resolution - 1) / Resolution);
+	}
+
+	BinPackError run(int dst_wid, int dst_hi, std::vector<BinImagePtr>& images) override
+	{
+		if (images.empty())
+			return BP_ERR_NO_IMAGE;
+
+		const int innerWid = spacing.inner(dst_wid), innerHi = spacing.inner(dst_hi);
+		const auto obstacles = obstacleRects(images);
+		if (BinPackError error = checkPinned(innerWid, innerHi, images, obstacles))
+			return error;
+
+		const int cell = cellSize(QSize(dst_wid, dst_hi));
+		auto floorDiv = [cell](int px) { return px >= 0 ? px / cell : -((cell - 1 - px) / cell); };
+		auto ceilDiv = [cell](int px) { return px >= 0 ? (px + cell - 1) / cell : -(-px / cell); };
+
+		//the sheet without its margins, partial cells at the edges stay empty
+		//obstacles without the spacing on their right and bottom, the tested masks keep it on every side
+		ShapeMask sheet((dst_wid - 2 * spacing.margin) / cell, (dst_hi - 2 * spacing.margin) / cell, cell);
+		for (auto const& obstacle : obstacles)
+		{
+			const int left = floorDiv(obstacle.x), top = floorDiv(obstacle.y);
+			const int right = ceilDiv(obstacle.x + obstacle.width - spacing.spacing), bottom = ceilDiv(obstacle.y + obstacle.height - spacing.spacing);
+			sheet.fillRect(left, top, right - left, bottom - top);
+		}
+
+		std::vector<BinImagePtr> reservoir;
+		for (auto ptr : images)
+			if (!ptr->pinned)
+				reservoir.push_back(ptr);
+		std::stable_sort(reservoir.begin(), reservoir.end(), [](BinImagePtr const& lhs, BinImagePtr const& rhs)
+			{
+				const QSize l = lhs->size(), r = rhs->size();
+				return insertsBefore((int64_t)l.width() * l.height(), l.width(), (int64_t)r.width() * r.height(), r.width());
+			});
+
+		const int bleedCells = ceilDiv(std::max(0, spacing.bleed));
+		const auto frames = shapeFrames(reservoir, cell, bleedCells, ceilDiv(std::max(0, spacing.spacing)));
+		if (util::isCancelled(task))
+			return BP_ERR_CANCELLED;
+
+		util::beginStage(task, "nesting", (int64_t)reservoir.size());
+		std::vector<BinImagePtr> result;
+		for (auto ptr : images)
+			if (ptr->pinned)
+				result.push_back(ptr);
+
+		//positions before the one of the previous copy of a shape cannot fit the next copy either, the sheet only fills up
+		ImageHandle const* lastHandle = nullptr;
+		std::array<QPoint, 2> resume;
+		for (auto binImage : reservoir)
+		{
+			if (util::isCancelled(task))
+				return BP_ERR_CANCELLED;
+
+			auto const& frame = frames.at(binImage->handle.get());
+			if (binImage->handle.get() != lastHandle)
+				resume = { QPoint(0, 0), QPoint(0, 0) };
+			lastHandle = binImage->handle.get();
+
+			//upright first, a turned position has to be strictly earlier to win
+			int turned = -1;
+			QPoint found(0, sheet.height());
+			for (int idx = 0; idx < (binImage->canRotate90() ? 2 : 1); ++idx)
+			{
+				QPoint position;
+				if (findPosition(sheet, *frame.occupied[idx], *frame.tested[idx], frame.pad, resume[idx], found.y(), position)
+					&& (turned < 0 || std::make_pair(position.y(), position.x()) < std::make_pair(found.y(), found.x())))
+				{
+					found = position;
+					turned = idx;
+				}
+			}
+			if (turned < 0)
+				return BP_ERR_EXCEED_AVAILABLE_SPACE;
+
+			sheet.stamp(*frame.occupied[turned], found.x(), found.y());
+			resume[turned] = found;
+
+			const QSize size = turned ? binImage->size().transposed() : binImage->size();
+			binImage->isFlipped = turned == 1;
+			binImage->result = QRect(QPoint(spacing.margin + (found.x() + bleedCells) * cell, spacing.margin + (found.y() + bleedCells) * cell), size);
+			result.push_back(binImage);
+			util::advance(task);
+		}
+
+		images = result;
+		return BP_NO_ERROR;
+	}
+
+protected:
+	// masks of one handle in both orientations, upright then turned
+	struct Frame
+	{
+		std::array<ShapeMaskPtr, 2> occupied; //shape grown by the bleed, stamped into the sheet
+		std::array<ShapeMaskPtr, 2> tested; //occupied grown by the spacing, tested against the sheet
+		int pad = 0; //spacing in cells, tested is larger by it on every side
+	};
+
+	// one Frame per handle, the shapes are read on worker threads
+	std::map<ImageHandle const*, Frame> shapeFrames(std::vector<BinImagePtr> const& reservoir, int cell, int bleedCells, int spacingCells) const
+	{
+		BP_TRACE_SCOPE("shapeFrames");
+		std::map<ImageHandle const*, Frame> retval;
+		std::vector<std::pair<ImageHandlePtr, Frame*>> pending;
+		for (auto const& ptr : reservoir)
+			if (auto inserted = retval.emplace(ptr->handle.get(), Frame()); inserted.second)
+				pending.emplace_back(ptr->handle, &inserted.first->second);
+
+		util::beginStage(task, "shapes", (int64_t)pending.size());
+		util::parallelFor((int)pending.size(), [&](int idx)
+			{
+				if (util::isCancelled(task))
+					return;
+				auto const& [handle, frame] = pending.at(idx);
+				for (int turned = 0; turned < 2; ++turned)
+				{
+					auto occupied = std::make_shared<ShapeMask const>(handle->shape(cell, turned)->grown(bleedCells));
+					frame->tested[turned] = std::make_shared<ShapeMask const>(occupied->grown(spacingCells));
+					frame->occupied[turned] = occupied;
+				}
+				frame->pad = spacingCells;
+				util::advance(task);
+			});
+		return retval;
+	}
+
+	// first position from resume on, in rows top to bottom then left to right, not below maxY
+	// the occupied frame has to be inside the sheet, the tested one may reach past its edges
+	static bool findPosition(ShapeMask const& sheet, ShapeMask const& occupied, ShapeMask const& tested, int pad, QPoint resume, int maxY, QPoint& found)
+	{
+		int hint = 0;
+		for (int y = resume.y(); y <= maxY && y + occupied.height() <= sheet.height(); ++y)
+		{
+			for (int x = y == resume.y() ? resume.x() : 0; x + occupied.width() <= sheet.width(); ++x)
+			{
+				if (!sheet.overlaps(tested, x - pad, y - pad, hint))
+				{
+					found = QPoint(x, y);
+					return true;
+				}
+			}
+		}
+		return false;
+	}
+};
@@ -0,0 +1,325 @@
+#pragma once
+
+#include "BinPacker.h"
+#include "Trace.h"
+#include "Utils.h"
+
+#include <chrono>
+#include <cmath>
+#include <mutex>
+#include <numeric>
+#include <random>
+
+// limits of the anytime search, whichever comes first
+struct SearchBudget
+{
+	int timeMs = 3000;		// <= 0 : no time limit
+	int iterations = 0;		// total over every thread, <= 0 : no iteration limit
+	int threadCount = 0;	// 0 : hardware concurrency
+};
+
+// anytime packer : starts from the best layout fits() of BinPacker<Guillotine> finds (uniform grid or best heuristic pair)
+// and keeps the best layout found by simulated annealing over insertion order and rbp heuristics on every core until the budget runs out
+//		a sheet the minimum sheet search accepts with fits() therefore always packs here, with or without a budget
+//		score : packed area first, then the bounding box of the layout (smaller leaves a larger remnant)
+//		orientation is left to rbp, it rotates an item when only the rotated one fits, unless the item is fixed
+//		pinned images are obstacles, only the others are in the insertion order
+template <>
+class BinPacker<GuillotineSearch> : public BaseBinPacker
+{
+public:
+	using Packer = rbp::GuillotineBinPack;
+	using Clock = std::chrono::steady_clock;
+
+	SearchBudget budget;
+
+	BinPacker(SearchBudget searchBudget = SearchBudget())
+		: budget(searchBudget)
+	{
+	}
+
+	struct Candidate
+	{
+		std::vector<int> order; //indices into the input images
+		Packer::FreeRectChoiceHeuristic choice = Packer::RectBestAreaFit;
+		Packer::GuillotineSplitHeuristic split = Packer::SplitMaximizeArea;
+	};
+
+	struct Layout
+	{
+		std::vector<rbp::Rect> rects; //by input index, zero sized if not packed
+		int64_t packedArea = 0;
+		int64_t boundArea = 0;
+		bool complete = false;
+
+		// lower is better
+		double cost(int64_t totalArea, int64_t sheetArea) const
+		{
+			return (double)(totalArea - packedArea) * (double)sheetArea + (double)boundArea;
+		}
+	};
+
+	static Layout evaluate(int dst_wid, int dst_hi, std::vector<rbp::RectSize> const& sizes, std::vector<char> const& fixed,
+		std::vector<rbp::Rect> const& obstacles, Candidate const& candidate)
+	{
+		Packer packer;
+		initPacker(packer, dst_wid, dst_hi, obstacles);
+
+		Layout retval;
+		retval.rects.assign(sizes.size(), rbp::Rect{ 0, 0, 0, 0 });
+		retval.complete = true;
+
+		int right = 0, bottom = 0;
+		const bool merge = false;
+		auto const& order = candidate.order;
+		std::vector<rbp::Rect> placed;
+		for (size_t first = 0, last = 0; first < order.size(); first = last)
+		{
+			//consecutive items of one size go in as a run, those that do not fit then one by one
+			auto const& size = sizes.at(order[first]);
+			const bool isFixed = fixed.at(order[first]) != 0;
+			for (last = first + 1; last < order.size(); ++last)
+			{
+				auto const& next = sizes.at(order[last]);
+				if (next.width != size.width || next.height != size.height || (fixed.at(order[last]) != 0) != isFixed)
+					break;
+			}
+
+			//a failed run keeps the items placed before it failed
+			placed.clear();
+			if (last - first > 1)
+				insertRun(packer, size.width, size.height, (int)(last - first), isFixed, merge, candidate.choice, candidate.split, placed);
+			for (size_t idx = first; idx < last; ++idx)
+			{
+				auto result = idx - first < placed.size() ? placed.at(idx - first)
+					: insert(packer, size.width, size.height, isFixed, merge, candidate.choice, candidate.split);
+				if (result.height == 0 || result.width == 0)
+				{
+					retval.complete = false;
+					continue;
+				}
+				retval.rects.at(order[idx]) = result;
+				retval.packedArea += (int64_t)size.width * size.height;
+				right = std::max(right, result.x + result.width);
+				bottom = std::max(bottom, result.y + result.height);
+			}
+		}
+		retval.boundArea = (int64_t)right * bottom;
+		return retval;
+	}
+
+	BinPackError run(int dst_wid, int dst_hi, std::vector<BinImagePtr>& images) override
+	{
+		if (images.empty())
+			return BP_ERR_NO_IMAGE;
+
+		//inflated by spacing, packed into the inner area
+		const auto sizes = binImage2Rects(images);
+		const auto fixed = binImage2Fixed(images);
+		const auto obstacles = obstacleRects(images);
+		dst_wid = spacing.inner(dst_wid);
+		dst_hi = spacing.inner(dst_hi);
+		if (BinPackError error = checkPinned(dst_wid, dst_hi, images, obstacles))
+			return error;
+		if (dst_wid <= 0 || dst_hi <= 0)
+			return BP_ERR_EXCEED_AVAILABLE_SPACE;
+
+		//greedy start : insertion order of BinPacker<Guillotine>
+		Candidate greedy;
+		std::vector<BinImagePtr> pinned;
+		for (int idx = 0; idx < (int)images.size(); ++idx)
+		{
+			if (images[idx]->pinned)
+				pinned.push_back(images[idx]);
+			else
+				greedy.order.push_back(idx);
+		}
+		const int count = (int)greedy.order.size();
+
+		const int64_t sheetArea = (int64_t)dst_wid * dst_hi;
+		const int64_t totalArea = std::accumulate(greedy.order.begin(), greedy.order.end(), (int64_t)0,
+			[&sizes](int64_t sum, int idx) { return sum + (int64_t)sizes[idx].width * sizes[idx].height; });
+
+		std::stable_sort(greedy.order.begin(), greedy.order.end(), [&sizes](int lhs, int rhs)
+			{
+				return insertsBefore((int64_t)sizes[lhs].width * sizes[lhs].height, sizes[lhs].width,
+					(int64_t)sizes[rhs].width * sizes[rhs].height, sizes[rhs].width);
+			});
+
+		//every heuristic pair fits() tries, the search goes on from the cheapest
+		Layout bestLayout;
+		double greedyCost = 0;
+		for (size_t idx = 0; idx < guillotineHeuristics().size(); ++idx)
+		{
+			Candidate candidate = greedy;
+			candidate.choice = guillotineHeuristics()[idx].first;
+			candidate.split = guillotineHeuristics()[idx].second;
+			Layout layout = evaluate(dst_wid, dst_hi, sizes, fixed, obstacles, candidate);
+			const double cost = layout.cost(totalArea, sheetArea);
+			if (idx == 0 || cost < greedyCost)
+			{
+				greedy = std::move(candidate);
+				bestLayout = std::move(layout);
+				greedyCost = cost;
+			}
+		}
+		Candidate best = greedy;
+
+		//the uniform grid of fits() is the best so far if it is cheaper, no candidate order makes it
+		std::vector<rbp::Rect> uniform;
+		if (placeUniform(dst_wid, dst_hi, sizes, fixed, obstacles, &uniform))
+		{
+			Layout layout = gridLayout(uniform, totalArea);
+			if (layout.cost(totalArea, sheetArea) < greedyCost)
+				bestLayout = std::move(layout);
+		}
+		std::atomic<double> bestCost{ bestLayout.cost(totalArea, sheetArea) }; //read without the lock as a fast reject
+		std::mutex bestMutex;
+
+		const auto start = Clock::now();
+		const auto deadline = start + std::chrono::milliseconds(budget.timeMs);
+		std::atomic<int> iterations{ 0 };
+
+		auto progress = [&]() -> double
+		{
+			double retval = 0;
+			if (budget.timeMs > 0)
+				retval = std::chrono::duration<double, std::milli>(Clock::now() - start).count() / budget.timeMs;
+			if (budget.iterations > 0)
+				retval = std::max(retval, (double)iterations / budget.iterations);
+			return retval;
+		};
+
+		util::beginStage(task, "searching", 1000);
+
+		//no budget at all means greedy only
+		const bool searchable = count > 1 && (budget.timeMs > 0 || budget.iterations > 0);
+
+		int threadCount = budget.threadCount > 0 ? budget.threadCount : (int)std::thread::hardware_concurrency();
+		threadCount = std::max(1, threadCount);
+
+		util::parallelFor(searchable ? threadCount : 0, [&](int threadIdx)
+			{
+				BP_TRACE_SCOPE("searchThread");
+				std::mt19937 rng((unsigned)(0x9E3779B9u * (threadIdx + 1)));
+				std::uniform_real_distribution<double> unit(0.0, 1.0);
+
+				Candidate current = greedy;
+				double currentCost = greedyCost;
+
+				for (;;)
+				{
+					if (budget.iterations > 0 && iterations++ >= budget.iterations)
+						break;
+					if (budget.timeMs > 0 && Clock::now() >= deadline)
+						break;
+					if (util::isCancelled(task))
+						break;
+					if (threadIdx == 0)
+						util::setFraction(task, progress());
+
+					Candidate next = current;
+					mutate(next, rng);
+
+					Layout layout = evaluate(dst_wid, dst_hi, sizes, fixed, obstacles, next);
+					const double nextCost = layout.cost(totalArea, sheetArea);
+
+					//temperature relative to the current cost, cooled linearly over the budget
+					const double temperature = 0.05 * std::max(0.0, 1.0 - progress()) + 1e-4;
+					const double delta = (nextCost - currentCost) / std::max(1.0, currentCost);
+					if (delta <= 0 || unit(rng) < std::exp(-delta / temperature))
+					{
+						current = std::move(next);
+						currentCost = nextCost;
+					}
+
+					if (nextCost < bestCost.load())
+					{
+						std::lock_guard<std::mutex> lock(bestMutex);
+						if (nextCost < bestCost.load())
+						{
+							best = current;
+							bestLayout = std::move(layout);
+							bestCost = nextCost;
+						}
+					}
+				}
+			}, threadCount);
+
+		if (util::isCancelled(task))
+			return BP_ERR_CANCELLED;
+		if (!bestLayout.complete)
+			return BP_ERR_EXCEED_AVAILABLE_SPACE;
+
+		//apply in insertion order of the best candidate, after the untouched pinned images
+		std::vector<BinImagePtr> reservoir = pinned;
+		for (int idx : best.order)
+		{
+			auto binImage = images.at(idx);
+			auto const& rect = bestLayout.rects.at(idx);
+			const QSize size = binImage->size();
+
+			const bool flipped = spacing.isFlipped(rect, size.width(), size.height());
+			binImage->isFlipped = flipped;
+			binImage->result = spacing.place(rect, flipped, size.width(), size.height());
+			reservoir.push_back(binImage);
+		}
+
+		images = reservoir;
+		return BP_NO_ERROR;
+	}
+
+protected:
+	// placements of placeUniform() by input index, all packed
+	static Layout gridLayout(std::vector<rbp::Rect> const& placed, int64_t totalArea)
+	{
+		Layout retval;
+		retval.rects = placed;
+		retval.packedArea = totalArea;
+		retval.complete = true;
+		int right = 0, bottom = 0;
+		for (auto const& rect : placed)
+		{
+			right = std::max(right, rect.x + rect.width);
+			bottom = std::max(bottom, rect.y + rect.height);
+		}
+		retval.boundArea = (int64_t)right * bottom;
+		return retval;
+	}
+
+	template <typename RngT>
+	static void mutate(Candidate& candidate, RngT& rng)
+	{
+		const int count = (int)candidate.order.size();
+		std::uniform_int_distribution<int> pick(0, count - 1);
+		std::uniform_int_distribution<int> move(0, 9);
+
+		switch (move(rng))
+		{
+		case 0:
+		{
+			std::uniform_int_distribution<int> choice(0, Packer::RectWorstLongSideFit);
+			candidate.choice = (Packer::FreeRectChoiceHeuristic)choice(rng);
+			break;
+		}
+		case 1:
+		{
+			std::uniform_int_distribution<int> split(0, Packer::SplitLongerAxis);
+			candidate.split = (Packer::GuillotineSplitHeuristic)split(rng);
+			break;
+		}
+		case 2: case 3: case 4:
+		{
+			//move one item to another position
+			const int from = pick(rng), to = pick(rng);
+			const int item = candidate.order.at(from);
+			candidate.order.erase(candidate.order.begin() + from);
+			candidate.order.insert(candidate.order.begin() + to, item);
+			break;
+		}
+		default:
+			std::swap(candidate.order.at(pick(rng)), candidate.order.at(pick(rng)));
+			break;
+		}
+	}
+};
@@ -2,13 +2,12 @@
 
 //file IO
 #include <QFileDialog>
-#include <QPainter>
-#include <QPdfWriter>
 
 //logging
 #include "Logger.h"
 #include <QDebug>
 #include <QMessageBox>
+#include <QProgressDialog>
 
 //UI components
 #include <QMenuBar>
@@ -21,6 +20,7 @@
 #include <QValidator>
 #include <QLineEdit>
 #include <QLabel>
+#include <QInputDialog>
 
 //events
 #include <QFileDialog>
@@ -28,10 +28,19 @@
 #include <QDropEvent>
 #include <QKeyEvent>
 #include <QMimeData>
+#include <QEventLoop>
+#include <QTimer>
+
+#include <exception>
 
 //private classes
 #include "Receivers.h"
 #include "BinImageManager.h"
+#include "JobRunner.h"
+#include "MemoryAccountant.h"
+#include "ResultExport.h"
+#include "SheetPdfWriter.h"
+#include "Task.h"
 #include "Utils.h"
 
 class BinpackMainWindow::PImpl
@@ -48,11 +57,15 @@ public:
 	ImagePathParser imagePathParser;
 	BinImageManager imageManager;
 	bool keepPreviousImage = true;
-	ImageDataRGBPtr finalImage;
+	bool devMode = false;
+	ImageDataRGBXPtr finalImage;
 	QSize canvasSize{ 1600,1000 };
 	KarlsunStyle globalKarlsunStyle = KarlsunStyle::DefaultStyle();
 	int resultImageDPI = 300;
 	int resultImageQuality = 100; // from 0 ~ 100
+	int proofImageDPI = 72; // screen proof, decoded at reduced size
+	SearchBudget searchBudget; // precise nesting
+	JobManifest::Outputs jobOutputs; // of the last loaded job, kept when it is saved again
 
 	template <typename T = void>
 	T Notify(QString title, QString msg) {}
@@ -77,6 +90,72 @@ public:
 		int ret = msgBox.exec();
 	}
 
+	bool lastTaskCancelled = false;
+	bool lastTaskFailed = false;
+
+	// runs work(TaskState*) on a worker thread and returns its result, lastTaskCancelled tells a cancelled one
+	// an exception from work (e.g. bad_alloc of a sheet) is shown here and a value initialized result returned, lastTaskFailed tells it
+	// work done within a moment shows nothing, longer work a modal progress dialog that cancels it cooperatively
+	// the canvas is not repainted meanwhile, the worker may be changing its images
+	template <typename FuncT>
+	auto runTask(QString title, FuncT&& work) -> decltype(work((TaskState*)nullptr))
+	{
+		using ResultT = decltype(work((TaskState*)nullptr));
+		auto task = Task<ResultT>::start(std::forward<FuncT>(work));
+
+		Owner->m_canvas->setUpdatesEnabled(false);
+		if (!task.waitFor(300))
+		{
+			QProgressDialog dialog(title, KorStr(""), 0, 1000, Owner);
+			dialog.setWindowModality(Qt::WindowModal);
+			dialog.setMinimumDuration(0);
+			dialog.setAutoClose(false);
+			dialog.setAutoReset(false);
+			dialog.show();
+
+			QEventLoop loop;
+			QTimer timer;
+			connect(&dialog, &QProgressDialog::canceled, [&]()
+				{
+					task.cancel();
+					dialog.setLabelText(KorStr("ϴ ..."));
+				});
+			connect(&timer, &QTimer::timeout, [&]()
+				{
+					//a stage without measurable progress shows a busy bar
+					const double fraction = task.progress().fraction();
+					dialog.setMaximum(fraction < 0 ? 0 : 1000);
+					if (fraction >= 0)
+						dialog.setValue((int)(fraction * 1000));
+					if (task.isReady())
+						loop.quit();
+				});
+			timer.start(50);
+			loop.exec();
+		}
+		Owner->m_canvas->setUpdatesEnabled(true);
+
+		lastTaskCancelled = task.progress().isCancelled();
+		lastTaskFailed = false;
+		QString error;
+		try
+		{
+			return task.get();
+		}
+		catch (std::exception const& e)
+		{
+			error = QString::fromLocal8Bit(e.what());
+		}
+		catch (...)
+		{
+			error = KorStr("   ");
+		}
+		qWarning() << "Task failed : " << error;
+		lastTaskFailed = true;
+		Notify(title, KorStr("۾   ߻߽ϴ : ") + error);
+		return ResultT();
+	}
+
 	void updateBinImage(QList<QUrl> const& fileList)
 	{
 		if (!keepPreviousImage)
@@ -89,8 +168,18 @@ public:
 		{
 			auto path = url.toLocalFile();
 
+			//header only, decoded after the layout is made
 			if (imagePathParser.isSupportedFormat(path))
-				imageManager.addImage(path);
+				imageManager.addImageDeferred(path);
+		}
+	}
+
+	void notifyDuplicates(int prevDuplicates)
+	{
+		if (const int duplicates = imageManager.duplicateCount() - prevDuplicates; duplicates > 0)
+		{
+			qWarning() << "Duplicated images added : " << duplicates;
+			Notify(KorStr("ߺ ̹"), QString("%1%2").arg(duplicates).arg(KorStr(" ̹ ̹ ߰ ̹ ϴ")));
 		}
 	}
 
@@ -160,9 +249,12 @@ public:
 		qDebug() << "adding images. Image count : " << fileList.size();
 
 		imageManager.storeCurState();
+		const int prevDuplicates = imageManager.duplicateCount();
 		updateBinImage(fileList);
 		if (!tryBinPack())
 			imageManager.restoreLastState();
+		else
+			notifyDuplicates(prevDuplicates);
 		updateCanvas();
 		updateInfoToolbar();
 	}
@@ -332,13 +424,42 @@ public:
 
 		//if (this->finalImage = mgr.binPack([this](QString msg) {Notify(__FUNCTION__, msg); }))
 #define _BINPACK_LOGGER_WARNING [](QString msg) { qWarning() << msg; }
-#define _BINPACK_LOGGER_MUTE
+#define _BINPACK_LOGGER_MUTE [](QString msg) {/* mute */}
 #ifdef _DEBUG
 #define BINPACK_LOGGER _BINPACK_LOGGER_WARNING
 #else //Binpack logger is muted on release version
 #define BINPACK_LOGGER _BINPACK_LOGGER_MUTE
 #endif
-		if (this->finalImage = mgr.binPack(BINPACK_LOGGER))
+		//the message handler is thread safe, the packer logs from its worker
+		const bool packed = runTask(KorStr("ڵ ׽"), [&](TaskState* task)
+			{
+				return mgr.pack(BINPACK_LOGGER, task);
+			});
+
+		if (!packed)
+		{
+			if (!lastTaskCancelled && !lastTaskFailed)
+				Notify(KorStr("ڵ ׽"), KorStr("׽ÿ ߽ϴ"));
+			return false;
+		}
+
+		//layout is ready before decoding, show placeholders meanwhile
+		if (mgr.pendingCount() > 0)
+		{
+			setGlobalKarlsunStyle();
+			Owner->m_canvas->repaint();
+		}
+
+		//over the memory budget the previous sheet and the decoded images go before a new sheet is made
+		if (!MemoryAccountant::instance().fits(mgr.sheetBytes()))
+		{
+			this->finalImage = nullptr;
+			const int spilled = mgr.spillDecoded();
+			qWarning() << "Over the memory budget, decoded images released : " << spilled;
+		}
+
+		this->finalImage = runTask(KorStr("̹ ռ"), [&](TaskState* task) { return mgr.makeFinalImage(VectorRGBX::White(), task); });
+		if (this->finalImage)
 		{
 			setGlobalKarlsunStyle();
 			sendBinImages2Canvas();
@@ -347,7 +468,8 @@ public:
 		}
 		else
 		{
-			Notify(KorStr("ڵ ׽"), KorStr("׽ÿ ߽ϴ"));
+			if (!lastTaskCancelled && !lastTaskFailed)
+				Notify(KorStr("ڵ ׽"), KorStr("̹  ߽ϴ"));
 			return false;
 		}
 
@@ -382,6 +504,147 @@ public:
 		}
 	}
 
+	// pinning keeps the current layout, later packs go around the pinned images
+	void pinImages(std::vector<int> const& indices, bool pin)
+	{
+		const QString title = pin ? KorStr("ġ ") : KorStr(" ");
+		if (!imageManager.setPinned(indices, pin))
+		{
+			Notify(title, KorStr(" ̹ ϴ"));
+			return;
+		}
+		sendBinImages2Canvas();
+	}
+
+	// false if the images do not fit with the new policies, the previous policies are packed again then
+	bool setRotationPolicy(std::vector<int> const& indices, RotationPolicy policy)
+	{
+		std::vector<std::pair<BinImagePtr, RotationPolicy>> prevPolicies;
+		for (int index : indices)
+		{
+			auto binImage = imageManager.imageAt(index);
+			if (!binImage)
+				continue;
+			prevPolicies.emplace_back(binImage, binImage->rotation);
+			binImage->rotation = policy;
+		}
+		if (prevPolicies.empty())
+			return false;
+
+		//stored layouts were packed with the old policies
+		imageManager.invalidateLayouts();
+		imageManager.storeCurState();
+		if (!tryBinPack())
+		{
+			imageManager.restoreLastState();
+			for (auto& [binImage, prev] : prevPolicies)
+				binImage->rotation = prev;
+			tryBinPack();
+			updateCanvas();
+			return false;
+		}
+		updateCanvas();
+		return true;
+	}
+
+	// every selected image is placed quantity times from its one decode
+	// false if they do not fit, the previous placements are packed again then
+	bool setQuantity(std::vector<int> const& indices, int quantity)
+	{
+		//indices change as placements are removed, the handles do not
+		std::vector<ImageHandlePtr> handles;
+		for (int index : indices)
+			if (auto binImage = imageManager.imageAt(index); binImage && std::find(handles.begin(), handles.end(), binImage->handle) == handles.end())
+				handles.push_back(binImage->handle);
+
+		imageManager.storeCurState();
+		bool changed = false;
+		for (auto const& handle : handles)
+		{
+			auto const& images = imageManager.images();
+			auto found = std::find_if(images.begin(), images.end(), [&](BinImagePtr const& ptr) { return ptr->handle == handle; });
+			if (found != images.end())
+				changed |= imageManager.setQuantity((*found)->imageIndex, quantity);
+		}
+		if (!changed)
+			return true;
+
+		if (!tryBinPack())
+		{
+			imageManager.restoreLastState();
+			tryBinPack();
+			updateCanvas();
+			return false;
+		}
+		updateCanvas();
+		return true;
+	}
+
+	// false if the images do not fit with the new spacing, the previous style is packed again then
+	bool setPackSpacing(KarlsunStyle const& style, KarlsunStyle const& prevStyle)
+	{
+		imageManager.setSpacing(PackSpacing{ style.spacing, style.bleed, style.margin });
+		if (!imageManager.isAble())
+			return true;
+
+		imageManager.storeCurState();
+		if (!tryBinPack())
+		{
+			imageManager.restoreLastState();
+			globalKarlsunStyle = prevStyle;
+			imageManager.setSpacing(PackSpacing{ prevStyle.spacing, prevStyle.bleed, prevStyle.margin });
+			tryBinPack();
+			updateCanvas();
+			return false;
+		}
+		updateCanvas();
+		return true;
+	}
+
+	// shrinks the canvas to the smallest one the current images fit in
+	// yes : keeps the width (roll media), no : keeps the aspect ratio
+	void fitCanvasToImages()
+	{
+		if (imageManager.images().empty())
+		{
+			Notify(KorStr("ּ ĵ ã"), KorStr("̹ ϴ"));
+			return;
+		}
+
+		const bool keepWidth = Notify<bool>(KorStr("ּ ĵ ã"), KorStr("ĵ  մϱ? (ƴϿ : μ  )"));
+		const QSize found = keepWidth
+			? imageManager.minimumSheetForWidth(canvasSize.width())
+			: imageManager.minimumSheetForAspect((double)canvasSize.width() / canvasSize.height());
+
+		if (!found.isValid())
+		{
+			Notify(KorStr("ּ ĵ ã"), KorStr("̹  ĵ ã ߽ϴ"));
+			return;
+		}
+
+		qDebug() << "Minimum canvas found : " << found;
+		const QSize prevSize = canvasSize;
+		imageManager.storeCurState();
+		canvasSize = found;
+		if (!tryBinPack())
+		{
+			//layout of the previous canvas
+			canvasSize = prevSize;
+			imageManager.restoreLastState();
+			tryBinPack();
+		}
+		updateInfoToolbar();
+	}
+
+	// spends searchBudget on every nesting for a few percent of occupancy
+	void setPreciseNesting(bool enabled)
+	{
+		qDebug() << "precise nesting : " << enabled;
+		imageManager.createBinPacker(enabled ? GuillotineSearch : Guillotine, searchBudget);
+		if (imageManager.isAble() && tryBinPack())
+			updateCanvas();
+	}
+
 	void setCanvasSize(QSize size)
 	{
 		resetCanvas();
@@ -397,13 +660,14 @@ public:
 
 	void handleDevmode(bool isDevMode)
 	{
+		devMode = isDevMode;
 		if (!isDevMode)
 			return;
 
 		//handle logger
 		qInstallMessageHandler(Binpacklog);
 		qDebug() << "[Dev mode start] Logger created";
-		LogWindow* logger = new LogWindow(g_logEdit, Owner);
+		LogWindow* logger = new LogWindow(Owner);
 		logger->show();
 	}
 
@@ -412,12 +676,18 @@ public:
 		QToolBar* controlToolbar = 0;
 		QAction* openFileAct = 0;
 		QAction* saveImageAct = 0;
+		QAction* saveProofAct = 0;
+		QAction* saveSheetPdfAct = 0;
+		QAction* loadJobAct = 0;
+		QAction* saveJobAct = 0;
 		QAction* showImgAct = 0;
 		QAction* showKsAct = 0;
 		QAction* showImgIdxAct = 0;
 		QAction* keepPrevAct = 0;
+		QAction* preciseNestAct = 0;
 		QAction* resetAct = 0;
 		QAction* canvasResizeAct = 0;
+		QAction* minimumSheetAct = 0;
 		QAction* karlsunStyleAct = 0;
 		QAction* setDPIAct = 0;
 		QAction* removeImageAct = 0;
@@ -439,6 +709,22 @@ public:
 		ca.saveImageAct = new QAction(KorStr(" ̹ "));
 		util::actionPreset(ca.saveImageAct, true, false, false);
 		ca.controlToolbar->addAction(ca.saveImageAct);
+
+		ca.saveProofAct = new QAction(KorStr("̸ ̹ "));
+		util::actionPreset(ca.saveProofAct, true, false, false);
+		ca.controlToolbar->addAction(ca.saveProofAct);
+
+		ca.saveSheetPdfAct = new QAction(KorStr("PDF "));
+		util::actionPreset(ca.saveSheetPdfAct, true, false, false);
+		ca.controlToolbar->addAction(ca.saveSheetPdfAct);
+
+		ca.loadJobAct = new QAction(KorStr("۾ ҷ"));
+		util::actionPreset(ca.loadJobAct, true, false, false);
+		ca.controlToolbar->addAction(ca.loadJobAct);
+
+		ca.saveJobAct = new QAction(KorStr("۾ "));
+		util::actionPreset(ca.saveJobAct, true, false, false);
+		ca.controlToolbar->addAction(ca.saveJobAct);
 		//!file actions
 
 		ca.controlToolbar->addSeparator();
@@ -465,6 +751,10 @@ public:
 		util::actionPreset(ca.keepPrevAct, true, true, keepPreviousImage);
 		ca.controlToolbar->addAction(ca.keepPrevAct);
 
+		ca.preciseNestAct = new QAction(KorStr(" ׽"));
+		util::actionPreset(ca.preciseNestAct, true, true, false);
+		ca.controlToolbar->addAction(ca.preciseNestAct);
+
 		ca.resetAct = new QAction(KorStr(""));
 		util::actionPreset(ca.resetAct, true, false, false);
 		ca.controlToolbar->addAction(ca.resetAct);
@@ -473,6 +763,10 @@ public:
 		util::actionPreset(ca.canvasResizeAct, true, false, false);
 		ca.controlToolbar->addAction(ca.canvasResizeAct);
 
+		ca.minimumSheetAct = new QAction(KorStr("ּ ĵ ã"));
+		util::actionPreset(ca.minimumSheetAct, true, false, false);
+		ca.controlToolbar->addAction(ca.minimumSheetAct);
+
 		ca.karlsunStyleAct = new QAction(KorStr("Į "));
 		util::actionPreset(ca.karlsunStyleAct, true, false, false);
 		ca.controlToolbar->addAction(ca.karlsunStyleAct);
@@ -504,6 +798,13 @@ public:
 		QWidget* karlsunInfoWidget = 0;
 		QLabel* karlsunOffsetLabel = 0;
 		QLabel* karlsunRoundingLabel = 0;
+
+		//dev mode only
+		QWidget* memoryInfoWidget = 0;
+		QLabel* memoryInfoTitleLabel = 0;
+		std::vector<QLabel*> memoryCategoryLabels; //by MemoryAccountant::Category
+		QLabel* memoryTotalLabel = 0;
+		QLabel* memoryBudgetLabel = 0;
 	};
 	InfoToolbar infoToolbar;
 
@@ -526,15 +827,48 @@ public:
 		addImageList(fl);
 	}
 
+	// both files are asked first, then encoded concurrently from the composited sheet
 	void saveResults()
 	{
-		saveResultImage();
-		savePDF();
+		if (!finalImage)
+		{
+			Notify(KorStr("̹ "), KorStr(" ̹ ϴ"));
+			return;
+		}
+
+		//TIFF for the RIP, lossless and tiled, compressed as the loaded job asks
+		const auto imagePath = QFileDialog::getSaveFileName(Owner, KorStr("̹ "), "", "Jpg image (*.jpg);;TIFF image (*.tif *.tiff)");
+		const auto pdfPath = QFileDialog::getSaveFileName(Owner, KorStr("Į "), "", "PDF (*.pdf)");
+		if (imagePath.isEmpty() && pdfPath.isEmpty())
+			return;
 
+		resultImageQuality = std::clamp(resultImageQuality, 0, 100);
+		std::vector<ResultExport::RasterTarget> rasters;
+		if (!imagePath.isEmpty())
+			rasters.push_back({ imagePath, resultImageQuality, resultImageDPI, jobOutputs.compression });
+
+		ResultExport::CutTarget cut{ pdfPath, std::vector<Karlsun>(), QSize(finalImage->width(), finalImage->height()), resultImageDPI };
+		for (BinImagePtr ptr : imageManager.binImages)
+			cut.karlsuns.push_back(ptr->karlsun);
+
+		auto sheet = finalImage;
+		const QStringList failed = runTask(KorStr(" "), [&](TaskState* task)
+			{
+				return ResultExport::exportAll(sheet, resultImageDPI, rasters, cut, task);
+			});
+		if (lastTaskCancelled || lastTaskFailed)
+			return;
+
+		if (!failed.isEmpty())
+		{
+			Notify(KorStr(" "), KorStr(" ߽ϴ : ") + failed.join(", "));
+			return;
+		}
 		Notify(KorStr(" "), KorStr(" ϷǾϴ"));
 	}
 
-	void savePDF()
+	// low resolution copy of the result, images are decoded at the reduced size directly
+	void saveProofImage()
 	{
 		if (!finalImage)
 		{
@@ -542,48 +876,143 @@ public:
 			return;
 		}
 
-		const auto f = QFileDialog::getSaveFileName(Owner, KorStr("Į "), "", "PDF (*.pdf)");
+		const auto f = QFileDialog::getSaveFileName(Owner, KorStr("̸ ̹ "), "", "Jpg image (*.jpg)");
 		if (f.isEmpty())
 			return;
 
-		auto images = imageManager.binImages;
-		std::vector<Karlsun> karlsuns;
+		const int proofDPI = std::min(proofImageDPI, resultImageDPI);
+		auto proof = runTask(KorStr("̸ ̹ "), [&](TaskState* task)
+			{
+				return imageManager.makeProofImage(resultImageDPI, proofDPI, VectorRGBX::White(), task);
+			});
+		if (!proof)
+		{
+			if (!lastTaskCancelled && !lastTaskFailed)
+				Notify(KorStr("̹ "), KorStr("̸ ̹  ߽ϴ"));
+			return;
+		}
 
-		for (BinImagePtr ptr : images)
-			karlsuns.push_back(ptr->karlsun);
+		runTask(KorStr("̸ ̹ "), [&](TaskState* task) { return proof->save(f, resultImageQuality, proofDPI, task); });
+	}
 
-		const int wid = finalImage->width(), hi = finalImage->height();
-		
-		QPdfWriter pdfWriter(f);
-		pdfWriter.setPdfVersion(QPdfWriter::PdfVersion::PdfVersion_1_4);
-		pdfWriter.setResolution(resultImageDPI);
-		pdfWriter.setPageSizeMM({util::px2mm(wid, resultImageDPI), util::px2mm(hi, resultImageDPI)});
-		QMarginsF pageMargin(0, 0, 0, 0);
-		pdfWriter.setPageMargins(pageMargin);
-		
-		QPainter painter(&pdfWriter);
-		QPen pen(Qt::black);
-		pen.setWidthF(1.5);
-		painter.setPen(pen);
+	// source images placed in a PDF with the cut lines on a spot color layer, the sheet is not encoded again
+	void saveSheetPdf()
+	{
+		if (!finalImage)
+		{
+			Notify(KorStr("PDF "), KorStr(" ̹ ϴ"));
+			return;
+		}
 
-		for (auto const& karlsun : karlsuns)
-			painter.drawRoundedRect(karlsun.rect, karlsun.style.roundPixel, karlsun.style.roundPixel);
+		const auto f = QFileDialog::getSaveFileName(Owner, KorStr("PDF "), "", "PDF (*.pdf)");
+		if (f.isEmpty())
+			return;
+
+		const SheetPdfWriter::Options options{ resultImageDPI, imageManager.packSpacing.bleed, imageManager.karlsuns() };
+		const bool saved = runTask(KorStr("PDF "), [&](TaskState* task)
+			{
+				return SheetPdfWriter::save(f, imageManager.images(), canvasSize, options, task);
+			});
+		if (lastTaskCancelled || lastTaskFailed)
+			return;
+
+		if (!saved)
+		{
+			Notify(KorStr("PDF "), KorStr(" ߽ϴ : ") + f);
+			return;
+		}
+		Notify(KorStr("PDF "), KorStr(" ϷǾϴ"));
 	}
 
-	void saveResultImage()
+	// settings and inputs of a job manifest, an unchanged job takes its layout from the job cache
+	void loadJob()
 	{
-		if (!finalImage)
+		const auto f = QFileDialog::getOpenFileName(Owner, KorStr("۾ ҷ"), "", "Job (*.json)");
+		if (f.isEmpty())
+			return;
+
+		JobManifest job;
+		QString error;
+		if (!JobManifest::load(f, job, error))
 		{
-			Notify(KorStr("̹ "), KorStr(" ̹ ϴ"));
+			Notify(KorStr("۾ ҷ"), error);
+			return;
+		}
+
+		if (!JobRunner::configure(job, imageManager, error))
+		{
+			Notify(KorStr("۾ ҷ"), error);
+			resetCanvas();
 			return;
 		}
 
-		const auto f = QFileDialog::getSaveFileName(Owner, KorStr("̹ "), "", "Jpg image (*.jpg)");
+		canvasSize = job.sheet;
+		resultImageDPI = job.dpi;
+		resultImageQuality = job.outputs.quality;
+		proofImageDPI = job.outputs.proofDPI;
+		globalKarlsunStyle = job.style;
+		searchBudget = job.budget;
+		jobOutputs = job.outputs;
+		controlToolbar.preciseNestAct->setChecked(job.algorithm == GuillotineSearch);
+
+		const uint64_t key = job.cacheKey();
+		JobRunner::restoreCached(key, imageManager);
+		if (tryBinPack())
+			JobRunner::storeCached(key, imageManager);
+		updateCanvas();
+		updateInfoToolbar();
+	}
+
+	void saveJob()
+	{
+		if (imageManager.images().empty())
+		{
+			Notify(KorStr("۾ "), KorStr(" ̹ ϴ"));
+			return;
+		}
+
+		const auto f = QFileDialog::getSaveFileName(Owner, KorStr("۾ "), "", "Job (*.json)");
 		if (f.isEmpty())
 			return;
 
-		resultImageQuality = std::clamp(resultImageQuality, 0, 100);
-		finalImage->save(f, resultImageQuality, resultImageDPI);
+		if (!currentJob().save(f))
+			Notify(KorStr("۾ "), KorStr("۾  ߽ϴ"));
+	}
+
+	// inputs in image index order, images without a file are left out
+	// unpinned images sharing a handle with the same rotation policy are one input with a quantity
+	JobManifest currentJob() const
+	{
+		auto images = imageManager.images();
+		std::sort(images.begin(), images.end(), [](BinImagePtr const& lhs, BinImagePtr const& rhs) { return lhs->imageIndex < rhs->imageIndex; });
+
+		JobManifest job;
+		std::map<std::pair<ImageHandle const*, int>, size_t> inputOf;
+		for (auto const& binImage : images)
+		{
+			if (!binImage->handle->hasFile())
+				continue;
+			if (!binImage->pinned)
+			{
+				auto [found, added] = inputOf.emplace(std::make_pair(binImage->handle.get(), (int)binImage->rotation), job.inputs.size());
+				if (!added)
+				{
+					job.inputs.at(found->second).quantity++;
+					continue;
+				}
+			}
+			job.inputs.push_back(JobManifest::Input{ binImage->path(), binImage->rotation, binImage->pinned, binImage->result, binImage->isFlipped });
+		}
+		job.sheet = canvasSize;
+		job.dpi = resultImageDPI;
+		job.forbidden = imageManager.forbiddenRegions;
+		job.algorithm = imageManager.packAlgorithm;
+		job.budget = searchBudget;
+		job.style = globalKarlsunStyle;
+		job.outputs = jobOutputs;
+		job.outputs.quality = resultImageQuality;
+		job.outputs.proofDPI = proofImageDPI;
+		return job;
 	}
 
 	void createInfoToolbar()
@@ -623,11 +1052,60 @@ public:
 		it.infoToolbar->addSeparator();
 		it.infoToolbar->addWidget(it.karlsunInfoWidget);
 
+		if (devMode)
+		{
+			auto* memoryInfoLayout = new QVBoxLayout;
+			it.memoryInfoWidget = new QWidget(Owner);
+			it.memoryInfoTitleLabel = new QLabel(Owner);
+			memoryInfoLayout->addWidget(it.memoryInfoTitleLabel);
+			for (int category = 0; category < MemoryAccountant::CategoryCount; ++category)
+			{
+				it.memoryCategoryLabels.push_back(new QLabel(Owner));
+				memoryInfoLayout->addWidget(it.memoryCategoryLabels.back());
+			}
+			it.memoryTotalLabel = new QLabel(Owner);
+			it.memoryBudgetLabel = new QLabel(Owner);
+			memoryInfoLayout->addWidget(it.memoryTotalLabel);
+			memoryInfoLayout->addWidget(it.memoryBudgetLabel);
+			it.memoryInfoWidget->setLayout(memoryInfoLayout);
+
+			it.infoToolbar->addSeparator();
+			it.infoToolbar->addWidget(it.memoryInfoWidget);
+
+			//counters change on worker threads too
+			auto* timer = new QTimer(Owner);
+			connect(timer, &QTimer::timeout, [this]() { updateMemoryInfo(); });
+			timer->start(500);
+		}
+
 		Owner->addToolBar(InfoToolbarArea, it.infoToolbar);
 		updateInfoToolbar();
 		// !Info toolbar
 	}
 
+	void updateMemoryInfo()
+	{
+		auto& it = infoToolbar;
+		if (!it.memoryInfoWidget)
+			return;
+
+		auto const& accountant = MemoryAccountant::instance();
+		auto mb = [](int64_t bytes) { return QString("%1MB").arg(QString::number(bytes / 1048576.0, 'f', 1)); };
+
+		it.memoryInfoTitleLabel->setText(KorStr("޸"));
+		for (int category = 0; category < MemoryAccountant::CategoryCount; ++category)
+		{
+			const auto cat = (MemoryAccountant::Category)category;
+			it.memoryCategoryLabels.at(category)->setText(QString("%1 : %2").arg(MemoryAccountant::categoryName(cat)).arg(mb(accountant.bytes(cat))));
+		}
+		it.memoryTotalLabel->setText(QString("%1 : %2 (%3 %4)").arg(KorStr("հ")).arg(mb(accountant.total())).arg(KorStr("ִ")).arg(mb(accountant.peak())));
+		if (accountant.budget() <= 0)
+			it.memoryBudgetLabel->setText(QString("%1 : %2").arg(KorStr("")).arg(KorStr("")));
+		else
+			it.memoryBudgetLabel->setText(QString("%1 : %2%3").arg(KorStr("")).arg(mb(accountant.budget()))
+				.arg(accountant.isOverBudget() ? KorStr(" (ʰ,  )") : QString()));
+	}
+
 	void updateInfoToolbar()
 	{
 		auto& it = infoToolbar;
@@ -646,6 +1124,7 @@ public:
 		const auto& st = globalKarlsunStyle;
 		it.karlsunOffsetLabel->setText(QString("%1 : %2px (%3mm)").arg(KorStr("Į ")).arg(st.offset).arg(QString::number(util::px2mm(st.offset, dpi), 'f', 1)));
 		it.karlsunRoundingLabel->setText(QString("%1 : %2px (%3mm)").arg(KorStr("Į ")).arg(st.roundPixel).arg(QString::number(util::px2mm(st.roundPixel, dpi), 'f', 1)));
+		updateMemoryInfo();
 	}
 
 	void createCanvas()
@@ -677,13 +1156,19 @@ public:
 		auto& ct = controlToolbar;
 		connect(ct.openFileAct, &QAction::triggered, [=](bool c)	{ this->openImageFiles(); });
 		connect(ct.saveImageAct, &QAction::triggered, [=](bool c)	{ this->saveResults(); });
+		connect(ct.saveProofAct, &QAction::triggered, [=](bool c)	{ this->saveProofImage(); });
+		connect(ct.saveSheetPdfAct, &QAction::triggered, [=](bool c)	{ this->saveSheetPdf(); });
+		connect(ct.loadJobAct, &QAction::triggered, [=](bool c)		{ this->loadJob(); });
+		connect(ct.saveJobAct, &QAction::triggered, [=](bool c)		{ this->saveJob(); });
 		connect(ct.showImgAct, &QAction::triggered, [=](bool c)		{ this->showImage(c); });
 		connect(ct.showKsAct, &QAction::triggered, [=](bool c)		{ this->showKarlsun(c); });
 		connect(ct.showImgIdxAct, &QAction::triggered, [=](bool c)	{ this->showImageIndex(c); });
 		connect(ct.keepPrevAct, &QAction::triggered, [=](bool c)	{ this->keepPreviousImage = c; });
+		connect(ct.preciseNestAct, &QAction::triggered, [=](bool c)	{ this->setPreciseNesting(c); });
 		connect(ct.resetAct, &QAction::triggered, [=](bool c)		{ this->askResetCanvas(); });
 
 		connect(ct.canvasResizeAct, &QAction::triggered, [=](bool c)	{ this->popReceiver(ReceiverType::CanvasResizer); });
+		connect(ct.minimumSheetAct, &QAction::triggered, [=](bool c)	{ this->fitCanvasToImages(); });
 		connect(ct.karlsunStyleAct, &QAction::triggered, [=](bool c)	{ this->popReceiver(ReceiverType::KarlsunSetter); });
 		connect(ct.setDPIAct, &QAction::triggered, [=](bool c)			{ this->popReceiver(ReceiverType::DPISetter); });
 		connect(ct.removeImageAct, &QAction::triggered, [=](bool c)		{ this->popReceiver(ReceiverType::ImageRemover); });
@@ -766,11 +1251,75 @@ void BinpackMainWindow::setRemoveImages(std::vector<int> const indices)
 
 	pImpl->removeImages(indices);
 }
+void BinpackMainWindow::setPinImages(std::vector<int> const indices, bool pin)
+{
+	// Called by :
+	// ImageCanvas context menu
+	qDebug() << "pin " << pin << " for indices, size : " << indices.size();
+
+	if (indices.empty())
+	{
+		pImpl->Notify(KorStr("ġ "), KorStr("õ ̹ ϴ"));
+		return;
+	}
+
+	pImpl->pinImages(indices, pin);
+}
+void BinpackMainWindow::setRotationPolicy(std::vector<int> const indices, RotationPolicy policy)
+{
+	// Called by :
+	// ImageCanvas context menu
+	qDebug() << "rotation policy " << policy << " for indices, size : " << indices.size();
+
+	if (indices.empty())
+	{
+		pImpl->Notify(KorStr("ȸ "), KorStr("õ ̹ ϴ"));
+		return;
+	}
+
+	if (!pImpl->setRotationPolicy(indices, policy))
+		pImpl->Notify(KorStr("ȸ "), KorStr("ȸ  ׽   ǵȽϴ"));
+	pImpl->updateInfoToolbar();
+}
+void BinpackMainWindow::setQuantity(std::vector<int> const indices)
+{
+	// Called by :
+	// ImageCanvas context menu
+	qDebug() << "quantity for indices, size : " << indices.size();
+
+	if (indices.empty())
+	{
+		pImpl->Notify(KorStr(" "), KorStr("õ ̹ ϴ"));
+		return;
+	}
+
+	bool ok = false;
+	const int current = pImpl->imageManager.quantityOf(indices.front());
+	const int quantity = QInputDialog::getInt(this, KorStr(" "), KorStr(""), std::max(1, current), 1, 100000, 1, &ok);
+	if (!ok)
+		return;
+
+	if (!pImpl->setQuantity(indices, quantity))
+		pImpl->Notify(KorStr(" "), KorStr("ŭ ׽   ǵȽϴ"));
+	pImpl->updateInfoToolbar();
+}
 void BinpackMainWindow::setGlobalKarlsunStyle(KarlsunStyle setter)
 {
 	qDebug() << "Size set from setGlobalKarlsunStyle. Offset/Rounding : " << setter.offset << "/" << setter.roundPixel;
+	const auto prevStyle = pImpl->globalKarlsunStyle;
+	const bool repack = !prevStyle.samePacking(setter);
 	pImpl->globalKarlsunStyle = setter;
-	pImpl->setGlobalKarlsunStyle();
+
+	//offset, rounding and color only redraw the karlsuns
+	if (!repack)
+	{
+		pImpl->setGlobalKarlsunStyle();
+		return;
+	}
+
+	qDebug() << "Spacing/Bleed/Margin : " << setter.spacing << "/" << setter.bleed << "/" << setter.margin;
+	pImpl->setPackSpacing(setter, prevStyle);
+	pImpl->updateInfoToolbar();
 }
 
 void BinpackMainWindow::setDPI(int DPI)
@@ -1,5 +1,6 @@
 #pragma once
 
+#include "BinImage.h"
 #include "ImageCanvas.h"
 #include "Karlsun.h"
 #include <QMainWindow>
@@ -20,6 +21,9 @@ public:
 	// call from receivers
 	void setCanvasSize(QSize resultSize);
 	void setRemoveImages(std::vector<int> const indicesToRemove);
+	void setRotationPolicy(std::vector<int> const indices, RotationPolicy policy);
+	void setPinImages(std::vector<int> const indices, bool pin);
+	void setQuantity(std::vector<int> const indices);
 	void setGlobalKarlsunStyle(KarlsunStyle);
 	void setDPI(int);
 	QSize canvasSize() const;
@@ -0,0 +1,222 @@
+// ContentHash.h
+#pragma once
+
+// * header only, Qt free
+// 64 bit non-cryptographic content hash for pixel buffers and files
+// layout follows XXH3 (64 byte stripes over 8 accumulators, 32x32->64 multiplies, periodic scramble)
+// so that SSE2/AVX2 process 2/4 lanes per instruction. the key material is generated here,
+// values are stable between builds and ISA levels but not compatible with the reference xxHash
+
+#include <cstdint>
+#include <cstring>
+#include <cstddef>
+#include "PixelKernels.h" //cpu features, BP_TARGET
+
+namespace hash
+{
+	constexpr uint64_t Prime32_1 = 0x9E3779B1u;
+	constexpr uint64_t Prime64_1 = 0x9E3779B185EBCA87ull;
+	constexpr uint64_t Prime64_2 = 0xC2B2AE3D27D4EB4Full;
+	constexpr uint64_t Prime64_3 = 0x165667B19E3779F9ull;
+	constexpr uint64_t Prime64_4 = 0x85EBCA77C2B2AE63ull;
+	constexpr uint64_t Prime64_5 = 0x27D4EB2F165667C5ull;
+
+	constexpr int StripeBytes = 64;
+	constexpr int StripesPerBlock = 16;
+	constexpr int KeyWords = 8 + StripesPerBlock; //key of stripe n starts at word n
+
+	struct KeyTable
+	{
+		uint64_t words[KeyWords + 8];
+	};
+
+	constexpr KeyTable makeKeyTable()
+	{
+		//splitmix64
+		KeyTable retval{};
+		uint64_t state = Prime64_5;
+		for (int idx = 0; idx < KeyWords + 8; ++idx)
+		{
+			state += 0x9E3779B97F4A7C15ull;
+			uint64_t z = state;
+			z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+			z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+			retval.words[idx] = z ^ (z >> 31);
+		}
+		return retval;
+	}
+
+	inline KeyTable const& keys()
+	{
+		static constexpr KeyTable table = makeKeyTable();
+		return table;
+	}
+
+	inline uint64_t read64(unsigned char const* ptr)
+	{
+		uint64_t retval;
+		std::memcpy(&retval, ptr, sizeof(retval));
+		return retval;
+	}
+
+	// low 64 bits of the 128 bit product folded with the high 64 bits
+	inline uint64_t mulFold64(uint64_t lhs, uint64_t rhs)
+	{
+		const uint64_t lo_lo = (lhs & 0xffffffffu) * (rhs & 0xffffffffu);
+		const uint64_t hi_lo = (lhs >> 32) * (rhs & 0xffffffffu);
+		const uint64_t lo_hi = (lhs & 0xffffffffu) * (rhs >> 32);
+		const uint64_t hi_hi = (lhs >> 32) * (rhs >> 32);
+
+		const uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xffffffffu) + lo_hi;
+		const uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+		const uint64_t lower = (cross << 32) | (lo_lo & 0xffffffffu);
+		return upper ^ lower;
+	}
+
+	inline uint64_t avalanche(uint64_t h)
+	{
+		h ^= h >> 37;
+		h *= 0x165667919E3779F9ull;
+		h ^= h >> 32;
+		return h;
+	}
+
+#pragma region Accumulate
+	inline void accumulateStripeScalar(uint64_t* acc, unsigned char const* data, uint64_t const* key)
+	{
+		for (int lane = 0; lane < 8; ++lane)
+		{
+			const uint64_t value = read64(data + lane * 8);
+			const uint64_t keyed = value ^ key[lane];
+			acc[lane ^ 1] += value;
+			acc[lane] += (keyed & 0xffffffffu) * (keyed >> 32);
+		}
+	}
+
+	inline void scrambleScalar(uint64_t* acc, uint64_t const* key)
+	{
+		for (int lane = 0; lane < 8; ++lane)
+		{
+			uint64_t a = acc[lane];
+			a ^= a >> 47;
+			a ^= key[lane];
+			acc[lane] = a * Prime32_1;
+		}
+	}
+
+#ifdef BP_KERNEL_X86
+	BP_TARGET("sse2") inline void accumulateStripeSSE2(uint64_t* acc, unsigned char const* data, uint64_t const* key)
+	{
+		for (int pair = 0; pair < 4; ++pair)
+		{
+			__m128i a = _mm_loadu_si128((__m128i const*)(acc + pair * 2));
+			const __m128i value = _mm_loadu_si128((__m128i const*)(data + pair * 16));
+			const __m128i keyed = _mm_xor_si128(value, _mm_loadu_si128((__m128i const*)(key + pair * 2)));
+			//acc[lane ^ 1] += value : swap the two 64 bit halves
+			a = _mm_add_epi64(a, _mm_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2)));
+			a = _mm_add_epi64(a, _mm_mul_epu32(keyed, _mm_srli_epi64(keyed, 32)));
+			_mm_storeu_si128((__m128i*)(acc + pair * 2), a);
+		}
+	}
+
+	BP_TARGET("sse2") inline void scrambleSSE2(uint64_t* acc, uint64_t const* key)
+	{
+		const __m128i prime = _mm_set1_epi32((int)Prime32_1);
+		for (int pair = 0; pair < 4; ++pair)
+		{
+			__m128i a = _mm_loadu_si128((__m128i const*)(acc + pair * 2));
+			a = _mm_xor_si128(a, _mm_srli_epi64(a, 47));
+			a = _mm_xor_si128(a, _mm_loadu_si128((__m128i const*)(key + pair * 2)));
+			//64 x 32 bit multiply from two 32 x 32 -> 64 products
+			const __m128i lo = _mm_mul_epu32(a, prime);
+			const __m128i hi = _mm_slli_epi64(_mm_mul_epu32(_mm_srli_epi64(a, 32), prime), 32);
+			_mm_storeu_si128((__m128i*)(acc + pair * 2), _mm_add_epi64(lo, hi));
+		}
+	}
+
+	BP_TARGET("avx2") inline void accumulateStripeAVX2(uint64_t* acc, unsigned char const* data, uint64_t const* key)
+	{
+		for (int quad = 0; quad < 2; ++quad)
+		{
+			__m256i a = _mm256_loadu_si256((__m256i const*)(acc + quad * 4));
+			const __m256i value = _mm256_loadu_si256((__m256i const*)(data + quad * 32));
+			const __m256i keyed = _mm256_xor_si256(value, _mm256_loadu_si256((__m256i const*)(key + quad * 4)));
+			a = _mm256_add_epi64(a, _mm256_shuffle_epi32(value, _MM_SHUFFLE(1, 0, 3, 2)));
+			a = _mm256_add_epi64(a, _mm256_mul_epu32(keyed, _mm256_srli_epi64(keyed, 32)));
+			_mm256_storeu_si256((__m256i*)(acc + quad * 4), a);
+		}
+	}
+
+	BP_TARGET("avx2") inline void scrambleAVX2(uint64_t* acc, uint64_t const* key)
+	{
+		const __m256i prime = _mm256_set1_epi32((int)Prime32_1);
+		for (int quad = 0; quad < 2; ++quad)
+		{
+			__m256i a = _mm256_loadu_si256((__m256i const*)(acc + quad * 4));
+			a = _mm256_xor_si256(a, _mm256_srli_epi64(a, 47));
+			a = _mm256_xor_si256(a, _mm256_loadu_si256((__m256i const*)(key + quad * 4)));
+			const __m256i lo = _mm256_mul_epu32(a, prime);
+			const __m256i hi = _mm256_slli_epi64(_mm256_mul_epu32(_mm256_srli_epi64(a, 32), prime), 32);
+			_mm256_storeu_si256((__m256i*)(acc + quad * 4), _mm256_add_epi64(lo, hi));
+		}
+	}
+#endif
+#pragma endregion
+
+	// stripes of whole blocks only, returns consumed bytes
+	template <typename AccumulateT, typename ScrambleT>
+	size_t hashBlocks(uint64_t* acc, unsigned char const* data, size_t bytes, AccumulateT&& accumulate, ScrambleT&& scramble)
+	{
+		uint64_t const* key = keys().words;
+		constexpr size_t blockBytes = (size_t)StripeBytes * StripesPerBlock;
+
+		size_t done = 0;
+		for (; done + blockBytes <= bytes; done += blockBytes)
+		{
+			for (int stripe = 0; stripe < StripesPerBlock; ++stripe)
+				accumulate(acc, data + done + (size_t)stripe * StripeBytes, key + stripe);
+			scramble(acc, key + StripesPerBlock);
+		}
+		return done;
+	}
+
+	inline uint64_t hashBytes(void const* input, size_t bytes, uint64_t seed = 0)
+	{
+		auto data = static_cast<unsigned char const*>(input);
+		uint64_t const* key = keys().words;
+
+		uint64_t acc[8] =
+		{
+			Prime32_1 ^ seed, Prime64_1, Prime64_2, Prime64_3,
+			Prime64_4, Prime32_1, Prime64_5, Prime64_1 ^ seed,
+		};
+
+		size_t done = 0;
+#ifdef BP_KERNEL_X86
+		if (kernel::cpu().avx2)
+			done = hashBlocks(acc, data, bytes, accumulateStripeAVX2, scrambleAVX2);
+		else if (kernel::cpu().sse2)
+			done = hashBlocks(acc, data, bytes, accumulateStripeSSE2, scrambleSSE2);
+		else
+#endif
+			done = hashBlocks(acc, data, bytes, accumulateStripeScalar, scrambleScalar);
+
+		//remaining full stripes, then the tail zero padded to a stripe, its length mixed into the last byte
+		int stripe = 0;
+		for (; done + StripeBytes <= bytes; done += StripeBytes)
+			accumulateStripeScalar(acc, data + done, key + (stripe++));
+		if (done < bytes)
+		{
+			unsigned char last[StripeBytes] = { 0 };
+			const size_t tail = bytes - done;
+			std::memcpy(last, data + done, tail);
+			last[StripeBytes - 1] ^= (unsigned char)tail;
+			accumulateStripeScalar(acc, last, key + StripesPerBlock - 1);
+		}
+
+		uint64_t result = (uint64_t)bytes * Prime64_1 ^ seed;
+		for (int pair = 0; pair < 4; ++pair)
+			result += mulFold64(acc[2 * pair] ^ key[2 * pair], acc[2 * pair + 1] ^ key[2 * pair + 1]);
+		return avalanche(result);
+	}
+}
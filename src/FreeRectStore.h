@@ -0,0 +1,502 @@
+// FreeRectStore.h
+#pragma once
+
+// * header only, Qt free
+// free rectangles of the MaxRects packer core
+//		SoA slots (x, y, width, height as int32)
+//		size buckets by (log2 width, log2 height), find() only scores the buckets whose rects can hold the item,
+//		4 rects at a time with SSE2. most free rects are slivers left behind the frontier, they are never visited again
+//		uniform grid of slot ids, split and containment pruning only visit the slots around the placed rect
+//		rects over many cells (the open area past the packed items) are kept in a short list instead,
+//		otherwise every insert at the frontier would rewrite most of the grid
+// removed slots keep width = height = -1, so they never fit, and are reused by the next add
+//
+// a new free rect is a piece of a removed one, so it can only be contained in another new rect or an old one
+// covering its top left corner : pruning is local instead of the O(n^2) pass over the whole list
+
+#include <cstdint>
+#include <climits>
+#include <cmath>
+#include <vector>
+#include <algorithm>
+#include "PixelKernels.h" //cpu features, BP_TARGET
+
+namespace maxrects
+{
+	struct Rect
+	{
+		int x = 0;
+		int y = 0;
+		int width = 0;
+		int height = 0;
+
+		int right() const { return x + width; }
+		int bottom() const { return y + height; }
+		bool intersects(Rect const& rhs) const { return x < rhs.right() && rhs.x < right() && y < rhs.bottom() && rhs.y < bottom(); }
+		bool contains(Rect const& rhs) const { return x <= rhs.x && y <= rhs.y && rhs.right() <= right() && rhs.bottom() <= bottom(); }
+		bool operator==(Rect const& rhs) const { return x == rhs.x && y == rhs.y && width == rhs.width && height == rhs.height; }
+	};
+
+	// lower (primary, secondary) is better
+	//		ShortSideFit : shorter leftover side, then the longer one
+	//		LongSideFit : longer leftover side, then the shorter one
+	//		BottomLeft : bottom edge of the placed rect, then its left edge (tetris style)
+	enum Heuristic { ShortSideFit = 0, LongSideFit, BottomLeft, MaxHeuristic };
+
+	struct Candidate
+	{
+		int slot = -1;
+		int primary = INT_MAX;
+		int secondary = INT_MAX;
+		bool rotated = false;
+
+		bool found() const { return slot >= 0; }
+		bool betterThan(Candidate const& rhs) const
+		{
+			return primary < rhs.primary || (primary == rhs.primary && secondary < rhs.secondary);
+		}
+	};
+
+#pragma region Scoring
+	inline void scoreFreeRect(int x, int y, int freeWid, int freeHi, int wid, int hi, Heuristic heuristic, int& primary, int& secondary)
+	{
+		const int leftoverWid = freeWid - wid, leftoverHi = freeHi - hi;
+		switch (heuristic)
+		{
+		case ShortSideFit:
+			primary = std::min(leftoverWid, leftoverHi);
+			secondary = std::max(leftoverWid, leftoverHi);
+			break;
+		case LongSideFit:
+			primary = std::max(leftoverWid, leftoverHi);
+			secondary = std::min(leftoverWid, leftoverHi);
+			break;
+		default:
+			primary = y + hi;
+			secondary = x;
+			break;
+		}
+	}
+
+	// scans [from, count), keeps the first best slot, same result as the SIMD path
+	inline void bestScalar(int const* xs, int const* ys, int const* wids, int const* his, int from, int count,
+		int wid, int hi, Heuristic heuristic, Candidate& best)
+	{
+		for (int idx = from; idx < count; ++idx)
+		{
+			if (wids[idx] < wid || his[idx] < hi)
+				continue;
+			Candidate candidate;
+			candidate.slot = idx;
+			scoreFreeRect(xs[idx], ys[idx], wids[idx], his[idx], wid, hi, heuristic, candidate.primary, candidate.secondary);
+			if (candidate.betterThan(best))
+				best = candidate;
+		}
+	}
+
+#ifdef BP_KERNEL_X86
+	//SSE2 has no 32 bit min/max, compare and select
+	BP_TARGET("sse2") inline __m128i minEpi32SSE2(__m128i a, __m128i b)
+	{
+		const __m128i greater = _mm_cmpgt_epi32(a, b);
+		return _mm_or_si128(_mm_and_si128(greater, b), _mm_andnot_si128(greater, a));
+	}
+
+	BP_TARGET("sse2") inline __m128i maxEpi32SSE2(__m128i a, __m128i b)
+	{
+		const __m128i greater = _mm_cmpgt_epi32(a, b);
+		return _mm_or_si128(_mm_and_si128(greater, a), _mm_andnot_si128(greater, b));
+	}
+
+	BP_TARGET("sse2") inline __m128i selectSSE2(__m128i mask, __m128i ifTrue, __m128i ifFalse)
+	{
+		return _mm_or_si128(_mm_and_si128(mask, ifTrue), _mm_andnot_si128(mask, ifFalse));
+	}
+
+	// 4 slots per step, every lane keeps its own best, lanes are reduced by (primary, secondary, slot)
+	// returns the number of slots scanned, the rest is left to bestScalar
+	BP_TARGET("sse2") inline int bestSSE2(int const* xs, int const* ys, int const* wids, int const* his, int count,
+		int wid, int hi, Heuristic heuristic, Candidate& best)
+	{
+		const __m128i needWid = _mm_set1_epi32(wid - 1), needHi = _mm_set1_epi32(hi - 1);
+		const __m128i hiVec = _mm_set1_epi32(hi);
+		const __m128i step = _mm_set1_epi32(4);
+		__m128i slot = _mm_setr_epi32(0, 1, 2, 3);
+		__m128i bestPrimary = _mm_set1_epi32(INT_MAX), bestSecondary = _mm_set1_epi32(INT_MAX), bestSlot = _mm_set1_epi32(-1);
+
+		int idx = 0;
+		for (; idx + 4 <= count; idx += 4, slot = _mm_add_epi32(slot, step))
+		{
+			const __m128i freeWid = _mm_loadu_si128((__m128i const*)(wids + idx));
+			const __m128i freeHi = _mm_loadu_si128((__m128i const*)(his + idx));
+			const __m128i fit = _mm_and_si128(_mm_cmpgt_epi32(freeWid, needWid), _mm_cmpgt_epi32(freeHi, needHi));
+			if (_mm_movemask_epi8(fit) == 0)
+				continue;
+
+			__m128i primary, secondary;
+			if (heuristic == BottomLeft)
+			{
+				primary = _mm_add_epi32(_mm_loadu_si128((__m128i const*)(ys + idx)), hiVec);
+				secondary = _mm_loadu_si128((__m128i const*)(xs + idx));
+			}
+			else
+			{
+				const __m128i leftoverWid = _mm_sub_epi32(freeWid, _mm_add_epi32(needWid, _mm_set1_epi32(1)));
+				const __m128i leftoverHi = _mm_sub_epi32(freeHi, hiVec);
+				const __m128i shortSide = minEpi32SSE2(leftoverWid, leftoverHi), longSide = maxEpi32SSE2(leftoverWid, leftoverHi);
+				primary = heuristic == ShortSideFit ? shortSide : longSide;
+				secondary = heuristic == ShortSideFit ? longSide : shortSide;
+			}
+
+			//strictly better keeps the first slot of a lane on ties
+			const __m128i better = _mm_and_si128(fit, _mm_or_si128(_mm_cmplt_epi32(primary, bestPrimary),
+				_mm_and_si128(_mm_cmpeq_epi32(primary, bestPrimary), _mm_cmplt_epi32(secondary, bestSecondary))));
+			bestPrimary = selectSSE2(better, primary, bestPrimary);
+			bestSecondary = selectSSE2(better, secondary, bestSecondary);
+			bestSlot = selectSSE2(better, slot, bestSlot);
+		}
+
+		alignas(16) int primaries[4], secondaries[4], slots[4];
+		_mm_store_si128((__m128i*)primaries, bestPrimary);
+		_mm_store_si128((__m128i*)secondaries, bestSecondary);
+		_mm_store_si128((__m128i*)slots, bestSlot);
+		for (int lane = 0; lane < 4; ++lane)
+		{
+			if (slots[lane] < 0)
+				continue;
+			const bool better = primaries[lane] < best.primary || (primaries[lane] == best.primary
+				&& (secondaries[lane] < best.secondary || (secondaries[lane] == best.secondary && slots[lane] < best.slot)));
+			if (better || !best.found())
+			{
+				best.slot = slots[lane];
+				best.primary = primaries[lane];
+				best.secondary = secondaries[lane];
+			}
+		}
+		return idx;
+	}
+#endif //BP_KERNEL_X86
+
+	inline Candidate bestFreeRect(int const* xs, int const* ys, int const* wids, int const* his, int count,
+		int wid, int hi, Heuristic heuristic)
+	{
+		Candidate retval;
+		int done = 0;
+#ifdef BP_KERNEL_X86
+		if (kernel::cpu().sse2)
+			done = bestSSE2(xs, ys, wids, his, count, wid, hi, heuristic, retval);
+#endif
+		bestScalar(xs, ys, wids, his, done, count, wid, hi, heuristic, retval);
+		return retval;
+	}
+#pragma endregion
+
+	class FreeRectStore
+	{
+	public:
+		// about GridCells x GridCells square cells over the area of the bin
+		static constexpr int GridCells = 64;
+		// rects over more cells than this are not put in the grid
+		static constexpr int LargeCells = 16;
+
+		void init(int binWid, int binHi)
+		{
+			classes = sizeClass(std::max(binWid, binHi)) + 1;
+			buckets.assign((size_t)classes * classes, Bucket());
+			bucketOf.clear();
+			bucketPos.clear();
+
+			xs.clear();
+			ys.clear();
+			wids.clear();
+			his.clear();
+			stamps.clear();
+			freeSlots.clear();
+			largeSlots.clear();
+			stamp = 0;
+
+			cellSize = std::max(16, (int)std::ceil(std::sqrt((double)binWid * binHi) / GridCells));
+			cols = std::max(1, (binWid + cellSize - 1) / cellSize);
+			rows = std::max(1, (binHi + cellSize - 1) / cellSize);
+			cells.assign((size_t)cols * rows, std::vector<int>());
+
+			add(Rect{ 0, 0, binWid, binHi });
+		}
+
+		int size() const { return (int)xs.size() - (int)freeSlots.size(); }
+		Rect at(int slot) const { return Rect{ xs[slot], ys[slot], wids[slot], his[slot] }; }
+
+		// best free rect for wid x hi, the rotated orientation is tried too if allowed
+		// ties go to the first rect of a bucket, then the lowest slot : deterministic for the same inserts
+		Candidate find(int wid, int hi, bool allowRotate, Heuristic heuristic) const
+		{
+			Candidate retval = best(wid, hi, heuristic);
+			if (allowRotate && wid != hi)
+			{
+				Candidate rotated = best(hi, wid, heuristic);
+				rotated.rotated = true;
+				if (rotated.found() && (!retval.found() || rotated.betterThan(retval)))
+					retval = rotated;
+			}
+			return retval;
+		}
+
+		// removes rect from the free space : every free rect it overlaps is split into its maximal leftovers
+		// also used for obstacles, which may reach out of the bin
+		void place(Rect const& rect)
+		{
+			std::vector<int> hits;
+			overlapping(rect, hits);
+
+			std::vector<Rect> pieces;
+			for (int slot : hits)
+			{
+				const Rect freeRect = at(slot);
+				if (!freeRect.intersects(rect))
+					continue;
+				remove(slot);
+				split(freeRect, rect, pieces);
+			}
+
+			//pieces against each other, one of two equal pieces survives
+			std::vector<char> dropped(pieces.size(), 0);
+			for (size_t idx = 0; idx < pieces.size(); ++idx)
+			{
+				for (size_t other = 0; other < pieces.size() && !dropped[idx]; ++other)
+				{
+					if (other == idx || dropped[other] || !pieces[other].contains(pieces[idx]))
+						continue;
+					if (!(pieces[idx] == pieces[other]) || other < idx)
+						dropped[idx] = 1;
+				}
+			}
+
+			//pieces against the old free rects covering their top left corner
+			for (size_t idx = 0; idx < pieces.size(); ++idx)
+			{
+				if (dropped[idx] || containedInOld(pieces[idx]))
+					continue;
+				add(pieces[idx]);
+			}
+		}
+
+	protected:
+		// SoA slots
+		std::vector<int> xs, ys, wids, his;
+		std::vector<int> freeSlots;
+
+		// grid of slot ids, a slot is listed in every cell it overlaps
+		int cellSize = 16, cols = 1, rows = 1;
+		std::vector<std::vector<int>> cells;
+		std::vector<int> largeSlots; //not in the grid, scanned by every query
+
+		// size buckets, classes x classes, SoA copies of their slots for the scoring kernels
+		struct Bucket
+		{
+			std::vector<int> xs, ys, wids, his;
+			std::vector<int> slots;
+		};
+		int classes = 1;
+		std::vector<Bucket> buckets;
+		std::vector<int> bucketOf, bucketPos; //per slot, -1 : removed
+
+		// dedup of overlap queries
+		mutable std::vector<uint32_t> stamps;
+		mutable uint32_t stamp = 0;
+
+		static int sizeClass(int length)
+		{
+			int retval = 0;
+			while ((length >>= 1) > 0)
+				++retval;
+			return retval;
+		}
+
+		int bucketIndex(Rect const& rect) const
+		{
+			return std::min(sizeClass(rect.width), classes - 1) * classes + std::min(sizeClass(rect.height), classes - 1);
+		}
+
+		// a bucket of a larger class holds wid x hi in that direction, one of the same class may
+		Candidate best(int wid, int hi, Heuristic heuristic) const
+		{
+			Candidate retval;
+			for (int widClass = sizeClass(wid); widClass < classes; ++widClass)
+			{
+				for (int hiClass = sizeClass(hi); hiClass < classes; ++hiClass)
+				{
+					Bucket const& bucket = buckets[(size_t)widClass * classes + hiClass];
+					if (bucket.slots.empty())
+						continue;
+					Candidate candidate = bestFreeRect(bucket.xs.data(), bucket.ys.data(), bucket.wids.data(), bucket.his.data(), (int)bucket.slots.size(),
+						wid, hi, heuristic);
+					if (!candidate.found())
+						continue;
+					candidate.slot = bucket.slots[candidate.slot];
+					if (!retval.found() || candidate.betterThan(retval) || (!retval.betterThan(candidate) && candidate.slot < retval.slot))
+						retval = candidate;
+				}
+			}
+			return retval;
+		}
+
+		void addToBucket(int slot, Rect const& rect)
+		{
+			Bucket& bucket = buckets[bucketIndex(rect)];
+			bucketOf[slot] = bucketIndex(rect);
+			bucketPos[slot] = (int)bucket.slots.size();
+			bucket.xs.push_back(rect.x);
+			bucket.ys.push_back(rect.y);
+			bucket.wids.push_back(rect.width);
+			bucket.his.push_back(rect.height);
+			bucket.slots.push_back(slot);
+		}
+
+		void removeFromBucket(int slot)
+		{
+			Bucket& bucket = buckets[bucketOf[slot]];
+			const int pos = bucketPos[slot], last = (int)bucket.slots.size() - 1;
+			bucket.xs[pos] = bucket.xs[last];
+			bucket.ys[pos] = bucket.ys[last];
+			bucket.wids[pos] = bucket.wids[last];
+			bucket.his[pos] = bucket.his[last];
+			bucket.slots[pos] = bucket.slots[last];
+			bucketPos[bucket.slots[pos]] = pos;
+			bucket.xs.pop_back();
+			bucket.ys.pop_back();
+			bucket.wids.pop_back();
+			bucket.his.pop_back();
+			bucket.slots.pop_back();
+			bucketOf[slot] = bucketPos[slot] = -1;
+		}
+
+		void cellRange(Rect const& rect, int& col0, int& col1, int& row0, int& row1) const
+		{
+			col0 = std::clamp(rect.x / cellSize, 0, cols - 1);
+			col1 = std::clamp((rect.right() - 1) / cellSize, 0, cols - 1);
+			row0 = std::clamp(rect.y / cellSize, 0, rows - 1);
+			row1 = std::clamp((rect.bottom() - 1) / cellSize, 0, rows - 1);
+		}
+
+		bool isLarge(Rect const& rect) const
+		{
+			int col0, col1, row0, row1;
+			cellRange(rect, col0, col1, row0, row1);
+			return (col1 - col0 + 1) * (row1 - row0 + 1) > LargeCells;
+		}
+
+		template <typename FuncT>
+		void forEachCell(Rect const& rect, FuncT&& func) const
+		{
+			int col0, col1, row0, row1;
+			cellRange(rect, col0, col1, row0, row1);
+			for (int row = row0; row <= row1; ++row)
+				for (int col = col0; col <= col1; ++col)
+					func((size_t)row * cols + col);
+		}
+
+		static void eraseId(std::vector<int>& ids, int slot)
+		{
+			auto found = std::find(ids.begin(), ids.end(), slot);
+			if (found != ids.end())
+			{
+				*found = ids.back();
+				ids.pop_back();
+			}
+		}
+
+		int add(Rect const& rect)
+		{
+			int slot;
+			if (!freeSlots.empty())
+			{
+				slot = freeSlots.back();
+				freeSlots.pop_back();
+				xs[slot] = rect.x;
+				ys[slot] = rect.y;
+				wids[slot] = rect.width;
+				his[slot] = rect.height;
+			}
+			else
+			{
+				slot = (int)xs.size();
+				xs.push_back(rect.x);
+				ys.push_back(rect.y);
+				wids.push_back(rect.width);
+				his.push_back(rect.height);
+				stamps.push_back(0);
+				bucketOf.push_back(-1);
+				bucketPos.push_back(-1);
+			}
+			addToBucket(slot, rect);
+			if (isLarge(rect))
+				largeSlots.push_back(slot);
+			else
+				forEachCell(rect, [&](size_t cell) { cells[cell].push_back(slot); });
+			return slot;
+		}
+
+		void remove(int slot)
+		{
+			const Rect rect = at(slot);
+			if (isLarge(rect))
+				eraseId(largeSlots, slot);
+			else
+				forEachCell(rect, [&](size_t cell) { eraseId(cells[cell], slot); });
+			removeFromBucket(slot);
+			wids[slot] = his[slot] = -1;
+			freeSlots.push_back(slot);
+		}
+
+		void overlapping(Rect const& rect, std::vector<int>& out) const
+		{
+			nextStamp();
+			out.insert(out.end(), largeSlots.begin(), largeSlots.end());
+			forEachCell(rect, [&](size_t cell)
+				{
+					for (int slot : cells[cell])
+					{
+						if (stamps[slot] == stamp)
+							continue;
+						stamps[slot] = stamp;
+						out.push_back(slot);
+					}
+				});
+		}
+
+		bool containedInOld(Rect const& rect) const
+		{
+			for (int slot : largeSlots)
+				if (at(slot).contains(rect))
+					return true;
+
+			const int col = std::clamp(rect.x / cellSize, 0, cols - 1), row = std::clamp(rect.y / cellSize, 0, rows - 1);
+			for (int slot : cells[(size_t)row * cols + col])
+				if (at(slot).contains(rect))
+					return true;
+			return false;
+		}
+
+		void nextStamp() const
+		{
+			if (++stamp == 0)
+			{
+				std::fill(stamps.begin(), stamps.end(), 0);
+				stamp = 1;
+			}
+		}
+
+		// maximal leftovers of freeRect around used, up to 4 overlapping pieces
+		static void split(Rect const& freeRect, Rect const& used, std::vector<Rect>& out)
+		{
+			if (used.x > freeRect.x)
+				out.push_back(Rect{ freeRect.x, freeRect.y, used.x - freeRect.x, freeRect.height });
+			if (used.right() < freeRect.right())
+				out.push_back(Rect{ used.right(), freeRect.y, freeRect.right() - used.right(), freeRect.height });
+			if (used.y > freeRect.y)
+				out.push_back(Rect{ freeRect.x, freeRect.y, freeRect.width, used.y - freeRect.y });
+			if (used.bottom() < freeRect.bottom())
+				out.push_back(Rect{ freeRect.x, used.bottom(), freeRect.width, freeRect.bottom() - used.bottom() });
+		}
+	};
+}
@@ -9,7 +9,13 @@
 #include <QMenu>
 #include <QDebug>
 #include <QPointer>
+#include <QRegion>
+#include <QTransform>
+#include <cmath>
+#include <map>
+#include <set>
 #include "BinImage.h"
+#include "MemoryAccountant.h"
 
 class ImageCanvas::Internal
 {
@@ -19,7 +25,7 @@ public:
 	Internal(BinpackMainWindow* owner)
 		: Owner(owner)
 	{}
-	~Internal() {}
+	~Internal() { releaseCopies(); }
 
 public:
 	bool m_antialising = true;
@@ -27,7 +33,10 @@ public:
 	ImageCanvas::CanvasObjectType m_showWhat = ImageCanvas::ALL;
 	QBrush m_KarlsunBrush;
 	std::vector<BinImagePtr> m_binImages;
-	std::vector<QImage> m_binQImages;
+	std::vector<std::pair<QRect, QImage>> m_binQImages; //placed rect, full resolution or preview copy
+	int64_t m_binQImageBytes = 0; //counted as MemoryAccountant::Canvas
+	std::vector<QRect> m_placeholders; //placed but not resident
+	std::vector<QRect> m_pinned; //kept in place on repacks
 	std::vector<Karlsun> m_karlsuns;
 
 	struct _EventState
@@ -167,6 +176,36 @@ public:
 					//Owner->callImageRemove(m_eventState->selectedBinImages);
 					Owner->setRemoveImages(m_eventState->selectedIndices());
 				});
+
+				//pinned images stay where they are on the next packs
+				static QAction* pin = new QAction(KorStr("ġ "), dropMenu);
+				static QAction* unpin = new QAction(KorStr(" "), dropMenu);
+				dropMenu->addAction(pin);
+				dropMenu->addAction(unpin);
+				Owner->connect(pin, &QAction::triggered, [=](bool c) { Owner->setPinImages(m_eventState->selectedIndices(), true); });
+				Owner->connect(unpin, &QAction::triggered, [=](bool c) { Owner->setPinImages(m_eventState->selectedIndices(), false); });
+
+				//placements of the selected images, all from one decode each
+				static QAction* quantity = new QAction(KorStr(" "), dropMenu);
+				dropMenu->addAction(quantity);
+				Owner->connect(quantity, &QAction::triggered, [=](bool c) { Owner->setQuantity(m_eventState->selectedIndices()); });
+
+				//orientation constraint of the selected images
+				QMenu* rotationMenu = dropMenu->addMenu(KorStr("ȸ "));
+				const std::vector<std::pair<const char*, RotationPolicy>> policies
+				{
+					{ " ȸ", RotateFree },
+					{ "ȸ ", RotateNever },
+					{ "180 ȸ", Rotate180 },
+				};
+				for (auto const& [name, policy] : policies)
+				{
+					QAction* action = rotationMenu->addAction(KorStr(name));
+					Owner->connect(action, &QAction::triggered, [=](bool c)
+					{
+						Owner->setRotationPolicy(m_eventState->selectedIndices(), policy);
+					});
+				}
 			}
 			dropMenu->popup(globalPos);
 			
@@ -187,10 +226,33 @@ public:
 		return m_prevSize + (includePadding ? QSize(m_canvasPadding, m_canvasPadding) : QSize(0,0));
 	}
 
+	// over the memory budget the canvas keeps previews of at most PreviewSide px, scaled up when painted
+	static constexpr int PreviewSide = 256;
+
+	void releaseCopies()
+	{
+		m_binQImages.clear();
+		MemoryAccountant::instance().release(MemoryAccountant::Canvas, m_binQImageBytes);
+		m_binQImageBytes = 0;
+	}
+
+	// counted : false for another placement of a copy already added, QImage shares its data
+	void addCopy(QRect rect, QImage image, bool counted = true)
+	{
+		if (counted)
+		{
+			m_binQImageBytes += image.sizeInBytes();
+			MemoryAccountant::instance().add(MemoryAccountant::Canvas, image.sizeInBytes());
+		}
+		m_binQImages.emplace_back(rect, image);
+	}
+
 	void clearAll()
 	{
 		m_binImages.clear();
-		m_binQImages.clear();
+		releaseCopies();
+		m_placeholders.clear();
+		m_pinned.clear();
 		m_eventState->reset();
 		m_karlsuns.clear();
 	}
@@ -263,17 +325,76 @@ void ImageCanvas::setCanvasSize(QSize inSize)
 void ImageCanvas::setBinImages(std::vector<BinImagePtr> binImages)
 {
 	pImpl->m_binImages = binImages;
-	pImpl->m_binQImages.clear();
+	pImpl->releaseCopies();
+	pImpl->m_placeholders.clear();
+	pImpl->m_pinned.clear();
 	pImpl->m_karlsuns.clear();
 	pImpl->m_eventState->reset();
 
+	//placements sharing a handle in one orientation share one implicitly shared QImage
+	using CopyKey = std::pair<ImageHandle const*, bool>;
+	std::map<CopyKey, QImage> copies;
+
+	int64_t fullBytes = 0;
+	std::set<CopyKey> counted;
+	for (BinImagePtr ptr : binImages)
+		if (ptr->isDecoded() && counted.emplace(ptr->handle.get(), ptr->isFlipped).second)
+			fullBytes += (int64_t)ptr->result.width() * ptr->result.height() * 4;
+	const bool previews = !MemoryAccountant::instance().fits(fullBytes);
+
 	for (BinImagePtr ptr : binImages)
 	{
-		//QImage buf = ptr->eval()->toQImage().copy();
-		QImage buf = ptr->imagePtr->toQImage().copy();
-		buf.setOffset(ptr->result.topLeft());
-		pImpl->m_binQImages.push_back(buf);
 		pImpl->m_karlsuns.push_back(ptr->karlsun);
+		if (ptr->pinned)
+			pImpl->m_pinned.push_back(ptr->result);
+
+		const CopyKey key(ptr->handle.get(), ptr->isFlipped);
+		if (auto found = copies.find(key); found != copies.end())
+		{
+			pImpl->addCopy(ptr->result, found->second, false);
+			continue;
+		}
+
+		//only resident pixels are shown, the canvas never decodes. held while copied, they may be evicted meanwhile
+		auto img = ptr->handle->resident();
+		if (!img)
+		{
+			pImpl->m_placeholders.push_back(ptr->result);
+			continue;
+		}
+
+		QImage buf;
+		if (previews)
+		{
+			//scaled before it is rotated, no full resolution rotation
+			buf = img->toQImage().scaled(Internal::PreviewSide, Internal::PreviewSide, Qt::KeepAspectRatio, Qt::SmoothTransformation);
+			if (ptr->isFlipped)
+				buf = buf.transformed(QTransform().rotate(90));
+		}
+		else
+		{
+			//images are stored unrotated
+			buf = (ptr->isFlipped ? img->rotate() : img)->toQImage();
+		}
+
+		//nested : only the shape is shown, the bounding boxes of neighbors overlap
+		if (ptr->shape && !ptr->result.isEmpty())
+		{
+			const double sx = (double)buf.width() / ptr->result.width(), sy = (double)buf.height() / ptr->result.height();
+			QRegion region;
+			for (auto const& run : ptr->shape->runs())
+				region += QRect(QPoint((int)std::floor(run.x() * sx), (int)std::floor(run.y() * sy)),
+					QPoint((int)std::ceil((run.x() + run.width()) * sx) - 1, (int)std::ceil((run.y() + run.height()) * sy) - 1));
+			QImage clipped(buf.size(), QImage::Format_ARGB32_Premultiplied);
+			clipped.fill(Qt::transparent);
+			QPainter clipper(&clipped);
+			clipper.setClipRegion(region);
+			clipper.drawImage(0, 0, buf);
+			clipper.end();
+			buf = clipped;
+		}
+		copies.emplace(key, buf);
+		pImpl->addCopy(ptr->result, buf);
 	}
 	
 	update();
@@ -342,7 +463,22 @@ void ImageCanvas::paintEvent(QPaintEvent* event)
 	if (!image.empty() && pImpl->showImage())
 	{
 		for(auto const& qimg : image)
-			painter.drawImage(QRect(qimg.offset() + canvasPadding, qimg.size()), qimg);
+			painter.drawImage(QRect(qimg.first.topLeft() + canvasPadding, qimg.first.size()), qimg.second);
+	}
+
+	if (!pImpl->m_placeholders.empty() && pImpl->showImage())
+	{
+		for (auto const& rect : pImpl->m_placeholders)
+			painter.fillRect(paddedRect(rect), Qt::lightGray);
+	}
+
+	if (!pImpl->m_pinned.empty() && pImpl->showImage())
+	{
+		auto prevPen = painter.pen();
+		painter.setPen(QPen(Qt::darkRed, 3));
+		for (auto const& rect : pImpl->m_pinned)
+			painter.drawRect(paddedRect(rect));
+		painter.setPen(prevPen);
 	}
 
 	if (!rects.empty() && pImpl->showKarlsun())
@@ -352,7 +488,10 @@ void ImageCanvas::paintEvent(QPaintEvent* event)
 			auto prevPen = painter.pen();
 			
 			painter.setPen(karlsun.style.color);
-			painter.drawRoundedRect(paddedRect(karlsun.rect), karlsun.style.roundPixel, karlsun.style.roundPixel);
+			if (karlsun.outline.empty())
+				painter.drawRoundedRect(paddedRect(karlsun.rect), karlsun.style.roundPixel, karlsun.style.roundPixel);
+			for (auto const& polygon : karlsun.outline)
+				painter.drawPolygon(polygon.translated(canvasPadding));
 
 			painter.setPen(prevPen);
 		}
@@ -0,0 +1,424 @@
+#pragma once
+
+#include <QCoreApplication>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QImageReader>
+#include <QLockFile>
+#include <QSize>
+#include <QStandardPaths>
+#include <QString>
+#include <array>
+#include <list>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <vector>
+#include "ImageObject.h"
+#include "MemoryAccountant.h"
+#include "ShapeMask.h"
+
+// * header only class
+// one sheet image by reference : path, size and content hash are known without its pixels
+//		the pixels are resident only on demand, pixels() decodes them and keeps them, evict() drops them again
+//		an image without a file is spilled raw to the disk cache before its pixels are dropped, the file goes with the last handle of its content
+//		resident handles are kept in a process wide LRU list, over the memory budget the least recently used are evicted
+//		the shape of the image (see ShapeMask) is read from the alpha of its file once and kept, it is a few bits per cell
+// thread safe. a caller keeps its own reference to the pixels it uses, an eviction meanwhile only drops the handle's
+class ImageHandle : public std::enable_shared_from_this<ImageHandle>
+{
+public:
+	using Ptr = std::shared_ptr<ImageHandle>;
+
+	// deferred : size probed from the file header
+	ImageHandle(QString path, QSize size) : m_path(path), m_size(size) {}
+	// already decoded, e.g. added from memory
+	explicit ImageHandle(ImageDataRGBPtr pixels, QString path = "")
+		: m_path(path), m_size(pixels ? QSize(pixels->width(), pixels->height()) : QSize())
+	{
+		setResident(pixels);
+	}
+	ImageHandle() {}
+	~ImageHandle()
+	{
+		std::lock_guard<std::mutex> lock(registry().mutex);
+		unlink();
+		releaseSpill(m_spillPath);
+	}
+
+	ImageHandle(ImageHandle const&) = delete;
+	ImageHandle& operator=(ImageHandle const&) = delete;
+
+	QString path() const { return m_path; }
+	bool hasFile() const { return !m_path.isEmpty(); }
+	//unrotated, the layout is made with it
+	QSize size() const { return m_size; }
+	//content hash of the pixels, 0 until they were resident once
+	uint64_t hash() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_hash;
+	}
+
+	bool isResident() const
+	{
+		std::lock_guard<std::mutex> lock(m_mutex);
+		return m_pixels != nullptr;
+	}
+
+	// the resident pixels, null if they are not. never decodes
+	ImageDataRGBPtr resident() const
+	{
+		ImageDataRGBPtr retval;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			retval = m_pixels;
+		}
+		if (retval)
+			touch();
+		return retval;
+	}
+
+	// the resident pixels or a new decode of them that is not kept, null if they cannot be loaded
+	ImageDataRGBPtr load() const
+	{
+		if (auto retval = resident())
+			return retval;
+
+		auto retval = std::make_shared<ImageDataRGB>();
+		if (!(hasFile() ? retval->load(m_path) : loadSpilled(*retval)))
+			return nullptr;
+		//the layout was made with the probed size
+		if (QSize(retval->width(), retval->height()) != m_size)
+			return nullptr;
+		return retval;
+	}
+
+	// the pixels, decoded and kept resident if they were not
+	ImageDataRGBPtr pixels()
+	{
+		if (auto retval = resident())
+			return retval;
+
+		auto retval = load();
+		if (retval)
+			setResident(retval);
+		return retval;
+	}
+
+	// keeps pixels resident, e.g. a decode shared with a duplicate or a warm cache entry
+	// least recently used handles are evicted while the process is over the memory budget
+	void setResident(ImageDataRGBPtr pixels)
+	{
+		if (!pixels)
+			return;
+		const uint64_t hash = pixels->contentHash();
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_pixels = pixels;
+			m_hash = hash;
+		}
+		touch();
+		if (MemoryAccountant::instance().isOverBudget())
+			evictLeastRecent(this);
+	}
+
+	// occupancy of the image at cell resolution, turned : rotated clockwise as drawSubImage draws it
+	// read from the alpha of the file once per cell size, an image without alpha or without a file is its whole rect
+	ShapeMaskPtr shape(int cell, bool turned) const
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			if (m_shapeCell == cell && m_shapes[turned])
+				return m_shapes[turned];
+		}
+
+		ImageDataRGBA alpha;
+		if (hasFile() && hasAlpha(m_path))
+		{
+			MemoryAccountant::Scope scope(MemoryAccountant::Temporary);
+			alpha.load(m_path);
+		}
+
+		//both orientations from one decode. the layout was made with the probed size
+		std::array<ShapeMaskPtr, 2> shapes;
+		const bool useAlpha = !alpha.empty() && QSize(alpha.width(), alpha.height()) == m_size;
+		for (int idx = 0; idx < 2; ++idx)
+			shapes[idx] = std::make_shared<ShapeMask const>(useAlpha
+				? ShapeMask::fromAlpha(alpha, cell, idx)
+				: ShapeMask::full(idx ? m_size.transposed() : m_size, cell));
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		m_shapeCell = cell;
+		m_shapes = shapes;
+		return m_shapes[turned];
+	}
+
+	// drops the resident pixels. false if they cannot be loaded again and are kept
+	bool evict()
+	{
+		{
+			std::lock_guard<std::mutex> lock(registry().mutex);
+			unlink();
+		}
+		ImageDataRGBPtr pixels;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			pixels = m_pixels;
+		}
+		return release(pixels);
+	}
+
+	// least recently used handles other than keep are evicted until the process would fit the memory budget
+	// pixels also held elsewhere (a duplicate, a warm cache entry, a caller) are skipped, dropping them frees nothing
+	// victims are chosen under the registry lock and spilled after it, no other handle waits on the disk
+	// returns the number of handles evicted
+	static int evictLeastRecent(ImageHandle const* keep = nullptr)
+	{
+		auto& accountant = MemoryAccountant::instance();
+		std::vector<std::pair<Ptr, ImageDataRGBPtr>> victims;
+		{
+			auto& reg = registry();
+			std::lock_guard<std::mutex> lock(reg.mutex);
+			int64_t excess = accountant.budget() > 0 ? accountant.total() - accountant.budget() : 0;
+			for (auto it = reg.order.begin(); it != reg.order.end() && excess > 0;)
+			{
+				ImageHandle* handle = *it++;
+				//null while the handle is destroyed
+				Ptr owner = handle->weak_from_this().lock();
+				if (handle == keep || !owner)
+					continue;
+
+				ImageDataRGBPtr pixels;
+				{
+					std::lock_guard<std::mutex> handleLock(handle->m_mutex);
+					pixels = handle->m_pixels;
+				}
+				//held by the handle and here only
+				if (pixels && pixels.use_count() > 2)
+					continue;
+				if (pixels)
+					excess -= pixels->dataSize();
+				handle->unlink();
+				victims.emplace_back(owner, pixels);
+			}
+		}
+
+		int retval = 0;
+		for (auto const& [owner, pixels] : victims)
+			if (owner->release(pixels))
+				retval++;
+		return retval;
+	}
+
+	// raw pixels of images without a file, see evict(). one directory per process, see initSpills()
+	static QString spillDirectory()
+	{
+		return QDir(spillRoot()).filePath(QString::number(QCoreApplication::applicationPid()));
+	}
+
+	// at startup, once the application is named : locks the spill directory of this process
+	// and removes those left behind by processes that are gone, e.g. after a crash
+	static void initSpills()
+	{
+		QDir root(spillRoot());
+		if (!root.mkpath("."))
+			return;
+
+		//never stale while this process runs
+		static QLockFile own(spillDirectory() + ".lock");
+		own.setStaleLockTime(0);
+		own.tryLock(0);
+
+		//a process locks its directory before it is created, a directory without a lock is left behind too
+		for (auto const& info : root.entryInfoList(QDir::Files | QDir::Dirs | QDir::NoDotAndDotDot))
+		{
+			const QString base = root.filePath(info.completeBaseName());
+			if (base == spillDirectory())
+				continue;
+			if (info.isDir())
+			{
+				if (!QFileInfo::exists(info.filePath() + ".lock"))
+					QDir(info.filePath()).removeRecursively();
+			}
+			else if (info.suffix() == "lock")
+			{
+				//a lock another process holds cannot be taken, a stale one is
+				QLockFile other(info.filePath());
+				other.setStaleLockTime(0);
+				if (other.tryLock(0))
+				{
+					QDir(base).removeRecursively();
+					other.unlock();
+				}
+			}
+			else
+			{
+				QFile::remove(info.filePath());
+			}
+		}
+	}
+
+protected:
+	// least recently used first
+	struct Registry
+	{
+		std::mutex mutex;
+		std::list<ImageHandle*> order;
+	};
+
+	static Registry& registry()
+	{
+		static Registry reg;
+		return reg;
+	}
+
+	//the registry lock is taken before a handle lock, never the other way
+	void touch() const
+	{
+		auto& reg = registry();
+		std::lock_guard<std::mutex> lock(reg.mutex);
+		auto* self = const_cast<ImageHandle*>(this);
+		if (m_linked)
+			reg.order.splice(reg.order.end(), reg.order, m_position);
+		else
+			m_position = reg.order.insert(reg.order.end(), self);
+		m_linked = true;
+	}
+
+	void unlink()
+	{
+		if (m_linked)
+			registry().order.erase(m_position);
+		m_linked = false;
+	}
+
+	static QString spillRoot()
+	{
+		return QDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)).filePath("spill");
+	}
+
+	// spill files by path, the handles whose pixels are in them. guarded by the registry lock
+	static std::map<QString, int>& spillUsers()
+	{
+		static std::map<QString, int> users;
+		return users;
+	}
+
+	// registry lock held, the file is removed with its last user
+	static void releaseSpill(QString path)
+	{
+		if (path.isEmpty())
+			return;
+		auto found = spillUsers().find(path);
+		if (found == spillUsers().end() || --found->second > 0)
+			return;
+		spillUsers().erase(found);
+		QFile::remove(path);
+	}
+
+	// the handle unlinked, no lock held. pixels are dropped if they are spilled or can be decoded again, relinked if not
+	bool release(ImageDataRGBPtr const& pixels)
+	{
+		if (pixels && !hasFile() && !spill(*pixels))
+		{
+			touch();
+			return false;
+		}
+
+		std::lock_guard<std::mutex> lock(m_mutex);
+		if (m_pixels == pixels)
+			m_pixels = nullptr;
+		return true;
+	}
+
+	// named by content so that duplicates share one file, kept for later spills of the same pixels
+	// written to a temporary file of this handle first, other handles may spill the same content meanwhile
+	bool spill(ImageDataRGB const& img)
+	{
+		const QString path = QDir(spillDirectory()).filePath(QString("%1.rgb").arg(img.contentHash(), 16, 16, QChar('0')));
+
+		//counted before the file is checked, a last user cannot remove it in between
+		QString previous;
+		{
+			std::lock_guard<std::mutex> lock(registry().mutex);
+			{
+				std::lock_guard<std::mutex> handleLock(m_mutex);
+				previous = m_spillPath;
+			}
+			if (previous != path)
+				spillUsers()[path]++;
+		}
+
+		const bool written = QFileInfo(path).size() == img.dataSize() || writeSpill(img, path);
+		if (previous == path)
+			return written;
+
+		std::lock_guard<std::mutex> lock(registry().mutex);
+		if (!written)
+		{
+			releaseSpill(path);
+			return false;
+		}
+		{
+			std::lock_guard<std::mutex> handleLock(m_mutex);
+			m_spillPath = path;
+		}
+		releaseSpill(previous);
+		return true;
+	}
+
+	bool writeSpill(ImageDataRGB const& img, QString path) const
+	{
+		QDir().mkpath(spillDirectory());
+		QFile file(path + QString(".%1.tmp").arg((quintptr)this, 0, 16));
+		if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+			return false;
+		const bool written = file.write(reinterpret_cast<const char*>(img.bits()), img.dataSize()) == img.dataSize();
+		file.close();
+		QFile::remove(path);
+		if (!written || !QFile::rename(file.fileName(), path))
+		{
+			file.remove();
+			return false;
+		}
+		return true;
+	}
+
+	// from the header, a format the reader does not tell is decoded to find out
+	static bool hasAlpha(QString path)
+	{
+		const QImage::Format format = QImageReader(path).imageFormat();
+		return format == QImage::Format_Invalid || QImage::toPixelFormat(format).alphaUsage() == QPixelFormat::UsesAlpha;
+	}
+
+	bool loadSpilled(ImageDataRGB& out) const
+	{
+		QString path;
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			path = m_spillPath;
+		}
+		QFile file(path);
+		if (path.isEmpty() || !file.open(QIODevice::ReadOnly))
+			return false;
+		out.resize(m_size.width(), m_size.height());
+		return file.read(reinterpret_cast<char*>(out.bits()), out.dataSize()) == out.dataSize();
+	}
+
+	const QString m_path;
+	const QSize m_size;
+
+	mutable std::mutex m_mutex;
+	ImageDataRGBPtr m_pixels;
+	uint64_t m_hash = 0;
+	QString m_spillPath;
+	mutable int m_shapeCell = 0;
+	mutable std::array<ShapeMaskPtr, 2> m_shapes; //upright, turned
+
+	//position in Registry::order, guarded by the registry lock
+	mutable std::list<ImageHandle*>::iterator m_position;
+	mutable bool m_linked = false;
+};
+using ImageHandlePtr = ImageHandle::Ptr;
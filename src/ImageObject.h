@@ -2,9 +2,20 @@
 
 #pragma once
 
+#include <QFileInfo>
 #include <QImage>
+#include <QImageReader>
+#include <QImageWriter>
+#include <QRect>
 #include <QString>
-#include <random> //for operator==
+#include <atomic>
+#include <memory>
+#include <vector>
+#include "PixelKernels.h"
+#include "ContentHash.h"
+#include "MemoryAccountant.h"
+#include "Task.h"
+#include "Trace.h"
 
 //this method doesn't handle under/overflow
 template<typename TOut, typename TIn>
@@ -18,13 +29,6 @@ constexpr TOut saturateCast(TIn val)
 		val;
 }
 
-struct VectorRGBA
-{
-	enum RGB { R = 0, G = 1, B = 2, A = 3 };
-	using RGBAType = unsigned char;
-	RGBAType rgba[4];
-};
-
 struct VectorRGB
 {
 	enum RGB { R = 0, G = 1, B = 2 };
@@ -34,19 +38,11 @@ struct VectorRGB
 	//operators
 	VectorRGB(RGBType fillVal = 0) : RGB{ fillVal,fillVal,fillVal } {}
 	VectorRGB(RGBType r, RGBType g, RGBType b) : RGB{ r,g,b, } {}
-	VectorRGB(VectorRGB const& rhs) : RGB{ rhs.r(), rhs.g(), rhs.b() } {}
-	VectorRGB(VectorRGB&& rhs) { memcpy(RGB, rhs.RGB, sizeof(RGB)); }
-
-	VectorRGB& operator=(VectorRGB const& rhs)
-	{
-		memcpy(RGB, rhs.RGB, sizeof(RGB));
-		return *this;
-	}
-	VectorRGB& operator=(VectorRGB&& rhs)
-	{
-		memcpy(RGB, rhs.RGB, sizeof(RGB));
-		return *this;
-	}
+	//keep trivially copyable so that buffers of pixels can be vectorized
+	VectorRGB(VectorRGB const& rhs) = default;
+	VectorRGB(VectorRGB&& rhs) = default;
+	VectorRGB& operator=(VectorRGB const& rhs) = default;
+	VectorRGB& operator=(VectorRGB&& rhs) = default;
 
 	RGBType& operator[](int index) { return RGB[index]; }
 	RGBType operator[](int index) const { return RGB[index]; }
@@ -67,12 +63,13 @@ struct VectorRGB
 		return
 			(r() == rhs.r()) &&
 			(g() == rhs.g()) &&
-			(g() == rhs.b())
+			(b() == rhs.b())
 			;
 	}
+	bool operator!=(VectorRGB const& rhs) const { return !(*this == rhs); }
 
 #define _VECTOR_RGB_SCALAR_OP(_oper) \
-VectorRGB& operator##_oper(RGBType value) \
+VectorRGB& operator _oper(RGBType value) \
 { \
 	r() = saturateCast<RGBType, int>(r() _oper value); \
 	g() = saturateCast<RGBType, int>(g() _oper value); \
@@ -126,6 +123,95 @@ VectorRGB& operator##_oper(RGBType value) \
 	}
 #endif
 };
+static_assert(sizeof(VectorRGB) == 3, "VectorRGB must stay packed");
+
+// 4 byte pixel, same memory order as QImage::Format_RGB32 (little endian : B, G, R, 0xff)
+// images of this type are handed to QImage without conversion and are processed by 32bit SIMD kernels
+struct VectorRGBX
+{
+	enum BGRX { B = 0, G = 1, R = 2, X = 3 };
+	using RGBType = unsigned char;
+	RGBType BGRX[4];
+
+	VectorRGBX(RGBType fillVal = 0) : BGRX{ fillVal,fillVal,fillVal,0xff } {}
+	VectorRGBX(RGBType r, RGBType g, RGBType b) : BGRX{ b,g,r,0xff } {}
+	VectorRGBX(VectorRGB const& rgb) : BGRX{ rgb.b(),rgb.g(),rgb.r(),0xff } {}
+	VectorRGBX(VectorRGBX const& rhs) = default;
+	VectorRGBX(VectorRGBX&& rhs) = default;
+	VectorRGBX& operator=(VectorRGBX const& rhs) = default;
+	VectorRGBX& operator=(VectorRGBX&& rhs) = default;
+
+	bool operator==(VectorRGBX const& rhs) const
+	{
+		return
+			(r() == rhs.r()) &&
+			(g() == rhs.g()) &&
+			(b() == rhs.b())
+			;
+	}
+	bool operator!=(VectorRGBX const& rhs) const { return !(*this == rhs); }
+
+	VectorRGB toRGB() const { return VectorRGB(r(), g(), b()); }
+
+	RGBType& r() { return BGRX[R]; }
+	RGBType r() const { return BGRX[R]; }
+	RGBType& g() { return BGRX[G]; }
+	RGBType g() const { return BGRX[G]; }
+	RGBType& b() { return BGRX[B]; }
+	RGBType b() const { return BGRX[B]; }
+
+	RGBType* data() { return BGRX; }
+	RGBType const* data() const { return BGRX; }
+
+	static VectorRGBX Constant(RGBType value) { return VectorRGBX(value); }
+	static VectorRGBX White() { return VectorRGBX(255, 255, 255); }
+	static VectorRGBX Black() { return VectorRGBX(0, 0, 0); }
+};
+static_assert(sizeof(VectorRGBX) == 4, "VectorRGBX must stay 4 bytes");
+
+// 4 byte pixel with alpha, same memory order as QImage::Format_ARGB32 (little endian : B, G, R, A), not premultiplied
+// read for the shape of an image with a transparent background, see ShapeMask
+struct VectorRGBA
+{
+	enum BGRA { B = 0, G = 1, R = 2, A = 3 };
+	using RGBType = unsigned char;
+	RGBType BGRA[4];
+
+	VectorRGBA(RGBType fillVal = 0) : BGRA{ fillVal,fillVal,fillVal,0xff } {}
+	VectorRGBA(RGBType r, RGBType g, RGBType b, RGBType a = 0xff) : BGRA{ b,g,r,a } {}
+	VectorRGBA(VectorRGBA const& rhs) = default;
+	VectorRGBA(VectorRGBA&& rhs) = default;
+	VectorRGBA& operator=(VectorRGBA const& rhs) = default;
+	VectorRGBA& operator=(VectorRGBA&& rhs) = default;
+
+	bool operator==(VectorRGBA const& rhs) const
+	{
+		return
+			(r() == rhs.r()) &&
+			(g() == rhs.g()) &&
+			(b() == rhs.b()) &&
+			(a() == rhs.a())
+			;
+	}
+	bool operator!=(VectorRGBA const& rhs) const { return !(*this == rhs); }
+
+	VectorRGB toRGB() const { return VectorRGB(r(), g(), b()); }
+
+	RGBType& r() { return BGRA[R]; }
+	RGBType r() const { return BGRA[R]; }
+	RGBType& g() { return BGRA[G]; }
+	RGBType g() const { return BGRA[G]; }
+	RGBType& b() { return BGRA[B]; }
+	RGBType b() const { return BGRA[B]; }
+	RGBType& a() { return BGRA[A]; }
+	RGBType a() const { return BGRA[A]; }
+
+	RGBType* data() { return BGRA; }
+	RGBType const* data() const { return BGRA; }
+
+	static VectorRGBA Transparent() { return VectorRGBA(0, 0, 0, 0); }
+};
+static_assert(sizeof(VectorRGBA) == 4, "VectorRGBA must stay 4 bytes");
 
 class ImageObject
 {
@@ -147,10 +233,35 @@ public:
 	virtual bool isStandardImageType() const = 0;
 	virtual bool isGrayType() const = 0;
 	virtual bool isRGBType() const = 0;
+	virtual bool isRGBXType() const = 0;
 	virtual bool isRGBAType() const = 0;
 
 public:
 	virtual ~ImageObject() {}
+
+	// format from the suffix, the resolution is the one set on image
+	// a cancelled task stops the encoder at its next write and removes the partial file
+	static bool writeImage(QImage const& image, QString path, int jpgQuality = -1, TaskState* task = nullptr)
+	{
+		BP_TRACE_SCOPE("writeImage");
+		const auto quality = std::clamp(jpgQuality, -1, 100);
+		if (!task)
+			return image.save(path, nullptr, quality);
+
+		util::beginStage(task, "encoding", 0);
+		bool retval = false;
+		{
+			CancellableFile file(path, task);
+			if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+				return false;
+			QImageWriter writer(&file, QFileInfo(path).suffix().toLatin1());
+			writer.setQuality(quality);
+			retval = writer.write(image) && !task->isCancelled();
+		}
+		if (!retval)
+			QFile::remove(path);
+		return retval;
+	}
 };
 using ImageObjectPtr = std::shared_ptr<ImageObject>;
 
@@ -163,6 +274,7 @@ inline T QRgbAllocator(QRgb val)
 	static_assert(
 		IS_T(unsigned char) ||
 		IS_T(VectorRGB) ||
+		IS_T(VectorRGBX) ||
 		IS_T(VectorRGBA)
 		);
 
@@ -172,8 +284,11 @@ inline T QRgbAllocator(QRgb val)
 	if constexpr (IS_T(VectorRGB))
 		return VectorRGB{ (unsigned char)qRed(val), (unsigned char)qGreen(val), (unsigned char)qBlue(val) };
 	
+	if constexpr (IS_T(VectorRGBX))
+		return VectorRGBX{ (unsigned char)qRed(val), (unsigned char)qGreen(val), (unsigned char)qBlue(val) };
+	
 	if constexpr (IS_T(VectorRGBA))
-		return VectorRGB{ (unsigned char)qRed(val), (unsigned char)qGreen(val), (unsigned char)qBlue(val), (unsigned char)qAlpha(val) };
+		return VectorRGBA{ (unsigned char)qRed(val), (unsigned char)qGreen(val), (unsigned char)qBlue(val), (unsigned char)qAlpha(val) };
 }
 
 template <typename T>
@@ -208,54 +323,70 @@ public:
 		clear();
 		m_wid = rhs.m_wid;
 		m_hi = rhs.m_hi;
+		m_category = rhs.m_category;
 		std::swap(m_data, rhs.m_data);
+		m_hash = rhs.m_hash.load();
+		m_hashValid = rhs.m_hashValid.load();
 	}
 	ImageData& operator=(ImageData const& rhs)
 	{
 		clear();
 		_alloc(rhs.m_wid, rhs.m_hi, rhs.m_data);
+		m_hash = rhs.m_hash.load();
+		m_hashValid = rhs.m_hashValid.load();
 		return *this;
 	}
 
 	//if any of imagedata is empty, returns false
-	// compares at least N random-index values and returns true if all the same
-	// therefore, operator== for type T must be predefined
-	bool operator==(ImageData const& rhs /*, const int compareAtLeast = 100*/) const
+	// dimensions first, then cached content hashes when both are known, then the whole buffer
+	bool operator==(ImageData const& rhs) const
 	{
 		if (empty() || rhs.empty())
 			return false;
-		if (rhs.pixelCount() != pixelCount())
+		if (rhs.width() != width() || rhs.height() != height())
+			return false;
+		if (m_hashValid && rhs.m_hashValid && m_hash.load() != rhs.m_hash.load())
 			return false;
 
-		//compare at least 100 values
-		//const int minThres = compareAtLeast;
-		constexpr int minThres = 100;
+		return memcmp(m_data, rhs.m_data, dataSize()) == 0;
+	}
+	bool operator!=(ImageData const& rhs) const { return !(*this == rhs); }
 
-		//compare random values
-		const int pxCnt = pixeCount();
-		if (pxCnt <= minThres)
-		{
-			for (auto idx = 0; idx < pxCnt)
-				if (this->at(idx) != rhs(idx))
-					return false;
-		}
-		else
-		{
-			std::random_device device;
-			std::mt19937 generator(device());
-			std::uniform_int_distribution<int> distribution(0, pxCnt);
-			
-			for (auto idx = 0; idx < minThres)
-			{
-				const int randomIdx = distribution(generator);
-				if (this->at(distribution(randomIdx)) != rhs(randomIdx))
-					return false;
-			}
-				
-		}
+	// quick rejection test : compares sampleCount pixels spread over the image with a fixed stride
+	// true does not guarantee equality, use operator== to confirm
+	bool sampledEquals(ImageData const& rhs, int sampleCount = 100) const
+	{
+		if (empty() || rhs.empty())
+			return false;
+		if (rhs.width() != width() || rhs.height() != height())
+			return false;
 
-		return true;
+		const int pxCnt = pixelCount();
+		const int step = std::max(1, pxCnt / std::max(1, sampleCount));
+		for (int idx = 0; idx < pxCnt; idx += step)
+			if (memcmp(&m_data[idx], &rhs.m_data[idx], sizeof(T)))
+				return false;
+
+		//always include the last pixel
+		return memcmp(&m_data[pxCnt - 1], &rhs.m_data[pxCnt - 1], sizeof(T)) == 0;
+	}
+
+	// 64 bit hash of dimensions and pixels, computed on first call and cached
+	// writes through data()/bits()/operator() are not tracked, call invalidateHash() after them
+	// thread safe for a buffer shared read only, e.g. by duplicates : callers that race both hash it and publish the same value
+	uint64_t contentHash() const
+	{
+		if (m_hashValid.load(std::memory_order_acquire))
+			return m_hash.load(std::memory_order_relaxed);
+
+		const uint64_t seed = ((uint64_t)(uint32_t)m_wid << 32) | (uint32_t)m_hi;
+		const uint64_t retval = m_data ? hash::hashBytes(m_data, (size_t)dataSize(), seed) : 0;
+		m_hash.store(retval, std::memory_order_relaxed);
+		m_hashValid.store(true, std::memory_order_release);
+		return retval;
 	}
+	bool hasContentHash() const { return m_hashValid; }
+	void invalidateHash() { m_hashValid = false; }
 
 	~ImageData() { clear(); }
 
@@ -267,15 +398,17 @@ public:
 	constexpr bool pixelTypeIs() const { return std::is_same<T, T2>::value; };
 #define IS_GRAY_IMAGE (pixelTypeIs<unsigned char>())
 #define IS_RGB_IMAGE (pixelTypeIs<VectorRGB>())
+#define IS_RGBX_IMAGE (pixelTypeIs<VectorRGBX>())
 #define IS_RGBA_IMAGE (pixelTypeIs<VectorRGBA>())
 #define GRAY_IMAGE_Q_FORM QImage::Format_Grayscale8
 #define RGB24_IMAGE_Q_FORM QImage::Format_RGB888
 #define RGB32_IMAGE_Q_FORM QImage::Format_RGB32
-#define RGBA_IMAGE_Q_FORM QImage::Format_RGB32
+#define RGBA_IMAGE_Q_FORM QImage::Format_ARGB32
 
-	bool isStandardImageType() const override { return isGrayType() || isRGBType() || isRGBAType(); }
+	bool isStandardImageType() const override { return isGrayType() || isRGBType() || isRGBXType() || isRGBAType(); }
 	bool isGrayType() const override { return IS_GRAY_IMAGE; }
 	bool isRGBType() const override { return IS_RGB_IMAGE; }
+	bool isRGBXType() const override { return IS_RGBX_IMAGE; }
 	bool isRGBAType() const override { return IS_RGBA_IMAGE; }
 	// !type definition field
 
@@ -299,9 +432,6 @@ public:
 	// Image IOs
 	void fromQImage(QImage const& input)
 	{
-		auto format = input.format();
-		int wid = input.width(), hi = input.height();
-
 		const auto this_form = toQImageFormat();
 
 		if (this_form == QImage::Format_Invalid)
@@ -309,80 +439,106 @@ public:
 			throw std::logic_error("QImage Format invalid");
 		}
 
-		const bool isSameFormat = this_form == format;
-		QImage buf = input;
-		if (isSameFormat)
+		if (input.isNull())
 		{
-			this->_alloc(buf.width(), buf.height(), buf.constBits());
+			clear();
+			return;
 		}
-		else
-		{
-			//buf = buf.convertToFormat(this_form);
 
-			const int wid = buf.width(), hi = buf.height();
-			std::vector<T> dataBuf(wid * hi);
+		const int wid = input.width(), hi = input.height();
+		this->_alloc(wid, hi);
 
-			for (int y = 0; y < hi; ++y)
-				for (int x = 0; x < wid; ++x)
-					dataBuf.at(x + y * wid) = QRgbAllocator<T>(buf.pixel(x, y));
+		//transparent pixels are flattened onto white, the paper they are printed on. only RGBA keeps the alpha
+		if constexpr (std::is_same<T, VectorRGB>::value || std::is_same<T, VectorRGBX>::value)
+		{
+			if (input.hasAlphaChannel())
+			{
+				const QImage buf = input.convertToFormat(QImage::Format_ARGB32);
+				std::vector<unsigned char> line(std::is_same<T, VectorRGB>::value ? (size_t)wid * 4 : 0);
+				for (int row = 0; row < hi; ++row)
+				{
+					unsigned char* flat = line.empty() ? reinterpret_cast<unsigned char*>(rowAddress(row)) : line.data();
+					memcpy(flat, buf.constScanLine(row), (size_t)wid * 4);
+					kernel::flattenBgra(flat, wid, 0xff);
+					if (!line.empty())
+						kernel::bgrxToRgb(flat, reinterpret_cast<unsigned char*>(rowAddress(row)), wid);
+				}
+				return;
+			}
+		}
 
-			this->_alloc(wid, hi, dataBuf.data());
+		//let Qt convert the whole image once, then copy scanlines (QImage rows are 4 byte aligned)
+		if constexpr (std::is_same<T, VectorRGB>::value)
+		{
+			const QImage buf = (input.format() == QImage::Format_RGB32) ? input : input.convertToFormat(QImage::Format_RGB32);
+			for (int row = 0; row < hi; ++row)
+				kernel::bgrxToRgb(buf.constScanLine(row), reinterpret_cast<unsigned char*>(rowAddress(row)), wid);
+		}
+		else
+		{
+			const QImage buf = (input.format() == this_form) ? input : input.convertToFormat(this_form);
+			for (int row = 0; row < hi; ++row)
+				memcpy(rowAddress(row), buf.constScanLine(row), sizeof(T) * wid);
 		}
 	}
 
 	QImage toQImage() const
 	{
+		BP_TRACE_SCOPE("toQImage");
 		QImage retval;
 
 		auto this_form = toQImageFormat();
 		if (!m_data || this_form == QImage::Format_Invalid || this->empty())
 			return retval;
 
-		//rgb specialization
-		if (this_form == QImage::Format_RGB888)
+		//rgb specialization, widened to RGB32 since QImage rows of RGB888 are padded
+		if constexpr (std::is_same<T, VectorRGB>::value)
 		{
-			//little endian byte order
-			enum _RGBF_ORDER { _R = 2, _G = 1, _B  = 0, _F = 3 };
-
-			const auto tempForm = QImage::Format_RGB32;
-			retval = QImage(width(), height(), tempForm);
+			retval = QImage(width(), height(), QImage::Format_RGB32);
 			for (int row = 0; row < height(); ++row)
-			{
-#if 1
-				auto* qRow = retval.scanLine(row);
-				for (int col = 0; col < width(); ++col)
-				{
-					const VectorRGB val = this->at(col, row);
-					* (qRow++) = val.b();
-					* (qRow++) = val.g();
-					* (qRow++) = val.r();
-					* (qRow++) = 0xff;
-				}
-#else
-				uint32_t* qRow = reinterpret_cast<uint32_t*>(retval.scanLine(row));
-				for (int col = 0; col < width(); ++col)
-					*(qRow + col) = this->at(col, row).toUint32();
-#endif
-			}
-			
+				kernel::rgbToBgrx(reinterpret_cast<unsigned char const*>(rowAddress(row)), retval.scanLine(row), width());
 		}
 		else retval = QImage(bits(), m_wid, m_hi, this_form);
 
 		return retval;
 	}
 
+	// toQImage() with the resolution set, 4 byte formats still share the buffer
+	// wrapped writable so that setting the resolution does not copy the pixels, nothing is written through it
+	QImage toQImage(int dpi) const
+	{
+		QImage retval;
+		auto this_form = toQImageFormat();
+		if (!m_data || this_form == QImage::Format_Invalid || this->empty())
+			return retval;
+
+		if constexpr (std::is_same<T, VectorRGB>::value)
+			retval = toQImage();
+		else
+			retval = QImage(const_cast<unsigned char*>(bits()), m_wid, m_hi, this_form);
+
+		auto dpi2dpm = [](int _dpi)->int { return (int)((_dpi) / 0.0254); };
+		const int dpm = dpi2dpm(dpi);
+
+		retval.setDotsPerMeterX(dpm);
+		retval.setDotsPerMeterY(dpm);
+		return retval;
+	}
+
 	QImage::Format toQImageFormat() const
 	{
 		return
 			IS_GRAY_IMAGE ? GRAY_IMAGE_Q_FORM :
 			IS_RGB_IMAGE ? RGB24_IMAGE_Q_FORM :
-			IS_RGBA_IMAGE ? RGB32_IMAGE_Q_FORM :
+			IS_RGBX_IMAGE ? RGB32_IMAGE_Q_FORM :
+			IS_RGBA_IMAGE ? RGBA_IMAGE_Q_FORM :
 			QImage::Format_Invalid
 			;
 	}
 
 	bool load(QString path)
 	{
+		BP_TRACE_SCOPE("load");
 		const auto this_form = toQImageFormat();
 
 		if (this_form == QImage::Format_Invalid)
@@ -397,19 +553,56 @@ public:
 		return true;
 	}
 
+	// denominator among 1, 2, 4, 8 : the smallest decode that still covers target
+	// JPEG decoders apply these in the DCT, so 1/8 decodes about 64x fewer pixels
+	static int chooseDecodeScale(QSize source, QSize target)
+	{
+		if (source.isEmpty() || target.isEmpty())
+			return 1;
+
+		int denom = 1;
+		while (denom < 8
+			&& source.width() / (denom * 2) >= target.width()
+			&& source.height() / (denom * 2) >= target.height())
+			denom *= 2;
+		return denom;
+	}
+
+	// decodes to exactly target size, reduced in the decoder first, the remainder smooth scaled
+	bool load(QString path, QSize target)
+	{
+		if (target.isEmpty())
+			return load(path);
+
+		BP_TRACE_SCOPE("loadScaled");
+		const auto this_form = toQImageFormat();
+
+		if (this_form == QImage::Format_Invalid)
+			return false;
+
+		QImageReader reader(path);
+		const QSize source = reader.size();
+		if (const int denom = chooseDecodeScale(source, target); denom > 1)
+			reader.setScaledSize(QSize((source.width() + denom - 1) / denom, (source.height() + denom - 1) / denom));
+
+		QImage buf;
+		if (!reader.read(&buf))
+			return false;
+
+		if (buf.size() != target)
+			buf = buf.scaled(target, Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+
+		fromQImage(buf);
+
+		return true;
+	}
+
 	// jpgQuality : 0 ~ 100, the higher the better. -1 is default value for QImage option
 	// dpi : will be converted to dots per meter internally
-	bool save(QString path, int jpgQuality = -1, int dpi = 72) const
+	// a cancelled task stops the encoder at its next write and removes the partial file
+	bool save(QString path, int jpgQuality = -1, int dpi = 72, TaskState* task = nullptr) const
 	{
-		const auto quality = std::clamp(jpgQuality, -1, 100);
-		QImage toq = this->toQImage();
-		
-		auto dpi2dpm = [](int _dpi)->int { return (int)((_dpi) / 0.0254); };
-		const int dpm = dpi2dpm(dpi);
-
-		toq.setDotsPerMeterX(dpm);
-		toq.setDotsPerMeterY(dpm);
-		return toq.save(path, nullptr, quality);
+		return writeImage(toQImage(dpi), path, jpgQuality, task);
 	}
 	// ! Image IOs
 #pragma endregion
@@ -444,6 +637,7 @@ public:
 	template<typename FuncT>
 	void for_each_px(bool parallel, FuncT&& func)
 	{
+		invalidateHash();
 		if (parallel)
 			_for_each_px_parallel(std::forward<FuncT>(func));
 		else
@@ -453,6 +647,7 @@ public:
 	template<typename FuncT>
 	void for_each_idx(bool parallel, FuncT&& func)
 	{
+		invalidateHash();
 		if (parallel)
 			_for_each_idx_parallel(std::forward<FuncT>(func));
 		else
@@ -464,9 +659,22 @@ public:
 	void fill(T val)
 	{
 		std::fill(m_data, m_data + pixelCount(), val);
+		invalidateHash();
 	}
 	void set(T val) { fill(std::forward<T>(val)); }
 
+#pragma region Saturating_Arithmetic
+	// whole buffer, fixed point, SIMD dispatched at runtime (see PixelKernels.h)
+	// only for 8 bit channel types, X of RGBX images stays 0xff
+	void addSaturate(unsigned char value) { _assertByteChannels(); kernel::addSaturate(bits(), (size_t)dataSize(), value, _keepMask()); invalidateHash(); }
+	void subtractSaturate(unsigned char value) { _assertByteChannels(); kernel::subtractSaturate(bits(), (size_t)dataSize(), value, _keepMask()); invalidateHash(); }
+	void multiplySaturate(unsigned char value) { _assertByteChannels(); kernel::scaleSaturate(bits(), (size_t)dataSize(), (float)value, _keepMask()); invalidateHash(); }
+	void divide(unsigned char value) { _assertByteChannels(); kernel::divide(bits(), (size_t)dataSize(), value, _keepMask()); invalidateHash(); }
+
+	// brightness/contrast gain, factor in 1/256 steps
+	void scale(float factor) { _assertByteChannels(); kernel::scaleSaturate(bits(), (size_t)dataSize(), factor, _keepMask()); invalidateHash(); }
+#pragma endregion
+
 	//Converter = lambdaFunction(InputType value) {
 	// //do something with value...
 	// return (OutputType) retval;
@@ -521,74 +729,172 @@ public:
 
 	static ImageData<T>::Ptr rotate(ImageData<T> const& input, bool clockwise = true)
 	{
+		BP_TRACE_SCOPE("rotate");
+		MemoryAccountant::Scope scope(MemoryAccountant::Temporary);
 		const int wid = input.height(), hi = input.width();
 		ImageData<T>::Ptr buf = std::make_shared<ImageData<T>>(wid, hi);
 		
-		const bool isParallel = false;
-
-		if (clockwise)
-		{
-			buf->for_each_px(isParallel, [&input, wid, hi](int x, int y, auto& val)
-			{
-				val = input(y, wid - 1 - x);
-			});
-		}
-		else //counter-clockwise
-		{
-			buf->for_each_px(isParallel, [&input, wid, hi](int x, int y, auto& val)
-			{
-				val = input(hi - 1 - y, x);
-			});
-		}
+		//tiled, 4x4 SIMD transpose for 4 byte pixels
+		kernel::rotate90(input.data(), input.width(), input.height(), input.width(), buf->data(), wid, clockwise);
 
 		return buf;
 	}
 
-	bool drawSubImage(ImageData<T> const& input, int x, int y, bool rotate90 = false)
+	// draws input with its top-left corner at (x, y), rotated clockwise if rotate90
+	// input may be packed RGB when this is RGBX (compositing onto an RGBX sheet)
+	template <typename SrcT>
+	bool drawSubImage(ImageData<SrcT> const& input, int x, int y, bool rotate90 = false)
 	{
 		const int wid = this->width(), hi = this->height();
 		const int in_wid = rotate90 ? input.height() : input.width();
 		const int in_hi = rotate90 ? input.width() : input.height();
 
-		if (x + in_wid >= wid || y + in_hi >= hi)
+		if (input.empty() || x < 0 || y < 0 || x + in_wid > wid || y + in_hi > hi)
 			return false;
 
-#if 1
-		for(int i = 0; i < input.width(); ++i)
-			for (int j = 0; j < input.height(); ++j)
+		invalidateHash();
+
+		if constexpr (std::is_same<SrcT, T>::value)
+		{
+			if (rotate90)
+				kernel::rotate90(input.data(), input.width(), input.height(), input.width(), rowAddress(y) + x, m_wid, true);
+			else
+				for (int row = 0; row < in_hi; ++row)
+					memcpy(rowAddress(y + row) + x, input.rowAddress(row), in_wid * sizeof(T));
+		}
+		else if constexpr (std::is_same<T, VectorRGBX>::value && std::is_same<SrcT, VectorRGB>::value)
+		{
+			if (rotate90)
 			{
-				this->at(
-					rotate90 ? (x + in_wid - 1 - j) : (x + i),
-					rotate90 ? (y + i) : (y + j)
-				) = input(i,j);
+				//widen first so that the rotation runs on 4 byte pixels
+				ImageData<VectorRGBX> widened(input.width(), input.height());
+				kernel::rgbToBgrx(input.bits(), widened.bits(), input.pixelCount());
+				kernel::rotate90(widened.data(), widened.width(), widened.height(), widened.width(), rowAddress(y) + x, m_wid, true);
+			}
+			else
+			{
+				for (int row = 0; row < in_hi; ++row)
+					kernel::rgbToBgrx(
+						reinterpret_cast<unsigned char const*>(input.rowAddress(row)),
+						reinterpret_cast<unsigned char*>(rowAddress(y + row) + x),
+						in_wid);
 			}
-#else
-		if (rotate90)
-		{
-			input.for_each_px(false, [=](int i, int j, auto const& val)
-				{
-					this->at(x + in_wid - 1 - j, y + i) = val;
-				});
 		}
 		else
 		{
-			input.for_each_px(false, [=](int i, int j, auto const& val)
-				{
-					this->at(x + i, y + j) = val;
-				});
+			static_assert(sizeof(SrcT) == 0, "drawSubImage : unsupported pixel type pair");
 		}
-#endif
-		
 		
 		return true;
 	}
 
+	// part of input with its top-left corner at (x, y), row by row. e.g. the runs of a nested shape, see ShapeMask::runs()
+	bool drawSubRect(ImageData const& input, QRect const& part, int x, int y)
+	{
+		if (input.empty() || part.isEmpty() || part.x() < 0 || part.y() < 0 || part.right() >= input.width() || part.bottom() >= input.height()
+			|| x < 0 || y < 0 || x + part.width() > width() || y + part.height() > height())
+			return false;
+
+		invalidateHash();
+		for (int row = 0; row < part.height(); ++row)
+			memcpy(rowAddress(y + row) + x, input.rowAddress(part.y() + row) + part.x(), part.width() * sizeof(T));
+		return true;
+	}
+
+	// repeats the edge pixels of inner outward by band pixels (print bleed), clipped to the image
+	void extendBorder(int x, int y, int in_wid, int in_hi, int band)
+	{
+		const int wid = this->width(), hi = this->height();
+		if (band <= 0 || in_wid <= 0 || in_hi <= 0 || x < 0 || y < 0 || x + in_wid > wid || y + in_hi > hi)
+			return;
+
+		invalidateHash();
+
+		const int left = std::max(0, x - band), right = std::min(wid, x + in_wid + band);
+		for (int row = y; row < y + in_hi; ++row)
+		{
+			T* line = rowAddress(row);
+			std::fill(line + left, line + x, line[x]);
+			std::fill(line + x + in_wid, line + right, line[x + in_wid - 1]);
+		}
+
+		const int top = std::max(0, y - band), bottom = std::min(hi, y + in_hi + band);
+		for (int row = top; row < y; ++row)
+			memcpy(rowAddress(row) + left, rowAddress(y) + left, (right - left) * sizeof(T));
+		for (int row = y + in_hi; row < bottom; ++row)
+			memcpy(rowAddress(row) + left, rowAddress(y + in_hi - 1) + left, (right - left) * sizeof(T));
+	}
+
+	// drawSubImage followed by extendBorder for a window of a larger image, e.g. one tile of a sheet that is never composited
+	// (x, y) may be negative or past the edges, only the part inside this image is drawn
+	// clip : in the coordinates of this image, nothing outside of it is drawn. null for no clip
+	void drawSubImageClipped(ImageData<VectorRGB> const& input, int x, int y, bool rotate90, int band, QRect const& clip = QRect())
+	{
+		static_assert(std::is_same<T, VectorRGBX>::value, "drawSubImageClipped : RGBX destination only");
+
+		const int in_wid = rotate90 ? input.height() : input.width();
+		const int in_hi = rotate90 ? input.width() : input.height();
+		band = std::max(0, band);
+		int left = std::max(0, x - band), right = std::min(this->width(), x + in_wid + band);
+		int top = std::max(0, y - band), bottom = std::min(this->height(), y + in_hi + band);
+		if (!clip.isNull())
+		{
+			left = std::max(left, clip.x());
+			right = std::min(right, clip.x() + clip.width());
+			top = std::max(top, clip.y());
+			bottom = std::min(bottom, clip.y() + clip.height());
+		}
+		if (input.empty() || left >= right || top >= bottom)
+			return;
+
+		invalidateHash();
+
+		//bleed pixels repeat the nearest edge pixel, as extendBorder does
+		const int from = std::clamp(x, left, right), to = std::clamp(x + in_wid, left, right);
+		for (int row = top; row < bottom; ++row)
+		{
+			const int py = std::clamp(row - y, 0, in_hi - 1);
+			T* line = rowAddress(row);
+			if (rotate90)
+			{
+				//clockwise : column px of the drawn image is row (height - 1 - px) of the input, read downwards
+				for (int col = left; col < right; ++col)
+				{
+					const int px = std::clamp(col - x, 0, in_wid - 1);
+					line[col] = T(input(py, input.height() - 1 - px));
+				}
+				continue;
+			}
+
+			VectorRGB const* src = input.rowAddress(py);
+			std::fill(line + left, line + from, T(src[0]));
+			if (from < to)
+				kernel::rgbToBgrx(reinterpret_cast<unsigned char const*>(src + (from - x)), reinterpret_cast<unsigned char*>(line + from), to - from);
+			std::fill(line + to, line + right, T(src[in_wid - 1]));
+		}
+	}
+
 protected:
+	static constexpr void _assertByteChannels()
+	{
+		static_assert(
+			std::is_same<T, unsigned char>::value ||
+			std::is_same<T, VectorRGB>::value ||
+			std::is_same<T, VectorRGBX>::value,
+			"saturating arithmetic needs 8 bit channels");
+	}
+	int64_t _byteCount() const { return (int64_t)sizeof(T) * m_wid * m_hi; }
+	static constexpr uint32_t _keepMask() { return std::is_same<T, VectorRGBX>::value ? kernel::KeepBgrxMask : 0u; }
+
 	void _Delete()
 	{
 		if (m_data)
-			delete m_data;
+		{
+			MemoryAccountant::instance().release(m_category, _byteCount());
+			delete[] m_data;
+		}
 		m_data = nullptr;
+		m_hashValid = false;
 	}
 	template<typename T2 = T>
 	void _alloc(int wid, int hi, T2 const* data = nullptr)
@@ -597,6 +903,9 @@ protected:
 		m_wid = wid;
 		m_hi = hi;
 		m_data = new T[(size_t)wid * hi];
+		m_hashValid = false;
+		m_category = MemoryAccountant::current();
+		MemoryAccountant::instance().add(m_category, _byteCount());
 
 		if (data)
 			memcpy(m_data, reinterpret_cast<unsigned char const* const>(data), dataSize());
@@ -635,6 +944,12 @@ protected:
 	
 	//col major
 	T* m_data = 0;
+	MemoryAccountant::Category m_category = MemoryAccountant::Images; //counted in while m_data is held
+
+	//atomic : contentHash() publishes from any reader thread, m_hashValid (release) after m_hash
+	mutable std::atomic<uint64_t> m_hash{ 0 };
+	//atomic : disjoint drawSubImage calls from worker threads all invalidate the sheet
+	mutable std::atomic<bool> m_hashValid{ false };
 };
 
 #define DECL_PTR(x) using x##Ptr = std::shared_ptr<x>
@@ -646,14 +961,17 @@ using ImageDataFloat = ImageData<float>;
 using ImageDataDouble = ImageData<double>;
 using ImageDataRGB = ImageData<VectorRGB>;
 using RGBImage = ImageData<VectorRGB>;
-//using ImageDataRGBA = ImageData<VectorRGBA>;
-//using RGBAImage = ImageData<VectorRGBA>;
+using ImageDataRGBX = ImageData<VectorRGBX>;
+using RGBXImage = ImageData<VectorRGBX>;
+using ImageDataRGBA = ImageData<VectorRGBA>;
+using RGBAImage = ImageData<VectorRGBA>;
 
 DECL_PTR(ImageData8);
 DECL_PTR(ImageDataFloat);
 DECL_PTR(ImageDataDouble);
 DECL_PTR(ImageDataRGB);
-//DECL_PTR(ImageDataRGBA);
+DECL_PTR(ImageDataRGBX);
+DECL_PTR(ImageDataRGBA);
 
 #undef DECL_PTR
 
@@ -670,15 +988,94 @@ inline unsigned char RGB2Gray(VectorRGB val)
 	);
 }
 
+// Q8 fixed point, same weights as RGB2Gray(VectorRGB) rounded to 1/256
 template<typename T = void>
 inline ImageData8 RGB2Gray(ImageDataRGB const& image)
 {
-	return image.convert<unsigned char>([](VectorRGB rgbVal)
-		{
-			return RGB2Gray(rgbVal);
-		});
+	ImageData8 retval(image.width(), image.height());
+	kernel::grayFromRgb(image.bits(), retval.bits(), image.pixelCount());
+	return retval;
+}
+
+template<typename T = void>
+inline ImageData8 RGB2Gray(ImageDataRGBX const& image)
+{
+	ImageData8 retval(image.width(), image.height());
+	kernel::grayFromBgrx(image.bits(), retval.bits(), image.pixelCount());
+	return retval;
+}
+
+template<typename T = void>
+inline ImageDataRGBX toRGBX(ImageDataRGB const& image)
+{
+	ImageDataRGBX retval(image.width(), image.height());
+	kernel::rgbToBgrx(image.bits(), retval.bits(), image.pixelCount());
+	return retval;
+}
+
+template<typename T = void>
+inline ImageDataRGB toRGB(ImageDataRGBX const& image)
+{
+	ImageDataRGB retval(image.width(), image.height());
+	kernel::bgrxToRgb(image.bits(), retval.bits(), image.pixelCount());
+	return retval;
 }
 
+#pragma endregion
 
+// R, G and B stored as three separated gray planes
+// channel-wise processing runs 16 pixels per SSE register without any shuffling
+class PlanarImageRGB
+{
+public:
+	enum Plane { R = 0, G = 1, B = 2 };
+	using Ptr = std::shared_ptr<PlanarImageRGB>;
 
-#pragma endregion
\ No newline at end of file
+	PlanarImageRGB() {}
+	PlanarImageRGB(int wid, int hi)
+	{
+		for (auto& plane : planes)
+			plane.resize(wid, hi);
+	}
+	PlanarImageRGB(ImageDataRGB const& packed) { fromRGB(packed); }
+
+	void fromRGB(ImageDataRGB const& packed)
+	{
+		for (auto& plane : planes)
+			plane.resize(packed.width(), packed.height());
+
+		kernel::rgbToPlanar(packed.bits(), planes[R].bits(), planes[G].bits(), planes[B].bits(), packed.pixelCount());
+	}
+
+	ImageDataRGB toRGB() const
+	{
+		ImageDataRGB retval(width(), height());
+		kernel::planarToRgb(planes[R].bits(), planes[G].bits(), planes[B].bits(), retval.bits(), retval.pixelCount());
+		return retval;
+	}
+
+	ImageData8 toGray() const
+	{
+		ImageData8 retval(width(), height());
+		kernel::grayFromPlanar(planes[R].bits(), planes[G].bits(), planes[B].bits(), retval.bits(), retval.pixelCount());
+		return retval;
+	}
+
+	ImageData8& plane(Plane index) { return planes[index]; }
+	ImageData8 const& plane(Plane index) const { return planes[index]; }
+
+	int width() const { return planes[R].width(); }
+	int height() const { return planes[R].height(); }
+	int pixelCount() const { return planes[R].pixelCount(); }
+	bool empty() const { return planes[R].empty(); }
+
+protected:
+	ImageData8 planes[3];
+};
+using PlanarImageRGBPtr = std::shared_ptr<PlanarImageRGB>;
+
+template<typename T = void>
+inline ImageData8 RGB2Gray(PlanarImageRGB const& image)
+{
+	return image.toGray();
+}
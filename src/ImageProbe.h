@@ -0,0 +1,180 @@
+// ImageProbe.h
+#pragma once
+
+#include <QFile>
+#include <QImageReader>
+#include <QSize>
+#include <QString>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+
+// * header only class
+// reads image dimensions from file headers without decoding pixels
+//		JPEG : first SOFn marker
+//		PNG  : IHDR chunk
+//		BMP  : BITMAPINFOHEADER / BITMAPCOREHEADER
+// anything else falls back to QImageReader::size()
+class ImageProbe
+{
+public:
+	// invalid QSize if the file cannot be read
+	static QSize size(QString path)
+	{
+		QFile file(path);
+		if (!file.open(QIODevice::ReadOnly))
+			return QSize();
+
+		//SOF usually sits right after APPn segments, EXIF thumbnails may push it further
+		constexpr qint64 headerBytes = 256 * 1024;
+		const QByteArray head = file.read(headerBytes);
+		file.close();
+
+		auto data = reinterpret_cast<unsigned char const*>(head.constData());
+		const int length = head.size();
+
+		QSize retval;
+		if (isPng(data, length))
+			retval = parsePng(data, length);
+		else if (isBmp(data, length))
+			retval = parseBmp(data, length);
+		else if (isJpeg(data, length))
+			retval = parseJpeg(data, length);
+
+		if (retval.isValid() && !retval.isEmpty())
+			return retval;
+
+		//unknown layout or truncated header
+		QImageReader reader(path);
+		return reader.size();
+	}
+
+	static bool isJpeg(unsigned char const* data, int length)
+	{
+		return length >= 3 && data[0] == 0xFF && data[1] == 0xD8 && data[2] == 0xFF;
+	}
+
+	static bool isPng(unsigned char const* data, int length)
+	{
+		static const unsigned char signature[8] = { 0x89, 'P', 'N', 'G', 0x0D, 0x0A, 0x1A, 0x0A };
+		return length >= 8 && memcmp(data, signature, 8) == 0;
+	}
+
+	static bool isBmp(unsigned char const* data, int length)
+	{
+		return length >= 2 && data[0] == 'B' && data[1] == 'M';
+	}
+
+	static QSize parseJpeg(unsigned char const* data, int length)
+	{
+		const int pos = findJpegFrame(data, length);
+		if (pos < 0)
+			return QSize();
+		const int hi = readBE16(data + pos + 5);
+		const int wid = readBE16(data + pos + 7);
+		return QSize(wid, hi);
+	}
+
+	// a JPEG a PDF can embed as a DCTDecode stream without re-encoding : 8 bit huffman coded, gray or YCbCr
+	// components is 1 or 3, false for anything else (CMYK, 12 bit, arithmetic, lossless, not a JPEG)
+	static bool dctPassthrough(QString path, QSize& size, int& components)
+	{
+		QFile file(path);
+		if (!file.open(QIODevice::ReadOnly))
+			return false;
+		const QByteArray head = file.read(256 * 1024);
+		file.close();
+
+		auto data = reinterpret_cast<unsigned char const*>(head.constData());
+		const int length = head.size();
+		const int pos = isJpeg(data, length) ? findJpegFrame(data, length) : -1;
+		if (pos < 0 || pos + 10 > length)
+			return false;
+
+		//SOF0 baseline, SOF1 extended, SOF2 progressive
+		const unsigned char marker = data[pos + 1];
+		const int precision = data[pos + 4];
+		components = data[pos + 9];
+		size = QSize(readBE16(data + pos + 7), readBE16(data + pos + 5));
+		return marker <= 0xC2 && precision == 8 && (components == 1 || components == 3) && !size.isEmpty();
+	}
+
+	// offset of the first SOFn marker, -1 if the header ends before it
+	static int findJpegFrame(unsigned char const* data, int length)
+	{
+		int pos = 2;
+		while (pos + 4 <= length)
+		{
+			if (data[pos] != 0xFF)
+				return -1;
+
+			const unsigned char marker = data[pos + 1];
+
+			//fill bytes
+			if (marker == 0xFF)
+			{
+				pos++;
+				continue;
+			}
+
+			//standalone markers
+			if (marker == 0x01 || (marker >= 0xD0 && marker <= 0xD7))
+			{
+				pos += 2;
+				continue;
+			}
+
+			const int segmentLength = readBE16(data + pos + 2);
+			if (segmentLength < 2)
+				return -1;
+
+			//SOF0~SOF15 except DHT(C4), JPG(C8), DAC(CC)
+			const bool isSOF = marker >= 0xC0 && marker <= 0xCF && marker != 0xC4 && marker != 0xC8 && marker != 0xCC;
+			if (isSOF)
+				return pos + 9 <= length ? pos : -1;
+
+			//start of scan reached without a frame header
+			if (marker == 0xDA)
+				return -1;
+
+			pos += 2 + segmentLength;
+		}
+		return -1;
+	}
+
+	static QSize parsePng(unsigned char const* data, int length)
+	{
+		//signature(8) + chunk length(4) + "IHDR"(4) + width(4) + height(4)
+		if (length < 24 || memcmp(data + 12, "IHDR", 4) != 0)
+			return QSize();
+		return QSize((int)readBE32(data + 16), (int)readBE32(data + 20));
+	}
+
+	static QSize parseBmp(unsigned char const* data, int length)
+	{
+		//file header(14) + DIB header size(4)
+		if (length < 26)
+			return QSize();
+
+		const uint32_t dibSize = readLE32(data + 14);
+		if (dibSize == 12)
+		{
+			//BITMAPCOREHEADER, 16 bit unsigned
+			return QSize(readLE16(data + 18), readLE16(data + 20));
+		}
+		if (dibSize >= 40 && length >= 26)
+		{
+			//negative height means top-down rows
+			const int32_t wid = (int32_t)readLE32(data + 18);
+			const int32_t hi = (int32_t)readLE32(data + 22);
+			return QSize(std::abs(wid), std::abs(hi));
+		}
+		return QSize();
+	}
+
+protected:
+	static int readBE16(unsigned char const* ptr) { return (ptr[0] << 8) | ptr[1]; }
+	static uint32_t readBE32(unsigned char const* ptr) { return ((uint32_t)ptr[0] << 24) | ((uint32_t)ptr[1] << 16) | ((uint32_t)ptr[2] << 8) | ptr[3]; }
+	static int readLE16(unsigned char const* ptr) { return ptr[0] | (ptr[1] << 8); }
+	static uint32_t readLE32(unsigned char const* ptr) { return ptr[0] | ((uint32_t)ptr[1] << 8) | ((uint32_t)ptr[2] << 16) | ((uint32_t)ptr[3] << 24); }
+};
@@ -0,0 +1,212 @@
+// JobCache.h
+#pragma once
+
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QRect>
+#include <QStandardPaths>
+#include <QString>
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include <vector>
+
+// * header only class
+// content addressed job results, see JobManifest::cacheKey
+//		<CacheLocation>/jobs/<key>/layout.json : placements in manifest input order
+//		<CacheLocation>/jobs/<key>/<output name> : encoded outputs, copied out on a hit
+//		<CacheLocation>/jobs/<key>/used : empty, its modification time is the last store or hit of the entry
+// entries are written to a temporary file first, a crashed run leaves no half written entry
+// the cache is kept under capacity() by prune(), least recently used entries first. an output larger than a quarter of a positive capacity is not cached
+class JobCache
+{
+public:
+	struct Placement
+	{
+		QRect result;
+		bool flipped = false;
+	};
+
+	static QString root()
+	{
+		return QDir(QStandardPaths::writableLocation(QStandardPaths::CacheLocation)).filePath("jobs");
+	}
+
+	static QString entryPath(uint64_t key, QString name)
+	{
+		return QDir(root()).filePath(QString("%1/%2").arg(key, 16, 16, QChar('0')).arg(name));
+	}
+
+	// bytes of all entries, <= 0 : only the entry of the latest job is kept
+	static void setCapacity(qint64 bytes) { capacityBytes() = bytes; }
+	static qint64 capacity() { return capacityBytes(); }
+
+	// false if not cached or not count placements
+	static bool loadLayout(uint64_t key, int count, std::vector<Placement>& out)
+	{
+		if (!key)
+			return false;
+
+		QFile file(entryPath(key, "layout.json"));
+		if (!file.open(QIODevice::ReadOnly))
+			return false;
+
+		const QJsonArray array = QJsonDocument::fromJson(file.readAll()).object()["placements"].toArray();
+		if (array.size() != count)
+			return false;
+
+		out.clear();
+		for (auto const& value : array)
+		{
+			const QJsonArray item = value.toArray();
+			if (item.size() != 5)
+				return false;
+			out.push_back(Placement{ QRect(item[0].toInt(), item[1].toInt(), item[2].toInt(), item[3].toInt()), item[4].toBool() });
+		}
+		touch(key);
+		return true;
+	}
+
+	static bool storeLayout(uint64_t key, std::vector<Placement> const& placements)
+	{
+		if (!key)
+			return false;
+
+		QJsonArray array;
+		for (auto const& placement : placements)
+		{
+			auto const& rect = placement.result;
+			array.append(QJsonArray{ rect.x(), rect.y(), rect.width(), rect.height(), placement.flipped });
+		}
+		const QByteArray bytes = QJsonDocument(QJsonObject{ { "placements", array } }).toJson(QJsonDocument::Compact);
+		return writeEntry(key, "layout.json", [&](QFile& file) { return file.write(bytes) == bytes.size(); });
+	}
+
+	// path of a cached output, empty if missing
+	static QString cachedFile(uint64_t key, QString name)
+	{
+		if (!key)
+			return QString();
+		const QString path = entryPath(key, name);
+		return QFile::exists(path) ? path : QString();
+	}
+
+	static bool storeFile(uint64_t key, QString name, QString source)
+	{
+		if (!key)
+			return false;
+
+		//e.g. a multi GB sheet, it would push every other entry out
+		//without a capacity the latest entry is kept whatever its size
+		QFile input(source);
+		if ((capacity() > 0 && input.size() > capacity() / 4) || !input.open(QIODevice::ReadOnly))
+			return false;
+		return writeEntry(key, name, [&](QFile& file)
+			{
+				while (!input.atEnd())
+				{
+					const QByteArray chunk = input.read(1 << 20);
+					if (chunk.isEmpty() || file.write(chunk) != chunk.size())
+						return false;
+				}
+				return true;
+			});
+	}
+
+	// copies a cached output to target, false if it is not cached
+	static bool copyOut(uint64_t key, QString name, QString target)
+	{
+		const QString cached = cachedFile(key, name);
+		if (cached.isEmpty())
+			return false;
+		if (QFile::exists(target))
+			QFile::remove(target);
+		if (!QFile::copy(cached, target))
+			return false;
+		touch(key);
+		return true;
+	}
+
+	// removes the least recently used entries other than keep until the cache fits capacity()
+	// returns the number of entries removed
+	static int prune(uint64_t keep = 0)
+	{
+		//one pass at a time, the workers of a daemon finish jobs concurrently
+		static std::mutex mutex;
+		std::lock_guard<std::mutex> lock(mutex);
+
+		struct Entry { QString path; qint64 bytes = 0; QDateTime used; };
+		std::vector<Entry> entries;
+		qint64 total = 0;
+		const QString kept = keep ? QString("%1").arg(keep, 16, 16, QChar('0')) : QString();
+		for (auto const& info : QDir(root()).entryInfoList(QDir::Dirs | QDir::NoDotAndDotDot))
+		{
+			Entry entry{ info.filePath() };
+			for (auto const& file : QDir(info.filePath()).entryInfoList(QDir::Files))
+				entry.bytes += file.size();
+			total += entry.bytes;
+			if (info.fileName() == kept)
+				continue;
+			const QFileInfo used(QDir(info.filePath()).filePath("used"));
+			entry.used = used.exists() ? used.lastModified() : info.lastModified();
+			entries.push_back(entry);
+		}
+
+		std::sort(entries.begin(), entries.end(), [](Entry const& lhs, Entry const& rhs) { return lhs.used < rhs.used; });
+		int retval = 0;
+		for (auto const& entry : entries)
+		{
+			if (total <= std::max<qint64>(0, capacity()))
+				break;
+			if (QDir(entry.path).removeRecursively())
+			{
+				total -= entry.bytes;
+				retval++;
+			}
+		}
+		return retval;
+	}
+
+protected:
+	static std::atomic<qint64>& capacityBytes()
+	{
+		static std::atomic<qint64> bytes{ 4096ll << 20 };
+		return bytes;
+	}
+
+	// the entry counts as used now, see prune()
+	static void touch(uint64_t key)
+	{
+		QFile file(entryPath(key, "used"));
+		if (file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+			file.setFileTime(QDateTime::currentDateTime(), QFileDevice::FileModificationTime);
+	}
+
+	template <typename FuncT>
+	static bool writeEntry(uint64_t key, QString name, FuncT&& write)
+	{
+		const QString path = entryPath(key, name);
+		if (!QDir().mkpath(QFileInfo(path).absolutePath()))
+			return false;
+
+		const QString temp = path + ".part";
+		{
+			QFile file(temp);
+			if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate) || !write(file))
+			{
+				QFile::remove(temp);
+				return false;
+			}
+		}
+		QFile::remove(path);
+		if (!QFile::rename(temp, path))
+			return false;
+		touch(key);
+		return true;
+	}
+};
@@ -0,0 +1,357 @@
+// JobManifest.h
+#pragma once
+
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QRect>
+#include <QString>
+#include <vector>
+#include "BinImage.h"
+#include "BinPacker.h"
+#include "BinPackerSearch.h"
+#include "ContentHash.h"
+#include "Karlsun.h"
+#include "TiffWriter.h"
+
+// * header only class
+// a packing job as JSON, loaded and saved by the GUI and run headless with --job
+// {
+//	"version" : 1,
+//	"priority" : 0,
+//	"inputs" : [ "a.jpg", { "path" : "logo.png", "rotation" : "never", "pin" : [x, y, w, h], "flipped" : false }, { "path" : "card.jpg", "quantity" : 200 } ],
+//	"sheet" : { "width" : 1600, "height" : 1000, "dpi" : 300, "forbidden" : [ [x, y, w, h] ] },
+//	"algorithm" : { "name" : "guillotine" | "search" | "maxrects" | "nesting", "timeMs" : 3000, "iterations" : 0, "threads" : 0 },
+//	"style" : { "offset" : 20, "round" : 10, "color" : "#ff0000", "spacing" : 0, "bleed" : 0, "margin" : 0 },
+//	"outputs" : { "image" : "sheet.jpg", "quality" : 100, "proof" : "proof.jpg", "proofDpi" : 72, "pdf" : "cut.pdf", "compression" : "deflate",
+//		"sheetPdf" : "sheet.pdf" }
+// }
+// relative paths are resolved against the directory of the manifest, every output is optional
+// an input of quantity N is placed N times from one decode, a pinned input has quantity 1
+struct JobManifest
+{
+	static constexpr int Version = 1;
+
+	struct Input
+	{
+		QString path;
+		RotationPolicy rotation = RotateFree;
+		bool pinned = false;
+		QRect pin; //result of a pinned image
+		bool flipped = false;
+		int quantity = 1;
+	};
+
+	struct Outputs
+	{
+		QString image;
+		int quality = 100;
+		TiffWriter::Compression compression = TiffWriter::Deflate; //TIFF outputs only
+		QString proof;
+		int proofDPI = 72;
+		QString pdf;
+		QString sheetPdf; //placed source images and cut lines, see SheetPdfWriter
+	};
+
+	std::vector<Input> inputs;
+	QSize sheet{ 1600, 1000 };
+	int dpi = 300;
+	std::vector<QRect> forbidden;
+	BinPackAlgorithm algorithm = Guillotine;
+	SearchBudget budget;
+	KarlsunStyle style = KarlsunStyle::DefaultStyle();
+	Outputs outputs;
+	int priority = 0; //queue order of PackDaemon, higher first
+
+#pragma region Json
+	// paths relative to base when they are below it
+	QJsonObject toJson(QDir const& base = QDir()) const
+	{
+		auto relative = [&base](QString path) { return path.isEmpty() ? path : base.relativeFilePath(path); };
+
+		QJsonArray inputArray;
+		for (auto const& input : inputs)
+		{
+			if (input.rotation == RotateFree && !input.pinned && input.quantity == 1)
+			{
+				inputArray.append(relative(input.path));
+				continue;
+			}
+			QJsonObject item;
+			item["path"] = relative(input.path);
+			item["rotation"] = rotationName(input.rotation);
+			if (input.pinned)
+			{
+				item["pin"] = rectToJson(input.pin);
+				item["flipped"] = input.flipped;
+			}
+			if (input.quantity != 1)
+				item["quantity"] = input.quantity;
+			inputArray.append(item);
+		}
+
+		QJsonArray forbiddenArray;
+		for (auto const& region : forbidden)
+			forbiddenArray.append(rectToJson(region));
+
+		QJsonObject retval;
+		retval["version"] = Version;
+		retval["priority"] = priority;
+		retval["inputs"] = inputArray;
+		retval["sheet"] = QJsonObject{ { "width", sheet.width() }, { "height", sheet.height() }, { "dpi", dpi }, { "forbidden", forbiddenArray } };
+		retval["algorithm"] = QJsonObject{ { "name", algorithmName(algorithm) }, { "timeMs", budget.timeMs },
+			{ "iterations", budget.iterations }, { "threads", budget.threadCount } };
+		retval["style"] = QJsonObject{ { "offset", style.offset }, { "round", style.roundPixel }, { "color", style.color.name() },
+			{ "spacing", style.spacing }, { "bleed", style.bleed }, { "margin", style.margin } };
+		retval["outputs"] = QJsonObject{ { "image", relative(outputs.image) }, { "quality", outputs.quality },
+			{ "proof", relative(outputs.proof) }, { "proofDpi", outputs.proofDPI }, { "pdf", relative(outputs.pdf) },
+			{ "sheetPdf", relative(outputs.sheetPdf) },
+			{ "compression", TiffWriter::compressionName(outputs.compression) } };
+		return retval;
+	}
+
+	// false with a reason on malformed input, missing keys keep their defaults
+	static bool fromJson(QJsonObject const& json, QDir const& base, JobManifest& out, QString& error)
+	{
+		auto absolute = [&base](QString path) { return path.isEmpty() ? path : QDir::cleanPath(base.absoluteFilePath(path)); };
+
+		JobManifest job;
+		if (json["version"].toInt(Version) > Version)
+		{
+			error = QString("unsupported manifest version %1").arg(json["version"].toInt());
+			return false;
+		}
+
+		job.priority = json["priority"].toInt(job.priority);
+
+		for (auto const& value : json["inputs"].toArray())
+		{
+			Input input;
+			if (value.isString())
+			{
+				input.path = absolute(value.toString());
+			}
+			else if (value.isObject())
+			{
+				const QJsonObject item = value.toObject();
+				input.path = absolute(item["path"].toString());
+				if (!rotationFromName(item["rotation"].toString("free"), input.rotation))
+				{
+					error = QString("unknown rotation '%1'").arg(item["rotation"].toString());
+					return false;
+				}
+				if (item.contains("pin"))
+				{
+					input.pinned = true;
+					input.pin = rectFromJson(item["pin"]);
+					input.flipped = item["flipped"].toBool(false);
+				}
+				input.quantity = item["quantity"].toInt(1);
+			}
+			if (input.path.isEmpty())
+			{
+				error = "input without a path";
+				return false;
+			}
+			if (input.quantity < 1 || (input.pinned && input.quantity != 1))
+			{
+				error = QString("invalid quantity %1 of %2").arg(input.quantity).arg(input.path);
+				return false;
+			}
+			job.inputs.push_back(input);
+		}
+
+		const QJsonObject sheet = json["sheet"].toObject();
+		job.sheet = QSize(sheet["width"].toInt(job.sheet.width()), sheet["height"].toInt(job.sheet.height()));
+		job.dpi = sheet["dpi"].toInt(job.dpi);
+		for (auto const& value : sheet["forbidden"].toArray())
+			job.forbidden.push_back(rectFromJson(value));
+		if (job.sheet.isEmpty() || job.dpi <= 0)
+		{
+			error = "invalid sheet size or dpi";
+			return false;
+		}
+
+		const QJsonObject algorithm = json["algorithm"].toObject();
+		if (!algorithmFromName(algorithm["name"].toString("guillotine"), job.algorithm))
+		{
+			error = QString("unknown algorithm '%1'").arg(algorithm["name"].toString());
+			return false;
+		}
+		job.budget.timeMs = algorithm["timeMs"].toInt(job.budget.timeMs);
+		job.budget.iterations = algorithm["iterations"].toInt(job.budget.iterations);
+		job.budget.threadCount = algorithm["threads"].toInt(job.budget.threadCount);
+
+		const QJsonObject style = json["style"].toObject();
+		job.style.offset = style["offset"].toInt(job.style.offset);
+		job.style.roundPixel = style["round"].toInt(job.style.roundPixel);
+		job.style.color = QColor(style["color"].toString(job.style.color.name()));
+		job.style.spacing = std::max(0, style["spacing"].toInt(job.style.spacing));
+		job.style.bleed = std::max(0, style["bleed"].toInt(job.style.bleed));
+		job.style.margin = std::max(0, style["margin"].toInt(job.style.margin));
+
+		const QJsonObject outputs = json["outputs"].toObject();
+		job.outputs.image = absolute(outputs["image"].toString());
+		job.outputs.quality = std::clamp(outputs["quality"].toInt(job.outputs.quality), 0, 100);
+		job.outputs.proof = absolute(outputs["proof"].toString());
+		job.outputs.proofDPI = outputs["proofDpi"].toInt(job.outputs.proofDPI);
+		job.outputs.pdf = absolute(outputs["pdf"].toString());
+		job.outputs.sheetPdf = absolute(outputs["sheetPdf"].toString());
+		job.outputs.compression = TiffWriter::compressionFromName(outputs["compression"].toString());
+
+		out = job;
+		return true;
+	}
+
+	bool save(QString path) const
+	{
+		QFile file(path);
+		if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+			return false;
+		const QByteArray bytes = QJsonDocument(toJson(QFileInfo(path).absoluteDir())).toJson(QJsonDocument::Indented);
+		return file.write(bytes) == bytes.size();
+	}
+
+	static bool load(QString path, JobManifest& out, QString& error)
+	{
+		QFile file(path);
+		if (!file.open(QIODevice::ReadOnly))
+		{
+			error = QString("cannot open %1").arg(path);
+			return false;
+		}
+
+		QJsonParseError parseError;
+		const QJsonDocument doc = QJsonDocument::fromJson(file.readAll(), &parseError);
+		if (!doc.isObject())
+		{
+			error = QString("%1 at offset %2").arg(parseError.errorString()).arg(parseError.offset);
+			return false;
+		}
+		return fromJson(doc.object(), QFileInfo(path).absoluteDir(), out, error);
+	}
+#pragma endregion
+
+#pragma region CacheKey
+	// everything that changes the layout or the encoded outputs, output paths and priority excluded
+	// inputs are keyed by file content, a renamed or touched file still hits. 0 if an input cannot be read
+	uint64_t cacheKey() const
+	{
+		QJsonObject canonical = toJson();
+		canonical.remove("priority");
+		QJsonObject outputs = canonical["outputs"].toObject();
+		outputs.remove("image");
+		outputs.remove("proof");
+		outputs.remove("pdf");
+		outputs.remove("sheetPdf");
+		canonical["outputs"] = outputs;
+
+		QJsonArray inputArray = canonical["inputs"].toArray();
+		for (int idx = 0; idx < inputArray.size(); ++idx)
+		{
+			const uint64_t contentHash = fileHash(inputs.at(idx).path);
+			if (!contentHash)
+				return 0;
+			const QString key = QString::number(contentHash, 16);
+			if (inputArray[idx].isString())
+			{
+				inputArray[idx] = key;
+			}
+			else
+			{
+				QJsonObject item = inputArray[idx].toObject();
+				item["path"] = key;
+				inputArray[idx] = item;
+			}
+		}
+		canonical["inputs"] = inputArray;
+
+		const QByteArray bytes = QJsonDocument(canonical).toJson(QJsonDocument::Compact);
+		const uint64_t retval = hash::hashBytes(bytes.constData(), (size_t)bytes.size());
+		return retval ? retval : 1;
+	}
+
+	static uint64_t fileHash(QString path)
+	{
+		QFile file(path);
+		if (!file.open(QIODevice::ReadOnly))
+			return 0;
+
+		const qint64 size = file.size();
+		if (uchar* mapped = size > 0 ? file.map(0, size) : nullptr)
+		{
+			const uint64_t retval = hash::hashBytes(mapped, (size_t)size);
+			file.unmap(mapped);
+			return retval ? retval : 1;
+		}
+		const QByteArray bytes = file.readAll();
+		const uint64_t retval = hash::hashBytes(bytes.constData(), (size_t)bytes.size());
+		return retval ? retval : 1;
+	}
+#pragma endregion
+
+#pragma region Names
+	static QString rotationName(RotationPolicy rotation)
+	{
+		switch (rotation)
+		{
+		case RotateNever: return "never";
+		case Rotate180: return "180";
+		default: return "free";
+		}
+	}
+
+	static bool rotationFromName(QString name, RotationPolicy& out)
+	{
+		for (int idx = 0; idx < MaxRotationPolicy; ++idx)
+		{
+			if (rotationName((RotationPolicy)idx) == name)
+			{
+				out = (RotationPolicy)idx;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static QString algorithmName(BinPackAlgorithm algorithm)
+	{
+		switch (algorithm)
+		{
+		case GuillotineSearch: return "search";
+		case MaxRects: return "maxrects";
+		case Nesting: return "nesting";
+		default: return "guillotine";
+		}
+	}
+
+	static bool algorithmFromName(QString name, BinPackAlgorithm& out)
+	{
+		for (int idx = 0; idx < MaxBinPackAlgorithm; ++idx)
+		{
+			if (algorithmName((BinPackAlgorithm)idx) == name)
+			{
+				out = (BinPackAlgorithm)idx;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	static QJsonArray rectToJson(QRect const& rect)
+	{
+		return QJsonArray{ rect.x(), rect.y(), rect.width(), rect.height() };
+	}
+
+	static QRect rectFromJson(QJsonValue const& value)
+	{
+		const QJsonArray array = value.toArray();
+		if (array.size() != 4)
+			return QRect();
+		return QRect(array[0].toInt(), array[1].toInt(), array[2].toInt(), array[3].toInt());
+	}
+#pragma endregion
+};
@@ -0,0 +1,285 @@
+// JobRunner.h
+#pragma once
+
+#include <QFileInfo>
+#include <QString>
+#include <algorithm>
+#include "BinImageManager.h"
+#include "JobCache.h"
+#include "JobManifest.h"
+#include "MemoryAccountant.h"
+#include "ResultExport.h"
+#include "SheetPdfWriter.h"
+#include "Task.h"
+#include "TiffWriter.h"
+#include "Trace.h"
+#include "WarmImageCache.h"
+
+// * header only class
+// runs a JobManifest without the GUI (--job <manifest>), the GUI loads jobs through configure() and restoreCached()
+// an unchanged job (same manifest and input contents) copies its outputs out of JobCache, nothing is packed or encoded
+class JobRunner
+{
+public:
+	// JobNoResult : a spool client gave up waiting, see PackDaemon::waitResult
+	enum ExitCode { JobDone = 0, JobBadManifest = 2, JobBadInput = 3, JobPackFailed = 4, JobOutputFailed = 5, JobCancelled = 6, JobAborted = 7, JobNoResult = 8 };
+
+	// handed to every job by a long running caller, see PackDaemon
+	// the task is passed down to the packer, the compositor and the encoders, they stop cooperatively
+	struct Context
+	{
+		TaskState* task = nullptr;
+		std::shared_ptr<WarmImageCache> warmImages;
+	};
+
+	// images are added deferred in manifest order, an input of quantity N as N consecutive images sharing one handle
+	// pinned images keep the top left of their pin, the size follows the image
+	static bool configure(JobManifest const& job, BinImageManager& mgr, QString& error)
+	{
+		mgr.clear();
+		mgr.setSpacing(PackSpacing{ job.style.spacing, job.style.bleed, job.style.margin });
+		mgr.setForbiddenRegions(job.forbidden);
+		mgr.createBinPacker(job.algorithm, job.budget);
+		mgr.setResultSize(job.sheet);
+
+		for (auto const& input : job.inputs)
+		{
+			if (!mgr.addImageDeferred(input.path, input.quantity))
+			{
+				error = QString("cannot read %1").arg(input.path);
+				return false;
+			}
+
+			for (int idx = mgr.imageCount() - input.quantity; idx < mgr.imageCount(); ++idx)
+				mgr.images().at(idx)->rotation = input.rotation;
+
+			auto binImage = mgr.images().back();
+			binImage->pinned = input.pinned;
+			if (input.pinned)
+			{
+				const QSize size = binImage->size();
+				binImage->isFlipped = input.flipped;
+				binImage->result = QRect(input.pin.topLeft(), input.flipped ? size.transposed() : size);
+			}
+		}
+		return true;
+	}
+
+	// true if the cached layout was applied, pack() restores it afterwards instead of packing
+	static bool restoreCached(uint64_t key, BinImageManager& mgr)
+	{
+		std::vector<JobCache::Placement> placements;
+		if (!JobCache::loadLayout(key, mgr.imageCount(), placements))
+			return false;
+
+		for (auto& binImage : mgr.images())
+		{
+			auto const& placement = placements.at(binImage->imageIndex);
+			binImage->result = placement.result;
+			binImage->isFlipped = placement.flipped;
+		}
+		mgr.storeLayout();
+		mgr.updateShapes();
+		return true;
+	}
+
+	static bool storeCached(uint64_t key, BinImageManager const& mgr)
+	{
+		std::vector<JobCache::Placement> placements(mgr.imageCount());
+		for (auto const& binImage : mgr.images())
+			placements.at(binImage->imageIndex) = JobCache::Placement{ binImage->result, binImage->isFlipped };
+		const bool retval = JobCache::storeLayout(key, placements);
+		JobCache::prune(key);
+		return retval;
+	}
+
+	template <typename FuncT>
+	static int run(QString manifestPath, FuncT&& logger, Context const& context = Context())
+	{
+		JobManifest job;
+		QString error;
+		if (!JobManifest::load(manifestPath, job, error))
+		{
+			logger(QString("Job manifest error : %1").arg(error));
+			return JobBadManifest;
+		}
+		return run(job, manifestPath, logger, context);
+	}
+
+	// name only labels the log
+	template <typename FuncT>
+	static int run(JobManifest const& job, QString name, FuncT&& logger, Context const& context = Context())
+	{
+		BP_TRACE_SCOPE("job");
+		auto cancelled = [&]()
+		{
+			if (!util::isCancelled(context.task))
+				return false;
+			logger(QString("Job %1 : cancelled").arg(name));
+			return true;
+		};
+
+		//cache entry name of every requested output, by kind and suffix
+		struct Output { QString target; QString name; };
+		std::vector<Output> outputs;
+		if (!job.outputs.image.isEmpty())
+			outputs.push_back({ job.outputs.image, "image." + QFileInfo(job.outputs.image).suffix() });
+		if (!job.outputs.proof.isEmpty())
+			outputs.push_back({ job.outputs.proof, "proof." + QFileInfo(job.outputs.proof).suffix() });
+		if (!job.outputs.pdf.isEmpty())
+			outputs.push_back({ job.outputs.pdf, "cut.pdf" });
+		if (!job.outputs.sheetPdf.isEmpty())
+			outputs.push_back({ job.outputs.sheetPdf, "sheet.pdf" });
+
+		const uint64_t key = job.cacheKey();
+		const bool allCached = key && std::all_of(outputs.begin(), outputs.end(),
+			[key](Output const& output) { return !JobCache::cachedFile(key, output.name).isEmpty(); });
+		if (allCached && !JobCache::cachedFile(key, "layout.json").isEmpty())
+		{
+			//the entry may be pruned by another job meanwhile, the outputs are then made below
+			//a target that cannot be written fails there
+			const bool copied = std::all_of(outputs.begin(), outputs.end(),
+				[key](Output const& output) { return JobCache::copyOut(key, output.name, output.target); });
+			if (copied)
+			{
+				logger(QString("Job %1 : unchanged, outputs copied from the cache").arg(name));
+				return JobDone;
+			}
+			logger(QString("Job %1 : cache entry incomplete, outputs are made again").arg(name));
+		}
+
+		if (cancelled())
+			return JobCancelled;
+
+		BinImageManager mgr;
+		mgr.warmImages = context.warmImages;
+		QString error;
+		if (!configure(job, mgr, error))
+		{
+			logger(QString("Job input error : %1").arg(error));
+			return JobBadInput;
+		}
+
+		if (restoreCached(key, mgr))
+		{
+			logger(QString("Job %1 : layout restored from the cache").arg(name));
+		}
+		else
+		{
+			if (cancelled())
+				return JobCancelled;
+			if (!mgr.pack(logger, context.task))
+				return cancelled() ? JobCancelled : JobPackFailed;
+			storeCached(key, mgr);
+		}
+
+		//outputs missing from the cache are encoded in one concurrent pass
+		std::vector<Output> missing;
+		for (auto const& output : outputs)
+			if (!JobCache::copyOut(key, output.name, output.target))
+				missing.push_back(output);
+		auto isMissing = [&missing](QString target)
+		{
+			return !target.isEmpty() && std::any_of(missing.begin(), missing.end(), [&target](Output const& output) { return output.target == target; });
+		};
+
+		if (!missing.empty())
+		{
+			if (cancelled())
+				return JobCancelled;
+
+			//a TIFF sheet is written band by band from the placements, it is never composited
+			//neither is a JPEG sheet over the memory budget
+			const QString imageSuffix = QFileInfo(job.outputs.image).suffix().toLower();
+			const bool streamJpeg = (imageSuffix == "jpg" || imageSuffix == "jpeg") && !MemoryAccountant::instance().fits(mgr.sheetBytes());
+			const bool streamSheet = TiffWriter::isTiffPath(job.outputs.image) || streamJpeg;
+			if (isMissing(job.outputs.image) && streamSheet)
+			{
+				bool written = false;
+				if (streamJpeg)
+				{
+					logger(QString("Job %1 : over the memory budget, the sheet is streamed").arg(name));
+					written = mgr.saveJpeg(job.outputs.image, job.outputs.quality, job.dpi, VectorRGBX::White(), context.task);
+				}
+				else
+				{
+					TiffWriter::Options options;
+					options.compression = job.outputs.compression;
+					options.dpi = job.dpi;
+					written = mgr.saveTiff(job.outputs.image, options, VectorRGBX::White(), context.task);
+				}
+				if (!written)
+				{
+					if (cancelled())
+						return JobCancelled;
+					logger(QString("Job output error : cannot write %1").arg(job.outputs.image));
+					return JobOutputFailed;
+				}
+			}
+			const bool composeSheet = isMissing(job.outputs.image) && !streamSheet;
+
+			//the proof is downsampled from the sheet when it is composited anyway, decoded at its size otherwise
+			const int proofDPI = std::min(job.outputs.proofDPI, job.dpi);
+			ImageDataRGBXPtr source;
+			int sourceDPI = job.dpi;
+			std::vector<ResultExport::RasterTarget> rasters;
+			if (composeSheet)
+			{
+				source = mgr.makeFinalImage(VectorRGBX::White(), context.task);
+				rasters.push_back({ job.outputs.image, job.outputs.quality, job.dpi });
+				if (isMissing(job.outputs.proof))
+					rasters.push_back({ job.outputs.proof, job.outputs.quality, proofDPI, job.outputs.compression });
+			}
+			else if (isMissing(job.outputs.proof))
+			{
+				source = mgr.makeProofImage(job.dpi, proofDPI, VectorRGBX::White(), context.task);
+				sourceDPI = proofDPI;
+				rasters.push_back({ job.outputs.proof, job.outputs.quality, proofDPI, job.outputs.compression });
+			}
+			if (!rasters.empty() && !source)
+			{
+				if (cancelled())
+					return JobCancelled;
+				logger(QString("Job output error : cannot compose %1").arg(rasters.front().path));
+				return JobOutputFailed;
+			}
+
+			if (isMissing(job.outputs.pdf) || isMissing(job.outputs.sheetPdf))
+				for (auto binImage : mgr.images())
+					binImage->updateKarlsun(job.style.offset, job.style.roundPixel, job.style.color);
+
+			ResultExport::CutTarget cut;
+			if (isMissing(job.outputs.pdf))
+				cut = ResultExport::CutTarget{ job.outputs.pdf, mgr.karlsuns(), job.sheet, job.dpi };
+
+			//placed images, nothing composited
+			if (isMissing(job.outputs.sheetPdf))
+			{
+				const SheetPdfWriter::Options options{ job.dpi, job.style.bleed, mgr.karlsuns() };
+				if (!SheetPdfWriter::save(job.outputs.sheetPdf, mgr.images(), job.sheet, options, context.task))
+				{
+					if (cancelled())
+						return JobCancelled;
+					logger(QString("Job output error : cannot write %1").arg(job.outputs.sheetPdf));
+					return JobOutputFailed;
+				}
+			}
+
+			const QStringList failed = ResultExport::exportAll(source, sourceDPI, rasters, cut, context.task);
+			if (cancelled())
+				return JobCancelled;
+			if (!failed.isEmpty())
+			{
+				logger(QString("Job output error : cannot write %1").arg(failed.join(", ")));
+				return JobOutputFailed;
+			}
+
+			for (auto const& output : missing)
+				JobCache::storeFile(key, output.name, output.target);
+			JobCache::prune(key);
+		}
+
+		logger(QString("Job %1 : %2 images packed").arg(name).arg(mgr.imageCount()));
+		return JobDone;
+	}
+};
@@ -0,0 +1,474 @@
+// JpegEncoder.h
+#pragma once
+
+#include <QBuffer>
+#include <QByteArray>
+#include <QFile>
+#include <QImage>
+#include <QImageWriter>
+#include <QRect>
+#include <QString>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <thread>
+#include <vector>
+#include "ImageObject.h"
+#include "MemoryAccountant.h"
+#include "PixelKernels.h"
+#include "Task.h"
+#include "Trace.h"
+#include "Utils.h"
+
+#ifdef LINK_LIBJPEG_ENABLED
+#include <csetjmp>
+#include <cstdio>
+#include <jpeglib.h>
+#endif
+
+// * header only class
+// baseline JPEG of a 4 byte BGRX image (ImageDataRGBX, QImage::Format_RGB32) encoded in horizontal strips on every core
+// every strip is a complete JPEG with the same tables, its entropy coded data becomes one restart interval of the output
+//		SOI, headers of strip 0 with the full height, DRI (MCUs per strip), SOS, strip 0, RST0, strip 1, RST1, ..., EOI
+// strips are encoded from the rows in place, by libjpeg when linked (LINK_LIBJPEG_ENABLED), by the Qt JPEG plugin otherwise
+// an image too small to split, or strips whose headers differ, are written by QImage::save in one piece
+class JpegEncoder
+{
+public:
+	static bool save(ImageDataRGBX const& image, QString path, int quality, int dpi, TaskState* task = nullptr, int threadCount = 0)
+	{
+		if (image.empty())
+			return false;
+		return save(image.bits(), image.width() * 4, image.width(), image.height(), path, quality, dpi, task, threadCount);
+	}
+
+	static bool save(QImage const& image, QString path, int quality, int dpi, TaskState* task = nullptr, int threadCount = 0)
+	{
+		if (image.format() != QImage::Format_RGB32)
+			return save(image.convertToFormat(QImage::Format_RGB32), path, quality, dpi, task, threadCount);
+		return save(image.constBits(), image.bytesPerLine(), image.width(), image.height(), path, quality, dpi, task, threadCount);
+	}
+
+	static bool save(unsigned char const* bgrx, int stride, int wid, int hi, QString path, int quality, int dpi,
+		TaskState* task = nullptr, int threadCount = 0)
+	{
+		BP_TRACE_SCOPE("JpegEncoder::save");
+		quality = std::clamp(quality < 0 ? 75 : quality, 0, 100);
+		if (threadCount <= 0)
+			threadCount = (int)std::thread::hardware_concurrency();
+		threadCount = std::max(1, threadCount);
+
+		const int stripHi = stripHeight(wid, hi, threadCount, hi);
+		const int stripCount = (hi + stripHi - 1) / stripHi;
+
+		if (stripCount < 2 || wid > 65535 || hi > 65535)
+			return saveWhole(bgrx, stride, wid, hi, path, quality, dpi, task);
+
+		util::beginStage(task, "encoding", stripCount);
+		std::vector<QByteArray> strips(stripCount);
+		std::atomic<bool> suc{ true };
+		util::parallelFor(stripCount, [&](int idx)
+			{
+				if (!suc || util::isCancelled(task))
+				{
+					suc = false;
+					return;
+				}
+				const int y = idx * stripHi;
+				if (!encodeStrip(bgrx + (size_t)y * stride, stride, wid, std::min(stripHi, hi - y), quality, dpi, strips.at(idx)))
+					suc = false;
+				util::advance(task);
+			}, threadCount);
+
+		if (util::isCancelled(task))
+			return false;
+
+		std::vector<Layout> layouts;
+		QByteArray header;
+		if (!suc || !stitchHeader(strips, hi, stripHi, layouts, header))
+			return saveWhole(bgrx, stride, wid, hi, path, quality, dpi, task);
+		return writeStitched(path, header, strips, layouts);
+	}
+
+	// rect of the image written into out, sized as rect. false stops the encoder
+	using StripSource = std::function<bool(QRect const&, ImageDataRGBX&)>;
+	// called with the rows of the next threadCount strips before they are rendered, top to bottom. false stops the encoder
+	using BandHook = std::function<bool(QRect const& band)>;
+
+	// rendered by source a strip at a time and written as the strips are encoded, the image never exists in memory whole
+	// strips are at most StreamStripPixels, threadCount of them in flight
+	// there is no single piece fallback : strips whose headers differ fail. a cancelled task leaves no file
+	static bool save(QString path, QSize size, StripSource const& source, int quality, int dpi, TaskState* task = nullptr,
+		int threadCount = 0, BandHook const& beginBand = nullptr)
+	{
+		BP_TRACE_SCOPE("JpegEncoder::save");
+		const int wid = size.width(), hi = size.height();
+		if (size.isEmpty() || wid > 65535 || hi > 65535)
+			return false;
+
+		quality = std::clamp(quality < 0 ? 75 : quality, 0, 100);
+		if (threadCount <= 0)
+			threadCount = (int)std::thread::hardware_concurrency();
+		threadCount = std::max(1, threadCount);
+
+		const int stripHi = stripHeight(wid, hi, threadCount, StreamStripPixels / wid);
+		const int stripCount = (hi + stripHi - 1) / stripHi;
+
+		CancellableFile file(path, task);
+		if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+			return false;
+
+		util::beginStage(task, "encoding", stripCount);
+		QByteArray firstHeader;
+		std::vector<QByteArray> strips(threadCount);
+		std::vector<Layout> layouts(threadCount);
+		bool suc = true;
+		for (int first = 0; suc && first < stripCount; first += threadCount)
+		{
+			const int count = std::min(threadCount, stripCount - first);
+			const QRect band(0, first * stripHi, wid, std::min(count * stripHi, hi - first * stripHi));
+			if (util::isCancelled(task) || (beginBand && !beginBand(band)))
+			{
+				suc = false;
+				break;
+			}
+
+			std::atomic<bool> bandSuc{ true };
+			util::parallelFor(count, [&](int idx)
+				{
+					if (!bandSuc || util::isCancelled(task))
+					{
+						bandSuc = false;
+						return;
+					}
+					const int y = (first + idx) * stripHi;
+					MemoryAccountant::Scope scope(MemoryAccountant::Temporary);
+					ImageDataRGBX strip(wid, std::min(stripHi, hi - y));
+					if (!source(QRect(0, y, wid, strip.height()), strip)
+						|| !encodeStrip(strip.bits(), wid * 4, wid, strip.height(), quality, dpi, strips.at(idx))
+						|| !parseStrip(strips.at(idx), layouts.at(idx)))
+						bandSuc = false;
+					util::advance(task);
+				}, count);
+			suc = bandSuc;
+
+			for (int idx = 0; suc && idx < count; ++idx)
+			{
+				const int number = first + idx;
+				if (number == 0)
+				{
+					QByteArray header;
+					firstHeader = stripHeader(strips.front(), layouts.front());
+					suc = outputHeader(strips.front(), layouts.front(), hi, stripHi, header) && file.write(header) == header.size();
+				}
+				else
+				{
+					suc = stripHeader(strips.at(idx), layouts.at(idx)) == firstHeader;
+				}
+				suc = suc && writeStrip(file, strips.at(idx), layouts.at(idx), number, number + 1 == stripCount);
+				strips.at(idx) = QByteArray();
+			}
+		}
+		suc = suc && writeEnd(file);
+
+		file.close();
+		if (!suc)
+			QFile::remove(path);
+		return suc;
+	}
+
+protected:
+	static constexpr int StreamStripPixels = 1 << 20;
+
+	// MCUs are at most 16 rows, a restart interval counts at most 65535 MCUs
+	static int stripHeight(int wid, int hi, int threadCount, int maxRows)
+	{
+		const int mcusPerRow = (wid + 15) / 16;
+		int stripHi = (hi + threadCount * 2 - 1) / (threadCount * 2);
+		stripHi = std::max(16, (std::min(stripHi, maxRows) + 15) / 16 * 16);
+		return std::min(stripHi, std::max(1, 65535 / std::max(1, mcusPerRow)) * 16);
+	}
+
+	// marker segments of one strip
+	struct Layout
+	{
+		int sofHeight = -1;	//offset of the height field in SOF0
+		int sos = -1;		//offset of the SOS marker
+		int sosEnd = -1;	//first entropy coded byte
+		int mcuWid = 0, mcuHi = 0;
+	};
+
+	static int be16(QByteArray const& bytes, int offset)
+	{
+		return ((unsigned char)bytes.at(offset) << 8) | (unsigned char)bytes.at(offset + 1);
+	}
+
+	static bool parse(QByteArray const& bytes, Layout& out)
+	{
+		if (bytes.size() < 4 || (unsigned char)bytes.at(0) != 0xFF || (unsigned char)bytes.at(1) != 0xD8)
+			return false;
+
+		for (int pos = 2; pos + 4 <= bytes.size();)
+		{
+			if ((unsigned char)bytes.at(pos) != 0xFF)
+				return false;
+			const int marker = (unsigned char)bytes.at(pos + 1);
+			const int length = be16(bytes, pos + 2);
+			if (pos + 2 + length > bytes.size())
+				return false;
+
+			if (marker == 0xC0)
+			{
+				//precision, height, width, component count, then id, sampling, table per component
+				out.sofHeight = pos + 5;
+				const int components = (unsigned char)bytes.at(pos + 9);
+				int maxH = 1, maxV = 1;
+				for (int idx = 0; idx < components; ++idx)
+				{
+					const int sampling = (unsigned char)bytes.at(pos + 11 + idx * 3);
+					maxH = std::max(maxH, sampling >> 4);
+					maxV = std::max(maxV, sampling & 15);
+				}
+				out.mcuWid = maxH * 8;
+				out.mcuHi = maxV * 8;
+			}
+			else if (marker == 0xC1 || marker == 0xC2 || marker == 0xDD)
+			{
+				//not baseline or already restarted
+				return false;
+			}
+			else if (marker == 0xDA)
+			{
+				out.sos = pos;
+				out.sosEnd = pos + 2 + length;
+				return out.sofHeight > 0;
+			}
+			pos += 2 + length;
+		}
+		return false;
+	}
+
+	// parsed and ending with EOI
+	static bool parseStrip(QByteArray const& bytes, Layout& out)
+	{
+		if (!parse(bytes, out))
+			return false;
+		return (unsigned char)bytes.at(bytes.size() - 2) == 0xFF && (unsigned char)bytes.at(bytes.size() - 1) == 0xD9;
+	}
+
+	// headers with the height cleared, equal for strips that can be joined
+	static QByteArray stripHeader(QByteArray bytes, Layout const& layout)
+	{
+		bytes.truncate(layout.sosEnd);
+		bytes[layout.sofHeight] = 0;
+		bytes[layout.sofHeight + 1] = 0;
+		return bytes;
+	}
+
+	// headers of the output up to the first entropy coded byte, taken from the first strip
+	static bool outputHeader(QByteArray const& strip, Layout const& layout, int hi, int stripHi, QByteArray& out)
+	{
+		if (stripHi % layout.mcuHi != 0)
+			return false;
+
+		const int wid = be16(strip, layout.sofHeight + 2);
+		const int interval = (wid + layout.mcuWid - 1) / layout.mcuWid * (stripHi / layout.mcuHi);
+		if (interval <= 0 || interval > 65535)
+			return false;
+
+		out = strip.left(layout.sos);
+		out[layout.sofHeight] = (char)(hi >> 8);
+		out[layout.sofHeight + 1] = (char)(hi & 0xFF);
+		const char dri[] = { (char)0xFF, (char)0xDD, 0, 4, (char)(interval >> 8), (char)(interval & 0xFF) };
+		out.append(dri, sizeof(dri));
+		out.append(strip.mid(layout.sos, layout.sosEnd - layout.sos));
+		return true;
+	}
+
+	// headers of the output up to the first entropy coded byte, false if the strips cannot be joined
+	static bool stitchHeader(std::vector<QByteArray> const& strips, int hi, int stripHi, std::vector<Layout>& layouts, QByteArray& out)
+	{
+		layouts.assign(strips.size(), Layout());
+		for (size_t idx = 0; idx < strips.size(); ++idx)
+			if (!parseStrip(strips[idx], layouts[idx]))
+				return false;
+
+		//same tables and geometry everywhere but the height
+		const QByteArray firstHeader = stripHeader(strips.front(), layouts.front());
+		for (size_t idx = 1; idx < strips.size(); ++idx)
+			if (stripHeader(strips[idx], layouts[idx]) != firstHeader)
+				return false;
+
+		return outputHeader(strips.front(), layouts.front(), hi, stripHi, out);
+	}
+
+	// entropy coded data of strip number, then its restart marker unless it is the last one
+	static bool writeStrip(QFile& file, QByteArray const& bytes, Layout const& layout, int number, bool last)
+	{
+		const int begin = layout.sosEnd;
+		const qint64 length = bytes.size() - begin - 2;
+		if (file.write(bytes.constData() + begin, length) != length)
+			return false;
+		if (last)
+			return true;
+		const char rst[] = { (char)0xFF, (char)(0xD0 + (number & 7)) };
+		return file.write(rst, sizeof(rst)) == (qint64)sizeof(rst);
+	}
+
+	static bool writeEnd(QFile& file)
+	{
+		const char eoi[] = { (char)0xFF, (char)0xD9 };
+		return file.write(eoi, sizeof(eoi)) == (qint64)sizeof(eoi);
+	}
+
+	// strips are streamed to the file, the output is never held in one piece
+	static bool writeStitched(QString path, QByteArray const& header, std::vector<QByteArray>& strips, std::vector<Layout> const& layouts)
+	{
+		QFile file(path);
+		if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+			return false;
+
+		bool suc = file.write(header) == header.size();
+		for (size_t idx = 0; suc && idx < strips.size(); ++idx)
+		{
+			suc = writeStrip(file, strips[idx], layouts[idx], (int)idx, idx + 1 == strips.size());
+			strips[idx] = QByteArray();
+		}
+		suc = suc && writeEnd(file);
+
+		file.close();
+		if (!suc)
+			QFile::remove(path);
+		return suc;
+	}
+
+	static bool saveWhole(unsigned char const* bgrx, int stride, int wid, int hi, QString path, int quality, int dpi, TaskState* task)
+	{
+		//writable wrapper, setting the resolution does not copy the pixels
+		QImage image(const_cast<unsigned char*>(bgrx), wid, hi, stride, QImage::Format_RGB32);
+		const int dpm = (int)(dpi / 0.0254);
+		image.setDotsPerMeterX(dpm);
+		image.setDotsPerMeterY(dpm);
+		return ImageObject::writeImage(image, path, quality, task);
+	}
+
+#ifdef LINK_LIBJPEG_ENABLED
+	// libjpeg reports errors through error_exit, which must not return
+	struct ErrorManager
+	{
+		jpeg_error_mgr pub;
+		jmp_buf jump;
+	};
+
+	static void onError(j_common_ptr cinfo)
+	{
+		longjmp(reinterpret_cast<ErrorManager*>(cinfo->err)->jump, 1);
+	}
+
+	// compressed into a QByteArray, grown by doubling
+	struct Destination
+	{
+		jpeg_destination_mgr pub;
+		QByteArray* out;
+	};
+
+	static void initDestination(j_compress_ptr cinfo)
+	{
+		auto dest = reinterpret_cast<Destination*>(cinfo->dest);
+		dest->out->resize(1 << 16);
+		dest->pub.next_output_byte = reinterpret_cast<JOCTET*>(dest->out->data());
+		dest->pub.free_in_buffer = (size_t)dest->out->size();
+	}
+
+	static boolean emptyOutput(j_compress_ptr cinfo)
+	{
+		auto dest = reinterpret_cast<Destination*>(cinfo->dest);
+		const int used = dest->out->size();
+		dest->out->resize(used * 2);
+		dest->pub.next_output_byte = reinterpret_cast<JOCTET*>(dest->out->data()) + used;
+		dest->pub.free_in_buffer = (size_t)used;
+		return TRUE;
+	}
+
+	static void termDestination(j_compress_ptr cinfo)
+	{
+		auto dest = reinterpret_cast<Destination*>(cinfo->dest);
+		dest->out->resize(dest->out->size() - (int)dest->pub.free_in_buffer);
+	}
+
+	static bool encodeStrip(unsigned char const* bgrx, int stride, int wid, int hi, int quality, int dpi, QByteArray& out)
+	{
+		BP_TRACE_SCOPE("encodeStrip");
+		jpeg_compress_struct cinfo;
+		ErrorManager error;
+		Destination dest;
+		std::vector<unsigned char> rgb; //declared before setjmp, the jump does not skip its destructor
+
+		cinfo.err = jpeg_std_error(&error.pub);
+		error.pub.error_exit = onError;
+		if (setjmp(error.jump))
+		{
+			jpeg_destroy_compress(&cinfo);
+			return false;
+		}
+
+		jpeg_create_compress(&cinfo);
+		dest.pub.init_destination = initDestination;
+		dest.pub.empty_output_buffer = emptyOutput;
+		dest.pub.term_destination = termDestination;
+		dest.out = &out;
+		cinfo.dest = &dest.pub;
+
+		cinfo.image_width = (JDIMENSION)wid;
+		cinfo.image_height = (JDIMENSION)hi;
+#ifdef JCS_EXTENSIONS
+		cinfo.input_components = 4;
+		cinfo.in_color_space = JCS_EXT_BGRX;
+#else
+		cinfo.input_components = 3;
+		cinfo.in_color_space = JCS_RGB;
+		rgb.resize((size_t)wid * 3);
+#endif
+		jpeg_set_defaults(&cinfo);
+		jpeg_set_quality(&cinfo, quality, TRUE);
+		//the standard Huffman tables, every strip has to share them
+		cinfo.optimize_coding = FALSE;
+		cinfo.density_unit = 1;
+		cinfo.X_density = (UINT16)std::clamp(dpi, 1, 65535);
+		cinfo.Y_density = (UINT16)std::clamp(dpi, 1, 65535);
+
+		jpeg_start_compress(&cinfo, TRUE);
+		while (cinfo.next_scanline < cinfo.image_height)
+		{
+			unsigned char const* src = bgrx + (size_t)cinfo.next_scanline * stride;
+#ifdef JCS_EXTENSIONS
+			JSAMPROW row = const_cast<JSAMPROW>(src);
+#else
+			kernel::bgrxToRgb(src, rgb.data(), wid);
+			JSAMPROW row = rgb.data();
+#endif
+			jpeg_write_scanlines(&cinfo, &row, 1);
+		}
+		jpeg_finish_compress(&cinfo);
+		jpeg_destroy_compress(&cinfo);
+		return true;
+	}
+#else
+	// the rows are wrapped, not copied
+	static bool encodeStrip(unsigned char const* bgrx, int stride, int wid, int hi, int quality, int dpi, QByteArray& out)
+	{
+		BP_TRACE_SCOPE("encodeStrip");
+		QImage strip(const_cast<unsigned char*>(bgrx), wid, hi, stride, QImage::Format_RGB32);
+		const int dpm = (int)(dpi / 0.0254);
+		strip.setDotsPerMeterX(dpm);
+		strip.setDotsPerMeterY(dpm);
+
+		QBuffer buffer(&out);
+		if (!buffer.open(QIODevice::WriteOnly))
+			return false;
+		QImageWriter writer(&buffer, "jpg");
+		writer.setQuality(quality);
+		return writer.write(strip);
+	}
+#endif
+};
@@ -2,6 +2,8 @@
 
 #include <QRect>
 #include <QColor>
+#include <QPolygon>
+#include <vector>
 
 struct KarlsunStyle
 {
@@ -18,12 +20,28 @@ struct KarlsunStyle
 	int roundPixel = 0;
 	QColor color = Qt::red;
 
+	//packing constraints, applied by the packer when images are placed
+	int spacing = 0;	// gap between neighboring images (outside of their bleeds)
+	int bleed = 0;		// band around every image, filled with its edge pixels
+	int margin = 0;		// empty border of the sheet
+
 	bool operator==(KarlsunStyle const& rhs) const
 	{
 		return
 			(offset == rhs.offset) &&
 			(roundPixel == rhs.roundPixel) &&
-			(color == rhs.color)
+			(color == rhs.color) &&
+			samePacking(rhs)
+			;
+	}
+
+	// false if a style change needs a repack
+	bool samePacking(KarlsunStyle const& rhs) const
+	{
+		return
+			(spacing == rhs.spacing) &&
+			(bleed == rhs.bleed) &&
+			(margin == rhs.margin)
 			;
 	}
 
@@ -37,6 +55,7 @@ struct Karlsun
 {
 	//accessable variables
 	QRect rect;
+	std::vector<QPolygon> outline; //closed cut paths of a nested shape, rect is cut if empty
 	KarlsunStyle style;
 	int imageIndex = -1;
 
@@ -49,6 +68,7 @@ struct Karlsun
 	{
 		return
 			(rect == rhs.rect) &&
+			(outline == rhs.outline) &&
 			style == rhs.style
 			;
 	}
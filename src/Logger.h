@@ -2,25 +2,220 @@
 
 #include <QtGlobal>
 #include <QString>
+#include <QStringList>
 #include <QByteArray>
+#include <QDateTime>
+#include <QFile>
 #include <QMainWindow>
-#include <QTextEdit>
+#include <QPlainTextEdit>
 #include <QKeyEvent>
+#include <QThread>
+#include <QTimer>
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <deque>
+#include <mutex>
+#include <vector>
 
-static QTextEdit* g_logEdit = 0;
+// * header only class
+// process wide log, written by Binpacklog (qInstallMessageHandler) from any thread
+//		every record keeps its level, time, thread and source location
+//		the last capacity records stay in a ring, older ones only reach the file sink
+//		a writer takes the ring lock for a push, the widget is never touched : LogWindow pulls the new records in batches
+class LogBuffer
+{
+public:
+	enum Level { Debug = 0, Info, Warning, Critical, Fatal };
+	static constexpr int DefaultCapacity = 10000;
+
+	struct Record
+	{
+		qint64 sequence = 0;
+		qint64 msecs = 0; //since epoch
+		Level level = Debug;
+		quint64 thread = 0;
+		QString message;
+		QString location; //file:line, function
+
+		QString toString() const
+		{
+			QString retval = QString("%1 [%2] <%3> %4")
+				.arg(QDateTime::fromMSecsSinceEpoch(msecs).toString("hh:mm:ss.zzz"))
+				.arg(levelName(level))
+				.arg(thread, 0, 16)
+				.arg(message);
+			if (!location.isEmpty())
+				retval += QString(" (%1)").arg(location);
+			return retval;
+		}
+	};
+
+	static LogBuffer& instance()
+	{
+		static LogBuffer buffer;
+		return buffer;
+	}
+
+	static QString levelName(Level level)
+	{
+		switch (level)
+		{
+		case Debug: return "Debug";
+		case Info: return "Info";
+		case Warning: return "Warning";
+		case Critical: return "Critical";
+		default: return "Fatal";
+		}
+	}
 
+	static Level fromQt(QtMsgType type)
+	{
+		switch (type)
+		{
+		case QtDebugMsg: return Debug;
+		case QtInfoMsg: return Info;
+		case QtWarningMsg: return Warning;
+		case QtCriticalMsg: return Critical;
+		default: return Fatal;
+		}
+	}
+
+	void write(Level level, QString message, QString location = QString())
+	{
+		Record record;
+		record.msecs = QDateTime::currentMSecsSinceEpoch();
+		record.level = level;
+		record.thread = (quint64)(quintptr)QThread::currentThreadId();
+		record.message = message;
+		record.location = location;
+		{
+			std::lock_guard<std::mutex> lock(ringMutex);
+			record.sequence = ++lastSequence;
+			ring.push_back(record);
+			while ((int)ring.size() > capacity)
+				ring.pop_front();
+		}
+
+		if (!fileEnabled && !console)
+			return;
+
+		//formatted outside the ring lock
+		const QByteArray line = (record.toString() + "\n").toUtf8();
+		std::lock_guard<std::mutex> lock(sinkMutex);
+		if (fileEnabled)
+		{
+			file.write(line);
+			if (level >= Warning)
+				file.flush();
+		}
+		if (console)
+			fputs(line.constData(), stderr);
+	}
+
+	// records written after sequence, oldest first. missed counts those already pushed out of the ring
+	std::vector<Record> since(qint64 sequence, qint64* missed = nullptr) const
+	{
+		std::lock_guard<std::mutex> lock(ringMutex);
+		const qint64 first = ring.empty() ? lastSequence + 1 : ring.front().sequence;
+		if (missed)
+			*missed = std::max<qint64>(0, first - sequence - 1);
+
+		std::vector<Record> retval;
+		for (auto it = ring.begin() + (size_t)std::max<qint64>(0, sequence + 1 - first); it < ring.end(); ++it)
+			retval.push_back(*it);
+		return retval;
+	}
+
+	void setCapacity(int count)
+	{
+		std::lock_guard<std::mutex> lock(ringMutex);
+		capacity = std::max(1, count);
+		while ((int)ring.size() > capacity)
+			ring.pop_front();
+	}
+
+	// every record is also appended to path, warnings and worse are flushed at once
+	bool openFile(QString path)
+	{
+		std::lock_guard<std::mutex> lock(sinkMutex);
+		if (file.isOpen())
+			file.close();
+		file.setFileName(path);
+		fileEnabled = file.open(QIODevice::WriteOnly | QIODevice::Append);
+		return fileEnabled;
+	}
+
+	// records also printed to stderr, for the headless modes
+	void setConsole(bool enabled)
+	{
+		std::lock_guard<std::mutex> lock(sinkMutex);
+		console = enabled;
+	}
+
+	void flush()
+	{
+		std::lock_guard<std::mutex> lock(sinkMutex);
+		if (fileEnabled)
+			file.flush();
+		fflush(stderr);
+	}
+
+protected:
+	LogBuffer() = default;
+
+	mutable std::mutex ringMutex;
+	std::deque<Record> ring;
+	qint64 lastSequence = 0;
+	int capacity = DefaultCapacity;
+
+	std::mutex sinkMutex;
+	QFile file;
+	std::atomic<bool> fileEnabled{ false };
+	std::atomic<bool> console{ false };
+};
+
+// dev mode log window, appends the records written since its last batch every BatchMs
 class LogWindow : public QMainWindow
 {
 public:
-	LogWindow(QTextEdit* logger, QMainWindow* parent = 0) : QMainWindow(parent)
+	static constexpr int BatchMs = 100;
+
+	LogWindow(QMainWindow* parent = 0) : QMainWindow(parent)
 	{
-		this->setCentralWidget(logger);
+		view = new QPlainTextEdit(this);
+		view->setReadOnly(true);
+		view->setMaximumBlockCount(LogBuffer::DefaultCapacity);
+		this->setCentralWidget(view);
+
+		auto* timer = new QTimer(this);
+		connect(timer, &QTimer::timeout, [this]() { appendBatch(); });
+		timer->start(BatchMs);
+		appendBatch();
 	}
 	QSize sizeHint() const override
 	{
 		return QSize(1600, 400);
 	}
 
+	void appendBatch()
+	{
+		qint64 missed = 0;
+		const auto records = LogBuffer::instance().since(shownSequence, &missed);
+		if (records.empty())
+			return;
+
+		QStringList lines;
+		if (missed > 0)
+			lines << QString("... %1 records dropped").arg(missed);
+		for (auto const& record : records)
+			lines << record.toString();
+		shownSequence = records.back().sequence;
+
+		//one append per batch, the document is not laid out again for every record
+		view->appendPlainText(lines.join("\n"));
+	}
+
 protected:
 	void keyPressEvent(QKeyEvent* event) override
 	{
@@ -30,47 +225,21 @@ protected:
 			close();
 		}
 	}
+
+	QPlainTextEdit* view = 0;
+	qint64 shownSequence = 0;
 };
 
+// qInstallMessageHandler target, thread safe
+// Qt aborts once a fatal message returns from here, the file sink is flushed first
 static
 void Binpacklog(QtMsgType type, const QMessageLogContext& context, const QString& msg)
 {
-	static QString message;
-
-	QByteArray localMsg = msg.toLocal8Bit();
-	QString typeStr;
-
-	bool abort = false;
-
-	switch (type) {
-	case QtDebugMsg:
-		typeStr = "[Debug] ";
-		break;
-	case QtInfoMsg:
-		typeStr = "[Info] ";
-		break;
-	case QtWarningMsg:
-		typeStr = "[Warning] ";
-		break;
-	case QtCriticalMsg:
-		typeStr = "[Critical] ";
-		break;
-	case QtFatalMsg:
-		typeStr = "[Fatal] ";
-	default:
-		typeStr = "[Fatal(default)] ";
-		abort = true;
-		break;
-	}
+	QString location;
+	if (context.file)
+		location = QString("%1:%2, %3").arg(context.file).arg(context.line).arg(context.function);
 
-	message += QString("%1: %2 (%3:%4, %5)\n").arg(typeStr).arg(msg).arg(context.file).arg(context.line).arg(context.function);
-	
-	//do something with log
-	if (!g_logEdit)
-		g_logEdit = new QTextEdit;
-	g_logEdit->setText(message);
-	g_logEdit->moveCursor(QTextCursor::MoveOperation::End);
-	
-	if (abort)
-		throw;
+	LogBuffer::instance().write(LogBuffer::fromQt(type), msg, location);
+	if (type == QtFatalMsg)
+		LogBuffer::instance().flush();
 }
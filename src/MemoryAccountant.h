@@ -0,0 +1,101 @@
+#pragma once
+
+#include <QString>
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+
+// * header only class
+// process wide count of the pixel memory held, by category
+//		ImageData buffers count themselves in the category of the thread that allocated them (see Scope)
+//		QImage copies are added and released by their owner (ImageCanvas)
+// a budget (0 : none) does not refuse allocations, owners check it and degrade instead
+//		ImageCanvas keeps previews instead of full resolution copies
+//		ImageHandle evicts the least recently used pixels, BinImageManager releases the decoded images (spillDecoded) and streams the sheet exports
+class MemoryAccountant
+{
+public:
+	enum Category { Images = 0, Canvas, Sheet, Temporary, CategoryCount };
+
+	static MemoryAccountant& instance()
+	{
+		static MemoryAccountant accountant;
+		return accountant;
+	}
+
+	static QString categoryName(Category category)
+	{
+		switch (category)
+		{
+		case Images: return "Images";
+		case Canvas: return "Canvas";
+		case Sheet: return "Sheet";
+		default: return "Temporary";
+		}
+	}
+
+	// allocations of the calling thread are counted in category while alive
+	class Scope
+	{
+	public:
+		explicit Scope(Category category) : previous(current())
+		{
+			current() = category;
+		}
+		~Scope()
+		{
+			current() = previous;
+		}
+
+		Scope(Scope const&) = delete;
+		Scope& operator=(Scope const&) = delete;
+
+	protected:
+		const Category previous;
+	};
+
+	static Category& current()
+	{
+		thread_local Category category = Images;
+		return category;
+	}
+
+	void add(Category category, int64_t bytes)
+	{
+		counters[category] += bytes;
+		const int64_t now = totalBytes += bytes;
+		for (int64_t seen = peakBytes; now > seen && !peakBytes.compare_exchange_weak(seen, now);)
+			;
+	}
+
+	void release(Category category, int64_t bytes)
+	{
+		counters[category] -= bytes;
+		totalBytes -= bytes;
+	}
+
+	int64_t bytes(Category category) const { return counters[category]; }
+	int64_t total() const { return totalBytes; }
+	int64_t peak() const { return peakBytes; }
+
+	void setBudget(int64_t bytes) { budgetBytes = std::max<int64_t>(0, bytes); }
+	int64_t budget() const { return budgetBytes; }
+
+	// extra more bytes stay within the budget
+	bool fits(int64_t extra) const
+	{
+		const int64_t limit = budgetBytes;
+		return limit <= 0 || totalBytes + extra <= limit;
+	}
+
+	bool isOverBudget() const { return !fits(0); }
+
+protected:
+	MemoryAccountant() = default;
+
+	std::array<std::atomic<int64_t>, CategoryCount> counters{};
+	std::atomic<int64_t> totalBytes{ 0 };
+	std::atomic<int64_t> peakBytes{ 0 };
+	std::atomic<int64_t> budgetBytes{ 0 };
+};
@@ -0,0 +1,401 @@
+// PackDaemon.h
+#pragma once
+
+#include <QCoreApplication>
+#include <QDateTime>
+#include <QDir>
+#include <QFile>
+#include <QFileInfo>
+#include <QFileSystemWatcher>
+#include <QJsonArray>
+#include <QJsonDocument>
+#include <QJsonObject>
+#include <QLockFile>
+#include <QStringList>
+#include <QTimer>
+#include <chrono>
+#include <condition_variable>
+#include <exception>
+#include <functional>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <thread>
+#include <vector>
+#include "JobManifest.h"
+#include "JobRunner.h"
+#include "Task.h"
+#include "WarmImageCache.h"
+
+// * header only class
+// long running packing service (--daemon <spool>), jobs are JobManifests dropped into a spool directory
+//		<spool>/incoming/<job>.json : submitted manifest, picked up by a directory watcher
+//		<spool>/incoming/<job>.cancel : cancels a queued job, or stops a running one cooperatively. kept until the job is seen
+//		<spool>/incoming/daemon.stop : running jobs finish, queued ones stay for the next start
+//		<spool>/done|failed/<job>.json, <job>.result.json : the manifest and { "exitCode", "log" } once finished
+//		<spool>/daemon.lock : held while a daemon runs on the spool, one daemon per spool
+// jobs run on a fixed number of workers, higher JobManifest::priority first, then in arrival order
+// decoded images stay in a WarmImageCache shared by every job
+// submit(), cancel() and waitResult() are the client side, see --submit in main.cpp
+class PackDaemon
+{
+public:
+	struct Options
+	{
+		QString spool;
+		int workerCount = 0; //0 : half the hardware threads, the packers are parallel themselves
+		qint64 warmBytes = 1024ll << 20;
+	};
+
+	// a client gives up when no daemon held the spool for this long, a daemon being restarted is not given up on
+	static constexpr int DaemonGraceSeconds = 10;
+
+	PackDaemon(Options const& options, std::function<void(QString)> logger)
+		: options(options), logger(logger), warmImages(std::make_shared<WarmImageCache>(options.warmBytes))
+	{
+	}
+
+	~PackDaemon()
+	{
+		stop();
+	}
+
+	static QString incomingDir(QString spool) { return QDir(spool).filePath("incoming"); }
+	static QString doneDir(QString spool) { return QDir(spool).filePath("done"); }
+	static QString failedDir(QString spool) { return QDir(spool).filePath("failed"); }
+	static QString lockPath(QString spool) { return QDir(spool).filePath("daemon.lock"); }
+
+	bool start(QString& error)
+	{
+		for (auto dir : { incomingDir(options.spool), doneDir(options.spool), failedDir(options.spool) })
+		{
+			if (!QDir().mkpath(dir))
+			{
+				error = QString("cannot create %1").arg(dir);
+				return false;
+			}
+		}
+
+		runningLock = std::make_unique<QLockFile>(lockPath(options.spool));
+		runningLock->setStaleLockTime(0);
+		if (!runningLock->tryLock(1000))
+		{
+			runningLock.reset();
+			error = QString("another daemon is running on %1").arg(options.spool);
+			return false;
+		}
+
+		int workerCount = options.workerCount;
+		if (workerCount <= 0)
+			workerCount = std::max(1, (int)std::thread::hardware_concurrency() / 2);
+		for (int idx = 0; idx < workerCount; ++idx)
+			workers.emplace_back([this]() { work(); });
+
+		//the timer catches events a network share does not report
+		watcher.addPath(incomingDir(options.spool));
+		QObject::connect(&watcher, &QFileSystemWatcher::directoryChanged, [this](QString const&) { scan(); });
+		QObject::connect(&rescanTimer, &QTimer::timeout, [this]() { scan(); });
+		rescanTimer.start(2000);
+
+		logger(QString("Pack daemon : watching %1 with %2 workers").arg(incomingDir(options.spool)).arg(workerCount));
+		scan();
+		return true;
+	}
+
+	// waits for the running jobs, queued ones are left in the spool
+	void stop()
+	{
+		rescanTimer.stop();
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		wakeup.notify_all();
+		for (auto& worker : workers)
+			worker.join();
+		workers.clear();
+	}
+
+#pragma region Client
+	// copies the manifest into the spool with its paths rebased, the job name is returned in name
+	static bool submit(QString spool, QString manifestPath, int priority, QString& name, QString& error)
+	{
+		JobManifest job;
+		if (!JobManifest::load(manifestPath, job, error))
+			return false;
+		job.priority = priority;
+
+		const QDir incoming(incomingDir(spool));
+		if (!QDir().mkpath(incoming.path()))
+		{
+			error = QString("cannot create %1").arg(incoming.path());
+			return false;
+		}
+
+		const QString base = QFileInfo(manifestPath).completeBaseName();
+		const qint64 stamp = QDateTime::currentMSecsSinceEpoch();
+		for (int idx = 0; name.isEmpty() || QFile::exists(incoming.filePath(name + ".json")); ++idx)
+			name = QString("%1-%2-%3").arg(base).arg(stamp).arg(idx);
+
+		//the watcher must not see a half written manifest
+		const QString target = incoming.filePath(name + ".json");
+		if (!job.save(target + ".part") || !QFile::rename(target + ".part", target))
+		{
+			QFile::remove(target + ".part");
+			error = QString("cannot write %1").arg(target);
+			return false;
+		}
+		return true;
+	}
+
+	static bool cancel(QString spool, QString name)
+	{
+		QFile file(QDir(incomingDir(spool)).filePath(name + ".cancel"));
+		return file.open(QIODevice::WriteOnly);
+	}
+
+	static bool requestStop(QString spool)
+	{
+		QFile file(QDir(incomingDir(spool)).filePath("daemon.stop"));
+		return file.open(QIODevice::WriteOnly);
+	}
+
+	// a lock left by a crashed daemon does not count
+	static bool isRunning(QString spool)
+	{
+		QLockFile lock(lockPath(spool));
+		lock.setStaleLockTime(0);
+		if (!lock.tryLock(0))
+			return true;
+		lock.unlock();
+		return false;
+	}
+
+	// polls until the job is finished, returns its JobRunner::ExitCode
+	// JobNoResult once timeoutSeconds (> 0) passed, no daemon ran for DaemonGraceSeconds or the manifest left incoming without a result
+	template <typename FuncT>
+	static int waitResult(QString spool, QString name, FuncT&& logger, int timeoutSeconds = 0)
+	{
+		auto readResult = [&](int& exitCode)
+		{
+			for (auto dir : { doneDir(spool), failedDir(spool) })
+			{
+				QFile file(QDir(dir).filePath(name + ".result.json"));
+				if (!file.open(QIODevice::ReadOnly))
+					continue;
+
+				const QJsonObject result = QJsonDocument::fromJson(file.readAll()).object();
+				for (auto const& line : result["log"].toArray())
+					logger(line.toString());
+				exitCode = result["exitCode"].toInt(JobRunner::JobBadManifest);
+				return true;
+			}
+			return false;
+		};
+
+		const auto started = std::chrono::steady_clock::now();
+		auto daemonSeen = started;
+		for (int exitCode;;)
+		{
+			if (readResult(exitCode))
+				return exitCode;
+
+			//the result is written before the manifest is moved, one more look once it is gone
+			if (!QFile::exists(QDir(incomingDir(spool)).filePath(name + ".json")))
+			{
+				if (readResult(exitCode))
+					return exitCode;
+				logger(QString("Job %1 : removed from the spool without a result").arg(name));
+				return JobRunner::JobNoResult;
+			}
+
+			const auto now = std::chrono::steady_clock::now();
+			if (timeoutSeconds > 0 && now - started >= std::chrono::seconds(timeoutSeconds))
+			{
+				logger(QString("Job %1 : no result after %2 s").arg(name).arg(timeoutSeconds));
+				return JobRunner::JobNoResult;
+			}
+			if (isRunning(spool))
+				daemonSeen = now;
+			else if (now - daemonSeen >= std::chrono::seconds(DaemonGraceSeconds))
+			{
+				logger(QString("Job %1 : no daemon is running on %2").arg(name).arg(spool));
+				return JobRunner::JobNoResult;
+			}
+			std::this_thread::sleep_for(std::chrono::milliseconds(200));
+		}
+	}
+#pragma endregion
+
+protected:
+	struct QueuedJob
+	{
+		QString name;
+		int priority = 0;
+		uint64_t order = 0;
+
+		bool operator<(QueuedJob const& rhs) const
+		{
+			if (priority != rhs.priority)
+				return priority < rhs.priority;
+			return order > rhs.order;
+		}
+	};
+
+	// main thread only
+	void scan()
+	{
+		QDir incoming(incomingDir(options.spool));
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			if (stopping)
+				return;
+
+			for (auto const& info : incoming.entryInfoList({ "*.json" }, QDir::Files, QDir::Time | QDir::Reversed))
+			{
+				const QString name = info.completeBaseName();
+				if (tasks.count(name))
+					continue;
+
+				//an unreadable manifest is queued as well, the worker reports it
+				JobManifest job;
+				QString error;
+				JobManifest::load(info.filePath(), job, error);
+
+				tasks[name] = std::make_shared<TaskState>();
+				queue.push(QueuedJob{ name, job.priority, nextOrder++ });
+			}
+
+			//a cancel may arrive before its manifest, it waits for the job. one for a finished job is dropped
+			for (auto const& info : incoming.entryInfoList({ "*.cancel" }, QDir::Files))
+			{
+				const QString name = info.completeBaseName();
+				auto found = tasks.find(name);
+				if (found != tasks.end())
+					found->second->cancel();
+				else if (!isFinished(name))
+					continue;
+				QFile::remove(info.filePath());
+			}
+		}
+		wakeup.notify_all();
+
+		if (QFile::exists(incoming.filePath("daemon.stop")))
+		{
+			QFile::remove(incoming.filePath("daemon.stop"));
+			logger("Pack daemon : stop requested");
+			QCoreApplication::quit();
+		}
+	}
+
+	// its manifest was moved to done or failed
+	bool isFinished(QString name) const
+	{
+		return QFile::exists(QDir(doneDir(options.spool)).filePath(name + ".json"))
+			|| QFile::exists(QDir(failedDir(options.spool)).filePath(name + ".json"));
+	}
+
+	void work()
+	{
+		for (;;)
+		{
+			QueuedJob queued;
+			TaskStatePtr task;
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				wakeup.wait(lock, [this]() { return stopping || !queue.empty(); });
+				if (stopping)
+					return;
+				queued = queue.top();
+				queue.pop();
+				task = tasks.at(queued.name);
+			}
+
+			runJob(queued.name, task);
+
+			std::lock_guard<std::mutex> lock(mutex);
+			tasks.erase(queued.name);
+		}
+	}
+
+	void runJob(QString name, TaskStatePtr task)
+	{
+		const QString manifestPath = QDir(incomingDir(options.spool)).filePath(name + ".json");
+
+		//the packers may log from their own threads
+		std::mutex logMutex;
+		QStringList lines;
+		auto jobLogger = [&](QString msg)
+		{
+			{
+				std::lock_guard<std::mutex> lock(logMutex);
+				lines << msg;
+			}
+			logger(QString("[%1] %2").arg(name).arg(msg));
+		};
+
+		//a job that throws, e.g. bad_alloc composing a huge sheet, fails alone. the daemon and the queue go on
+		int exitCode = JobRunner::JobCancelled;
+		if (task->isCancelled())
+		{
+			jobLogger(QString("Job %1 : cancelled").arg(name));
+		}
+		else
+		{
+			try
+			{
+				exitCode = JobRunner::run(manifestPath, jobLogger, JobRunner::Context{ task.get(), warmImages });
+			}
+			catch (std::exception const& e)
+			{
+				jobLogger(QString("Job %1 : aborted, %2").arg(name).arg(e.what()));
+				exitCode = JobRunner::JobAborted;
+			}
+			catch (...)
+			{
+				jobLogger(QString("Job %1 : aborted").arg(name));
+				exitCode = JobRunner::JobAborted;
+			}
+		}
+
+		const QDir target(exitCode == JobRunner::JobDone ? doneDir(options.spool) : failedDir(options.spool));
+		const QByteArray bytes = QJsonDocument(QJsonObject{ { "exitCode", exitCode }, { "log", QJsonArray::fromStringList(lines) } })
+			.toJson(QJsonDocument::Indented);
+		const QString resultPath = target.filePath(name + ".result.json");
+		{
+			QFile file(resultPath + ".part");
+			if (file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+				file.write(bytes);
+		}
+		QFile::remove(resultPath);
+		QFile::rename(resultPath + ".part", resultPath);
+
+		//moved before the name is released, the next scan must not queue it again
+		QFile::remove(target.filePath(name + ".json"));
+		if (!QFile::rename(manifestPath, target.filePath(name + ".json")))
+			QFile::remove(manifestPath);
+
+		//a cancel that arrived while it ran has nothing left to cancel
+		QFile::remove(QDir(incomingDir(options.spool)).filePath(name + ".cancel"));
+
+		logger(QString("Pack daemon : %1 finished with %2, warm images %3").arg(name).arg(exitCode).arg(warmImages->stats()));
+	}
+
+	Options options;
+	std::function<void(QString)> logger;
+	std::shared_ptr<WarmImageCache> warmImages;
+
+	std::unique_ptr<QLockFile> runningLock;
+	QFileSystemWatcher watcher;
+	QTimer rescanTimer;
+
+	std::mutex mutex;
+	std::condition_variable wakeup;
+	bool stopping = false;
+	std::priority_queue<QueuedJob> queue;
+	std::map<QString, TaskStatePtr> tasks; //queued and running jobs by name
+	uint64_t nextOrder = 0;
+	std::vector<std::thread> workers;
+};
@@ -0,0 +1,869 @@
+// PixelKernels.h
+#pragma once
+
+// * header only, Qt free
+// raw buffer kernels used by ImageData
+//		packed RGB (3 bytes) <-> BGRX (4 bytes, same memory order as QImage::Format_RGB32)
+//		packed RGB <-> planar RGB
+//		grayscale from RGB / BGRX / planar (Q8 fixed point)
+//		saturating add, subtract, scale and divide over whole byte buffers
+//		blocked 90 degree rotation (SSE2 4x4 transpose for 4-byte pixels)
+//
+// SIMD paths are compiled regardless of compiler flags and selected at runtime from cpuid,
+// env BINPACK_SIMD=none|sse2|ssse3|avx2 caps the selected level (for comparing outputs)
+
+#include <cstdint>
+#include <cstring>
+#include <cstdlib>
+#include <cmath>
+#include <algorithm>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define BP_KERNEL_X86 1
+#include <immintrin.h>
+#if defined(_MSC_VER) && !defined(__clang__)
+#include <intrin.h>
+//MSVC emits any intrinsic without /arch flags
+#define BP_TARGET(isa)
+#else
+#include <cpuid.h>
+#define BP_TARGET(isa) __attribute__((target(isa)))
+#endif
+#endif
+
+namespace kernel
+{
+	//BT.709 luma in Q8, sums up to 256
+	constexpr int GrayWeightR = 54;
+	constexpr int GrayWeightG = 183;
+	constexpr int GrayWeightB = 19;
+
+	inline unsigned char grayQ8(int r, int g, int b)
+	{
+		return (unsigned char)((r * GrayWeightR + g * GrayWeightG + b * GrayWeightB + 128) >> 8);
+	}
+
+	// side length of the cache tile used by rotations, in pixels
+	constexpr int RotateTile = 64;
+
+	// OR-ed into every 4 byte group after arithmetic, keeps X of BGRX buffers at 0xff
+	constexpr uint32_t KeepBgrxMask = 0xff000000u;
+
+#pragma region CpuFeatures
+	struct CpuFeatures
+	{
+		bool sse2 = false;
+		bool ssse3 = false;
+		bool avx2 = false;
+	};
+
+	inline CpuFeatures detectCpuFeatures()
+	{
+		CpuFeatures retval;
+#ifdef BP_KERNEL_X86
+		unsigned int info[4] = { 0, 0, 0, 0 };
+		auto cpuid = [&info](unsigned int leaf, unsigned int subleaf)
+		{
+#if defined(_MSC_VER) && !defined(__clang__)
+			int regs[4];
+			__cpuidex(regs, (int)leaf, (int)subleaf);
+			for (int idx = 0; idx < 4; ++idx)
+				info[idx] = (unsigned int)regs[idx];
+#else
+			__cpuid_count(leaf, subleaf, info[0], info[1], info[2], info[3]);
+#endif
+		};
+		auto xcr0 = []() -> unsigned long long
+		{
+#if defined(_MSC_VER) && !defined(__clang__)
+			return _xgetbv(0);
+#else
+			unsigned int eax = 0, edx = 0;
+			__asm__ volatile("xgetbv" : "=a"(eax), "=d"(edx) : "c"(0));
+			return ((unsigned long long)edx << 32) | eax;
+#endif
+		};
+
+		cpuid(0, 0);
+		const unsigned int maxLeaf = info[0];
+
+		cpuid(1, 0);
+		retval.sse2 = info[3] & (1u << 26);
+		retval.ssse3 = info[2] & (1u << 9);
+		const bool osxsave = info[2] & (1u << 27);
+		const bool avx = info[2] & (1u << 28);
+
+		//AVX2 also needs the OS to save ymm registers
+		if (maxLeaf >= 7 && osxsave && avx && ((xcr0() & 0x6) == 0x6))
+		{
+			cpuid(7, 0);
+			retval.avx2 = info[1] & (1u << 5);
+		}
+#endif
+		if (const char* cap = std::getenv("BINPACK_SIMD"))
+		{
+			if (!std::strcmp(cap, "none"))
+				retval = CpuFeatures();
+			else if (!std::strcmp(cap, "sse2"))
+				retval.ssse3 = retval.avx2 = false;
+			else if (!std::strcmp(cap, "ssse3"))
+				retval.avx2 = false;
+		}
+		return retval;
+	}
+
+	inline CpuFeatures const& cpu()
+	{
+		static const CpuFeatures features = detectCpuFeatures();
+		return features;
+	}
+#pragma endregion
+
+#pragma region Scalar
+	inline void rgbToBgrxScalar(unsigned char const* src, unsigned char* dst, int count)
+	{
+		for (int idx = 0; idx < count; ++idx, src += 3, dst += 4)
+		{
+			dst[0] = src[2];
+			dst[1] = src[1];
+			dst[2] = src[0];
+			dst[3] = 0xff;
+		}
+	}
+
+	inline void bgrxToRgbScalar(unsigned char const* src, unsigned char* dst, int count)
+	{
+		for (int idx = 0; idx < count; ++idx, src += 4, dst += 3)
+		{
+			dst[0] = src[2];
+			dst[1] = src[1];
+			dst[2] = src[0];
+		}
+	}
+
+	inline void rgbToPlanarScalar(unsigned char const* src, unsigned char* r, unsigned char* g, unsigned char* b, int count)
+	{
+		for (int idx = 0; idx < count; ++idx, src += 3)
+		{
+			r[idx] = src[0];
+			g[idx] = src[1];
+			b[idx] = src[2];
+		}
+	}
+
+	inline void planarToRgbScalar(unsigned char const* r, unsigned char const* g, unsigned char const* b, unsigned char* dst, int count)
+	{
+		for (int idx = 0; idx < count; ++idx, dst += 3)
+		{
+			dst[0] = r[idx];
+			dst[1] = g[idx];
+			dst[2] = b[idx];
+		}
+	}
+
+	inline void grayFromBgrxScalar(unsigned char const* src, unsigned char* dst, int count)
+	{
+		for (int idx = 0; idx < count; ++idx, src += 4)
+			dst[idx] = grayQ8(src[2], src[1], src[0]);
+	}
+
+	inline void grayFromPlanarScalar(unsigned char const* r, unsigned char const* g, unsigned char const* b, unsigned char* dst, int count)
+	{
+		for (int idx = 0; idx < count; ++idx)
+			dst[idx] = grayQ8(r[idx], g[idx], b[idx]);
+	}
+
+	inline void grayFromRgbScalar(unsigned char const* src, unsigned char* dst, int count)
+	{
+		for (int idx = 0; idx < count; ++idx, src += 3)
+			dst[idx] = grayQ8(src[0], src[1], src[2]);
+	}
+
+	// BGRA (not premultiplied) blended onto a gray level in place, alpha becomes 0xff so the buffer is BGRX
+	inline void flattenBgraScalar(unsigned char* data, int count, unsigned char background)
+	{
+		for (int idx = 0; idx < count; ++idx, data += 4)
+		{
+			const int alpha = data[3], rest = (255 - alpha) * background;
+			data[0] = (unsigned char)((data[0] * alpha + rest + 127) / 255);
+			data[1] = (unsigned char)((data[1] * alpha + rest + 127) / 255);
+			data[2] = (unsigned char)((data[2] * alpha + rest + 127) / 255);
+			data[3] = 0xff;
+		}
+	}
+
+	// arithmetic tails start at byte 'from' so that orMask keeps its 4 byte phase
+	inline unsigned char maskByte(uint32_t orMask, size_t byteIndex)
+	{
+		return (unsigned char)(orMask >> (8 * (byteIndex & 3)));
+	}
+
+	inline void addSaturateScalar(unsigned char* data, size_t from, size_t bytes, unsigned char value, uint32_t orMask)
+	{
+		for (size_t idx = from; idx < bytes; ++idx)
+			data[idx] = (unsigned char)std::min(data[idx] + value, 255) | maskByte(orMask, idx);
+	}
+
+	inline void subtractSaturateScalar(unsigned char* data, size_t from, size_t bytes, unsigned char value, uint32_t orMask)
+	{
+		for (size_t idx = from; idx < bytes; ++idx)
+			data[idx] = (unsigned char)std::max(data[idx] - value, 0) | maskByte(orMask, idx);
+	}
+
+	// factorQ8 : scale factor * 256
+	inline void scaleSaturateScalar(unsigned char* data, size_t from, size_t bytes, uint16_t factorQ8, uint32_t orMask)
+	{
+		for (size_t idx = from; idx < bytes; ++idx)
+			data[idx] = (unsigned char)std::min((data[idx] * (uint32_t)factorQ8 + 128) >> 8, 255u) | maskByte(orMask, idx);
+	}
+
+	// reciprocal : 65536 / divisor + 1, exact truncating division for 8 bit values and divisor >= 2
+	inline void divideScalar(unsigned char* data, size_t from, size_t bytes, uint16_t reciprocal, uint32_t orMask)
+	{
+		for (size_t idx = from; idx < bytes; ++idx)
+			data[idx] = (unsigned char)((data[idx] * (uint32_t)reciprocal) >> 16) | maskByte(orMask, idx);
+	}
+#pragma endregion
+
+#ifdef BP_KERNEL_X86
+#pragma region SSE2
+	// r, g, b : 8 values each in 16 bit lanes. returns Q8 luma in 16 bit lanes
+	BP_TARGET("sse2") inline __m128i grayQ8Epi16(__m128i r, __m128i g, __m128i b)
+	{
+		__m128i sum = _mm_mullo_epi16(r, _mm_set1_epi16(GrayWeightR));
+		sum = _mm_add_epi16(sum, _mm_mullo_epi16(g, _mm_set1_epi16(GrayWeightG)));
+		sum = _mm_add_epi16(sum, _mm_mullo_epi16(b, _mm_set1_epi16(GrayWeightB)));
+		sum = _mm_add_epi16(sum, _mm_set1_epi16(128));
+		return _mm_srli_epi16(sum, 8);
+	}
+
+	// 16 pixels per iteration
+	BP_TARGET("sse2") inline int grayFromBgrxSSE2(unsigned char const* src, unsigned char* dst, int count)
+	{
+		const __m128i lowByte = _mm_set1_epi32(0xff);
+
+		int idx = 0;
+		for (; idx + 16 <= count; idx += 16, src += 64)
+		{
+			__m128i gray16[2];
+			for (int half = 0; half < 2; ++half)
+			{
+				const __m128i p0 = _mm_loadu_si128((__m128i const*)(src + half * 32));
+				const __m128i p1 = _mm_loadu_si128((__m128i const*)(src + half * 32 + 16));
+
+				const __m128i b = _mm_packs_epi32(_mm_and_si128(p0, lowByte), _mm_and_si128(p1, lowByte));
+				const __m128i g = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 8), lowByte), _mm_and_si128(_mm_srli_epi32(p1, 8), lowByte));
+				const __m128i r = _mm_packs_epi32(_mm_and_si128(_mm_srli_epi32(p0, 16), lowByte), _mm_and_si128(_mm_srli_epi32(p1, 16), lowByte));
+				gray16[half] = grayQ8Epi16(r, g, b);
+			}
+			_mm_storeu_si128((__m128i*)(dst + idx), _mm_packus_epi16(gray16[0], gray16[1]));
+		}
+		return idx;
+	}
+
+	BP_TARGET("sse2") inline int grayFromPlanarSSE2(unsigned char const* r, unsigned char const* g, unsigned char const* b, unsigned char* dst, int count)
+	{
+		const __m128i zero = _mm_setzero_si128();
+
+		int idx = 0;
+		for (; idx + 16 <= count; idx += 16)
+		{
+			const __m128i vr = _mm_loadu_si128((__m128i const*)(r + idx));
+			const __m128i vg = _mm_loadu_si128((__m128i const*)(g + idx));
+			const __m128i vb = _mm_loadu_si128((__m128i const*)(b + idx));
+
+			const __m128i lo = grayQ8Epi16(_mm_unpacklo_epi8(vr, zero), _mm_unpacklo_epi8(vg, zero), _mm_unpacklo_epi8(vb, zero));
+			const __m128i hi = grayQ8Epi16(_mm_unpackhi_epi8(vr, zero), _mm_unpackhi_epi8(vg, zero), _mm_unpackhi_epi8(vb, zero));
+			_mm_storeu_si128((__m128i*)(dst + idx), _mm_packus_epi16(lo, hi));
+		}
+		return idx;
+	}
+
+	// 16 bytes per iteration, returns processed byte count
+	BP_TARGET("sse2") inline size_t addSaturateSSE2(unsigned char* data, size_t bytes, unsigned char value, uint32_t orMask)
+	{
+		const __m128i v = _mm_set1_epi8((char)value);
+		const __m128i mask = _mm_set1_epi32((int)orMask);
+		size_t idx = 0;
+		for (; idx + 16 <= bytes; idx += 16)
+		{
+			const __m128i px = _mm_loadu_si128((__m128i const*)(data + idx));
+			_mm_storeu_si128((__m128i*)(data + idx), _mm_or_si128(_mm_adds_epu8(px, v), mask));
+		}
+		return idx;
+	}
+
+	BP_TARGET("sse2") inline size_t subtractSaturateSSE2(unsigned char* data, size_t bytes, unsigned char value, uint32_t orMask)
+	{
+		const __m128i v = _mm_set1_epi8((char)value);
+		const __m128i mask = _mm_set1_epi32((int)orMask);
+		size_t idx = 0;
+		for (; idx + 16 <= bytes; idx += 16)
+		{
+			const __m128i px = _mm_loadu_si128((__m128i const*)(data + idx));
+			_mm_storeu_si128((__m128i*)(data + idx), _mm_or_si128(_mm_subs_epu8(px, v), mask));
+		}
+		return idx;
+	}
+
+	// 8 values in 16 bit lanes -> (x * factor + 128) >> 8, 32 bit intermediate, saturated to 16 bit
+	BP_TARGET("sse2") inline __m128i scaleQ8Epi16(__m128i x, __m128i factor)
+	{
+		const __m128i lo = _mm_mullo_epi16(x, factor);
+		const __m128i hi = _mm_mulhi_epu16(x, factor);
+		const __m128i round = _mm_set1_epi32(128);
+		const __m128i p0 = _mm_srli_epi32(_mm_add_epi32(_mm_unpacklo_epi16(lo, hi), round), 8);
+		const __m128i p1 = _mm_srli_epi32(_mm_add_epi32(_mm_unpackhi_epi16(lo, hi), round), 8);
+		return _mm_packs_epi32(p0, p1);
+	}
+
+	BP_TARGET("sse2") inline size_t scaleSaturateSSE2(unsigned char* data, size_t bytes, uint16_t factorQ8, uint32_t orMask)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i factor = _mm_set1_epi16((short)factorQ8);
+		const __m128i mask = _mm_set1_epi32((int)orMask);
+		size_t idx = 0;
+		for (; idx + 16 <= bytes; idx += 16)
+		{
+			const __m128i px = _mm_loadu_si128((__m128i const*)(data + idx));
+			const __m128i lo = scaleQ8Epi16(_mm_unpacklo_epi8(px, zero), factor);
+			const __m128i hi = scaleQ8Epi16(_mm_unpackhi_epi8(px, zero), factor);
+			_mm_storeu_si128((__m128i*)(data + idx), _mm_or_si128(_mm_packus_epi16(lo, hi), mask));
+		}
+		return idx;
+	}
+
+	BP_TARGET("sse2") inline size_t divideSSE2(unsigned char* data, size_t bytes, uint16_t reciprocal, uint32_t orMask)
+	{
+		const __m128i zero = _mm_setzero_si128();
+		const __m128i m = _mm_set1_epi16((short)reciprocal);
+		const __m128i mask = _mm_set1_epi32((int)orMask);
+		size_t idx = 0;
+		for (; idx + 16 <= bytes; idx += 16)
+		{
+			const __m128i px = _mm_loadu_si128((__m128i const*)(data + idx));
+			const __m128i lo = _mm_mulhi_epu16(_mm_unpacklo_epi8(px, zero), m);
+			const __m128i hi = _mm_mulhi_epu16(_mm_unpackhi_epi8(px, zero), m);
+			_mm_storeu_si128((__m128i*)(data + idx), _mm_or_si128(_mm_packus_epi16(lo, hi), mask));
+		}
+		return idx;
+	}
+
+	// rotates one 4x4 block of 32 bit pixels
+	BP_TARGET("sse2") inline void rotateBlock4x4SSE2(uint32_t const* src, int srcStride, uint32_t* dst, int dstStride, bool clockwise)
+	{
+		const __m128i r0 = _mm_loadu_si128((__m128i const*)(src + 0 * srcStride));
+		const __m128i r1 = _mm_loadu_si128((__m128i const*)(src + 1 * srcStride));
+		const __m128i r2 = _mm_loadu_si128((__m128i const*)(src + 2 * srcStride));
+		const __m128i r3 = _mm_loadu_si128((__m128i const*)(src + 3 * srcStride));
+
+		const __m128i t0 = _mm_unpacklo_epi32(r0, r1);
+		const __m128i t1 = _mm_unpacklo_epi32(r2, r3);
+		const __m128i t2 = _mm_unpackhi_epi32(r0, r1);
+		const __m128i t3 = _mm_unpackhi_epi32(r2, r3);
+
+		//column k of the source block
+		__m128i col[4] =
+		{
+			_mm_unpacklo_epi64(t0, t1),
+			_mm_unpackhi_epi64(t0, t1),
+			_mm_unpacklo_epi64(t2, t3),
+			_mm_unpackhi_epi64(t2, t3),
+		};
+
+		if (clockwise)
+		{
+			//source column k becomes destination row k, read bottom to top
+			for (int k = 0; k < 4; ++k)
+				_mm_storeu_si128((__m128i*)(dst + k * dstStride), _mm_shuffle_epi32(col[k], _MM_SHUFFLE(0, 1, 2, 3)));
+		}
+		else
+		{
+			//source column k becomes destination row 3-k
+			for (int k = 0; k < 4; ++k)
+				_mm_storeu_si128((__m128i*)(dst + (3 - k) * dstStride), col[k]);
+		}
+	}
+#pragma endregion
+
+#pragma region SSSE3
+	// 16 pixels per iteration
+	BP_TARGET("ssse3") inline int rgbToBgrxSSSE3(unsigned char const* src, unsigned char* dst, int count)
+	{
+		const __m128i mask = _mm_setr_epi8(2, 1, 0, -1, 5, 4, 3, -1, 8, 7, 6, -1, 11, 10, 9, -1);
+		const __m128i alpha = _mm_set1_epi32((int)0xff000000);
+
+		int idx = 0;
+		for (; idx + 16 <= count; idx += 16, src += 48, dst += 64)
+		{
+			const __m128i a = _mm_loadu_si128((__m128i const*)(src + 0));
+			const __m128i b = _mm_loadu_si128((__m128i const*)(src + 16));
+			const __m128i c = _mm_loadu_si128((__m128i const*)(src + 32));
+
+			const __m128i p0 = a;
+			const __m128i p1 = _mm_alignr_epi8(b, a, 12);
+			const __m128i p2 = _mm_alignr_epi8(c, b, 8);
+			const __m128i p3 = _mm_srli_si128(c, 4);
+
+			_mm_storeu_si128((__m128i*)(dst + 0), _mm_or_si128(_mm_shuffle_epi8(p0, mask), alpha));
+			_mm_storeu_si128((__m128i*)(dst + 16), _mm_or_si128(_mm_shuffle_epi8(p1, mask), alpha));
+			_mm_storeu_si128((__m128i*)(dst + 32), _mm_or_si128(_mm_shuffle_epi8(p2, mask), alpha));
+			_mm_storeu_si128((__m128i*)(dst + 48), _mm_or_si128(_mm_shuffle_epi8(p3, mask), alpha));
+		}
+		return idx;
+	}
+
+	BP_TARGET("ssse3") inline int bgrxToRgbSSSE3(unsigned char const* src, unsigned char* dst, int count)
+	{
+		const __m128i mask = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+		int idx = 0;
+		for (; idx + 16 <= count; idx += 16, src += 64, dst += 48)
+		{
+			const __m128i v0 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)(src + 0)), mask);
+			const __m128i v1 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)(src + 16)), mask);
+			const __m128i v2 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)(src + 32)), mask);
+			const __m128i v3 = _mm_shuffle_epi8(_mm_loadu_si128((__m128i const*)(src + 48)), mask);
+
+			_mm_storeu_si128((__m128i*)(dst + 0), _mm_or_si128(v0, _mm_slli_si128(v1, 12)));
+			_mm_storeu_si128((__m128i*)(dst + 16), _mm_or_si128(_mm_srli_si128(v1, 4), _mm_slli_si128(v2, 8)));
+			_mm_storeu_si128((__m128i*)(dst + 32), _mm_or_si128(_mm_srli_si128(v2, 8), _mm_slli_si128(v3, 4)));
+		}
+		return idx;
+	}
+
+	// splits 16 packed pixels into R, G, B registers
+	BP_TARGET("ssse3") inline void deinterleaveRgb16(unsigned char const* src, __m128i& r, __m128i& g, __m128i& b)
+	{
+		const __m128i a = _mm_loadu_si128((__m128i const*)(src + 0));
+		const __m128i m = _mm_loadu_si128((__m128i const*)(src + 16));
+		const __m128i c = _mm_loadu_si128((__m128i const*)(src + 32));
+
+		r = _mm_or_si128(_mm_or_si128(
+			_mm_shuffle_epi8(a, _mm_setr_epi8(0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+			_mm_shuffle_epi8(m, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14, -1, -1, -1, -1, -1))),
+			_mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 1, 4, 7, 10, 13)));
+		g = _mm_or_si128(_mm_or_si128(
+			_mm_shuffle_epi8(a, _mm_setr_epi8(1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+			_mm_shuffle_epi8(m, _mm_setr_epi8(-1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15, -1, -1, -1, -1, -1))),
+			_mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 2, 5, 8, 11, 14)));
+		b = _mm_or_si128(_mm_or_si128(
+			_mm_shuffle_epi8(a, _mm_setr_epi8(2, 5, 8, 11, 14, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1)),
+			_mm_shuffle_epi8(m, _mm_setr_epi8(-1, -1, -1, -1, -1, 1, 4, 7, 10, 13, -1, -1, -1, -1, -1, -1))),
+			_mm_shuffle_epi8(c, _mm_setr_epi8(-1, -1, -1, -1, -1, -1, -1, -1, -1, -1, 0, 3, 6, 9, 12, 15)));
+	}
+
+	BP_TARGET("ssse3") inline int rgbToPlanarSSSE3(unsigned char const* src, unsigned char* r, unsigned char* g, unsigned char* b, int count)
+	{
+		int idx = 0;
+		for (; idx + 16 <= count; idx += 16, src += 48)
+		{
+			__m128i vr, vg, vb;
+			deinterleaveRgb16(src, vr, vg, vb);
+			_mm_storeu_si128((__m128i*)(r + idx), vr);
+			_mm_storeu_si128((__m128i*)(g + idx), vg);
+			_mm_storeu_si128((__m128i*)(b + idx), vb);
+		}
+		return idx;
+	}
+
+	BP_TARGET("ssse3") inline int planarToRgbSSSE3(unsigned char const* r, unsigned char const* g, unsigned char const* b, unsigned char* dst, int count)
+	{
+		int idx = 0;
+		for (; idx + 16 <= count; idx += 16, dst += 48)
+		{
+			const __m128i vr = _mm_loadu_si128((__m128i const*)(r + idx));
+			const __m128i vg = _mm_loadu_si128((__m128i const*)(g + idx));
+			const __m128i vb = _mm_loadu_si128((__m128i const*)(b + idx));
+
+			const __m128i o0 = _mm_or_si128(_mm_or_si128(
+				_mm_shuffle_epi8(vr, _mm_setr_epi8(0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1, 5)),
+				_mm_shuffle_epi8(vg, _mm_setr_epi8(-1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1, -1))),
+				_mm_shuffle_epi8(vb, _mm_setr_epi8(-1, -1, 0, -1, -1, 1, -1, -1, 2, -1, -1, 3, -1, -1, 4, -1)));
+			const __m128i o1 = _mm_or_si128(_mm_or_si128(
+				_mm_shuffle_epi8(vr, _mm_setr_epi8(-1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10, -1)),
+				_mm_shuffle_epi8(vg, _mm_setr_epi8(5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1, 10))),
+				_mm_shuffle_epi8(vb, _mm_setr_epi8(-1, 5, -1, -1, 6, -1, -1, 7, -1, -1, 8, -1, -1, 9, -1, -1)));
+			const __m128i o2 = _mm_or_si128(_mm_or_si128(
+				_mm_shuffle_epi8(vr, _mm_setr_epi8(-1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1, -1)),
+				_mm_shuffle_epi8(vg, _mm_setr_epi8(-1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15, -1))),
+				_mm_shuffle_epi8(vb, _mm_setr_epi8(10, -1, -1, 11, -1, -1, 12, -1, -1, 13, -1, -1, 14, -1, -1, 15)));
+
+			_mm_storeu_si128((__m128i*)(dst + 0), o0);
+			_mm_storeu_si128((__m128i*)(dst + 16), o1);
+			_mm_storeu_si128((__m128i*)(dst + 32), o2);
+		}
+		return idx;
+	}
+
+	BP_TARGET("ssse3") inline int grayFromRgbSSSE3(unsigned char const* src, unsigned char* dst, int count)
+	{
+		const __m128i zero = _mm_setzero_si128();
+
+		int idx = 0;
+		for (; idx + 16 <= count; idx += 16, src += 48)
+		{
+			__m128i r, g, b;
+			deinterleaveRgb16(src, r, g, b);
+			const __m128i lo = grayQ8Epi16(_mm_unpacklo_epi8(r, zero), _mm_unpacklo_epi8(g, zero), _mm_unpacklo_epi8(b, zero));
+			const __m128i hi = grayQ8Epi16(_mm_unpackhi_epi8(r, zero), _mm_unpackhi_epi8(g, zero), _mm_unpackhi_epi8(b, zero));
+			_mm_storeu_si128((__m128i*)(dst + idx), _mm_packus_epi16(lo, hi));
+		}
+		return idx;
+	}
+#pragma endregion
+
+#pragma region AVX2
+	BP_TARGET("avx2") inline __m256i grayQ8Epi16AVX2(__m256i r, __m256i g, __m256i b)
+	{
+		__m256i sum = _mm256_mullo_epi16(r, _mm256_set1_epi16(GrayWeightR));
+		sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(g, _mm256_set1_epi16(GrayWeightG)));
+		sum = _mm256_add_epi16(sum, _mm256_mullo_epi16(b, _mm256_set1_epi16(GrayWeightB)));
+		sum = _mm256_add_epi16(sum, _mm256_set1_epi16(128));
+		return _mm256_srli_epi16(sum, 8);
+	}
+
+	// 32 pixels per iteration. the 3 byte deinterleave stays in 128 bit lanes, the math runs on 256
+	BP_TARGET("avx2") inline int grayFromRgbAVX2(unsigned char const* src, unsigned char* dst, int count)
+	{
+		int idx = 0;
+		for (; idx + 32 <= count; idx += 32, src += 96)
+		{
+			__m128i r0, g0, b0, r1, g1, b1;
+			deinterleaveRgb16(src, r0, g0, b0);
+			deinterleaveRgb16(src + 48, r1, g1, b1);
+
+			const __m256i lo = grayQ8Epi16AVX2(_mm256_cvtepu8_epi16(r0), _mm256_cvtepu8_epi16(g0), _mm256_cvtepu8_epi16(b0));
+			const __m256i hi = grayQ8Epi16AVX2(_mm256_cvtepu8_epi16(r1), _mm256_cvtepu8_epi16(g1), _mm256_cvtepu8_epi16(b1));
+			//packus works per 128 bit lane, restore pixel order
+			const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), _MM_SHUFFLE(3, 1, 2, 0));
+			_mm256_storeu_si256((__m256i*)(dst + idx), packed);
+		}
+		return idx;
+	}
+
+	BP_TARGET("avx2") inline int grayFromBgrxAVX2(unsigned char const* src, unsigned char* dst, int count)
+	{
+		const __m256i lowByte = _mm256_set1_epi32(0xff);
+		//undo the lane interleave of packs_epi32 + packus_epi16, in 4 pixel groups
+		const __m256i order = _mm256_setr_epi32(0, 4, 1, 5, 2, 6, 3, 7);
+
+		int idx = 0;
+		for (; idx + 32 <= count; idx += 32, src += 128)
+		{
+			__m256i gray16[2];
+			for (int half = 0; half < 2; ++half)
+			{
+				const __m256i p0 = _mm256_loadu_si256((__m256i const*)(src + half * 64));
+				const __m256i p1 = _mm256_loadu_si256((__m256i const*)(src + half * 64 + 32));
+
+				const __m256i b = _mm256_packs_epi32(_mm256_and_si256(p0, lowByte), _mm256_and_si256(p1, lowByte));
+				const __m256i g = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p0, 8), lowByte), _mm256_and_si256(_mm256_srli_epi32(p1, 8), lowByte));
+				const __m256i r = _mm256_packs_epi32(_mm256_and_si256(_mm256_srli_epi32(p0, 16), lowByte), _mm256_and_si256(_mm256_srli_epi32(p1, 16), lowByte));
+				gray16[half] = grayQ8Epi16AVX2(r, g, b);
+			}
+			const __m256i packed = _mm256_permutevar8x32_epi32(_mm256_packus_epi16(gray16[0], gray16[1]), order);
+			_mm256_storeu_si256((__m256i*)(dst + idx), packed);
+		}
+		return idx;
+	}
+
+	BP_TARGET("avx2") inline int grayFromPlanarAVX2(unsigned char const* r, unsigned char const* g, unsigned char const* b, unsigned char* dst, int count)
+	{
+		int idx = 0;
+		for (; idx + 32 <= count; idx += 32)
+		{
+			__m256i gray16[2];
+			for (int half = 0; half < 2; ++half)
+			{
+				const int at = idx + half * 16;
+				gray16[half] = grayQ8Epi16AVX2(
+					_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const*)(r + at))),
+					_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const*)(g + at))),
+					_mm256_cvtepu8_epi16(_mm_loadu_si128((__m128i const*)(b + at))));
+			}
+			const __m256i packed = _mm256_permute4x64_epi64(_mm256_packus_epi16(gray16[0], gray16[1]), _MM_SHUFFLE(3, 1, 2, 0));
+			_mm256_storeu_si256((__m256i*)(dst + idx), packed);
+		}
+		return idx;
+	}
+
+	// 32 bytes per iteration
+	BP_TARGET("avx2") inline size_t addSaturateAVX2(unsigned char* data, size_t bytes, unsigned char value, uint32_t orMask)
+	{
+		const __m256i v = _mm256_set1_epi8((char)value);
+		const __m256i mask = _mm256_set1_epi32((int)orMask);
+		size_t idx = 0;
+		for (; idx + 32 <= bytes; idx += 32)
+		{
+			const __m256i px = _mm256_loadu_si256((__m256i const*)(data + idx));
+			_mm256_storeu_si256((__m256i*)(data + idx), _mm256_or_si256(_mm256_adds_epu8(px, v), mask));
+		}
+		return idx;
+	}
+
+	BP_TARGET("avx2") inline size_t subtractSaturateAVX2(unsigned char* data, size_t bytes, unsigned char value, uint32_t orMask)
+	{
+		const __m256i v = _mm256_set1_epi8((char)value);
+		const __m256i mask = _mm256_set1_epi32((int)orMask);
+		size_t idx = 0;
+		for (; idx + 32 <= bytes; idx += 32)
+		{
+			const __m256i px = _mm256_loadu_si256((__m256i const*)(data + idx));
+			_mm256_storeu_si256((__m256i*)(data + idx), _mm256_or_si256(_mm256_subs_epu8(px, v), mask));
+		}
+		return idx;
+	}
+
+	BP_TARGET("avx2") inline __m256i scaleQ8Epi16AVX2(__m256i x, __m256i factor)
+	{
+		const __m256i lo = _mm256_mullo_epi16(x, factor);
+		const __m256i hi = _mm256_mulhi_epu16(x, factor);
+		const __m256i round = _mm256_set1_epi32(128);
+		const __m256i p0 = _mm256_srli_epi32(_mm256_add_epi32(_mm256_unpacklo_epi16(lo, hi), round), 8);
+		const __m256i p1 = _mm256_srli_epi32(_mm256_add_epi32(_mm256_unpackhi_epi16(lo, hi), round), 8);
+		//unpack and pack are both per lane, so the order comes back as it was
+		return _mm256_packs_epi32(p0, p1);
+	}
+
+	BP_TARGET("avx2") inline size_t scaleSaturateAVX2(unsigned char* data, size_t bytes, uint16_t factorQ8, uint32_t orMask)
+	{
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i factor = _mm256_set1_epi16((short)factorQ8);
+		const __m256i mask = _mm256_set1_epi32((int)orMask);
+		size_t idx = 0;
+		for (; idx + 32 <= bytes; idx += 32)
+		{
+			const __m256i px = _mm256_loadu_si256((__m256i const*)(data + idx));
+			const __m256i lo = scaleQ8Epi16AVX2(_mm256_unpacklo_epi8(px, zero), factor);
+			const __m256i hi = scaleQ8Epi16AVX2(_mm256_unpackhi_epi8(px, zero), factor);
+			_mm256_storeu_si256((__m256i*)(data + idx), _mm256_or_si256(_mm256_packus_epi16(lo, hi), mask));
+		}
+		return idx;
+	}
+
+	BP_TARGET("avx2") inline size_t divideAVX2(unsigned char* data, size_t bytes, uint16_t reciprocal, uint32_t orMask)
+	{
+		const __m256i zero = _mm256_setzero_si256();
+		const __m256i m = _mm256_set1_epi16((short)reciprocal);
+		const __m256i mask = _mm256_set1_epi32((int)orMask);
+		size_t idx = 0;
+		for (; idx + 32 <= bytes; idx += 32)
+		{
+			const __m256i px = _mm256_loadu_si256((__m256i const*)(data + idx));
+			const __m256i lo = _mm256_mulhi_epu16(_mm256_unpacklo_epi8(px, zero), m);
+			const __m256i hi = _mm256_mulhi_epu16(_mm256_unpackhi_epi8(px, zero), m);
+			_mm256_storeu_si256((__m256i*)(data + idx), _mm256_or_si256(_mm256_packus_epi16(lo, hi), mask));
+		}
+		return idx;
+	}
+#pragma endregion
+#endif //BP_KERNEL_X86
+
+#pragma region Dispatchers
+	inline void rgbToBgrx(unsigned char const* src, unsigned char* dst, int count)
+	{
+		int done = 0;
+#ifdef BP_KERNEL_X86
+		if (cpu().ssse3)
+			done = rgbToBgrxSSSE3(src, dst, count);
+#endif
+		rgbToBgrxScalar(src + done * 3, dst + done * 4, count - done);
+	}
+
+	inline void bgrxToRgb(unsigned char const* src, unsigned char* dst, int count)
+	{
+		int done = 0;
+#ifdef BP_KERNEL_X86
+		if (cpu().ssse3)
+			done = bgrxToRgbSSSE3(src, dst, count);
+#endif
+		bgrxToRgbScalar(src + done * 4, dst + done * 3, count - done);
+	}
+
+	// scalar only, runs once per decode of an image with alpha
+	inline void flattenBgra(unsigned char* data, int count, unsigned char background)
+	{
+		flattenBgraScalar(data, count, background);
+	}
+
+	inline void rgbToPlanar(unsigned char const* src, unsigned char* r, unsigned char* g, unsigned char* b, int count)
+	{
+		int done = 0;
+#ifdef BP_KERNEL_X86
+		if (cpu().ssse3)
+			done = rgbToPlanarSSSE3(src, r, g, b, count);
+#endif
+		rgbToPlanarScalar(src + done * 3, r + done, g + done, b + done, count - done);
+	}
+
+	inline void planarToRgb(unsigned char const* r, unsigned char const* g, unsigned char const* b, unsigned char* dst, int count)
+	{
+		int done = 0;
+#ifdef BP_KERNEL_X86
+		if (cpu().ssse3)
+			done = planarToRgbSSSE3(r, g, b, dst, count);
+#endif
+		planarToRgbScalar(r + done, g + done, b + done, dst + done * 3, count - done);
+	}
+
+	inline void grayFromBgrx(unsigned char const* src, unsigned char* dst, int count)
+	{
+		int done = 0;
+#ifdef BP_KERNEL_X86
+		if (cpu().avx2)
+			done = grayFromBgrxAVX2(src, dst, count);
+		if (cpu().sse2)
+			done += grayFromBgrxSSE2(src + done * 4, dst + done, count - done);
+#endif
+		grayFromBgrxScalar(src + done * 4, dst + done, count - done);
+	}
+
+	inline void grayFromPlanar(unsigned char const* r, unsigned char const* g, unsigned char const* b, unsigned char* dst, int count)
+	{
+		int done = 0;
+#ifdef BP_KERNEL_X86
+		if (cpu().avx2)
+			done = grayFromPlanarAVX2(r, g, b, dst, count);
+		if (cpu().sse2)
+			done += grayFromPlanarSSE2(r + done, g + done, b + done, dst + done, count - done);
+#endif
+		grayFromPlanarScalar(r + done, g + done, b + done, dst + done, count - done);
+	}
+
+	inline void grayFromRgb(unsigned char const* src, unsigned char* dst, int count)
+	{
+		int done = 0;
+#ifdef BP_KERNEL_X86
+		if (cpu().avx2)
+			done = grayFromRgbAVX2(src, dst, count);
+		if (cpu().ssse3)
+			done += grayFromRgbSSSE3(src + done * 3, dst + done, count - done);
+#endif
+		grayFromRgbScalar(src + done * 3, dst + done, count - done);
+	}
+
+	// saturating, whole buffer. orMask is OR-ed into each 4 byte group (KeepBgrxMask for BGRX, 0 otherwise)
+	inline void addSaturate(unsigned char* data, size_t bytes, unsigned char value, uint32_t orMask = 0)
+	{
+		size_t done = 0;
+#ifdef BP_KERNEL_X86
+		if (cpu().avx2)
+			done = addSaturateAVX2(data, bytes, value, orMask);
+		if (cpu().sse2)
+			done += addSaturateSSE2(data + done, bytes - done, value, orMask);
+#endif
+		addSaturateScalar(data, done, bytes, value, orMask);
+	}
+
+	inline void subtractSaturate(unsigned char* data, size_t bytes, unsigned char value, uint32_t orMask = 0)
+	{
+		size_t done = 0;
+#ifdef BP_KERNEL_X86
+		if (cpu().avx2)
+			done = subtractSaturateAVX2(data, bytes, value, orMask);
+		if (cpu().sse2)
+			done += subtractSaturateSSE2(data + done, bytes - done, value, orMask);
+#endif
+		subtractSaturateScalar(data, done, bytes, value, orMask);
+	}
+
+	// factor is rounded to Q8 (1/256 steps) and clamped to [0, 255.99]
+	inline void scaleSaturate(unsigned char* data, size_t bytes, float factor, uint32_t orMask = 0)
+	{
+		const uint16_t factorQ8 = (uint16_t)std::clamp((long)std::lround(factor * 256.f), 0L, 65535L);
+
+		size_t done = 0;
+#ifdef BP_KERNEL_X86
+		if (cpu().avx2)
+			done = scaleSaturateAVX2(data, bytes, factorQ8, orMask);
+		if (cpu().sse2)
+			done += scaleSaturateSSE2(data + done, bytes - done, factorQ8, orMask);
+#endif
+		scaleSaturateScalar(data, done, bytes, factorQ8, orMask);
+	}
+
+	// truncating division like VectorRGB::operator/, division by zero saturates to 255
+	inline void divide(unsigned char* data, size_t bytes, unsigned char divisor, uint32_t orMask = 0)
+	{
+		if (divisor == 0)
+		{
+			std::memset(data, 0xff, bytes);
+			return;
+		}
+		if (divisor == 1)
+		{
+			addSaturate(data, bytes, 0, orMask);
+			return;
+		}
+
+		const uint16_t reciprocal = (uint16_t)(65536 / divisor + 1);
+
+		size_t done = 0;
+#ifdef BP_KERNEL_X86
+		if (cpu().avx2)
+			done = divideAVX2(data, bytes, reciprocal, orMask);
+		if (cpu().sse2)
+			done += divideSSE2(data + done, bytes - done, reciprocal, orMask);
+#endif
+		divideScalar(data, done, bytes, reciprocal, orMask);
+	}
+
+	// rotates a srcWid x srcHi block by 90 degrees into dst (srcHi x srcWid)
+	// strides are in pixels, so both buffers may be sub-regions of larger images
+	// clockwise     : dst(x, y) = src(y, srcHi - 1 - x)
+	// anticlockwise : dst(x, y) = src(srcWid - 1 - y, x)
+	template <typename PixelT>
+	void rotate90(PixelT const* src, int srcWid, int srcHi, int srcStride, PixelT* dst, int dstStride, bool clockwise)
+	{
+#ifdef BP_KERNEL_X86
+		const bool useSSE2 = (sizeof(PixelT) == 4) && cpu().sse2;
+#endif
+		for (int ty = 0; ty < srcHi; ty += RotateTile)
+		{
+			const int tyEnd = std::min(ty + RotateTile, srcHi);
+			for (int tx = 0; tx < srcWid; tx += RotateTile)
+			{
+				const int txEnd = std::min(tx + RotateTile, srcWid);
+				int y = ty;
+
+#ifdef BP_KERNEL_X86
+				if (useSSE2)
+				{
+					const int tx4End = tx + ((txEnd - tx) & ~3);
+					for (; y + 4 <= tyEnd; y += 4)
+					{
+						int x = tx;
+						for (; x < tx4End; x += 4)
+						{
+							//top-left corner of the destination block
+							const int dx = clockwise ? (srcHi - 4 - y) : y;
+							const int dy = clockwise ? x : (srcWid - 4 - x);
+							rotateBlock4x4SSE2(
+								reinterpret_cast<uint32_t const*>(src + (size_t)y * srcStride + x), srcStride,
+								reinterpret_cast<uint32_t*>(dst + (size_t)dy * dstStride + dx), dstStride,
+								clockwise);
+						}
+						//right edge of the tile
+						for (int row = y; row < y + 4; ++row)
+							for (int col = x; col < txEnd; ++col)
+							{
+								const int dx = clockwise ? (srcHi - 1 - row) : row;
+								const int dy = clockwise ? col : (srcWid - 1 - col);
+								dst[(size_t)dy * dstStride + dx] = src[(size_t)row * srcStride + col];
+							}
+					}
+				}
+#endif
+				for (; y < tyEnd; ++y)
+					for (int x = tx; x < txEnd; ++x)
+					{
+						const int dx = clockwise ? (srcHi - 1 - y) : y;
+						const int dy = clockwise ? x : (srcWid - 1 - x);
+						dst[(size_t)dy * dstStride + dx] = src[(size_t)y * srcStride + x];
+					}
+			}
+		}
+	}
+#pragma endregion
+}
@@ -252,7 +252,9 @@ public:
 public:
 	BinpackMainWindow* Owner = 0;
 	QLineEdit* offsetEdit = 0, *roundingEdit = 0;
+	QLineEdit* spacingEdit = 0, *bleedEdit = 0, *marginEdit = 0;
 	QLabel* offsetPxLbl = 0, *roundingPxLbl = 0;
+	QLabel* spacingPxLbl = 0, *bleedPxLbl = 0, *marginPxLbl = 0;
 	int curDPI;
 };
 
@@ -283,15 +285,31 @@ void KarlsunStyleReceiver::initialize()
 	pImpl->roundingEdit = new QLineEdit(this);
 	pImpl->roundingEdit->setValidator(validator);
 	pImpl->roundingEdit->setText(QString::number(rounding));
+	pImpl->spacingEdit = new QLineEdit(this);
+	pImpl->spacingEdit->setValidator(validator);
+	pImpl->spacingEdit->setText(QString::number(globalKarlsunStyle.spacing));
+	pImpl->bleedEdit = new QLineEdit(this);
+	pImpl->bleedEdit->setValidator(validator);
+	pImpl->bleedEdit->setText(QString::number(globalKarlsunStyle.bleed));
+	pImpl->marginEdit = new QLineEdit(this);
+	pImpl->marginEdit->setValidator(validator);
+	pImpl->marginEdit->setText(QString::number(globalKarlsunStyle.margin));
 	auto* DPIInfoLbl = new QLabel(QString("DPI : %1").arg(QString::number(pImpl->curDPI)), this);
 	auto* widLbl = new QLabel(KorStr(""), this);
 	auto* hiLbl = new QLabel(KorStr(""), this);
 	pImpl->offsetPxLbl = new QLabel(QString("px"), this);
 	pImpl->roundingPxLbl = new QLabel("px", this);
+	auto* spacingLbl = new QLabel(KorStr(""), this);
+	auto* bleedLbl = new QLabel(KorStr(""), this);
+	auto* marginLbl = new QLabel(KorStr(""), this);
+	pImpl->spacingPxLbl = new QLabel("px", this);
+	pImpl->bleedPxLbl = new QLabel("px", this);
+	pImpl->marginPxLbl = new QLabel("px", this);
+	auto* packWarnLbl = new QLabel(KorStr(" * // ٲ ٽ ׽մϴ"), this);
 	auto* updateBtn = new QPushButton(KorStr("Ȯ"), this);
 	auto* cancelBtn = new QPushButton(KorStr(""), this);
 
-	enum Rows { DPIINFO, OFFSET, ROUNDING, BUTTONS };
+	enum Rows { DPIINFO, OFFSET, ROUNDING, SPACING, BLEED, MARGIN, PACK_WARNER, BUTTONS };
 
 	editLayout->addWidget(DPIInfoLbl, DPIINFO, 3, 1, 1);
 	editLayout->addWidget(widLbl, OFFSET, 0, 1, 1);
@@ -300,6 +318,16 @@ void KarlsunStyleReceiver::initialize()
 	editLayout->addWidget(hiLbl, ROUNDING, 0, 1, 1);
 	editLayout->addWidget(pImpl->roundingEdit, ROUNDING, 1, 1, 2);
 	editLayout->addWidget(pImpl->roundingPxLbl, ROUNDING, 3, 1, 1);
+	editLayout->addWidget(spacingLbl, SPACING, 0, 1, 1);
+	editLayout->addWidget(pImpl->spacingEdit, SPACING, 1, 1, 2);
+	editLayout->addWidget(pImpl->spacingPxLbl, SPACING, 3, 1, 1);
+	editLayout->addWidget(bleedLbl, BLEED, 0, 1, 1);
+	editLayout->addWidget(pImpl->bleedEdit, BLEED, 1, 1, 2);
+	editLayout->addWidget(pImpl->bleedPxLbl, BLEED, 3, 1, 1);
+	editLayout->addWidget(marginLbl, MARGIN, 0, 1, 1);
+	editLayout->addWidget(pImpl->marginEdit, MARGIN, 1, 1, 2);
+	editLayout->addWidget(pImpl->marginPxLbl, MARGIN, 3, 1, 1);
+	editLayout->addWidget(packWarnLbl, PACK_WARNER, 0, 1, 4);
 	editLayout->addWidget(updateBtn, BUTTONS, 0, 1, 2);
 	editLayout->addWidget(cancelBtn, BUTTONS, 2, 1, 2);
 
@@ -309,6 +337,9 @@ void KarlsunStyleReceiver::initialize()
 	updateRealUnit();
 	connect(pImpl->offsetEdit, &QLineEdit::textChanged, this, &KarlsunStyleReceiver::updateRealUnit);
 	connect(pImpl->roundingEdit, &QLineEdit::textChanged, this, &KarlsunStyleReceiver::updateRealUnit);
+	connect(pImpl->spacingEdit, &QLineEdit::textChanged, this, &KarlsunStyleReceiver::updateRealUnit);
+	connect(pImpl->bleedEdit, &QLineEdit::textChanged, this, &KarlsunStyleReceiver::updateRealUnit);
+	connect(pImpl->marginEdit, &QLineEdit::textChanged, this, &KarlsunStyleReceiver::updateRealUnit);
 	connect(updateBtn, &QPushButton::released, this, &KarlsunStyleReceiver::handleValues);
 	connect(cancelBtn, &QPushButton::released, [=]() {this->close(); });
 
@@ -321,7 +352,12 @@ void KarlsunStyleReceiver::handleValues()
 	const auto offset = pImpl->offsetEdit->text().toInt();
 	const auto rounding = pImpl->roundingEdit->text().toInt();
 
-	pImpl->Owner->setGlobalKarlsunStyle ({ offset,rounding });
+	KarlsunStyle style{ offset,rounding };
+	style.spacing = pImpl->spacingEdit->text().toInt();
+	style.bleed = pImpl->bleedEdit->text().toInt();
+	style.margin = pImpl->marginEdit->text().toInt();
+
+	pImpl->Owner->setGlobalKarlsunStyle(style);
 
 	this->close();
 }
@@ -336,6 +372,15 @@ void KarlsunStyleReceiver::updateRealUnit()
 
 	pImpl->offsetPxLbl->setText(QString("px (%1mm)").arg(QString::number(offsetInMm, 'f', 2)));
 	pImpl->roundingPxLbl->setText(QString("px (%1mm)").arg(QString::number(roundingInMm, 'f', 2)));
+
+	auto toMmLabel = [this](QLineEdit* edit, QLabel* label)
+	{
+		const double inMm = util::px2mm(edit->text().toInt(), pImpl->curDPI);
+		label->setText(QString("px (%1mm)").arg(QString::number(inMm, 'f', 2)));
+	};
+	toMmLabel(pImpl->spacingEdit, pImpl->spacingPxLbl);
+	toMmLabel(pImpl->bleedEdit, pImpl->bleedPxLbl);
+	toMmLabel(pImpl->marginEdit, pImpl->marginPxLbl);
 }
 
 #pragma endregion
@@ -0,0 +1,165 @@
+// ResultExport.h
+#pragma once
+
+#include <QFile>
+#include <QFileInfo>
+#include <QPainter>
+#include <QPdfWriter>
+#include <QString>
+#include <QStringList>
+#include <functional>
+#include <vector>
+#include "ImageObject.h"
+#include "JpegEncoder.h"
+#include "Karlsun.h"
+#include "Task.h"
+#include "Trace.h"
+#include "TiffWriter.h"
+#include "Utils.h"
+
+// * header only class
+// output files of a packed sheet, shared by the GUI and the headless job runner
+class ResultExport
+{
+public:
+	// an encoded copy of the sheet, downsampled when dpi is below the sheet resolution
+	struct RasterTarget
+	{
+		QString path; //format from the suffix
+		int quality = -1;
+		int dpi = 0; //<= 0 : the sheet resolution
+		TiffWriter::Compression tiffCompression = TiffWriter::Deflate;
+	};
+
+	// cut lines of saveKarlsunPdf, skipped without a path
+	struct CutTarget
+	{
+		QString path;
+		std::vector<Karlsun> karlsuns;
+		QSize sheetSize;
+		int dpi = 0;
+	};
+
+	// every raster target and the cut lines at once, each on its own thread, so the export takes as long as its slowest file
+	// the sheet is wrapped once and shared by the encoders, sheet may be null without raster targets
+	// paths that could not be written are returned, nothing if the task was cancelled
+	static QStringList exportAll(ImageDataRGBXPtr sheet, int sheetDPI, std::vector<RasterTarget> const& rasters,
+		CutTarget const& cut, TaskState* task = nullptr)
+	{
+		BP_TRACE_SCOPE("exportAll");
+		QStringList failed;
+		if (!rasters.empty() && (!sheet || sheetDPI <= 0))
+		{
+			for (auto const& raster : rasters)
+				failed << raster.path;
+			return failed;
+		}
+
+		const QImage shared = sheet ? sheet->toQImage(sheetDPI) : QImage();
+		std::vector<std::function<bool(TaskState*)>> jobs;
+		for (auto const& raster : rasters)
+		{
+			jobs.push_back([&shared, raster, sheetDPI](TaskState* child)
+				{
+					const int dpi = raster.dpi > 0 ? std::min(raster.dpi, sheetDPI) : sheetDPI;
+					if (dpi == sheetDPI)
+						return writeRaster(shared, raster, dpi, child);
+
+					//same edge mapping as BinImageManager::makeProofImage
+					auto scaled = [=](int px) { return std::max(1, (int)(((int64_t)px * dpi + sheetDPI / 2) / sheetDPI)); };
+					QImage reduced = shared.scaled(scaled(shared.width()), scaled(shared.height()), Qt::IgnoreAspectRatio, Qt::SmoothTransformation);
+					const int dpm = (int)(dpi / 0.0254);
+					reduced.setDotsPerMeterX(dpm);
+					reduced.setDotsPerMeterY(dpm);
+					return writeRaster(reduced, raster, dpi, child);
+				});
+		}
+		if (!cut.path.isEmpty())
+			jobs.push_back([&cut](TaskState* child) { return saveKarlsunPdf(cut.path, cut.karlsuns, cut.sheetSize, cut.dpi, child); });
+
+		QStringList paths;
+		for (auto const& raster : rasters)
+			paths << raster.path;
+		if (!cut.path.isEmpty())
+			paths << cut.path;
+
+		util::beginStage(task, "exporting", (int64_t)jobs.size());
+		std::vector<char> saved(jobs.size(), 0);
+		util::parallelFor((int)jobs.size(), [&](int idx)
+			{
+				TaskState child(task);
+				saved.at(idx) = jobs.at(idx)(&child);
+				util::advance(task);
+			}, (int)jobs.size());
+
+		if (util::isCancelled(task))
+			return failed;
+		for (size_t idx = 0; idx < jobs.size(); ++idx)
+			if (!saved.at(idx))
+				failed << paths.at((int)idx);
+		return failed;
+	}
+
+	// JPEG through the strip parallel JpegEncoder, TIFF through the tile parallel TiffWriter, other formats through the Qt plugins
+	static bool writeRaster(QImage const& image, RasterTarget const& raster, int dpi, TaskState* task)
+	{
+		BP_TRACE_SCOPE("writeRaster");
+		const QString suffix = QFileInfo(raster.path).suffix().toLower();
+		if (suffix == "jpg" || suffix == "jpeg")
+			return JpegEncoder::save(image, raster.path, raster.quality, dpi, task);
+		if (TiffWriter::isTiffPath(raster.path))
+		{
+			TiffWriter::Options options;
+			options.compression = raster.tiffCompression;
+			options.dpi = dpi;
+			return TiffWriter::save(image, raster.path, options, task);
+		}
+		return ImageObject::writeImage(image, raster.path, raster.quality, task);
+	}
+
+	// cut lines as a vector PDF of the sheet size, one rounded rect per karlsun or the outline of a nested shape
+	// a cancelled task leaves no file
+	static bool saveKarlsunPdf(QString path, std::vector<Karlsun> const& karlsuns, QSize sheetSize, int dpi, TaskState* task = nullptr)
+	{
+		BP_TRACE_SCOPE("saveKarlsunPdf");
+		if (path.isEmpty() || sheetSize.isEmpty() || dpi <= 0)
+			return false;
+
+		bool retval = false;
+		{
+			QPdfWriter pdfWriter(path);
+			pdfWriter.setPdfVersion(QPdfWriter::PdfVersion::PdfVersion_1_4);
+			pdfWriter.setResolution(dpi);
+			pdfWriter.setPageSizeMM({ util::px2mm(sheetSize.width(), dpi), util::px2mm(sheetSize.height(), dpi) });
+			QMarginsF pageMargin(0, 0, 0, 0);
+			pdfWriter.setPageMargins(pageMargin);
+
+			QPainter painter;
+			if (!painter.begin(&pdfWriter))
+				return false;
+
+			QPen pen(Qt::black);
+			pen.setWidthF(1.5);
+			painter.setPen(pen);
+
+			util::beginStage(task, "cut lines", (int64_t)karlsuns.size());
+			for (auto const& karlsun : karlsuns)
+			{
+				if (util::isCancelled(task))
+					break;
+				if (karlsun.outline.empty())
+					painter.drawRoundedRect(karlsun.rect, karlsun.style.roundPixel, karlsun.style.roundPixel);
+				for (auto const& polygon : karlsun.outline)
+					painter.drawPolygon(polygon);
+				util::advance(task);
+			}
+
+			retval = painter.end() && !util::isCancelled(task);
+		}
+
+		//the writer has closed the file
+		if (!retval && util::isCancelled(task))
+			QFile::remove(path);
+		return retval;
+	}
+};
@@ -0,0 +1,522 @@
+// ShapeMask.h
+#pragma once
+
+// * header only class
+// occupancy of an image at reduced resolution : one bit per cell of cell x cell pixels, set if any pixel of the cell is opaque
+//		rows are 64 bit words, overlaps() and stamp() work a word at a time
+//		holes are filled, the cut follows the outline only so nothing may be nested inside it
+// cells of the nesting packer, clip of a nested image when it is drawn and source of its cut outline
+// bits past the width of a row are always zero
+
+#include <QPolygon>
+#include <QRect>
+#include <QSize>
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+#include <vector>
+#include "ImageObject.h"
+
+class ShapeMask
+{
+public:
+	using Ptr = std::shared_ptr<ShapeMask const>;
+
+	// alpha at or below it is transparent, anti-aliasing fringes do not widen the shape
+	static constexpr unsigned char AlphaThreshold = 8;
+
+	ShapeMask() {}
+	// wid x hi empty cells
+	ShapeMask(int wid, int hi, int cell = 1)
+		: m_wid(std::max(0, wid)), m_hi(std::max(0, hi)), m_cell(std::max(1, cell)), m_words((m_wid + 63) / 64)
+		, m_pixels(m_wid * m_cell, m_hi * m_cell), m_bits((size_t)m_words * m_hi, 0)
+	{
+	}
+
+	// every cell of an image of the given size, e.g. one without alpha
+	static ShapeMask full(QSize pixels, int cell)
+	{
+		ShapeMask retval = forPixels(pixels, cell);
+		retval.fillRect(0, 0, retval.m_wid, retval.m_hi);
+		return retval;
+	}
+
+	// cells with an opaque pixel, holes filled. turned : the image rotated clockwise, as drawSubImage draws it
+	static ShapeMask fromAlpha(ImageDataRGBA const& image, int cell, bool turned = false)
+	{
+		const int wid = image.width(), hi = image.height();
+		ShapeMask retval = forPixels(turned ? QSize(hi, wid) : QSize(wid, hi), cell);
+		cell = retval.m_cell;
+		for (int py = 0; py < hi; ++py)
+		{
+			VectorRGBA const* line = image.rowAddress(py);
+			for (int px = 0; px < wid; ++px)
+			{
+				if (line[px].a() <= AlphaThreshold)
+					continue;
+				//clockwise : pixel (px, py) is drawn at (hi - 1 - py, px)
+				if (turned)
+					retval.set((hi - 1 - py) / cell, px / cell);
+				else
+					retval.set(px / cell, py / cell);
+			}
+		}
+		retval.fillHoles();
+		return retval;
+	}
+
+	int width() const { return m_wid; }
+	int height() const { return m_hi; }
+	int cell() const { return m_cell; }
+	// size of the image the cells cover, the last column and row of cells may be partial
+	QSize pixelSize() const { return m_pixels; }
+	bool isEmpty() const { return m_wid == 0 || m_hi == 0; }
+
+	int64_t count() const
+	{
+		int64_t retval = 0;
+		for (uint64_t bits : m_bits)
+			retval += popcount(bits);
+		return retval;
+	}
+
+	bool test(int x, int y) const
+	{
+		if (x < 0 || y < 0 || x >= m_wid || y >= m_hi)
+			return false;
+		return (row(y)[x >> 6] >> (x & 63)) & 1;
+	}
+
+	void set(int x, int y)
+	{
+		if (x < 0 || y < 0 || x >= m_wid || y >= m_hi)
+			return;
+		row(y)[x >> 6] |= uint64_t(1) << (x & 63);
+	}
+
+	// clipped to the mask
+	void fillRect(int x, int y, int wid, int hi)
+	{
+		const int left = std::max(0, x), right = std::min(m_wid, x + wid);
+		const int top = std::max(0, y), bottom = std::min(m_hi, y + hi);
+		for (int cy = top; cy < bottom; ++cy)
+			for (int cx = left; cx < right; ++cx)
+				set(cx, cy);
+	}
+
+#pragma region Collision
+	// true if a set cell of other, its top left at cell (x, y) of this, meets a set cell of this
+	// cells of other outside this are ignored
+	bool overlaps(ShapeMask const& other, int x, int y) const
+	{
+		int hint = 0;
+		return overlaps(other, x, y, hint);
+	}
+
+	// hint : row of other tested first, set to the row that met. the positions a packer tries next to each other mostly meet on the same row
+	bool overlaps(ShapeMask const& other, int x, int y, int& hint) const
+	{
+		const int top = std::max(0, -y), bottom = std::min(other.m_hi, m_hi - y);
+		if (hint >= top && hint < bottom && rowOverlaps(other, hint, x, y))
+			return true;
+		for (int oy = top; oy < bottom; ++oy)
+		{
+			if (oy != hint && rowOverlaps(other, oy, x, y))
+			{
+				hint = oy;
+				return true;
+			}
+		}
+		return false;
+	}
+
+	// sets the cells of other, its top left at cell (x, y) of this. cells outside this are dropped
+	void stamp(ShapeMask const& other, int x, int y)
+	{
+		const int top = std::max(0, -y), bottom = std::min(other.m_hi, m_hi - y);
+		for (int oy = top; oy < bottom; ++oy)
+			orShifted(row(oy + y), other.row(oy), other.m_words, x);
+	}
+
+	// set cells within radius of a set cell (chessboard distance), the frame grows by radius on every side
+	ShapeMask grown(int radius) const
+	{
+		radius = std::max(0, radius);
+		ShapeMask retval(m_wid + 2 * radius, m_hi + 2 * radius, m_cell);
+		retval.stamp(*this, radius, radius);
+		retval.dilate(radius);
+		return retval;
+	}
+
+	// set cells whose whole neighborhood of radius is set, outside of the frame counts as empty
+	ShapeMask shrunk(int radius) const
+	{
+		if (radius <= 0)
+			return *this;
+		ShapeMask inverse(m_wid + 2 * radius, m_hi + 2 * radius, m_cell);
+		inverse.stamp(*this, radius, radius);
+		inverse.invert();
+		inverse.dilate(radius);
+		inverse.invert();
+
+		ShapeMask retval = *this;
+		std::fill(retval.m_bits.begin(), retval.m_bits.end(), 0);
+		retval.stamp(inverse, -radius, -radius);
+		return retval;
+	}
+#pragma endregion
+
+#pragma region Geometry
+	// set cells as pixel rects, each row of runs merged with identical runs below it
+	// clipped to pixelSize(), in the order of their top edge
+	std::vector<QRect> runs() const
+	{
+		struct Run { int left, right, top; };
+		std::vector<QRect> retval;
+		std::vector<Run> open, next;
+		auto close = [&](Run const& run, int bottom)
+		{
+			const int left = run.left * m_cell, top = run.top * m_cell;
+			const int right = std::min(run.right * m_cell, m_pixels.width()), lower = std::min(bottom * m_cell, m_pixels.height());
+			if (right > left && lower > top)
+				retval.emplace_back(left, top, right - left, lower - top);
+		};
+
+		for (int y = 0; y <= m_hi; ++y)
+		{
+			next.clear();
+			for (int x = 0; y < m_hi && x < m_wid;)
+			{
+				if (!test(x, y))
+				{
+					x++;
+					continue;
+				}
+				const int left = x;
+				while (x < m_wid && test(x, y))
+					x++;
+				next.push_back(Run{ left, x, y });
+			}
+
+			//both sorted by left edge, a run of the row above goes on if this row has the same one
+			size_t idx = 0;
+			for (auto const& run : open)
+			{
+				while (idx < next.size() && next[idx].left < run.left)
+					idx++;
+				if (idx < next.size() && next[idx].left == run.left && next[idx].right == run.right)
+					next[idx].top = run.top;
+				else
+					close(run, y);
+			}
+			open.swap(next);
+		}
+
+		std::stable_sort(retval.begin(), retval.end(), [](QRect const& lhs, QRect const& rhs) { return lhs.y() < rhs.y(); });
+		return retval;
+	}
+
+	// closed outlines of the set cells in pixels, clockwise, one per island of edge connected cells
+	// cell corners simplified within tolerance pixels (Douglas-Peucker), clipped to pixelSize()
+	std::vector<QPolygon> outline(double tolerance = 0) const
+	{
+		//boundary edges between a set and an empty cell, the set one on the right
+		//directions clockwise : +x, +y, -x, -y
+		const int stride = m_wid + 1;
+		struct Edge { int from, to, dir; };
+		auto vertex = [stride](int vx, int vy) { return vx + vy * stride; };
+		std::vector<Edge> edges;
+		for (int y = 0; y < m_hi; ++y)
+		{
+			for (int x = 0; x < m_wid; ++x)
+			{
+				if (!test(x, y))
+					continue;
+				if (!test(x, y - 1))
+					edges.push_back(Edge{ vertex(x, y), vertex(x + 1, y), 0 });
+				if (!test(x + 1, y))
+					edges.push_back(Edge{ vertex(x + 1, y), vertex(x + 1, y + 1), 1 });
+				if (!test(x, y + 1))
+					edges.push_back(Edge{ vertex(x + 1, y + 1), vertex(x, y + 1), 2 });
+				if (!test(x - 1, y))
+					edges.push_back(Edge{ vertex(x, y + 1), vertex(x, y), 3 });
+			}
+		}
+
+		//outgoing edges by vertex, two at most where islands touch diagonally
+		std::vector<int> first((size_t)stride * (m_hi + 1) + 1, 0);
+		for (auto const& edge : edges)
+			first[edge.from + 1]++;
+		for (size_t idx = 1; idx < first.size(); ++idx)
+			first[idx] += first[idx - 1];
+		std::vector<int> byVertex(edges.size());
+		{
+			std::vector<int> filled(first.begin(), first.end() - 1);
+			for (int idx = 0; idx < (int)edges.size(); ++idx)
+				byVertex[filled[edges[idx].from]++] = idx;
+		}
+
+		std::vector<QPolygon> retval;
+		std::vector<char> used(edges.size(), 0);
+		for (int start = 0; start < (int)edges.size(); ++start)
+		{
+			if (used[start])
+				continue;
+
+			std::vector<QPoint> corners;
+			int current = start, dir = -1;
+			while (current >= 0 && !used[current])
+			{
+				auto const& edge = edges[current];
+				used[current] = 1;
+				if (edge.dir != dir)
+					corners.push_back(pixelAt(edge.from % stride, edge.from / stride));
+				dir = edge.dir;
+
+				//right turn first, then straight on : islands touching at a corner stay apart
+				current = -1;
+				for (int turn : { 1, 0, 3 })
+				{
+					for (int slot = first[edge.to]; slot < first[edge.to + 1]; ++slot)
+					{
+						const int candidate = byVertex[slot];
+						if (!used[candidate] && edges[candidate].dir == (dir + turn) % 4)
+						{
+							current = candidate;
+							break;
+						}
+					}
+					if (current >= 0)
+						break;
+				}
+			}
+
+			corners.erase(std::unique(corners.begin(), corners.end()), corners.end());
+			while (corners.size() > 1 && corners.front() == corners.back())
+				corners.pop_back();
+			if (corners.size() < 3)
+				continue;
+
+			QPolygon polygon;
+			for (auto const& point : simplifyClosed(corners, tolerance))
+				polygon << point;
+			retval.push_back(polygon);
+		}
+		return retval;
+	}
+#pragma endregion
+
+protected:
+	static ShapeMask forPixels(QSize pixels, int cell)
+	{
+		cell = std::max(1, cell);
+		ShapeMask retval((pixels.width() + cell - 1) / cell, (pixels.height() + cell - 1) / cell, cell);
+		retval.m_pixels = pixels;
+		return retval;
+	}
+
+	uint64_t* row(int y) { return m_bits.data() + (size_t)y * m_words; }
+	uint64_t const* row(int y) const { return m_bits.data() + (size_t)y * m_words; }
+
+	static int popcount(uint64_t bits)
+	{
+		int retval = 0;
+		for (; bits; bits &= bits - 1)
+			retval++;
+		return retval;
+	}
+
+	// row oy of other at row oy + y of this, which has to exist
+	bool rowOverlaps(ShapeMask const& other, int oy, int x, int y) const
+	{
+		uint64_t const* src = other.row(oy);
+		for (int word = 0; word < other.m_words; ++word)
+			if (src[word] && (src[word] & bitsAt(oy + y, x + word * 64)))
+				return true;
+		return false;
+	}
+
+	// 64 cells of row y from cell pos on, pos may be negative. zero outside of the row
+	uint64_t bitsAt(int y, int pos) const
+	{
+		uint64_t const* line = row(y);
+		const int word = pos >= 0 ? pos / 64 : -((63 - pos) / 64);
+		const int shift = pos - word * 64;
+		const uint64_t lo = word >= 0 && word < m_words ? line[word] : 0;
+		const uint64_t hi = word + 1 >= 0 && word + 1 < m_words ? line[word + 1] : 0;
+		return shift ? (lo >> shift) | (hi << (64 - shift)) : lo;
+	}
+
+	// dst |= src moved by offset cells, bits past this width are dropped
+	void orShifted(uint64_t* dst, uint64_t const* src, int srcWords, int offset) const
+	{
+		const int word = offset >= 0 ? offset / 64 : -((63 - offset) / 64);
+		const int shift = offset - word * 64;
+		for (int idx = 0; idx < srcWords; ++idx)
+		{
+			if (!src[idx])
+				continue;
+			const int target = idx + word;
+			if (target >= 0 && target < m_words)
+				dst[target] |= src[idx] << shift;
+			if (shift && target + 1 >= 0 && target + 1 < m_words)
+				dst[target + 1] |= src[idx] >> (64 - shift);
+		}
+		clearTail(dst);
+	}
+
+	void clearTail(uint64_t* line) const
+	{
+		if (m_words && (m_wid & 63))
+			line[m_words - 1] &= (uint64_t(1) << (m_wid & 63)) - 1;
+	}
+
+	void invert()
+	{
+		for (int y = 0; y < m_hi; ++y)
+		{
+			uint64_t* line = row(y);
+			for (int word = 0; word < m_words; ++word)
+				line[word] = ~line[word];
+			clearTail(line);
+		}
+	}
+
+	// in place, the frame is kept. horizontal then vertical passes, the reach doubles every step
+	void dilate(int radius)
+	{
+		std::vector<uint64_t> source(m_words);
+		for (int y = 0; y < m_hi; ++y)
+		{
+			uint64_t* line = row(y);
+			for (int covered = 0, step = 1; covered < radius; covered += step, step *= 2)
+			{
+				step = std::min(step, radius - covered);
+				std::copy(line, line + m_words, source.begin());
+				orShifted(line, source.data(), m_words, step);
+				orShifted(line, source.data(), m_words, -step);
+			}
+		}
+
+		std::vector<uint64_t> rows;
+		for (int covered = 0, step = 1; covered < radius; covered += step, step *= 2)
+		{
+			step = std::min(step, radius - covered);
+			rows = m_bits;
+			for (int y = 0; y < m_hi; ++y)
+			{
+				uint64_t* line = row(y);
+				for (int from : { y - step, y + step })
+				{
+					if (from < 0 || from >= m_hi)
+						continue;
+					uint64_t const* src = rows.data() + (size_t)from * m_words;
+					for (int word = 0; word < m_words; ++word)
+						line[word] |= src[word];
+				}
+			}
+		}
+	}
+
+	// empty cells not reachable from the border through empty cells are set
+	void fillHoles()
+	{
+		std::vector<char> outside((size_t)m_wid * m_hi, 0);
+		std::vector<int> pending;
+		auto reach = [&](int x, int y)
+		{
+			if (x < 0 || y < 0 || x >= m_wid || y >= m_hi || test(x, y) || outside[(size_t)y * m_wid + x])
+				return;
+			outside[(size_t)y * m_wid + x] = 1;
+			pending.push_back(y * m_wid + x);
+		};
+		for (int x = 0; x < m_wid; ++x)
+		{
+			reach(x, 0);
+			reach(x, m_hi - 1);
+		}
+		for (int y = 0; y < m_hi; ++y)
+		{
+			reach(0, y);
+			reach(m_wid - 1, y);
+		}
+		while (!pending.empty())
+		{
+			const int idx = pending.back();
+			pending.pop_back();
+			const int x = idx % m_wid, y = idx / m_wid;
+			reach(x - 1, y);
+			reach(x + 1, y);
+			reach(x, y - 1);
+			reach(x, y + 1);
+		}
+
+		for (int y = 0; y < m_hi; ++y)
+			for (int x = 0; x < m_wid; ++x)
+				if (!outside[(size_t)y * m_wid + x])
+					set(x, y);
+	}
+
+	QPoint pixelAt(int vx, int vy) const
+	{
+		return QPoint(std::min(vx * m_cell, m_pixels.width()), std::min(vy * m_cell, m_pixels.height()));
+	}
+
+	// Douglas-Peucker on a closed ring : split at the corner farthest from the first, both chains simplified
+	static std::vector<QPoint> simplifyClosed(std::vector<QPoint> const& ring, double tolerance)
+	{
+		const int count = (int)ring.size();
+		if (tolerance <= 0 || count <= 4)
+			return ring;
+
+		auto distance2 = [](QPoint const& a, QPoint const& b) { return (double)(a.x() - b.x()) * (a.x() - b.x()) + (double)(a.y() - b.y()) * (a.y() - b.y()); };
+		int far = 0;
+		for (int idx = 1; idx < count; ++idx)
+			if (distance2(ring[idx], ring[0]) > distance2(ring[far], ring[0]))
+				far = idx;
+
+		std::vector<char> keep(count, 0);
+		keep[0] = keep[far] = 1;
+		std::vector<std::pair<int, int>> chains{ { 0, far }, { far, count } };
+		while (!chains.empty())
+		{
+			const auto [from, to] = chains.back();
+			chains.pop_back();
+			QPoint const& a = ring[from];
+			QPoint const& b = ring[to % count];
+			const double dx = b.x() - a.x(), dy = b.y() - a.y(), length = std::sqrt(dx * dx + dy * dy);
+
+			int worst = -1;
+			double worstDistance = tolerance;
+			for (int idx = from + 1; idx < to; ++idx)
+			{
+				QPoint const& p = ring[idx];
+				const double d = length > 0 ? std::abs(dy * (p.x() - a.x()) - dx * (p.y() - a.y())) / length : std::sqrt(distance2(p, a));
+				if (d > worstDistance)
+				{
+					worstDistance = d;
+					worst = idx;
+				}
+			}
+			if (worst < 0)
+				continue;
+			keep[worst] = 1;
+			chains.emplace_back(from, worst);
+			chains.emplace_back(worst, to);
+		}
+
+		std::vector<QPoint> retval;
+		for (int idx = 0; idx < count; ++idx)
+			if (keep[idx])
+				retval.push_back(ring[idx]);
+		return retval;
+	}
+
+	int m_wid = 0, m_hi = 0;
+	int m_cell = 1;
+	int m_words = 0;
+	QSize m_pixels;
+	std::vector<uint64_t> m_bits;
+};
+using ShapeMaskPtr = ShapeMask::Ptr;
@@ -0,0 +1,344 @@
+// SheetPdfWriter.h
+#pragma once
+
+#include <QByteArray>
+#include <QFile>
+#include <QString>
+#include <algorithm>
+#include <atomic>
+#include <map>
+#include <vector>
+#include "BinImage.h"
+#include "ImageObject.h"
+#include "ImageProbe.h"
+#include "Karlsun.h"
+#include "Task.h"
+#include "Trace.h"
+#include "Utils.h"
+
+// * header only class
+// the packed sheet as a one page PDF that places the source images instead of a composited raster
+//		every distinct source is one image XObject, drawn at BinImage::result by its transform matrix, rotated ones included
+//		JPEG files are embedded as they are (DCTDecode), other images as lossless FlateDecode RGB
+//		bleed bands stretch the edge pixels of the same XObject, as extendBorder does on the raster sheet
+//		cut paths are stroked in a CutContour separation on their own optional content layer
+// the file is about the size of its inputs and is written without decoding a JPEG
+class SheetPdfWriter
+{
+public:
+	struct Options
+	{
+		int dpi = 300;
+		int bleed = 0;
+		std::vector<Karlsun> karlsuns;
+	};
+
+	// images without a result are left out, a cancelled task or an unreadable image leaves no file
+	static bool save(QString path, std::vector<BinImagePtr> const& images, QSize sheetSize, Options const& options, TaskState* task = nullptr)
+	{
+		if (path.isEmpty() || sheetSize.isEmpty() || options.dpi <= 0)
+			return false;
+		BP_TRACE_SCOPE("SheetPdfWriter::save");
+
+		//one XObject per file, or per buffer for images added from memory
+		std::vector<Source> sources;
+		std::vector<std::pair<BinImagePtr, int>> placements;
+		std::map<QString, int> sourceOf;
+		for (auto const& binImage : images)
+		{
+			if (binImage->result.isEmpty())
+				continue;
+			const QString key = binImage->handle->hasFile() ? binImage->path() : QString::number(binImage->handle->hash(), 16);
+			auto found = sourceOf.find(key);
+			if (found == sourceOf.end())
+			{
+				found = sourceOf.emplace(key, (int)sources.size()).first;
+				sources.push_back(Source{ binImage });
+			}
+			placements.emplace_back(binImage, found->second);
+		}
+
+		util::beginStage(task, "encoding", (int64_t)sources.size());
+		std::atomic<bool> suc{ true };
+		util::parallelFor((int)sources.size(), [&](int idx)
+			{
+				if (!suc || util::isCancelled(task) || !prepare(sources.at(idx)))
+					suc = false;
+				util::advance(task);
+			});
+		if (!suc || util::isCancelled(task))
+			return false;
+
+		CancellableFile file(path, task);
+		if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+			return false;
+
+		util::beginStage(task, "writing", (int64_t)sources.size());
+		Objects objects(file, FirstImage + (int)sources.size());
+		bool written = file.write("%PDF-1.5\n%\xE2\xE3\xCF\xD3\n") > 0;
+		for (size_t idx = 0; written && idx < sources.size(); ++idx)
+		{
+			written = writeImage(objects, FirstImage + (int)idx, sources[idx]);
+			sources[idx].stream = QByteArray();
+			util::advance(task);
+		}
+
+		//sheet pixels with y down : 72 / dpi points per pixel
+		const double scale = 72.0 / options.dpi;
+		const double pageWid = sheetSize.width() * scale, pageHi = sheetSize.height() * scale;
+		const QByteArray toSheet = matrix(scale, 0, 0, -scale, 0, pageHi);
+
+		QByteArray content;
+		content += "q " + toSheet + " cm\n";
+		for (auto const& placement : placements)
+			drawPlaced(content, *placement.first, placement.second, std::max(0, options.bleed));
+		content += "Q\n";
+
+		content += "/OC /CutLayer BDC\nq " + toSheet + " cm /Cut CS 1 SCN 1.5 w\n";
+		for (auto const& karlsun : options.karlsuns)
+			if (karlsun.style.isUsable() && !karlsun.outline.empty())
+				outline(content, karlsun.outline);
+			else if (karlsun.style.isUsable() && !karlsun.rect.isEmpty())
+				roundedRect(content, karlsun.rect, karlsun.style.roundPixel);
+		content += "Q\nEMC\n";
+
+		const QByteArray packed = qCompress(content).mid(4);
+
+		QByteArray xobjects;
+		for (size_t idx = 0; idx < sources.size(); ++idx)
+			xobjects += "/Im" + QByteArray::number((qint64)idx) + " " + ref(FirstImage + (int)idx) + " ";
+
+		written = written
+			&& objects.write(Catalog, "<< /Type /Catalog /Pages " + ref(Pages)
+				+ " /OCProperties << /OCGs [" + ref(CutLayer) + "] /D << /Order [" + ref(CutLayer) + "] /ON [" + ref(CutLayer) + "] >> >> >>")
+			&& objects.write(Pages, "<< /Type /Pages /Kids [" + ref(Page) + "] /Count 1 >>")
+			&& objects.write(Page, "<< /Type /Page /Parent " + ref(Pages)
+				+ " /MediaBox [0 0 " + number(pageWid) + " " + number(pageHi) + "]"
+				+ " /Resources << /XObject << " + xobjects + ">> /ColorSpace << /Cut " + ref(CutColorSpace) + " >>"
+				+ " /Properties << /CutLayer " + ref(CutLayer) + " >> >>"
+				+ " /Contents " + ref(Contents) + " >>")
+			&& objects.write(Contents, "<< /Length " + QByteArray::number((qint64)packed.size()) + " /Filter /FlateDecode >>", &packed)
+			&& objects.write(CutLayer, "<< /Type /OCG /Name (CutContour) >>")
+			&& objects.write(CutColorSpace, "[/Separation /CutContour /DeviceCMYK"
+				" << /FunctionType 2 /Domain [0 1] /C0 [0 0 0 0] /C1 [0 1 0 0] /N 1 >>]")
+			&& objects.finish(Catalog);
+
+		file.close();
+		if (!written)
+			QFile::remove(path);
+		return written;
+	}
+
+protected:
+	// fixed object numbers, images follow
+	enum { Catalog = 1, Pages, Page, Contents, CutLayer, CutColorSpace, FirstImage };
+
+	struct Source
+	{
+		BinImagePtr binImage;
+		bool dct = false; //the file is the stream
+		int components = 3;
+		QByteArray stream; //FlateDecode RGB rows otherwise
+	};
+
+	// byte offsets of the objects for the cross reference table
+	class Objects
+	{
+	public:
+		Objects(QFile& file, int count) : file(file), offsets(count, 0) {}
+
+		bool begin(int number, QByteArray const& dictionary)
+		{
+			offsets.at(number) = file.pos();
+			const QByteArray head = QByteArray::number((qint64)number) + " 0 obj\n" + dictionary;
+			return file.write(head) == head.size();
+		}
+
+		bool end(bool stream)
+		{
+			const QByteArray tail = stream ? "\nendstream\nendobj\n" : "\nendobj\n";
+			return file.write(tail) == tail.size();
+		}
+
+		bool write(int number, QByteArray const& dictionary, QByteArray const* stream = nullptr)
+		{
+			if (!begin(number, dictionary))
+				return false;
+			if (stream && (file.write("\nstream\n") != 8 || file.write(*stream) != stream->size()))
+				return false;
+			return end(stream != nullptr);
+		}
+
+		bool finish(int root)
+		{
+			const qint64 xref = file.pos();
+			QByteArray table = "xref\n0 " + QByteArray::number((qint64)offsets.size()) + "\n0000000000 65535 f \n";
+			for (size_t idx = 1; idx < offsets.size(); ++idx)
+				table += QByteArray::number(offsets[idx]).rightJustified(10, '0') + " 00000 n \n";
+			table += "trailer\n<< /Size " + QByteArray::number((qint64)offsets.size()) + " /Root " + ref(root)
+				+ " >>\nstartxref\n" + QByteArray::number(xref) + "\n%%EOF\n";
+			return file.write(table) == table.size();
+		}
+
+		QFile& file;
+		std::vector<qint64> offsets;
+	};
+
+	static QByteArray ref(int number) { return QByteArray::number((qint64)number) + " 0 R"; }
+
+	static QByteArray number(double value)
+	{
+		QByteArray retval = QByteArray::number(value, 'f', 4);
+		while (retval.contains('.') && (retval.endsWith('0') || retval.endsWith('.')))
+			retval.chop(1);
+		return retval;
+	}
+
+	static QByteArray matrix(double a, double b, double c, double d, double e, double f)
+	{
+		return number(a) + " " + number(b) + " " + number(c) + " " + number(d) + " " + number(e) + " " + number(f);
+	}
+
+	// a JPEG the PDF can carry is only probed, everything else is decoded and deflated
+	static bool prepare(Source& source)
+	{
+		BP_TRACE_SCOPE("preparePdfImage");
+		BinImage const& binImage = *source.binImage;
+		QSize size;
+		if (binImage.handle->hasFile() && ImageProbe::dctPassthrough(binImage.path(), size, source.components) && size == binImage.size())
+		{
+			source.dct = true;
+			return true;
+		}
+
+		source.components = 3;
+		//resident or decoded for the stream only, the size is checked against the probed one
+		auto img = binImage.handle->load();
+		if (!img)
+			return false;
+
+		//VectorRGB rows are the samples of a DeviceRGB image, qCompress prefixes the zlib stream with the size
+		source.stream = qCompress(QByteArray::fromRawData(reinterpret_cast<char const*>(img->bits()), img->dataSize())).mid(4);
+		return true;
+	}
+
+	static bool writeImage(Objects& objects, int number, Source const& source)
+	{
+		const QSize size = source.binImage->size();
+		QByteArray dictionary = "<< /Type /XObject /Subtype /Image /Width " + QByteArray::number((qint64)size.width())
+			+ " /Height " + QByteArray::number((qint64)size.height())
+			+ (source.components == 1 ? " /ColorSpace /DeviceGray" : " /ColorSpace /DeviceRGB") + " /BitsPerComponent 8";
+		if (!source.dct)
+		{
+			dictionary += " /Filter /FlateDecode /Length " + QByteArray::number((qint64)source.stream.size()) + " >>";
+			return objects.write(number, dictionary, &source.stream);
+		}
+
+		//copied in pieces, the file may have changed since it was probed
+		QFile input(source.binImage->path());
+		if (!input.open(QIODevice::ReadOnly))
+			return false;
+		const qint64 length = input.size();
+		dictionary += " /Filter /DCTDecode /Length " + QByteArray::number(length) + " >>\nstream\n";
+		if (!objects.begin(number, dictionary))
+			return false;
+
+		qint64 copied = 0;
+		while (copied < length)
+		{
+			const QByteArray chunk = input.read(std::min<qint64>(length - copied, 4 << 20));
+			if (chunk.isEmpty() || objects.file.write(chunk) != chunk.size())
+				return false;
+			copied += chunk.size();
+		}
+		return objects.end(true);
+	}
+
+	// unit square of the image onto rect of the sheet (pixels, y down), rotated clockwise if flipped
+	static QByteArray placement(double x, double y, double wid, double hi, bool flipped)
+	{
+		//the first sample row is the top of the unit square
+		if (flipped)
+			return matrix(0, hi, wid, 0, x, y);
+		return matrix(wid, 0, 0, -hi, x, y + hi);
+	}
+
+	static void drawPlaced(QByteArray& content, BinImage const& binImage, int source, int bleed)
+	{
+		const QByteArray name = "/Im" + QByteArray::number((qint64)source);
+		const QRect rect = binImage.result;
+		const double x = rect.x(), y = rect.y(), wid = rect.width(), hi = rect.height();
+		if (binImage.shape)
+		{
+			//nested : clipped to the runs of its shape, no bleed bands
+			content += "q ";
+			for (auto const& run : binImage.shape->runs())
+				content += number(x + run.x()) + " " + number(y + run.y()) + " " + number(run.width()) + " " + number(run.height()) + " re ";
+			content += "W n " + placement(x, y, wid, hi, binImage.isFlipped) + " cm " + name + " Do Q\n";
+			return;
+		}
+		content += "q " + placement(x, y, wid, hi, binImage.isFlipped) + " cm " + name + " Do Q\n";
+		if (bleed <= 0)
+			return;
+
+		//each band shows the image scaled so that its edge pixels span the band, clipped to the band
+		for (int dy = -1; dy <= 1; ++dy)
+		{
+			for (int dx = -1; dx <= 1; ++dx)
+			{
+				if (dx == 0 && dy == 0)
+					continue;
+
+				const double clipX = dx < 0 ? x - bleed : dx == 0 ? x : x + wid;
+				const double clipY = dy < 0 ? y - bleed : dy == 0 ? y : y + hi;
+				const double clipWid = dx == 0 ? wid : bleed, clipHi = dy == 0 ? hi : bleed;
+
+				const double drawWid = dx == 0 ? wid : wid * bleed, drawHi = dy == 0 ? hi : hi * bleed;
+				const double drawX = dx < 0 ? x - bleed : dx == 0 ? x : x + wid + bleed - drawWid;
+				const double drawY = dy < 0 ? y - bleed : dy == 0 ? y : y + hi + bleed - drawHi;
+
+				content += "q " + number(clipX) + " " + number(clipY) + " " + number(clipWid) + " " + number(clipHi) + " re W n "
+					+ placement(drawX, drawY, drawWid, drawHi, binImage.isFlipped) + " cm " + name + " Do Q\n";
+			}
+		}
+	}
+
+	// closed polygons of a nested shape, same path as QPainter::drawPolygon of saveKarlsunPdf
+	static void outline(QByteArray& content, std::vector<QPolygon> const& polygons)
+	{
+		for (auto const& polygon : polygons)
+		{
+			if (polygon.size() < 3)
+				continue;
+			content += number(polygon.front().x()) + " " + number(polygon.front().y()) + " m\n";
+			for (int idx = 1; idx < (int)polygon.size(); ++idx)
+				content += number(polygon.at(idx).x()) + " " + number(polygon.at(idx).y()) + " l\n";
+			content += "h S\n";
+		}
+	}
+
+	// same outline as QPainter::drawRoundedRect of saveKarlsunPdf
+	static void roundedRect(QByteArray& content, QRect const& rect, int round)
+	{
+		const double x = rect.x(), y = rect.y(), wid = rect.width(), hi = rect.height();
+		const double r = std::min<double>(std::max(0, round), std::min(wid, hi) / 2);
+		if (r <= 0)
+		{
+			content += number(x) + " " + number(y) + " " + number(wid) + " " + number(hi) + " re S\n";
+			return;
+		}
+
+		//quarter circles as cubic beziers
+		const double k = r * 0.5523;
+		auto point = [](double px, double py) { return number(px) + " " + number(py) + " "; };
+		content += point(x + r, y) + "m\n";
+		content += point(x + wid - r, y) + "l\n";
+		content += point(x + wid - r + k, y) + point(x + wid, y + r - k) + point(x + wid, y + r) + "c\n";
+		content += point(x + wid, y + hi - r) + "l\n";
+		content += point(x + wid, y + hi - r + k) + point(x + wid - r + k, y + hi) + point(x + wid - r, y + hi) + "c\n";
+		content += point(x + r, y + hi) + "l\n";
+		content += point(x + r - k, y + hi) + point(x, y + hi - r + k) + point(x, y + hi - r) + "c\n";
+		content += point(x, y + r) + "l\n";
+		content += point(x, y + r - k) + point(x + r - k, y) + point(x + r, y) + "c\nh S\n";
+	}
+};
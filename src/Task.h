@@ -0,0 +1,120 @@
+// Task.h
+#pragma once
+
+#include <QFile>
+#include <QString>
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <future>
+#include <memory>
+#include <mutex>
+
+// * header only class
+// cancel token and progress of a long operation, shared by the worker and whoever watches it
+// the worker checks util::isCancelled() between units of work and reports them with util::beginStage() / util::advance()
+// every TaskState* parameter may be null : not cancellable, progress not reported
+// a child has its own progress and is cancelled with its parent, e.g. one of several concurrent exports
+class TaskState
+{
+public:
+	explicit TaskState(TaskState const* parent = nullptr) : parent(parent) {}
+
+	void cancel() { cancelled = true; }
+	bool isCancelled() const { return cancelled || (parent && parent->isCancelled()); }
+
+	// total <= 0 : the stage has no measurable progress
+	void beginStage(QString name, int64_t total)
+	{
+		std::lock_guard<std::mutex> lock(stageMutex);
+		stageName = name;
+		stageTotal = total;
+		stageDone = 0;
+	}
+
+	void advance(int64_t count) { stageDone += count; }
+
+	// for time or iteration budgeted stages, fraction of the total
+	void setFraction(double fraction)
+	{
+		const int64_t total = stageTotal;
+		stageDone = (int64_t)(std::clamp(fraction, 0.0, 1.0) * (double)total);
+	}
+
+	QString stage() const
+	{
+		std::lock_guard<std::mutex> lock(stageMutex);
+		return stageName;
+	}
+
+	// [0, 1] of the current stage, negative if it has no measurable progress
+	double fraction() const
+	{
+		const int64_t total = stageTotal;
+		if (total <= 0)
+			return -1;
+		return std::clamp((double)stageDone / (double)total, 0.0, 1.0);
+	}
+
+protected:
+	TaskState const* parent = nullptr;
+	std::atomic<bool> cancelled{ false };
+	mutable std::mutex stageMutex;
+	QString stageName;
+	std::atomic<int64_t> stageTotal{ 0 };
+	std::atomic<int64_t> stageDone{ 0 };
+};
+using TaskStatePtr = std::shared_ptr<TaskState>;
+
+// null safe accessors for the workers
+namespace util
+{
+	inline bool isCancelled(TaskState const* task) { return task && task->isCancelled(); }
+	inline void beginStage(TaskState* task, QString name, int64_t total) { if (task) task->beginStage(name, total); }
+	inline void advance(TaskState* task, int64_t count = 1) { if (task) task->advance(count); }
+	inline void setFraction(TaskState* task, double fraction) { if (task) task->setFraction(fraction); }
+}
+
+// writes fail once the task is cancelled, an encoder writing through it gives up at its next write
+class CancellableFile : public QFile
+{
+public:
+	CancellableFile(QString path, TaskState const* task) : QFile(path), task(task) {}
+
+protected:
+	qint64 writeData(const char* data, qint64 len) override
+	{
+		if (util::isCancelled(task))
+			return -1;
+		return QFile::writeData(data, len);
+	}
+
+	TaskState const* task = nullptr;
+};
+
+// func(TaskState*) run on its own thread, the result is taken with get() once isReady()
+template <typename T>
+class Task
+{
+public:
+	template <typename FuncT>
+	static Task start(FuncT&& func)
+	{
+		Task retval;
+		retval.state = std::make_shared<TaskState>();
+		auto state = retval.state;
+		retval.future = std::async(std::launch::async, [state, func]() { return func(state.get()); });
+		return retval;
+	}
+
+	bool isReady() const { return future.wait_for(std::chrono::seconds(0)) == std::future_status::ready; }
+	bool waitFor(int ms) const { return future.wait_for(std::chrono::milliseconds(ms)) == std::future_status::ready; }
+	T get() { return future.get(); }
+
+	void cancel() { state->cancel(); }
+	TaskState const& progress() const { return *state; }
+
+protected:
+	TaskStatePtr state;
+	std::future<T> future;
+};
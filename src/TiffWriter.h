@@ -0,0 +1,410 @@
+// TiffWriter.h
+#pragma once
+
+#include <QByteArray>
+#include <QFileInfo>
+#include <QImage>
+#include <QRect>
+#include <QString>
+#include <algorithm>
+#include <atomic>
+#include <functional>
+#include <vector>
+#include "ImageObject.h"
+#include "PixelKernels.h"
+#include "Task.h"
+#include "Trace.h"
+#include "Utils.h"
+
+// * header only class
+// lossless tiled RGB TIFF for print RIPs, BigTIFF once the pixels could pass the 4 GB offsets of a classic TIFF
+// the image is pulled from a TileSource one row of tiles at a time, every tile of a row rendered and compressed on its own thread
+// only that row of compressed tiles is held, the offset tables and the directory are written after the last tile
+//		header, tile 0, tile 1, ..., out of line tag values, IFD
+// so a sheet larger than memory is written from its placements without being composited (see BinImageManager::saveTiff)
+class TiffWriter
+{
+public:
+	// TIFF compression tag values, compressed tiles use horizontal differencing (Predictor 2)
+	enum Compression { NoCompression = 1, LZW = 5, Deflate = 8 };
+
+	struct Options
+	{
+		Compression compression = Deflate;
+		int dpi = 0; //<= 0 : no resolution tags
+		int tileSize = 256; //multiple of 16
+		int threadCount = 0;
+		bool bigTiff = false; //forced, chosen by size otherwise
+	};
+
+	// fills every pixel of tile, rect is in image coordinates and may pass the right and bottom edges
+	// called concurrently for the tiles of one row
+	using TileSource = std::function<bool(QRect const& rect, ImageDataRGBX& tile)>;
+
+	// called on the writing thread before the tiles of each row are requested, band is the part of the image they cover
+	using RowHook = std::function<bool(QRect const& band)>;
+
+	static bool isTiffPath(QString path)
+	{
+		const QString suffix = QFileInfo(path).suffix().toLower();
+		return suffix == "tif" || suffix == "tiff";
+	}
+
+	// "none", "lzw", "deflate", the default for anything else
+	static Compression compressionFromName(QString name, Compression defaultValue = Deflate)
+	{
+		name = name.toLower();
+		if (name == "none")
+			return NoCompression;
+		if (name == "lzw")
+			return LZW;
+		if (name == "deflate")
+			return Deflate;
+		return defaultValue;
+	}
+
+	static QString compressionName(Compression compression)
+	{
+		switch (compression)
+		{
+		case NoCompression: return "none";
+		case LZW: return "lzw";
+		default: return "deflate";
+		}
+	}
+
+	static bool save(QImage const& image, QString path, Options const& options, TaskState* task = nullptr)
+	{
+		if (image.isNull())
+			return false;
+		if (image.format() != QImage::Format_RGB32)
+			return save(image.convertToFormat(QImage::Format_RGB32), path, options, task);
+
+		const QRect bounds = image.rect();
+		return save(path, image.size(), [&image, bounds](QRect const& rect, ImageDataRGBX& tile)
+			{
+				const QRect inside = rect.intersected(bounds);
+				if (inside != rect)
+					tile.fill(VectorRGBX::White());
+				for (int row = inside.top(); row <= inside.bottom(); ++row)
+					memcpy(tile.rowAddress(row - rect.y()) + (inside.x() - rect.x()), image.constScanLine(row) + (size_t)inside.x() * 4, (size_t)inside.width() * 4);
+				return true;
+			}, options, task);
+	}
+
+	// a cancelled task or a failed source leaves no file
+	static bool save(QString path, QSize size, TileSource const& source, Options const& options, TaskState* task = nullptr,
+		RowHook const& beginRow = nullptr)
+	{
+		BP_TRACE_SCOPE("TiffWriter::save");
+		const int tileSize = options.tileSize;
+		if (size.isEmpty() || tileSize <= 0 || tileSize % 16 != 0)
+			return false;
+
+		const int across = (size.width() + tileSize - 1) / tileSize;
+		const int down = (size.height() + tileSize - 1) / tileSize;
+
+		//compressed tiles may grow past the raw size, a classic TIFF is only chosen with room to spare
+		const uint64_t rawBytes = (uint64_t)across * down * tileSize * tileSize * 3;
+		const bool big = options.bigTiff || rawBytes > ClassicLimit / 4 * 3;
+
+		CancellableFile file(path, task);
+		if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+			return false;
+
+		QByteArray header("II");
+		if (big)
+		{
+			put(header, 43, 2);
+			put(header, 8, 2);
+			put(header, 0, 2);
+			put(header, 0, 8);
+		}
+		else
+		{
+			put(header, 42, 2);
+			put(header, 0, 4);
+		}
+		bool suc = file.write(header) == header.size();
+
+		std::vector<uint64_t> offsets, byteCounts;
+		offsets.reserve((size_t)across * down);
+		byteCounts.reserve((size_t)across * down);
+
+		util::beginStage(task, "encoding", (int64_t)across * down);
+		std::vector<QByteArray> row(across);
+		for (int ty = 0; suc && ty < down; ++ty)
+		{
+			const QRect band(0, ty * tileSize, size.width(), std::min(tileSize, size.height() - ty * tileSize));
+			if (util::isCancelled(task) || (beginRow && !beginRow(band)))
+			{
+				suc = false;
+				break;
+			}
+
+			std::atomic<bool> rowSuc{ true };
+			util::parallelFor(across, [&](int tx)
+				{
+					if (!rowSuc || util::isCancelled(task))
+					{
+						rowSuc = false;
+						return;
+					}
+					BP_TRACE_SCOPE("tile");
+					MemoryAccountant::Scope scope(MemoryAccountant::Temporary);
+					ImageDataRGBX tile(tileSize, tileSize);
+					if (!source(QRect(tx * tileSize, band.y(), tileSize, tileSize), tile))
+					{
+						rowSuc = false;
+						return;
+					}
+					row[tx] = encodeTile(tile, options.compression);
+					util::advance(task);
+				}, options.threadCount);
+			suc = rowSuc;
+
+			for (int tx = 0; suc && tx < across; ++tx)
+			{
+				offsets.push_back((uint64_t)file.pos());
+				byteCounts.push_back((uint64_t)row[tx].size());
+				suc = file.write(row[tx]) == row[tx].size();
+				row[tx] = QByteArray();
+			}
+			suc = suc && (big || (uint64_t)file.pos() < ClassicLimit);
+		}
+
+		suc = suc && writeDirectory(file, size, offsets, byteCounts, options, big);
+		file.close();
+		if (!suc)
+			QFile::remove(path);
+		return suc;
+	}
+
+protected:
+	static constexpr uint64_t ClassicLimit = 0xFFFFFFFFull;
+
+	// field types
+	enum Type { Short = 3, Long = 4, Rational = 5, Long8 = 16 };
+
+	struct Entry
+	{
+		uint16_t tag;
+		uint16_t type;
+		uint64_t count;
+		QByteArray value; //little endian, not padded
+	};
+
+	static void put(QByteArray& out, uint64_t value, int bytes)
+	{
+		for (int idx = 0; idx < bytes; ++idx)
+			out.append((char)((value >> (idx * 8)) & 0xFF));
+	}
+
+	static Entry entry(uint16_t tag, Type type, std::vector<uint64_t> const& values)
+	{
+		const int bytes = type == Short ? 2 : type == Long ? 4 : 8;
+		Entry retval{ tag, (uint16_t)type, values.size(), QByteArray() };
+		retval.value.reserve((int)values.size() * bytes);
+		for (auto value : values)
+			put(retval.value, value, bytes);
+		return retval;
+	}
+
+	static Entry rational(uint16_t tag, uint32_t numerator, uint32_t denominator)
+	{
+		Entry retval{ tag, Rational, 1, QByteArray() };
+		put(retval.value, numerator, 4);
+		put(retval.value, denominator, 4);
+		return retval;
+	}
+
+	// values that do not fit their entry first, then the directory, then its offset into the header
+	static bool writeDirectory(QFile& file, QSize size, std::vector<uint64_t> const& offsets, std::vector<uint64_t> const& byteCounts,
+		Options const& options, bool big)
+	{
+		const Type offsetType = big ? Long8 : Long;
+		const bool compressed = options.compression != NoCompression;
+
+		//ascending tag order
+		std::vector<Entry> entries;
+		entries.push_back(entry(256, Long, { (uint64_t)size.width() }));
+		entries.push_back(entry(257, Long, { (uint64_t)size.height() }));
+		entries.push_back(entry(258, Short, { 8, 8, 8 }));
+		entries.push_back(entry(259, Short, { (uint64_t)options.compression }));
+		entries.push_back(entry(262, Short, { 2 })); //RGB
+		entries.push_back(entry(277, Short, { 3 }));
+		if (options.dpi > 0)
+		{
+			entries.push_back(rational(282, (uint32_t)options.dpi, 1));
+			entries.push_back(rational(283, (uint32_t)options.dpi, 1));
+		}
+		entries.push_back(entry(284, Short, { 1 })); //chunky
+		if (options.dpi > 0)
+			entries.push_back(entry(296, Short, { 2 })); //inch
+		if (compressed)
+			entries.push_back(entry(317, Short, { 2 }));
+		entries.push_back(entry(322, Long, { (uint64_t)options.tileSize }));
+		entries.push_back(entry(323, Long, { (uint64_t)options.tileSize }));
+		entries.push_back(entry(324, offsetType, offsets));
+		entries.push_back(entry(325, offsetType, byteCounts));
+
+		const int inlineBytes = big ? 8 : 4;
+		uint64_t pos = (uint64_t)file.pos();
+		QByteArray tail;
+		auto align = [&]()
+		{
+			if ((pos + tail.size()) & 1)
+				tail.append('\0');
+		};
+
+		align();
+		std::vector<uint64_t> valueOffsets(entries.size(), 0);
+		for (size_t idx = 0; idx < entries.size(); ++idx)
+		{
+			if (entries[idx].value.size() <= inlineBytes)
+				continue;
+			valueOffsets[idx] = pos + tail.size();
+			tail.append(entries[idx].value);
+			align();
+		}
+
+		const uint64_t directory = pos + tail.size();
+		if (!big && directory + 2 + entries.size() * 12 + 4 > ClassicLimit)
+			return false;
+
+		put(tail, entries.size(), big ? 8 : 2);
+		for (size_t idx = 0; idx < entries.size(); ++idx)
+		{
+			auto const& e = entries[idx];
+			put(tail, e.tag, 2);
+			put(tail, e.type, 2);
+			put(tail, e.count, big ? 8 : 4);
+			if (e.value.size() <= inlineBytes)
+			{
+				tail.append(e.value);
+				tail.append(QByteArray(inlineBytes - e.value.size(), '\0'));
+			}
+			else
+			{
+				put(tail, valueOffsets[idx], inlineBytes);
+			}
+		}
+		put(tail, 0, inlineBytes); //no further directory
+
+		if (file.write(tail) != tail.size())
+			return false;
+
+		QByteArray link;
+		put(link, directory, inlineBytes);
+		return file.seek(big ? 8 : 4) && file.write(link) == link.size();
+	}
+
+	static QByteArray encodeTile(ImageDataRGBX const& tile, Compression compression)
+	{
+		BP_TRACE_SCOPE("encodeTile");
+		const int rowBytes = tile.width() * 3;
+		QByteArray raw(rowBytes * tile.height(), Qt::Uninitialized);
+		kernel::bgrxToRgb(tile.bits(), reinterpret_cast<unsigned char*>(raw.data()), tile.pixelCount());
+		if (compression == NoCompression)
+			return raw;
+
+		//difference to the pixel on the left, flat areas become runs of zero
+		for (int row = 0; row < tile.height(); ++row)
+		{
+			unsigned char* line = reinterpret_cast<unsigned char*>(raw.data()) + (size_t)row * rowBytes;
+			for (int idx = rowBytes - 1; idx >= 3; --idx)
+				line[idx] = (unsigned char)(line[idx] - line[idx - 3]);
+		}
+
+		if (compression == Deflate)
+		{
+			//qCompress prefixes the zlib stream with the uncompressed size
+			return qCompress(raw, 6).mid(4);
+		}
+		return lzw(raw);
+	}
+
+	// the TIFF flavour of LZW : codes of 9 to 12 bits, most significant bit first
+	// the code width grows one code early and the table is cleared just before it is full, as libtiff does
+	static QByteArray lzw(QByteArray const& raw)
+	{
+		enum { ClearCode = 256, EndOfInformation = 257, FirstCode = 258, MaxCode = 4095, HashSize = 9029 };
+
+		QByteArray out;
+		out.reserve(raw.size() / 2);
+
+		uint32_t bits = 0;
+		int bitCount = 0;
+		int width = 9;
+		auto putCode = [&](int code)
+		{
+			bits = (bits << width) | (uint32_t)code;
+			bitCount += width;
+			while (bitCount >= 8)
+			{
+				bitCount -= 8;
+				out.append((char)((bits >> bitCount) & 0xFF));
+			}
+		};
+
+		//(prefix code << 8 | byte) -> code, open addressing
+		std::vector<int32_t> keys(HashSize, -1);
+		std::vector<uint16_t> codes(HashSize, 0);
+		auto slotOf = [&](int32_t key)
+		{
+			uint32_t slot = ((uint32_t)key * 2654435761u) % HashSize;
+			while (keys[slot] != -1 && keys[slot] != key)
+				slot = slot + 1 == HashSize ? 0 : slot + 1;
+			return slot;
+		};
+
+		int next = FirstCode;
+		auto grow = [&]()
+		{
+			if (next == MaxCode - 1)
+			{
+				putCode(ClearCode);
+				std::fill(keys.begin(), keys.end(), -1);
+				next = FirstCode;
+				width = 9;
+			}
+			else if (next > (1 << width) - 1)
+			{
+				++width;
+			}
+		};
+
+		putCode(ClearCode);
+		unsigned char const* data = reinterpret_cast<unsigned char const*>(raw.constData());
+		if (!raw.isEmpty())
+		{
+			int prefix = data[0];
+			for (int idx = 1; idx < raw.size(); ++idx)
+			{
+				const int32_t key = (prefix << 8) | data[idx];
+				const uint32_t slot = slotOf(key);
+				if (keys[slot] == key)
+				{
+					prefix = codes[slot];
+					continue;
+				}
+
+				putCode(prefix);
+				keys[slot] = key;
+				codes[slot] = (uint16_t)next++;
+				prefix = data[idx];
+				grow();
+			}
+
+			//the decoder adds an entry for the last code as well
+			putCode(prefix);
+			++next;
+			grow();
+		}
+		putCode(EndOfInformation);
+
+		if (bitCount > 0)
+			out.append((char)((bits << (8 - bitCount)) & 0xFF));
+		return out;
+	}
+};
@@ -0,0 +1,235 @@
+#pragma once
+
+#include <QByteArray>
+#include <QCoreApplication>
+#include <QFile>
+#include <QString>
+#include <QtGlobal>
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+// * header only class
+// scoped spans of the pack / export pipeline, saved as Chrome trace events (chrome://tracing, Perfetto)
+//		each thread appends to its own buffer without a lock : the owner publishes the count, save() reads up to it
+//		the buffer of a finished thread goes to the next new one, the short lived parallelFor workers share a few rows
+//		disabled, a span costs one relaxed load. BP_NO_TRACE removes them at compile time
+class TraceLog
+{
+public:
+	static constexpr int ChunkEvents = 4096;
+	static constexpr int MaxChunks = 256; //a million spans per thread, later ones are only counted
+
+	struct Event
+	{
+		const char* name; //string literal
+		qint64 begin; //us since the trace clock started
+		qint64 duration;
+	};
+
+	static TraceLog& instance()
+	{
+		static TraceLog log;
+		return log;
+	}
+
+	bool isEnabled() const { return enabled.load(std::memory_order_relaxed); }
+	void setEnabled(bool on) { enabled = on; }
+
+	qint64 now() const
+	{
+		return std::chrono::duration_cast<std::chrono::microseconds>(Clock::now() - epoch).count();
+	}
+
+	void record(const char* name, qint64 begin)
+	{
+		threadBuffer()->push({ name, begin, now() - begin });
+	}
+
+	// every span recorded so far, threads may keep tracing meanwhile
+	bool save(QString path) const
+	{
+		QFile file(path);
+		if (!file.open(QIODevice::WriteOnly | QIODevice::Truncate))
+			return false;
+
+		std::vector<ThreadBuffer*> snapshot;
+		{
+			std::lock_guard<std::mutex> lock(registryMutex);
+			for (auto const& buffer : buffers)
+				snapshot.push_back(buffer.get());
+		}
+
+		const QByteArray pid = QByteArray::number(QCoreApplication::applicationPid());
+		QByteArray json = "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		bool first = true;
+		auto append = [&](QByteArray const& event)
+		{
+			json += first ? "\n" : ",\n";
+			json += event;
+			first = false;
+			if (json.size() > (1 << 20))
+			{
+				file.write(json);
+				json.clear();
+			}
+		};
+
+		for (auto const* buffer : snapshot)
+		{
+			const QByteArray tid = QByteArray::number(buffer->tid);
+			const int count = buffer->count.load(std::memory_order_acquire);
+			QByteArray threadName = "thread " + tid;
+			if (const int dropped = buffer->dropped.load(std::memory_order_relaxed))
+				threadName += ", " + QByteArray::number(dropped) + " spans dropped";
+			append("{\"ph\":\"M\",\"pid\":" + pid + ",\"tid\":" + tid + ",\"name\":\"thread_name\",\"args\":{\"name\":\"" + threadName + "\"}}");
+
+			for (int idx = 0; idx < count; ++idx)
+			{
+				Event const& event = buffer->chunks[idx / ChunkEvents].load(std::memory_order_relaxed)[idx % ChunkEvents];
+				append("{\"ph\":\"X\",\"pid\":" + pid + ",\"tid\":" + tid
+					+ ",\"ts\":" + QByteArray::number(event.begin) + ",\"dur\":" + QByteArray::number(event.duration)
+					+ ",\"name\":\"" + QByteArray(event.name) + "\"}");
+			}
+		}
+		json += "\n]}\n";
+		return file.write(json) == json.size() && file.flush();
+	}
+
+protected:
+	using Clock = std::chrono::steady_clock;
+
+	// written by its owner thread only
+	struct ThreadBuffer
+	{
+		int tid = 0;
+		std::array<std::atomic<Event*>, MaxChunks> chunks{};
+		std::atomic<int> count{ 0 };
+		std::atomic<int> dropped{ 0 };
+
+		~ThreadBuffer()
+		{
+			for (auto& chunk : chunks)
+				delete[] chunk.load();
+		}
+
+		void push(Event const& event)
+		{
+			const int idx = count.load(std::memory_order_relaxed);
+			const int chunkIdx = idx / ChunkEvents;
+			if (chunkIdx >= MaxChunks)
+			{
+				dropped.fetch_add(1, std::memory_order_relaxed);
+				return;
+			}
+
+			Event* events = chunks[chunkIdx].load(std::memory_order_relaxed);
+			if (!events)
+			{
+				events = new Event[ChunkEvents];
+				chunks[chunkIdx].store(events, std::memory_order_relaxed);
+			}
+			events[idx % ChunkEvents] = event;
+			//the event and its chunk are visible to save() once the count is
+			count.store(idx + 1, std::memory_order_release);
+		}
+	};
+
+	TraceLog() : epoch(Clock::now()) {}
+
+	ThreadBuffer* threadBuffer()
+	{
+		struct Holder
+		{
+			ThreadBuffer* buffer = nullptr;
+			~Holder()
+			{
+				if (buffer)
+					TraceLog::instance().release(buffer);
+			}
+		};
+		thread_local Holder holder;
+		if (!holder.buffer)
+			holder.buffer = acquire();
+		return holder.buffer;
+	}
+
+	ThreadBuffer* acquire()
+	{
+		std::lock_guard<std::mutex> lock(registryMutex);
+		if (!idle.empty())
+		{
+			auto* retval = idle.back();
+			idle.pop_back();
+			return retval;
+		}
+		buffers.push_back(std::make_unique<ThreadBuffer>());
+		buffers.back()->tid = (int)buffers.size();
+		return buffers.back().get();
+	}
+
+	void release(ThreadBuffer* buffer)
+	{
+		std::lock_guard<std::mutex> lock(registryMutex);
+		idle.push_back(buffer);
+	}
+
+	const Clock::time_point epoch;
+	std::atomic<bool> enabled{ false };
+
+	mutable std::mutex registryMutex;
+	std::vector<std::unique_ptr<ThreadBuffer>> buffers;
+	std::vector<ThreadBuffer*> idle;
+};
+
+// one span from construction to destruction, nothing is recorded if tracing was off when it began
+class TraceScope
+{
+public:
+	explicit TraceScope(const char* name) : name(name), begin(TraceLog::instance().isEnabled() ? TraceLog::instance().now() : -1) {}
+	~TraceScope()
+	{
+		if (begin >= 0)
+			TraceLog::instance().record(name, begin);
+	}
+
+	TraceScope(TraceScope const&) = delete;
+	TraceScope& operator=(TraceScope const&) = delete;
+
+protected:
+	const char* name;
+	const qint64 begin;
+};
+
+// enables tracing for its lifetime and saves the trace to path when destroyed, e.g. at the end of main
+class TraceSession
+{
+public:
+	explicit TraceSession(QString path) : path(path)
+	{
+		TraceLog::instance().setEnabled(!path.isEmpty());
+	}
+	~TraceSession()
+	{
+		if (path.isEmpty())
+			return;
+		TraceLog::instance().setEnabled(false);
+		if (!TraceLog::instance().save(path))
+			qWarning("cannot write trace file %s", qPrintable(path));
+	}
+
+protected:
+	QString path;
+};
+
+#ifndef BP_NO_TRACE
+#define BP_TRACE_CONCAT_(a, b) a##b
+#define BP_TRACE_CONCAT(a, b) BP_TRACE_CONCAT_(a, b)
+// BP_TRACE_SCOPE("name") : the rest of the enclosing block is one span, name must be a string literal
+#define BP_TRACE_SCOPE(name) TraceScope BP_TRACE_CONCAT(traceScope_, __LINE__)(name)
+#else
+#define BP_TRACE_SCOPE(name)
+#endif
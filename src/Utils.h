@@ -1,5 +1,12 @@
 #pragma once
 
+#include <algorithm>
+#include <atomic>
+#include <exception>
+#include <mutex>
+#include <thread>
+#include <vector>
+
 namespace util
 {
 #define KorStr(x) QString::fromLocal8Bit(x)
@@ -45,4 +52,54 @@ namespace util
 	{
 		return (FloatType)Inch2mm(((FloatType)pixel / (FloatType)DPI));
 	}
+
+	// calls func(idx) for every idx in [0, count) on up to threadCount threads (0 : hardware concurrency)
+	// the calling thread works too, returns when every index is done
+	// an exception from func stops handing out indices, the first one is rethrown on the calling thread after every thread joined
+	template<typename FuncT>
+	void parallelFor(int count, FuncT&& func, int threadCount = 0)
+	{
+		if (count <= 0)
+			return;
+		if (threadCount <= 0)
+			threadCount = (int)std::thread::hardware_concurrency();
+		threadCount = std::max(1, std::min(threadCount, count));
+
+		std::atomic<int> next{ 0 };
+		std::mutex errorMutex;
+		std::exception_ptr error;
+		auto worker = [&]()
+		{
+			for (int idx = next++; idx < count; idx = next++)
+			{
+				try
+				{
+					func(idx);
+				}
+				catch (...)
+				{
+					next = count;
+					std::lock_guard<std::mutex> lock(errorMutex);
+					if (!error)
+						error = std::current_exception();
+				}
+			}
+		};
+
+		std::vector<std::thread> threads;
+		try
+		{
+			for (int t = 1; t < threadCount; ++t)
+				threads.emplace_back(worker);
+		}
+		catch (...)
+		{
+			//no more threads, the ones started and this one finish the work
+		}
+		worker();
+		for (auto& thread : threads)
+			thread.join();
+		if (error)
+			std::rethrow_exception(error);
+	}
 }
\ No newline at end of file
@@ -0,0 +1,107 @@
+// WarmImageCache.h
+#pragma once
+
+#include <QDateTime>
+#include <QFileInfo>
+#include <QString>
+#include <list>
+#include <map>
+#include <mutex>
+#include "ImageObject.h"
+
+// * header only class
+// decoded images kept across jobs by a long running process (see PackDaemon), least recently used first out
+// keyed by path, size and modification time : a rewritten file is decoded again
+// thread safe, shared by every BinImageManager of the process through BinImageManager::warmImages
+class WarmImageCache
+{
+public:
+	explicit WarmImageCache(qint64 byteBudget) : byteBudget(byteBudget) {}
+
+	// null on a miss
+	ImageDataRGBPtr find(QString path)
+	{
+		const QString key = keyOf(path);
+		if (key.isEmpty())
+			return nullptr;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		auto found = entries.find(key);
+		if (found == entries.end())
+		{
+			++misses;
+			return nullptr;
+		}
+		++hits;
+		lru.splice(lru.begin(), lru, found->second);
+		return found->second->image;
+	}
+
+	// images larger than the whole budget are not kept
+	void insert(QString path, ImageDataRGBPtr image)
+	{
+		const QString key = keyOf(path);
+		const qint64 bytes = image ? (qint64)image->dataSize() : 0;
+		if (key.isEmpty() || bytes <= 0 || bytes > byteBudget)
+			return;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		auto found = entries.find(key);
+		if (found != entries.end())
+		{
+			usedBytes -= found->second->bytes;
+			lru.erase(found->second);
+			entries.erase(found);
+		}
+
+		lru.push_front(Entry{ key, image, bytes });
+		entries[key] = lru.begin();
+		usedBytes += bytes;
+
+		while (usedBytes > byteBudget && !lru.empty())
+		{
+			usedBytes -= lru.back().bytes;
+			entries.erase(lru.back().key);
+			lru.pop_back();
+		}
+	}
+
+	void clear()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		lru.clear();
+		entries.clear();
+		usedBytes = 0;
+	}
+
+	QString stats()
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		return QString("%1 images, %2 MB, %3 hits, %4 misses")
+			.arg(lru.size()).arg(usedBytes >> 20).arg(hits).arg(misses);
+	}
+
+protected:
+	static QString keyOf(QString path)
+	{
+		const QFileInfo info(path);
+		if (!info.exists())
+			return QString();
+		return QString("%1|%2|%3").arg(info.absoluteFilePath()).arg(info.size()).arg(info.lastModified().toMSecsSinceEpoch());
+	}
+
+	struct Entry
+	{
+		QString key;
+		ImageDataRGBPtr image;
+		qint64 bytes = 0;
+	};
+
+	const qint64 byteBudget;
+	std::mutex mutex;
+	std::list<Entry> lru; //front is the most recently used
+	std::map<QString, std::list<Entry>::iterator> entries;
+	qint64 usedBytes = 0;
+	qint64 hits = 0;
+	qint64 misses = 0;
+};
@@ -1,14 +1,113 @@
 
 #include "ImageObjectExample.h"
 #include "BinpackMainWindow.h"
+#include "ImageHandle.h"
+#include "JobCache.h"
+#include "JobRunner.h"
+#include "Logger.h"
+#include "MemoryAccountant.h"
+#include "PackDaemon.h"
+#include "Trace.h"
 #include <QApplication>
+#include <QCoreApplication>
+#include <QDebug>
+#include <QGuiApplication>
 
 int main(int argc, char* argv[])
 {
 	if(0)
 		ImageObjectExample ex;
 
+	auto hasArg = [&](QString name)
+	{
+		for (int idx = 1; idx < argc; ++idx)
+			if (QString(argv[idx]).compare(name, Qt::CaseInsensitive) == 0)
+				return true;
+		return false;
+	};
+	auto argAfter = [&](QString name, QString fallback = QString())
+	{
+		for (int idx = 1; idx + 1 < argc; ++idx)
+			if (QString(argv[idx]).compare(name, Qt::CaseInsensitive) == 0)
+				return QString::fromLocal8Bit(argv[idx + 1]);
+		return fallback;
+	};
+	auto printer = [](QString msg) { qInfo().noquote() << msg; };
+
+	//--log <file> : every message also appended to file with its level, time and thread, in any mode
+	if (!argAfter("--log").isEmpty())
+	{
+		LogBuffer::instance().setConsole(true);
+		if (!LogBuffer::instance().openFile(argAfter("--log")))
+			printer(QString("cannot open log file %1").arg(argAfter("--log")));
+		qInstallMessageHandler(Binpacklog);
+	}
+
+	//--diag or BINPACK_TRACE=<file> : pipeline spans saved as a Chrome trace when the process ends
+	QString tracePath = qEnvironmentVariable("BINPACK_TRACE");
+	if (tracePath.isEmpty() && hasArg("--diag"))
+		tracePath = "binpack_trace.json";
+	TraceSession traceSession(tracePath);
+
+	//--memory-mb <N> : pixel memory budget in any mode, over it the canvas, decoded images and sheet exports degrade, see MemoryAccountant
+	MemoryAccountant::instance().setBudget(argAfter("--memory-mb", "0").toLongLong() << 20);
+
+	//--cache-mb <N> : size of the job cache, least recently used jobs are dropped over it, see JobCache
+	JobCache::setCapacity(argAfter("--cache-mb", "4096").toLongLong() << 20);
+
+	//headless batch job : --job <manifest.json>, exits with JobRunner::ExitCode
+	if (!argAfter("--job").isEmpty())
+	{
+		QGuiApplication app(argc, argv);
+		ImageHandle::initSpills();
+		return JobRunner::run(argAfter("--job"), printer);
+	}
+
+	//packing service : --daemon <spool> [--workers N] [--warm-mb N], see PackDaemon
+	if (!argAfter("--daemon").isEmpty())
+	{
+		QGuiApplication app(argc, argv);
+		ImageHandle::initSpills();
+		PackDaemon::Options options;
+		options.spool = argAfter("--daemon");
+		options.workerCount = argAfter("--workers", "0").toInt();
+		options.warmBytes = argAfter("--warm-mb", "1024").toLongLong() << 20;
+
+		PackDaemon daemon(options, printer);
+		QString error;
+		if (!daemon.start(error))
+		{
+			printer(QString("Pack daemon error : %1").arg(error));
+			return JobRunner::JobBadManifest;
+		}
+		return app.exec();
+	}
+
+	//stub client of the daemon
+	//		--spool <spool> --submit <manifest.json> [--priority N] [--wait [--timeout S]] : prints the job name, --wait exits with its JobRunner::ExitCode
+	//		--spool <spool> --cancel <job>
+	//		--spool <spool> --stop
+	if (!argAfter("--spool").isEmpty())
+	{
+		QCoreApplication app(argc, argv);
+		const QString spool = argAfter("--spool");
+		if (!argAfter("--cancel").isEmpty())
+			return PackDaemon::cancel(spool, argAfter("--cancel")) ? 0 : 1;
+		if (hasArg("--stop"))
+			return PackDaemon::requestStop(spool) ? 0 : 1;
+
+		QString name, error;
+		if (!PackDaemon::submit(spool, argAfter("--submit"), argAfter("--priority", "0").toInt(), name, error))
+		{
+			printer(QString("Submit error : %1").arg(error));
+			return JobRunner::JobBadManifest;
+		}
+		printer(name);
+		return hasArg("--wait") ? PackDaemon::waitResult(spool, name, printer, argAfter("--timeout", "0").toInt()) : 0;
+	}
+
 	QApplication app(argc, argv);
+	ImageHandle::initSpills();
 
 	//if isDevMode, shows log window
 	const bool isDevMode = app.arguments().contains("--diag", Qt::CaseInsensitive);